@@ -0,0 +1,86 @@
+// Compile time of clox on functions with many locals, in identifier
+// references per second.
+//
+// Each generated function nests scopes until it has close to the
+// maximum number of locals, then refers to the outermost ones many
+// times, the worst case for finding a name by scanning the locals.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "vm.h"
+
+#define FUNCTIONS 200
+#define SCOPES 50
+#define LOCALS_PER_SCOPE 5
+#define STATEMENTS 1000
+#define RUNS 5
+
+typedef struct {
+  char* chars;
+  size_t length;
+  size_t capacity;
+} Buffer;
+
+static void appendf(Buffer* buffer, const char* format, int a, int b, int c) {
+  char text[128];
+  int length = snprintf(text, sizeof(text), format, a, b, c);
+  if (buffer->length + length + 1 > buffer->capacity) {
+    buffer->capacity = (buffer->capacity + length + 1) * 2;
+    buffer->chars = (char*)realloc(buffer->chars, buffer->capacity);
+  }
+  memcpy(buffer->chars + buffer->length, text, length + 1);
+  buffer->length += length;
+}
+
+static char* generateSource(long* references) {
+  Buffer buffer = {NULL, 0, 0};
+  *references = 0;
+  for (int function = 0; function < FUNCTIONS; function++) {
+    appendf(&buffer, "fun generated%d() {\n", function, 0, 0);
+    for (int scope = 0; scope < SCOPES; scope++) {
+      appendf(&buffer, "{\n", 0, 0, 0);
+      for (int i = 0; i < LOCALS_PER_SCOPE; i++) {
+        appendf(&buffer, "var local%d_%d = %d;\n", scope, i, i % 2);
+      }
+    }
+    for (int statement = 0; statement < STATEMENTS; statement++) {
+      int scope = statement % 3;
+      appendf(&buffer, "local%d_0 = local%d_1 + local%d_2;\n",
+              scope, scope, scope);
+      *references += 3;
+    }
+    for (int scope = 0; scope < SCOPES; scope++) {
+      appendf(&buffer, "}\n", 0, 0, 0);
+    }
+    appendf(&buffer, "}\n", 0, 0, 0);
+  }
+  return buffer.chars;
+}
+
+int main() {
+  long references;
+  char* source = generateSource(&references);
+
+  VM vm;
+  initVM(&vm);
+  double best = -1;
+  for (int run = 0; run < RUNS; run++) {
+    clock_t start = clock();
+    if (compile(&vm, source) == NULL) {
+      fprintf(stderr, "Generated source failed to compile.\n");
+      exit(1);
+    }
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    if (best < 0 || seconds < best) best = seconds;
+  }
+
+  printf("clox compiler: %ld references in %.3f s, %.1f M references/s\n",
+         references, best, references / best / 1e6);
+  freeVM(&vm);
+  free(source);
+  return 0;
+}
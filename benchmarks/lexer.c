@@ -0,0 +1,61 @@
+// Lexing throughput of the clox scanner, in MB/s.
+//
+// The input is a large generated script mixing the things the scanner
+// spends its time on: indentation, comments, identifiers, numbers and
+// strings.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+#define SOURCE_SIZE (16 * 1024 * 1024)
+#define RUNS 10
+
+static const char* snippet =
+  "// Computes the running totals for one bucket of the report.\n"
+  "fun accumulateBucketTotals(bucketIndex, previousTotal) {\n"
+  "    var currentValue = previousTotal + bucketIndex * 1.5;\n"
+  "    if (currentValue >= 1000000) {\n"
+  "        print \"bucket overflowed, resetting running total\";\n"
+  "        currentValue = 0;\n"
+  "    }\n"
+  "    return currentValue;   // carried into the next bucket\n"
+  "}\n"
+  "\n";
+
+static char* generateSource(size_t size) {
+  size_t length = strlen(snippet);
+  char* source = (char*)malloc(size + 1);
+  size_t filled = 0;
+  while (filled + length <= size) {
+    memcpy(source + filled, snippet, length);
+    filled += length;
+  }
+  source[filled] = '\0';
+  return source;
+}
+
+int main() {
+  char* source = generateSource(SOURCE_SIZE);
+  double megabytes = strlen(source) / (1024.0 * 1024.0);
+
+  double best = 0;
+  long tokens = 0;
+  for (int run = 0; run < RUNS; run++) {
+    clock_t start = clock();
+    Scanner scanner;
+    initScanner(&scanner, source);
+    tokens = 0;
+    while (scanToken(&scanner).type != TOKEN_EOF) tokens++;
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+    if (megabytes / seconds > best) best = megabytes / seconds;
+  }
+
+  printf("clox scanner: %.1f MB, %ld tokens, %.1f MB/s\n",
+         megabytes, tokens, best);
+  free(source);
+  return 0;
+}
@@ -0,0 +1,45 @@
+// Lexing throughput of the cpplox scanner, in MB/s.
+// Uses the same generated input as lexer.c.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "scanner.h"
+
+static constexpr size_t sourceSize = 16 * 1024 * 1024;
+static constexpr int runs = 10;
+
+static const char* snippet =
+    "// Computes the running totals for one bucket of the report.\n"
+    "fun accumulateBucketTotals(bucketIndex, previousTotal) {\n"
+    "    var currentValue = previousTotal + bucketIndex * 1.5;\n"
+    "    if (currentValue >= 1000000) {\n"
+    "        print \"bucket overflowed, resetting running total\";\n"
+    "        currentValue = 0;\n"
+    "    }\n"
+    "    return currentValue;   // carried into the next bucket\n"
+    "}\n"
+    "\n";
+
+int main() {
+    std::string source;
+    source.reserve(sourceSize);
+    while (source.size() + strlen(snippet) <= sourceSize) source += snippet;
+    double megabytes = source.size() / (1024.0 * 1024.0);
+
+    double best = 0;
+    long tokens = 0;
+    for (int run = 0; run < runs; run++) {
+        auto start = std::chrono::steady_clock::now();
+        Scanner scanner(source.c_str());
+        tokens = 0;
+        while (scanner.scanToken().type != TOKEN_EOF) tokens++;
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        if (megabytes / seconds.count() > best) best = megabytes / seconds.count();
+    }
+
+    printf("cpplox scanner: %.1f MB, %ld tokens, %.1f MB/s\n", megabytes, tokens, best);
+    return 0;
+}
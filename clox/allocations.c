@@ -0,0 +1,325 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocations.h"
+
+#define TABLE_MAX_LOAD 0.75
+// The kind of site that counts what objects grow for their elements,
+// entries and upvalues, after the object types.
+#define STORAGE (OBJ_UPVALUE + 1)
+// Marks a slot of the live objects whose object was freed.
+#define TOMBSTONE ((Obj*)1)
+
+static const char* kindNames[] = {
+  [OBJ_ARRAY] = "OBJ_ARRAY",
+  [OBJ_BOUND_METHOD] = "OBJ_BOUND_METHOD",
+  [OBJ_CLASS] = "OBJ_CLASS",
+  [OBJ_CLOSURE] = "OBJ_CLOSURE",
+  [OBJ_FUNCTION] = "OBJ_FUNCTION",
+  [OBJ_INSTANCE] = "OBJ_INSTANCE",
+  [OBJ_MAP] = "OBJ_MAP",
+  [OBJ_NATIVE] = "OBJ_NATIVE",
+  [OBJ_SHAPE] = "OBJ_SHAPE",
+  [OBJ_STRING] = "OBJ_STRING",
+  [OBJ_UPVALUE] = "OBJ_UPVALUE",
+  [STORAGE] = "storage",
+};
+
+typedef struct {
+  // NULL for objects made outside Lox code.
+  ObjFunction* function;
+  // A copy of the function's name, which outlives it when a VM is reset.
+  char* name;
+  int line;
+  int kind;
+  // The objects allocated, or the times storage grew.
+  long count;
+  size_t bytes;
+  // The objects not freed yet. Storage isn't followed once it's grown.
+  long liveObjects;
+  size_t liveBytes;
+} Site;
+
+typedef struct {
+  Obj* object;
+  int site;
+  size_t size;
+} LiveObject;
+
+struct AllocationProfile {
+  const char* path;
+  Site* sites;
+  int siteCount;
+  int siteCapacity;
+  // Indexes into sites plus one, by function, line and kind. Zero is an
+  // empty slot.
+  int* siteSlots;
+  int siteSlotCapacity;
+  // The objects allocated since the profile started that aren't freed
+  // yet. Used counts the tombstones too.
+  LiveObject* live;
+  int liveUsed;
+  int liveCapacity;
+};
+
+// Only one VM is profiled at a time. Its profile is written on exit,
+// when the VM itself may be gone, so the sites keep what they need.
+static AllocationProfile* exitProfile;
+
+_Thread_local VM* allocatingVM;
+
+static uint32_t hashPointer(const void* pointer) {
+  uint64_t hash = (uint64_t)(uintptr_t)pointer;
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return (uint32_t)hash;
+}
+
+static uint32_t hashSite(ObjFunction* function, int line, int kind) {
+  return hashPointer(function) ^ ((uint32_t)line * 2654435761u) ^
+         ((uint32_t)kind << 24);
+}
+
+static void growSiteSlots(AllocationProfile* profile) {
+  int capacity = profile->siteSlotCapacity < 64
+      ? 64 : profile->siteSlotCapacity * 2;
+  int* slots = calloc(capacity, sizeof(int));
+  if (slots == NULL) exit(1);
+
+  for (int i = 0; i < profile->siteCount; i++) {
+    Site* site = &profile->sites[i];
+    uint32_t index = hashSite(site->function, site->line, site->kind) &
+                     (capacity - 1);
+    while (slots[index] != 0) index = (index + 1) & (capacity - 1);
+    slots[index] = i + 1;
+  }
+
+  free(profile->siteSlots);
+  profile->siteSlots = slots;
+  profile->siteSlotCapacity = capacity;
+}
+
+static Site* findSite(AllocationProfile* profile, ObjFunction* function,
+                      int line, int kind) {
+  if (profile->siteCount + 1 > profile->siteSlotCapacity * TABLE_MAX_LOAD) {
+    growSiteSlots(profile);
+  }
+
+  int mask = profile->siteSlotCapacity - 1;
+  uint32_t index = hashSite(function, line, kind) & mask;
+  for (;;) {
+    int slot = profile->siteSlots[index];
+    if (slot == 0) break;
+    Site* site = &profile->sites[slot - 1];
+    if (site->function == function && site->line == line &&
+        site->kind == kind) {
+      return site;
+    }
+    index = (index + 1) & mask;
+  }
+
+  if (profile->siteCount == profile->siteCapacity) {
+    profile->siteCapacity = profile->siteCapacity < 64
+        ? 64 : profile->siteCapacity * 2;
+    profile->sites = realloc(profile->sites,
+                             sizeof(Site) * profile->siteCapacity);
+    if (profile->sites == NULL) exit(1);
+  }
+
+  Site* site = &profile->sites[profile->siteCount];
+  memset(site, 0, sizeof(Site));
+  site->function = function;
+  if (function != NULL) {
+    const char* name = function->name == NULL ? "script"
+                                              : function->name->chars;
+    site->name = malloc(strlen(name) + 1);
+    if (site->name == NULL) exit(1);
+    strcpy(site->name, name);
+  }
+  site->line = line;
+  site->kind = kind;
+  profile->siteSlots[index] = ++profile->siteCount;
+  return site;
+}
+
+// The site of the instruction the VM is running.
+static Site* currentSite(VM* vm, int kind) {
+  ObjFunction* function = NULL;
+  int line = 0;
+  if (vm->frameCount > 0) {
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    function = frame->closure->function;
+    // The ip is past the instruction that allocates.
+    int offset = (int)(frame->ip - function->chunk.code) - 1;
+    line = getLine(&function->chunk, offset < 0 ? 0 : offset);
+  }
+  return findSite(vm->allocations, function, line, kind);
+}
+
+static LiveObject* findLive(LiveObject* live, int capacity, Obj* object) {
+  uint32_t index = hashPointer(object) & (capacity - 1);
+  LiveObject* tombstone = NULL;
+  for (;;) {
+    LiveObject* entry = &live[index];
+    if (entry->object == NULL) {
+      return tombstone != NULL ? tombstone : entry;
+    } else if (entry->object == TOMBSTONE) {
+      if (tombstone == NULL) tombstone = entry;
+    } else if (entry->object == object) {
+      return entry;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void growLive(AllocationProfile* profile) {
+  int capacity = profile->liveCapacity < 1024
+      ? 1024 : profile->liveCapacity * 2;
+  LiveObject* live = calloc(capacity, sizeof(LiveObject));
+  if (live == NULL) exit(1);
+
+  // The tombstones are left behind.
+  profile->liveUsed = 0;
+  for (int i = 0; i < profile->liveCapacity; i++) {
+    LiveObject* entry = &profile->live[i];
+    if (entry->object == NULL || entry->object == TOMBSTONE) continue;
+    *findLive(live, capacity, entry->object) = *entry;
+    profile->liveUsed++;
+  }
+
+  free(profile->live);
+  profile->live = live;
+  profile->liveCapacity = capacity;
+}
+
+void recordAllocation(VM* vm, Obj* object, size_t size) {
+  AllocationProfile* profile = vm->allocations;
+  Site* site = currentSite(vm, object->type);
+  site->count++;
+  site->bytes += size;
+  site->liveObjects++;
+  site->liveBytes += size;
+
+  if (profile->liveUsed + 1 > profile->liveCapacity * TABLE_MAX_LOAD) {
+    growLive(profile);
+  }
+  LiveObject* entry = findLive(profile->live, profile->liveCapacity, object);
+  if (entry->object == NULL) profile->liveUsed++;
+  entry->object = object;
+  entry->site = (int)(site - profile->sites);
+  entry->size = size;
+}
+
+void recordFree(VM* vm, Obj* object) {
+  AllocationProfile* profile = vm->allocations;
+  if (profile->liveCapacity == 0) return;
+
+  LiveObject* entry = findLive(profile->live, profile->liveCapacity, object);
+  // Objects from before the profile started, or from other VMs, aren't
+  // counted.
+  if (entry->object != object) return;
+
+  Site* site = &profile->sites[entry->site];
+  site->liveObjects--;
+  site->liveBytes -= entry->size;
+  entry->object = TOMBSTONE;
+}
+
+void recordGrowth(size_t size) {
+  Site* site = currentSite(allocatingVM, STORAGE);
+  site->count++;
+  site->bytes += size;
+}
+
+static int compareSites(const void* a, const void* b) {
+  const Site* siteA = a;
+  const Site* siteB = b;
+  if (siteA->bytes != siteB->bytes) {
+    return siteA->bytes < siteB->bytes ? 1 : -1;
+  }
+  if (siteA->count != siteB->count) {
+    return siteA->count < siteB->count ? 1 : -1;
+  }
+
+  // The rest of the order only keeps reports of the same run the same.
+  if (siteA->name == NULL || siteB->name == NULL) {
+    if (siteA->name != siteB->name) return siteA->name == NULL ? -1 : 1;
+  } else {
+    int names = strcmp(siteA->name, siteB->name);
+    if (names != 0) return names;
+  }
+  if (siteA->line != siteB->line) return siteA->line - siteB->line;
+  return siteA->kind - siteB->kind;
+}
+
+static void writeAllocationProfile(void) {
+  AllocationProfile* profile = exitProfile;
+  FILE* file = fopen(profile->path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write allocation profile \"%s\".\n",
+            profile->path);
+    return;
+  }
+
+  long objects = 0;
+  long liveObjects = 0;
+  size_t objectBytes = 0;
+  size_t liveBytes = 0;
+  size_t storageBytes = 0;
+  for (int i = 0; i < profile->siteCount; i++) {
+    Site* site = &profile->sites[i];
+    if (site->kind == STORAGE) {
+      storageBytes += site->bytes;
+    } else {
+      objects += site->count;
+      objectBytes += site->bytes;
+      liveObjects += site->liveObjects;
+      liveBytes += site->liveBytes;
+    }
+  }
+  fprintf(file, "%zu bytes in %ld objects and %zu bytes of storage "
+                "allocated, %zu bytes in %ld objects live\n\n",
+          objectBytes, objects, storageBytes, liveBytes, liveObjects);
+
+  // The sites are sorted in place, so the table of slots is out of date
+  // from here on.
+  qsort(profile->sites, profile->siteCount, sizeof(Site), compareSites);
+  fprintf(file, "%12s %10s %12s %10s  %-16s %s\n", "bytes", "count",
+          "live bytes", "live", "kind", "site");
+  for (int i = 0; i < profile->siteCount; i++) {
+    Site* site = &profile->sites[i];
+    fprintf(file, "%12zu %10ld ", site->bytes, site->count);
+    if (site->kind == STORAGE) {
+      fprintf(file, "%12s %10s ", "-", "-");
+    } else {
+      fprintf(file, "%12zu %10ld ", site->liveBytes, site->liveObjects);
+    }
+    fprintf(file, " %-16s ", kindNames[site->kind]);
+    if (site->name == NULL) {
+      fprintf(file, "(vm)\n");
+    } else {
+      fprintf(file, "%s:%d\n", site->name, site->line);
+    }
+  }
+  fclose(file);
+}
+
+bool startAllocationProfile(VM* vm, const char* path) {
+  if (exitProfile != NULL) return false;
+
+  AllocationProfile* profile = calloc(1, sizeof(AllocationProfile));
+  if (profile == NULL) return false;
+  profile->path = path;
+  vm->allocations = profile;
+  exitProfile = profile;
+  allocatingVM = vm;
+  // Storage grows inside instructions that don't store their ip.
+  vm->profiling = true;
+
+  // The report covers runs that end in exit() too.
+  atexit(writeAllocationProfile);
+  return true;
+}
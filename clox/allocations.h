@@ -0,0 +1,49 @@
+#ifndef clox_allocations_h
+#define clox_allocations_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// An allocation profiler. Every object the VM allocates is counted, with
+// its size, against its type and the Lox function and line that
+// allocated it. So is every time reallocate() grows the memory behind an
+// object, the elements of an array, the entries of a map or table, the
+// fields of an instance or the upvalues of a closure, by how much it
+// grew, against the kind "storage". The report ranks the sites by the
+// bytes they allocated:
+//
+//   clox --alloc-profile out.txt script.lox
+//
+// run() stores its ip in the frame before every instruction while the
+// VM is profiled, so the line is the one of the instruction that
+// allocated. Under --jit or --trace it is where the frame entered the
+// compiled code, whose own memory counts as storage there too. Memory
+// allocated while no Lox code runs, by the compiler or for the natives,
+// is counted against "(vm)".
+//
+// Objects are looked up again when they are freed, by resetVM() or when
+// a string built at runtime turns out to be interned already, and the
+// live columns are what each site allocated that is still there at
+// exit. Freeing the VM ends the profile, so what it frees is left live.
+// Storage isn't followed once it has grown, so it has no live columns.
+//
+// The report is written when the process exits.
+
+typedef struct AllocationProfile AllocationProfile;
+
+// Starts profiling the VM's allocations. Returns false if the profile
+// couldn't be set up.
+bool startAllocationProfile(VM* vm, const char* path);
+// Called by allocateObject() for a profiled VM.
+void recordAllocation(VM* vm, Obj* object, size_t size);
+// Called by reallocate() when it grows memory on the thread of the
+// profiled VM.
+void recordGrowth(size_t size);
+// Called before an object of a profiled VM is freed.
+void recordFree(VM* vm, Obj* object);
+
+// The profiled VM on the thread that runs it, and NULL anywhere else.
+extern _Thread_local VM* allocatingVM;
+
+#endif
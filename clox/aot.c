@@ -0,0 +1,616 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "aot.h"
+#include "compiler.h"
+#include "memory.h"
+#include "verify.h"
+
+typedef struct {
+  ObjFunction** functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+static void addFunction(FunctionList* list, ObjFunction* function) {
+  if (list->capacity < list->count + 1) {
+    int oldCapacity = list->capacity;
+    list->capacity = GROW_CAPACITY(oldCapacity);
+    list->functions = GROW_ARRAY(ObjFunction*, list->functions,
+                                 oldCapacity, list->capacity);
+  }
+  list->functions[list->count++] = function;
+}
+
+// Lists the function and then, in the order of their constants, the
+// functions inside it. Compiling the same source always gives the same
+// list, which is how the C functions are matched to theirs.
+static void collectFunctions(FunctionList* list, ObjFunction* function) {
+  addFunction(list, function);
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      collectFunctions(list, AS_FUNCTION(constants->values[i]));
+    }
+  }
+}
+
+static void freeFunctionList(FunctionList* list) {
+  FREE_ARRAY(ObjFunction*, list->functions, list->capacity);
+}
+
+typedef struct {
+  FILE* file;
+  ObjFunction* function;
+  // The stack depth before each instruction, or negative where no
+  // reachable instruction starts.
+  int* depths;
+  // The slots closures capture, which have to stay on the VM stack. The
+  // others are C variables, which are only stored to the stack for the
+  // runtime to use.
+  bool* captured;
+  // The slots the code uses as C variables.
+  bool* used;
+  bool* targets;
+} Emitter;
+
+// The C expression for a stack slot. Returns one of a few buffers that
+// are reused, so it is only good for one emit.
+static const char* slot(Emitter* emitter, int index) {
+  static char buffers[4][24];
+  static int next = 0;
+  char* buffer = buffers[next++ % 4];
+  if (emitter->captured[index]) {
+    snprintf(buffer, sizeof(buffers[0]), "slots[%d]", index);
+  } else {
+    emitter->used[index] = true;
+    snprintf(buffer, sizeof(buffers[0]), "s%d", index);
+  }
+  return buffer;
+}
+
+// Stores the C variables among the slots from start up to end to the VM
+// stack, for the runtime.
+static void emitSpill(Emitter* emitter, int start, int end) {
+  for (int i = start; i < end; i++) {
+    if (emitter->captured[i]) continue;
+    fprintf(emitter->file, "  slots[%d] = %s;\n", i, slot(emitter, i));
+  }
+}
+
+static void emitReload(Emitter* emitter, int start, int end) {
+  for (int i = start; i < end; i++) {
+    if (emitter->captured[i]) continue;
+    fprintf(emitter->file, "  %s = slots[%d];\n", slot(emitter, i), i);
+  }
+}
+
+static bool isLongOpcode(uint8_t opcode) {
+  switch (opcode) {
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+    case OP_GET_SUPER_LONG:
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE_LONG:
+    case OP_CLOSURE_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static uint32_t readOperand(uint8_t* code, int width) {
+  uint32_t operand = 0;
+  for (int i = 0; i < width; i++) {
+    operand = (operand << 8) | code[i];
+  }
+  return operand;
+}
+
+// Writes the number so that it reads back exactly.
+static void emitNumber(FILE* file, double number) {
+  char buffer[32];
+  for (int precision = 15; precision <= 17; precision++) {
+    snprintf(buffer, sizeof(buffer), "%.*g", precision, number);
+    if (strtod(buffer, NULL) == number) break;
+  }
+  fprintf(file, "NUMBER_VAL(%s)", buffer);
+}
+
+static void emitNumberCheck(Emitter* emitter, int depth, int next,
+                            const char* message) {
+  fprintf(emitter->file,
+          "  if (!IS_NUMBER(%s) || !IS_NUMBER(%s)) {\n"
+          "    AOT_ERROR(%d, \"%s\");\n"
+          "  }\n",
+          slot(emitter, depth - 2), slot(emitter, depth - 1), next, message);
+}
+
+static void emitBinary(Emitter* emitter, int depth, int next,
+                       const char* valueType, const char* op) {
+  emitNumberCheck(emitter, depth, next, "Operands must be numbers.");
+  const char* a = slot(emitter, depth - 2);
+  const char* b = slot(emitter, depth - 1);
+  fprintf(emitter->file, "  %s = %s(AS_NUMBER(%s) %s AS_NUMBER(%s));\n",
+          a, valueType, a, op, b);
+}
+
+// Emits an instruction the runtime does on the VM stack: stores what it
+// pops there, calls it, and loads what it pushes. The call is checked
+// for a runtime error unless checked is false.
+static void emitRuntime(Emitter* emitter, int depth, int next,
+                        Instruction* instruction, bool checked,
+                        const char* format, ...) {
+  FILE* file = emitter->file;
+  int base = depth - instruction->pops;
+  emitSpill(emitter, base, depth);
+  fprintf(file, "  vm->stackTop = &slots[%d];\n", depth);
+  fprintf(file, "  AOT_AT(%d);\n", next);
+
+  fprintf(file, checked ? "  if (!" : "  ");
+  va_list args;
+  va_start(args, format);
+  vfprintf(file, format, args);
+  va_end(args);
+  fprintf(file, checked ? ") return false;\n" : ";\n");
+
+  emitReload(emitter, base, base + instruction->pushes);
+}
+
+static void emitInstruction(Emitter* emitter, int offset,
+                            Instruction* instruction) {
+  FILE* file = emitter->file;
+  Chunk* chunk = &emitter->function->chunk;
+  uint8_t* ip = &chunk->code[offset];
+  uint8_t opcode = ip[0];
+  int depth = emitter->depths[offset];
+  int next = offset + instruction->length;
+
+  int width = isLongOpcode(opcode) ? 3 : 1;
+  uint32_t operand = readOperand(ip + 1, width);
+  // The argument count and cache that follow a name.
+  int argCount = ip[1 + width];
+  int cache = (int)readOperand(ip + 1 + width, 2);
+  int invokeCache = (int)readOperand(ip + 2 + width, 2);
+
+  const char* top = slot(emitter, depth - 1);
+  switch (opcode) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG: {
+      Value constant = chunk->constants.values[operand];
+      fprintf(file, "  %s = ", slot(emitter, depth));
+      if (IS_NUMBER(constant) && isfinite(AS_NUMBER(constant))) {
+        emitNumber(file, AS_NUMBER(constant));
+      } else {
+        fprintf(file, "AOT_CONSTANT(%u)", operand);
+      }
+      fprintf(file, ";\n");
+      break;
+    }
+
+    case OP_NIL:
+      fprintf(file, "  %s = NIL_VAL;\n", slot(emitter, depth));
+      break;
+    case OP_TRUE:
+      fprintf(file, "  %s = BOOL_VAL(true);\n", slot(emitter, depth));
+      break;
+    case OP_FALSE:
+      fprintf(file, "  %s = BOOL_VAL(false);\n", slot(emitter, depth));
+      break;
+    case OP_ZERO:
+      fprintf(file, "  %s = NUMBER_VAL(0);\n", slot(emitter, depth));
+      break;
+    case OP_ONE:
+      fprintf(file, "  %s = NUMBER_VAL(1);\n", slot(emitter, depth));
+      break;
+
+    case OP_POP:
+    case OP_POPN:
+      break;
+
+    case OP_DUP:
+      fprintf(file, "  %s = %s;\n", slot(emitter, depth), top);
+      break;
+
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+      fprintf(file, "  %s = %s;\n", slot(emitter, depth),
+              slot(emitter, operand));
+      break;
+
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+      fprintf(file, "  %s = %s;\n", slot(emitter, operand), top);
+      break;
+
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_LONG:
+      fprintf(file, "  %s = *frame->closure->upvalues[%u]->location;\n",
+              slot(emitter, depth), operand);
+      break;
+
+    case OP_SET_UPVALUE:
+    case OP_SET_UPVALUE_LONG:
+      fprintf(file, "  *frame->closure->upvalues[%u]->location = %s;\n",
+              operand, top);
+      break;
+
+    case OP_EQUAL:
+    case OP_NEQUAL: {
+      const char* a = slot(emitter, depth - 2);
+      fprintf(file, "  %s = BOOL_VAL(%svaluesEqual(%s, %s));\n", a,
+              opcode == OP_NEQUAL ? "!" : "", a, top);
+      break;
+    }
+
+    case OP_GREATER:
+    case OP_GREATER_NUMBER:
+      emitBinary(emitter, depth, next, "BOOL_VAL", ">");
+      break;
+    case OP_LESS:
+    case OP_LESS_NUMBER:
+      emitBinary(emitter, depth, next, "BOOL_VAL", "<");
+      break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUMBER:
+      emitBinary(emitter, depth, next, "NUMBER_VAL", "-");
+      break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUMBER:
+      emitBinary(emitter, depth, next, "NUMBER_VAL", "*");
+      break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUMBER:
+      emitBinary(emitter, depth, next, "NUMBER_VAL", "/");
+      break;
+
+    case OP_ADD:
+    case OP_ADD_NUMBER: {
+      // Strings are added by the runtime.
+      const char* a = slot(emitter, depth - 2);
+      const char* b = slot(emitter, depth - 1);
+      fprintf(file,
+              "  if (IS_NUMBER(%s) && IS_NUMBER(%s)) {\n"
+              "    %s = NUMBER_VAL(AS_NUMBER(%s) + AS_NUMBER(%s));\n"
+              "  } else {\n",
+              a, b, a, a, b);
+      emitRuntime(emitter, depth, next, instruction, true, "jitAdd(vm)");
+      fprintf(file, "  }\n");
+      break;
+    }
+
+    case OP_NOT:
+      fprintf(file, "  %s = BOOL_VAL(aotFalsey(%s));\n", top, top);
+      break;
+
+    case OP_NEGATE:
+      fprintf(file,
+              "  if (!IS_NUMBER(%s)) AOT_ERROR(%d, \"Operand must be a number.\");\n"
+              "  %s = NUMBER_VAL(-AS_NUMBER(%s));\n",
+              top, next, top, top);
+      break;
+
+    case OP_PRINT:
+      fprintf(file, "  printValue(%s);\n  printf(\"\\n\");\n", top);
+      break;
+
+    case OP_JUMP_NEAR:
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+    case OP_LOOP_NEAR:
+    case OP_LOOP:
+    case OP_LOOP_LONG:
+      fprintf(file, "  goto L%d;\n", instruction->target);
+      break;
+
+    case OP_JUMP_IF_FALSE_NEAR:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+      fprintf(file, "  if (aotFalsey(%s)) goto L%d;\n", top,
+              instruction->target);
+      break;
+
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+      emitRuntime(emitter, depth, next, instruction, true,
+                  "jitGetGlobal(vm, AS_STRING(AOT_CONSTANT(%u)))", operand);
+      break;
+
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+      emitRuntime(emitter, depth, next, instruction, false,
+                  "jitDefineGlobal(vm, AS_STRING(AOT_CONSTANT(%u)))",
+                  operand);
+      break;
+
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+      emitRuntime(emitter, depth, next, instruction, true,
+                  "jitSetGlobal(vm, AS_STRING(AOT_CONSTANT(%u)))", operand);
+      break;
+
+    case OP_GET_PROPERTY:
+    case OP_GET_PROPERTY_LONG:
+      emitRuntime(emitter, depth, next, instruction, true,
+                  "aotGetProperty(vm, AS_STRING(AOT_CONSTANT(%u)), %d)",
+                  operand, cache);
+      break;
+
+    case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_LONG:
+      emitRuntime(emitter, depth, next, instruction, true,
+                  "aotSetProperty(vm, AS_STRING(AOT_CONSTANT(%u)), %d)",
+                  operand, cache);
+      break;
+
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+      emitRuntime(emitter, depth, next, instruction, true,
+                  "aotGetSuper(vm, AS_STRING(AOT_CONSTANT(%u)))", operand);
+      break;
+
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+      emitRuntime(emitter, depth, next, instruction, true,
+                  "aotInvoke(vm, AS_STRING(AOT_CONSTANT(%u)), %d, %d)",
+                  operand, argCount, invokeCache);
+      break;
+
+    case OP_SUPER_INVOKE:
+    case OP_SUPER_INVOKE_LONG:
+      emitRuntime(emitter, depth, next, instruction, true,
+                  "aotSuperInvoke(vm, AS_STRING(AOT_CONSTANT(%u)), %d, %d)",
+                  operand, argCount, invokeCache);
+      break;
+
+    case OP_CALL:
+      emitRuntime(emitter, depth, next, instruction, true,
+                  "jitCall(vm, %u)", operand);
+      break;
+
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+      emitRuntime(emitter, depth, next, instruction, false,
+                  "aotClosure(vm, frame->closure->function->chunk.code + %d)",
+                  offset);
+      break;
+
+    case OP_CLOSE_UPVALUE:
+      emitRuntime(emitter, depth, next, instruction, false,
+                  "jitCloseUpvalue(vm)");
+      break;
+
+    case OP_RETURN:
+      emitRuntime(emitter, depth, next, instruction, false,
+                  "jitReturn(vm, frame)");
+      fprintf(file, "  return true;\n");
+      break;
+
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+      emitRuntime(emitter, depth, next, instruction, false,
+                  "aotClass(vm, AS_STRING(AOT_CONSTANT(%u)))", operand);
+      break;
+
+    case OP_INHERIT:
+      emitRuntime(emitter, depth, next, instruction, true, "aotInherit(vm)");
+      break;
+
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+      emitRuntime(emitter, depth, next, instruction, true,
+                  "aotMethod(vm, AS_STRING(AOT_CONSTANT(%u)))", operand);
+      break;
+
+    case OP_ARRAY:
+      emitRuntime(emitter, depth, next, instruction, false,
+                  "aotArray(vm, %u)", operand);
+      break;
+
+    case OP_MAP:
+      emitRuntime(emitter, depth, next, instruction, true,
+                  "aotMap(vm, %u)", operand);
+      break;
+
+    case OP_INDEX_GET:
+      emitRuntime(emitter, depth, next, instruction, true, "aotIndexGet(vm)");
+      break;
+
+    case OP_INDEX_SET:
+      emitRuntime(emitter, depth, next, instruction, true, "aotIndexSet(vm)");
+      break;
+  }
+}
+
+// Finds the slots closures capture, which includes the slot a local
+// function is pushed to when it captures itself.
+static void findCaptured(Emitter* emitter) {
+  Chunk* chunk = &emitter->function->chunk;
+  for (int offset = 0; offset < chunk->count; offset++) {
+    uint8_t opcode = chunk->code[offset];
+    if (emitter->depths[offset] < 0 ||
+        (opcode != OP_CLOSURE && opcode != OP_CLOSURE_LONG)) {
+      continue;
+    }
+
+    int width = opcode == OP_CLOSURE_LONG ? 3 : 1;
+    ObjFunction* closed = AS_FUNCTION(
+        chunk->constants.values[readOperand(&chunk->code[offset + 1], width)]);
+    for (int i = 0; i < closed->upvalueCount; i++) {
+      uint8_t* upvalue = &chunk->code[offset + 1 + width + i * (1 + width)];
+      if (upvalue[0] == 1) {
+        emitter->captured[readOperand(upvalue + 1, width)] = true;
+      }
+    }
+  }
+}
+
+// Writes the C function for a Lox function, or nothing when its
+// bytecode doesn't verify. Returns whether it wrote one.
+static bool emitFunction(FILE* file, ObjFunction* function, int index) {
+  Chunk* chunk = &function->chunk;
+  int* depths = ALLOCATE(int, chunk->count);
+  if (!findStackDepths(function, depths)) {
+    FREE_ARRAY(int, depths, chunk->count);
+    return false;
+  }
+
+  Emitter emitter;
+  emitter.function = function;
+  emitter.depths = depths;
+  emitter.captured = ALLOCATE(bool, function->maxSlots + 1);
+  emitter.used = ALLOCATE(bool, function->maxSlots + 1);
+  emitter.targets = ALLOCATE(bool, chunk->count);
+  for (int i = 0; i <= function->maxSlots; i++) {
+    emitter.captured[i] = false;
+    emitter.used[i] = false;
+  }
+  for (int i = 0; i < chunk->count; i++) emitter.targets[i] = false;
+  findCaptured(&emitter);
+
+  for (int offset = 0; offset < chunk->count; offset++) {
+    Instruction instruction;
+    if (depths[offset] < 0) continue;
+    decodeInstruction(function, offset, &instruction);
+    if (instruction.target != -1) emitter.targets[instruction.target] = true;
+  }
+
+  // The body goes first, to find which C variables it uses.
+  char* body;
+  size_t bodySize;
+  emitter.file = open_memstream(&body, &bodySize);
+  for (int offset = 0; offset < chunk->count;) {
+    Instruction instruction;
+    decodeInstruction(function, offset, &instruction);
+    if (depths[offset] >= 0) {
+      if (emitter.targets[offset]) fprintf(emitter.file, "L%d:;\n", offset);
+      emitInstruction(&emitter, offset, &instruction);
+    }
+    offset += instruction.length;
+  }
+  fclose(emitter.file);
+
+  fprintf(file, "// %s\n", function->name == NULL ? "script"
+                                                  : function->name->chars);
+  fprintf(file, "static bool function%d(VM* vm) {\n", index);
+  fprintf(file, "  CallFrame* frame = &vm->frames[vm->frameCount - 1];\n");
+  fprintf(file, "  Value* slots = frame->slots;\n");
+  for (int i = 0; i <= function->maxSlots; i++) {
+    if (!emitter.used[i]) continue;
+    // The callee and the arguments are already on the stack.
+    if (i <= function->arity) {
+      fprintf(file, "  Value s%d = slots[%d];\n", i, i);
+    } else {
+      fprintf(file, "  Value s%d = NIL_VAL;\n", i);
+    }
+  }
+  fwrite(body, 1, bodySize, file);
+  fprintf(file, "}\n\n");
+  free(body);
+
+  FREE_ARRAY(int, depths, chunk->count);
+  FREE_ARRAY(bool, emitter.captured, function->maxSlots + 1);
+  FREE_ARRAY(bool, emitter.used, function->maxSlots + 1);
+  FREE_ARRAY(bool, emitter.targets, chunk->count);
+  return true;
+}
+
+static void emitSource(FILE* file, const char* source) {
+  fprintf(file, "static const char source[] =\n  \"");
+  for (const char* c = source; *c != '\0'; c++) {
+    switch (*c) {
+      case '\n':
+        if (c[1] != '\0') {
+          fprintf(file, "\\n\"\n  \"");
+        } else {
+          fprintf(file, "\\n");
+        }
+        break;
+      case '"': fprintf(file, "\\\""); break;
+      case '\\': fprintf(file, "\\\\"); break;
+      default:
+        if ((unsigned char)*c < ' ' || (unsigned char)*c >= 0x7f) {
+          fprintf(file, "\\%03o", (unsigned char)*c);
+        } else {
+          fputc(*c, file);
+        }
+        break;
+    }
+  }
+  fprintf(file, "\";\n\n");
+}
+
+bool writeAot(ObjFunction* script, const char* source, const char* path) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) return false;
+
+  FunctionList list = {NULL, 0, 0};
+  collectFunctions(&list, script);
+  bool* emitted = ALLOCATE(bool, list.count);
+
+  fprintf(file, "// Compiled from Lox by clox --emit-c.\n\n");
+  fprintf(file, "#include \"aot.h\"\n\n");
+  for (int i = 0; i < list.count; i++) {
+    emitted[i] = emitFunction(file, list.functions[i], i);
+  }
+
+  emitSource(file, source);
+  fprintf(file, "static const AotFunction functions[] = {\n");
+  for (int i = 0; i < list.count; i++) {
+    if (emitted[i]) {
+      fprintf(file, "  {function%d, %d},\n", i, list.functions[i]->chunk.count);
+    } else {
+      fprintf(file, "  {NULL, %d},\n", list.functions[i]->chunk.count);
+    }
+  }
+  fprintf(file, "};\n\n");
+  fprintf(file, "int main(void) {\n");
+  fprintf(file, "  return runAot(source, functions, %d);\n", list.count);
+  fprintf(file, "}\n");
+
+  FREE_ARRAY(bool, emitted, list.count);
+  freeFunctionList(&list);
+  return fclose(file) == 0;
+}
+
+int runAot(const char* source, const AotFunction* functions, int count) {
+  VM vm;
+  initVM(&vm);
+  ObjFunction* script = compile(&vm, source);
+  if (script == NULL) return 65;
+
+  FunctionList list = {NULL, 0, 0};
+  collectFunctions(&list, script);
+  bool matches = list.count == count;
+  for (int i = 0; matches && i < count; i++) {
+    matches = list.functions[i]->chunk.count == functions[i].codeCount;
+  }
+  if (!matches) {
+    fprintf(stderr, "The compiled code doesn't match its script.\n");
+    freeFunctionList(&list);
+    return 70;
+  }
+
+  for (int i = 0; i < count; i++) {
+    list.functions[i]->aot = functions[i].function;
+  }
+  freeFunctionList(&list);
+
+  InterpretResult result = interpretFunction(&vm, script);
+  // Exiting releases the heap faster than freeing every object.
+  if (result == INTERPRET_COMPILE_ERROR) return 65;
+  if (result == INTERPRET_RUNTIME_ERROR) return 70;
+  return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "jit.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+// Compiles a script ahead of time to a C program, which links against
+// the rest of clox:
+//
+//   clox --emit-c script.c script.lox
+//   cc -O2 -Iclox -o script script.c clox/libclox.a -lm -pthread
+//
+// Each Lox function becomes a C function that keeps its locals and
+// temporaries in C variables, apart from the locals closures capture,
+// which stay on the VM stack. Anything but numbers, locals, upvalues and
+// jumps calls the same runtime the JIT uses. The program embeds the
+// script and compiles it again when it starts, for the objects,
+// constants and line numbers the C code refers to, then runs it with
+// the C functions in place of the bytecode.
+
+typedef struct {
+  AotFn function;
+  // The length of the function's bytecode, checked when the function is
+  // put in place.
+  int codeCount;
+} AotFunction;
+
+// Returns false when the file can't be written.
+bool writeAot(ObjFunction* script, const char* source, const char* path);
+// Runs the script with the C functions compiled from it, in the order
+// writeAot() wrote them. Returns the process's exit code.
+int runAot(const char* source, const AotFunction* functions, int count);
+
+// The rest is used by the generated code, inside a function that has
+// "vm" and the top "frame".
+
+#define AOT_CONSTANT(index) \
+    (frame->closure->function->chunk.constants.values[index])
+// Where runtime errors, and the stack traces of calls, find the line.
+#define AOT_AT(offset) \
+    (frame->ip = frame->closure->function->chunk.code + (offset))
+#define AOT_ERROR(offset, message)                      \
+    do {                                                \
+      AOT_AT(offset);                                   \
+      jitError(vm, message);                            \
+      return false;                                     \
+    } while (false)
+
+static inline bool aotFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Like the JIT's helpers, these run an instruction on the values at the
+// top of the VM stack. The ones that return bool return false after
+// reporting a runtime error.
+bool aotGetProperty(VM* vm, ObjString* name, int cache);
+bool aotSetProperty(VM* vm, ObjString* name, int cache);
+bool aotGetSuper(VM* vm, ObjString* name);
+bool aotInvoke(VM* vm, ObjString* name, int argCount, int cache);
+bool aotSuperInvoke(VM* vm, ObjString* name, int argCount, int cache);
+// ip is the instruction in the frame's code, for its operands.
+void aotClosure(VM* vm, uint8_t* ip);
+void aotClass(VM* vm, ObjString* name);
+bool aotInherit(VM* vm);
+bool aotMethod(VM* vm, ObjString* name);
+void aotArray(VM* vm, int elementCount);
+bool aotMap(VM* vm, int entryCount);
+bool aotIndexGet(VM* vm);
+bool aotIndexSet(VM* vm);
+
+#endif
@@ -0,0 +1,551 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+#include "verify.h"
+#include "vm.h"
+
+// A cache file is an image that is mmapped and executed in place. It
+// holds no pointers, only offsets from the start of the file, and is
+// laid out in the host's native byte order:
+//
+//   ImageHeader
+//   ImageFunction[functionCount]     function 0 is the script
+//   ImageConstant[constantCount]     constants of all functions
+//   uint64_t[stringCount]            offsets of the string records
+//   string records                   ObjString layout, 8-byte aligned
+//   code                             chunk bytecode
+//   LineStart[]                      chunk line tables, 4-byte aligned
+//
+// Strings are stored exactly as an ObjString (header, length, hash and
+// NUL terminated chars), so the interned strings of a loaded script are
+// the records inside the mapping. Bytecode and line tables are used
+// in place too, which lets every process running the same script share
+// those pages. The mapping is private and writable because the VM
+// quickens instructions in place, so only the pages it rewrites are
+// copied. The only allocations on load are the ObjFunctions and
+// one Value array for all the constants.
+
+#define CACHE_MAGIC   "LOXC"
+#define CACHE_VERSION 7
+
+#define IMAGE_LAYOUT \
+    ((uint32_t)(sizeof(Value) | sizeof(LineStart) << 8 | \
+                offsetof(ObjString, chars) << 16 | sizeof(void*) << 24))
+
+typedef enum {
+  CONST_NIL,
+  CONST_TRUE,
+  CONST_FALSE,
+  CONST_NUMBER,
+  CONST_STRING,
+  CONST_FUNCTION,
+} ConstantTag;
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint64_t sourceHash;
+  uint32_t layout;
+  uint32_t functionCount;
+  uint32_t constantCount;
+  uint32_t stringCount;
+  uint64_t functionsOffset;
+  uint64_t constantsOffset;
+  uint64_t stringsOffset;
+  uint64_t size;
+} ImageHeader;
+
+typedef struct {
+  uint32_t arity;
+  uint32_t upvalueCount;
+  int32_t name;
+  uint32_t codeCount;
+  uint64_t codeOffset;
+  uint64_t linesOffset;
+  uint32_t lineCount;
+  uint32_t constantsStart;
+  uint32_t constantCount;
+  uint32_t cacheCount;
+  uint32_t maxSlots;
+  uint32_t padding;
+} ImageFunction;
+
+typedef struct {
+  uint32_t tag;
+  uint32_t index;
+  uint64_t bits;
+} ImageConstant;
+
+typedef struct {
+  int count;
+  int capacity;
+  uint8_t* bytes;
+} Writer;
+
+// Objects collected from the function tree in the order they are laid
+// out in the image.
+typedef struct {
+  int functionCount;
+  int functionCapacity;
+  ObjFunction** functions;
+  int constantCount;
+  Table strings;  // ObjString -> index in the image
+  int stringCount;
+} Layout;
+
+// implements hash algorithm FNV-1a (64 bit variant)
+static uint64_t hashSource(const char* source) {
+  uint64_t hash = 14695981039346656037u;
+  for (const char* c = source; *c != '\0'; c++) {
+    hash ^= (uint8_t)*c;
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+static char* cachePath(const char* sourcePath) {
+  size_t length = strlen(sourcePath);
+  char* path = ALLOCATE(char, length + 2);
+  memcpy(path, sourcePath, length);
+  path[length] = 'c';
+  path[length + 1] = '\0';
+  return path;
+}
+
+// ----------------------------------
+//      Writing
+// ----------------------------------
+
+static void writeBytes(Writer* writer, const void* bytes, int length) {
+  if (writer->capacity < writer->count + length) {
+    int oldCapacity = writer->capacity;
+    while (writer->capacity < writer->count + length) {
+      writer->capacity = GROW_CAPACITY(writer->capacity);
+    }
+    writer->bytes = GROW_ARRAY(uint8_t, writer->bytes,
+                               oldCapacity, writer->capacity);
+  }
+  memcpy(writer->bytes + writer->count, bytes, length);
+  writer->count += length;
+}
+
+static void writeAlign(Writer* writer, int alignment) {
+  static const uint8_t zeroes[8] = {0};
+  writeBytes(writer, zeroes, (alignment - writer->count % alignment) % alignment);
+}
+
+static int stringIndex(Layout* layout, ObjString* string) {
+  Value index;
+  if (tableGet(&layout->strings, string, &index)) return (int)AS_NUMBER(index);
+
+  tableSet(&layout->strings, string, NUMBER_VAL(layout->stringCount));
+  return layout->stringCount++;
+}
+
+// Assigns indices in pre-order: a function comes before the functions
+// nested in its constants.
+static int collectFunction(Layout* layout, ObjFunction* function) {
+  if (layout->functionCapacity < layout->functionCount + 1) {
+    int oldCapacity = layout->functionCapacity;
+    layout->functionCapacity = GROW_CAPACITY(oldCapacity);
+    layout->functions = GROW_ARRAY(ObjFunction*, layout->functions,
+                                   oldCapacity, layout->functionCapacity);
+  }
+  int index = layout->functionCount++;
+  layout->functions[index] = function;
+  layout->constantCount += function->chunk.constants.count;
+
+  if (function->name != NULL) stringIndex(layout, function->name);
+  for (int i = 0; i < function->chunk.constants.count; i++) {
+    Value value = function->chunk.constants.values[i];
+    if (IS_STRING(value)) stringIndex(layout, AS_STRING(value));
+    if (IS_FUNCTION(value)) collectFunction(layout, AS_FUNCTION(value));
+  }
+  return index;
+}
+
+static int functionIndex(Layout* layout, ObjFunction* function) {
+  for (int i = 0; i < layout->functionCount; i++) {
+    if (layout->functions[i] == function) return i;
+  }
+  return -1; // Unreachable.
+}
+
+static void writeImage(Writer* writer, Layout* layout, uint64_t sourceHash) {
+  ImageHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, 4);
+  header.version = CACHE_VERSION;
+  header.sourceHash = sourceHash;
+  header.layout = IMAGE_LAYOUT;
+  header.functionCount = (uint32_t)layout->functionCount;
+  header.constantCount = (uint32_t)layout->constantCount;
+  header.stringCount = (uint32_t)layout->stringCount;
+  header.functionsOffset = sizeof(ImageHeader);
+  header.constantsOffset = header.functionsOffset +
+      sizeof(ImageFunction) * layout->functionCount;
+  header.stringsOffset = header.constantsOffset +
+      sizeof(ImageConstant) * layout->constantCount;
+
+  // Strings first, so we know where the code starts.
+  uint64_t* stringOffsets = ALLOCATE(uint64_t, layout->stringCount);
+  Writer strings = {0, 0, NULL};
+  uint64_t stringsStart = header.stringsOffset +
+      sizeof(uint64_t) * layout->stringCount;
+  for (int i = 0; i < layout->strings.capacity; i++) {
+    Entry* entry = &layout->strings.entries[i];
+    if (IS_NIL(entry->key)) continue;
+
+    ObjString* string = AS_STRING(entry->key);
+    ObjString record;
+    memset(&record, 0, sizeof(record));
+    record.obj.type = OBJ_STRING;
+    record.length = string->length;
+    record.hash = string->hash;
+
+    stringOffsets[(int)AS_NUMBER(entry->value)] = stringsStart + strings.count;
+    writeBytes(&strings, &record, offsetof(ObjString, chars));
+    writeBytes(&strings, string->chars, string->length + 1);
+    writeAlign(&strings, 8);
+  }
+
+  uint64_t codeStart = stringsStart + strings.count;
+  uint64_t codeSize = 0;
+  for (int i = 0; i < layout->functionCount; i++) {
+    codeSize += layout->functions[i]->chunk.count;
+  }
+  uint64_t linesStart = (codeStart + codeSize + 3) & ~(uint64_t)3;
+
+  writeBytes(writer, &header, sizeof(header));
+
+  uint64_t codeOffset = codeStart;
+  uint64_t linesOffset = linesStart;
+  uint32_t constantsStart = 0;
+  for (int i = 0; i < layout->functionCount; i++) {
+    ObjFunction* function = layout->functions[i];
+    ImageFunction image;
+    memset(&image, 0, sizeof(image));
+    image.arity = (uint32_t)function->arity;
+    image.upvalueCount = (uint32_t)function->upvalueCount;
+    image.maxSlots = (uint32_t)function->maxSlots;
+    image.name = function->name == NULL
+        ? -1 : stringIndex(layout, function->name);
+    image.codeOffset = codeOffset;
+    image.codeCount = (uint32_t)function->chunk.count;
+    image.linesOffset = linesOffset;
+    image.lineCount = (uint32_t)function->chunk.lineCount;
+    image.constantsStart = constantsStart;
+    image.constantCount = (uint32_t)function->chunk.constants.count;
+    image.cacheCount = (uint32_t)function->chunk.cacheCount;
+    writeBytes(writer, &image, sizeof(image));
+
+    codeOffset += image.codeCount;
+    linesOffset += sizeof(LineStart) * image.lineCount;
+    constantsStart += image.constantCount;
+  }
+
+  for (int i = 0; i < layout->functionCount; i++) {
+    ValueArray* constants = &layout->functions[i]->chunk.constants;
+    for (int j = 0; j < constants->count; j++) {
+      Value value = constants->values[j];
+      ImageConstant constant = {CONST_NIL, 0, 0};
+      switch (value.type) {
+        case VAL_NIL: break;
+        case VAL_BOOL:
+          constant.tag = AS_BOOL(value) ? CONST_TRUE : CONST_FALSE;
+          break;
+        case VAL_NUMBER:
+          constant.tag = CONST_NUMBER;
+          memcpy(&constant.bits, &value.as.number, sizeof(constant.bits));
+          break;
+        case VAL_OBJ:
+          if (IS_STRING(value)) {
+            constant.tag = CONST_STRING;
+            constant.index = (uint32_t)stringIndex(layout, AS_STRING(value));
+          } else {
+            constant.tag = CONST_FUNCTION;
+            constant.index = (uint32_t)functionIndex(layout, AS_FUNCTION(value));
+          }
+          break;
+      }
+      writeBytes(writer, &constant, sizeof(constant));
+    }
+  }
+
+  writeBytes(writer, stringOffsets, sizeof(uint64_t) * layout->stringCount);
+  writeBytes(writer, strings.bytes, strings.count);
+
+  for (int i = 0; i < layout->functionCount; i++) {
+    Chunk* chunk = &layout->functions[i]->chunk;
+    writeBytes(writer, chunk->code, chunk->count);
+  }
+  writeAlign(writer, 4);
+  for (int i = 0; i < layout->functionCount; i++) {
+    Chunk* chunk = &layout->functions[i]->chunk;
+    writeBytes(writer, chunk->lines, sizeof(LineStart) * chunk->lineCount);
+  }
+
+  ((ImageHeader*)writer->bytes)->size = (uint64_t)writer->count;
+
+  FREE_ARRAY(uint64_t, stringOffsets, layout->stringCount);
+  FREE_ARRAY(uint8_t, strings.bytes, strings.capacity);
+}
+
+bool writeCache(const char* sourcePath, const char* source, ObjFunction* function) {
+  Layout layout;
+  memset(&layout, 0, sizeof(layout));
+  initTable(&layout.strings);
+  collectFunction(&layout, function);
+
+  Writer writer = {0, 0, NULL};
+  writeImage(&writer, &layout, hashSource(source));
+
+  // Write to a private temporary file and rename it into place so
+  // concurrent runs never observe a half written cache.
+  char* path = cachePath(sourcePath);
+  size_t tempLength = strlen(path) + 32;
+  char* tempPath = ALLOCATE(char, tempLength);
+  snprintf(tempPath, tempLength, "%s.%ld.tmp", path, (long)getpid());
+
+  bool written = false;
+  FILE* file = fopen(tempPath, "wb");
+  if (file != NULL) {
+    written = fwrite(writer.bytes, 1, writer.count, file) == (size_t)writer.count;
+    written = fclose(file) == 0 && written;
+    written = written && rename(tempPath, path) == 0;
+    if (!written) remove(tempPath);
+  }
+
+  FREE_ARRAY(char, tempPath, tempLength);
+  FREE_ARRAY(char, path, strlen(sourcePath) + 2);
+  FREE_ARRAY(uint8_t, writer.bytes, writer.capacity);
+  FREE_ARRAY(ObjFunction*, layout.functions, layout.functionCapacity);
+  freeTable(&layout.strings);
+  return written;
+}
+
+// ----------------------------------
+//      Loading
+// ----------------------------------
+
+static bool inImage(uint64_t size, uint64_t offset, uint64_t length) {
+  return offset <= size && length <= size - offset;
+}
+
+static bool validString(const uint8_t* base, uint64_t size, uint64_t offset) {
+  if (offset % 8 != 0 || !inImage(size, offset, offsetof(ObjString, chars))) {
+    return false;
+  }
+
+  const ObjString* string = (const ObjString*)(base + offset);
+  return string->obj.type == OBJ_STRING && string->length >= 0 &&
+         inImage(size, offset + offsetof(ObjString, chars),
+                 (uint64_t)string->length + 1) &&
+         string->chars[string->length] == '\0' &&
+         string->hash == hashString(string->chars, string->length);
+}
+
+static bool validFunction(const ImageHeader* header,
+                          const ImageFunction* image) {
+  return inImage(header->size, image->codeOffset, image->codeCount) &&
+         image->linesOffset % 4 == 0 &&
+         inImage(header->size, image->linesOffset,
+                 sizeof(LineStart) * (uint64_t)image->lineCount) &&
+         (uint64_t)image->constantsStart + image->constantCount <=
+             header->constantCount &&
+         image->arity <= UINT8_MAX &&
+         image->upvalueCount <= UINT16_COUNT &&
+         image->cacheCount <= UINT16_COUNT &&
+         image->maxSlots <= UINT16_COUNT &&
+         (image->name == -1 ||
+          (image->name >= 0 && (uint32_t)image->name < header->stringCount));
+}
+
+static bool validConstant(const ImageHeader* header,
+                          const ImageConstant* constant) {
+  switch (constant->tag) {
+    case CONST_NIL:
+    case CONST_TRUE:
+    case CONST_FALSE:
+    case CONST_NUMBER:   return true;
+    case CONST_STRING:   return constant->index < header->stringCount;
+    case CONST_FUNCTION: return constant->index < header->functionCount;
+    default:             return false;
+  }
+}
+
+// Checks every offset and index in the image before anything from it is
+// handed to the VM.
+static bool validImage(const uint8_t* base, uint64_t size, const char* source) {
+  const ImageHeader* header = (const ImageHeader*)base;
+  if (size < sizeof(ImageHeader) ||
+      memcmp(header->magic, CACHE_MAGIC, 4) != 0 ||
+      header->version != CACHE_VERSION ||
+      header->layout != IMAGE_LAYOUT ||
+      header->size != size ||
+      header->sourceHash != hashSource(source) ||
+      header->functionCount == 0 ||
+      header->functionsOffset % 8 != 0 ||
+      header->constantsOffset % 8 != 0 ||
+      header->stringsOffset % 8 != 0 ||
+      !inImage(size, header->functionsOffset,
+               sizeof(ImageFunction) * (uint64_t)header->functionCount) ||
+      !inImage(size, header->constantsOffset,
+               sizeof(ImageConstant) * (uint64_t)header->constantCount) ||
+      !inImage(size, header->stringsOffset,
+               sizeof(uint64_t) * (uint64_t)header->stringCount)) {
+    return false;
+  }
+
+  // The script takes no arguments and closes over nothing.
+  const ImageFunction* functions =
+      (const ImageFunction*)(base + header->functionsOffset);
+  if (functions[0].arity != 0 || functions[0].upvalueCount != 0) {
+    return false;
+  }
+
+  for (uint32_t i = 0; i < header->functionCount; i++) {
+    if (!validFunction(header, &functions[i])) return false;
+  }
+
+  const ImageConstant* constants =
+      (const ImageConstant*)(base + header->constantsOffset);
+  for (uint32_t i = 0; i < header->constantCount; i++) {
+    if (!validConstant(header, &constants[i])) return false;
+  }
+
+  const uint64_t* strings = (const uint64_t*)(base + header->stringsOffset);
+  for (uint32_t i = 0; i < header->stringCount; i++) {
+    if (!validString(base, size, strings[i])) return false;
+  }
+
+  return true;
+}
+
+// Interns a string record of the image. The record itself becomes the
+// interned string unless the VM already has an equal one.
+static ObjString* internRecord(VM* vm, const uint8_t* base,
+                               uint64_t offset) {
+  ObjString* string = (ObjString*)(base + offset);
+  ObjString* interned = tableFindString(&vm->strings, string->chars,
+                                        string->length, string->hash);
+  if (interned != NULL) return interned;
+
+  tableSet(&vm->strings, string, NIL_VAL);
+  return string;
+}
+
+static ObjFunction* loadImage(VM* vm, const uint8_t* base) {
+  const ImageHeader* header = (const ImageHeader*)base;
+  const ImageFunction* images =
+      (const ImageFunction*)(base + header->functionsOffset);
+  const ImageConstant* constants =
+      (const ImageConstant*)(base + header->constantsOffset);
+  const uint64_t* stringOffsets =
+      (const uint64_t*)(base + header->stringsOffset);
+
+  ObjString** strings = ALLOCATE(ObjString*, header->stringCount);
+  for (uint32_t i = 0; i < header->stringCount; i++) {
+    strings[i] = internRecord(vm, base, stringOffsets[i]);
+  }
+
+  ObjFunction** functions = ALLOCATE(ObjFunction*, header->functionCount);
+  Value* values = ALLOCATE(Value, header->constantCount);
+  for (uint32_t i = 0; i < header->functionCount; i++) {
+    const ImageFunction* image = &images[i];
+
+    // Chunks with zero capacity borrow their arrays, here from the
+    // mapping and from the shared constant array.
+    ObjFunction* function = newFunction(vm);
+    function->arity = (int)image->arity;
+    function->upvalueCount = (int)image->upvalueCount;
+    function->maxSlots = (int)image->maxSlots;
+    function->name = image->name == -1 ? NULL : strings[image->name];
+    function->chunk.code = (uint8_t*)(base + image->codeOffset);
+    function->chunk.count = (int)image->codeCount;
+    function->chunk.lines = (LineStart*)(base + image->linesOffset);
+    function->chunk.lineCount = (int)image->lineCount;
+    function->chunk.constants.values = values + image->constantsStart;
+    function->chunk.constants.count = (int)image->constantCount;
+
+    // Inline caches are written to as the script runs, so each chunk
+    // gets its own.
+    for (uint32_t j = 0; j < image->cacheCount; j++) {
+      addInlineCache(&function->chunk);
+    }
+    functions[i] = function;
+  }
+
+  for (uint32_t i = 0; i < header->constantCount; i++) {
+    const ImageConstant* constant = &constants[i];
+    switch (constant->tag) {
+      case CONST_NIL:   values[i] = NIL_VAL; break;
+      case CONST_TRUE:  values[i] = BOOL_VAL(true); break;
+      case CONST_FALSE: values[i] = BOOL_VAL(false); break;
+      case CONST_NUMBER: {
+        double number;
+        memcpy(&number, &constant->bits, sizeof(number));
+        values[i] = NUMBER_VAL(number);
+        break;
+      }
+      case CONST_STRING:
+        values[i] = OBJ_VAL(strings[constant->index]);
+        break;
+      case CONST_FUNCTION:
+        values[i] = OBJ_VAL(functions[constant->index]);
+        break;
+    }
+  }
+
+  // The image is run without bounds checks, so the bytecode has to be
+  // verified like the compiler's own.
+  ObjFunction* script = functions[0];
+  for (uint32_t i = 0; i < header->functionCount; i++) {
+    if (!verifyFunction(functions[i])) script = NULL;
+  }
+
+  FREE_ARRAY(ObjString*, strings, header->stringCount);
+  FREE_ARRAY(ObjFunction*, functions, header->functionCount);
+  return script;
+}
+
+ObjFunction* loadCache(VM* vm, const char* sourcePath, const char* source) {
+  char* path = cachePath(sourcePath);
+  int fd = open(path, O_RDONLY);
+  FREE_ARRAY(char, path, strlen(sourcePath) + 2);
+  if (fd == -1) return NULL;
+
+  struct stat status;
+  if (fstat(fd, &status) == -1 || status.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  // The mapping stays alive for as long as the functions loaded from it,
+  // which is the lifetime of the process.
+  size_t size = (size_t)status.st_size;
+  void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return NULL;
+
+  if (!validImage((const uint8_t*)base, size, source)) {
+    munmap(base, size);
+    return NULL;
+  }
+
+  // When the bytecode doesn't verify, strings from the mapping may have
+  // been interned already, so it isn't unmapped.
+  return loadImage(vm, (const uint8_t*)base);
+}
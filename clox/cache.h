@@ -0,0 +1,16 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// Compiled scripts are cached next to their source as "<path>c"
+// (e.g. "script.lox" -> "script.loxc"). A cache file is an image that
+// is mmapped and executed in place, and is only used when the hash of
+// the source it was compiled from matches.
+
+ObjFunction* loadCache(VM* vm, const char* sourcePath, const char* source);
+bool writeCache(const char* sourcePath, const char* source, ObjFunction* function);
+
+#endif
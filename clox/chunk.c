@@ -10,13 +10,21 @@ void initChunk(Chunk* chunk) {
   chunk->lineCount = 0;
   chunk->lineCapacity = 0;
   chunk->lines = NULL;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->caches = NULL;
   initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk* chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
-  freeValueArray(&chunk->constants);
+  // Chunks loaded from a cache image borrow their arrays and have zero
+  // capacity, so there is nothing to free for them.
+  if (chunk->capacity > 0) FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  if (chunk->lineCapacity > 0) {
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
+  }
+  if (chunk->constants.capacity > 0) freeValueArray(&chunk->constants);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
   initChunk(chunk);
 }
 
@@ -53,6 +61,18 @@ int addConstant(Chunk* chunk, Value value) {
   return chunk->constants.count - 1;
 }
 
+int addInlineCache(Chunk* chunk) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches,
+                               oldCapacity, chunk->cacheCapacity);
+  }
+
+  chunk->caches[chunk->cacheCount].count = 0;
+  return chunk->cacheCount++;
+}
+
 int writeConstant(Chunk* chunk, Value value, int line) {
   int index = addConstant(chunk, value);
   if (index < 256) {
@@ -60,9 +80,9 @@ int writeConstant(Chunk* chunk, Value value, int line) {
     writeChunk(chunk, (uint8_t)index, line);
   } else {
     writeChunk(chunk, OP_CONSTANT_LONG, line);
-    writeChunk(chunk, (uint8_t)(index & 0xff), line);
-    writeChunk(chunk, (uint8_t)((index >> 8) & 0xff), line);
     writeChunk(chunk, (uint8_t)((index >> 16) & 0xff), line);
+    writeChunk(chunk, (uint8_t)((index >> 8) & 0xff), line);
+    writeChunk(chunk, (uint8_t)(index & 0xff), line);
   }
   return index;
 }
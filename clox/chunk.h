@@ -4,6 +4,9 @@
 #include "common.h"
 #include "value.h"
 
+typedef struct ObjClass ObjClass;
+typedef struct ObjShape ObjShape;
+
 typedef enum {
   OP_CONSTANT,
   OP_CONSTANT_LONG,
@@ -13,12 +16,29 @@ typedef enum {
   OP_ZERO,
   OP_ONE,
   OP_GET_LOCAL,
+  OP_GET_LOCAL_LONG,
   OP_SET_LOCAL,
+  OP_SET_LOCAL_LONG,
   OP_GET_GLOBAL,
+  OP_GET_GLOBAL_LONG,
   OP_DEFINE_GLOBAL,
+  OP_DEFINE_GLOBAL_LONG,
   OP_SET_GLOBAL,
+  OP_SET_GLOBAL_LONG,
   OP_GET_UPVALUE,
+  OP_GET_UPVALUE_LONG,
   OP_SET_UPVALUE,
+  OP_SET_UPVALUE_LONG,
+  OP_GET_PROPERTY,
+  OP_GET_PROPERTY_LONG,
+  OP_SET_PROPERTY,
+  OP_SET_PROPERTY_LONG,
+  OP_GET_SUPER,
+  OP_GET_SUPER_LONG,
+  OP_INVOKE,
+  OP_INVOKE_LONG,
+  OP_SUPER_INVOKE,
+  OP_SUPER_INVOKE_LONG,
   OP_POP,
   OP_POPN,
   OP_DUP,
@@ -30,23 +50,79 @@ typedef enum {
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_DIVIDE,
+  OP_GREATER_NUMBER,
+  OP_LESS_NUMBER,
+  OP_ADD_NUMBER,
+  OP_SUBTRACT_NUMBER,
+  OP_MULTIPLY_NUMBER,
+  OP_DIVIDE_NUMBER,
   OP_NOT,
   OP_NEGATE,
   OP_PRINT,
+  OP_JUMP_NEAR,
   OP_JUMP,
+  OP_JUMP_LONG,
+  OP_JUMP_IF_FALSE_NEAR,
   OP_JUMP_IF_FALSE,
+  OP_JUMP_IF_FALSE_LONG,
+  OP_LOOP_NEAR,
   OP_LOOP,
+  OP_LOOP_LONG,
   OP_CALL,
   OP_CLOSURE,
+  OP_CLOSURE_LONG,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
+  OP_CLASS,
+  OP_CLASS_LONG,
+  OP_INHERIT,
+  OP_METHOD,
+  OP_METHOD_LONG,
+  OP_ARRAY,
+  OP_MAP,
+  OP_INDEX_GET,
+  OP_INDEX_SET,
 } OpCode;
 
+// The _LONG form of an instruction follows it in the enum and takes a
+// 24-bit big-endian operand instead of a single byte. Jumps come in
+// three forms instead, with a one byte offset for _NEAR, two bytes for
+// the plain form and four bytes for _LONG.
+#define LONG_OPERAND_MAX 0xffffff
+
+// The compiler never emits the _NUMBER instructions. The VM rewrites an
+// arithmetic or comparison instruction to its _NUMBER form once it has
+// seen two numbers there, and back again when the operands of a _NUMBER
+// instruction aren't both numbers.
+
 typedef struct {
   int offset;
   int line;
 } LineStart;
 
+#define INLINE_CACHE_SIZE 4
+
+// What a property instruction found the last time it saw an instance of
+// the given shape. A field is found in the same slot of every instance
+// with that shape. A method also depends on the instance's class, and
+// "slot" is -1. For a set that added the field, "next" is the shape the
+// instance moved to.
+typedef struct {
+  ObjShape* shape;
+  ObjClass* klass;
+  ObjShape* next;
+  int slot;
+  Value method;
+} CacheEntry;
+
+// Each property access and invoke instruction has its own inline cache,
+// found through the instruction's cache operand. Once all entries are
+// taken, the instruction is megamorphic and looks names up every time.
+typedef struct {
+  int count;
+  CacheEntry entries[INLINE_CACHE_SIZE];
+} InlineCache;
+
 typedef struct {
   int count;
   int capacity;
@@ -55,12 +131,16 @@ typedef struct {
   int lineCount;
   int lineCapacity;
   LineStart* lines;
+  int cacheCount;
+  int cacheCapacity;
+  InlineCache* caches;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int addInlineCache(Chunk* chunk);
 int writeConstant(Chunk* chunk, Value value, int line);
 int getLine(Chunk* chunk, int instruction);
 
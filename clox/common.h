@@ -11,5 +11,6 @@
 // #define DEBUG_VM_TABLES
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
 
 #endif
\ No newline at end of file
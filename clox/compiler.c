@@ -4,18 +4,34 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
 #include "scanner.h"
+#include "verify.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
 #endif
 
+#define LOCALS_MAX UINT16_COUNT
+#define UPVALUES_MAX UINT16_COUNT
 
+
+// Everything one compilation works on, so that several threads can
+// compile at once.
 typedef struct {
+  VM* vm;
+  Scanner scanner;
   Token current;
   Token previous;
   bool hadError;
   bool panicMode;
+  struct Compiler* compiler;
+  struct ClassCompiler* currentClass;
+  int innermostLoopStart;
+  int innermostLoopScopeDepth;
+  // The operand of the last break in the innermost loop. Until the loop
+  // ends, each break's operand holds the one of the break before it.
+  int innermostBreakJump;
 } Parser;
 
 typedef enum {
@@ -33,7 +49,7 @@ typedef enum {
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct {
   ParseFn prefix;
@@ -43,17 +59,22 @@ typedef struct {
 
 typedef struct {
   Token name;
+  ObjString* key;
+  // The slot of the enclosing local with the same name, or -1.
+  int shadowed;
   int depth;
   bool isCaptured;
 } Local;
 
 typedef struct {
-  uint8_t index;
+  int index;
   bool isLocal;
 } Upvalue;
 
 typedef enum {
   TYPE_FUNCTION,
+  TYPE_INITIALIZER,
+  TYPE_METHOD,
   TYPE_SCRIPT
 } FunctionType;
 
@@ -61,26 +82,36 @@ typedef struct Compiler {
   struct Compiler* enclosing;
   ObjFunction* function;
   FunctionType type;
-  Local locals[UINT8_COUNT];
+  Local* locals;
   int localCount;
-  Upvalue upvalues[UINT8_COUNT];
+  int localCapacity;
+  Upvalue* upvalues;
+  int upvalueCapacity;
   int scopeDepth;
+  // Map interned names to the slot of the innermost local with that name
+  // (-1 once there is none) and to the upvalue capturing that name, so
+  // resolving a name doesn't scan the locals.
+  Table localSlots;
+  Table upvalueSlots;
+  // Offsets of every jump and loop instruction, in order. They are
+  // emitted in their _LONG form and shrunk once the function is done.
+  int* jumps;
+  int jumpCount;
+  int jumpCapacity;
 } Compiler;
 
-// GLobals
-Parser parser;
-Compiler* current = NULL;
-int innermostLoopStart = -1;
-int innermostLoopScopeDepth = 0;
-int innermostBreakOffset = 0;
+typedef struct ClassCompiler {
+  struct ClassCompiler* enclosing;
+  bool hasSuperclass;
+} ClassCompiler;
 
-static Chunk* currentChunk() {
-  return &current->function->chunk;
+static Chunk* currentChunk(Parser* parser) {
+  return &parser->compiler->function->chunk;
 }
 
-static void errorAt(Token* token, const char* message) {
-  if (parser.panicMode) return;
-  parser.panicMode = true;
+static void errorAt(Parser* parser, Token* token, const char* message) {
+  if (parser->panicMode) return;
+  parser->panicMode = true;
 
   fprintf(stderr, "[line %d] Error", token->line);
 
@@ -93,210 +124,411 @@ static void errorAt(Token* token, const char* message) {
   }
 
   fprintf(stderr, ": %s\n", message);
-  parser.hadError = true;
+  parser->hadError = true;
 }
 
-static void error(const char* message) {
-  errorAt(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+  errorAt(parser, &parser->previous, message);
 }
 
-static void errorAtCurrent(const char* message) {
-  errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+  errorAt(parser, &parser->current, message);
 }
 
-static void advance() {
-  parser.previous = parser.current;
+static void advance(Parser* parser) {
+  parser->previous = parser->current;
 
   for (;;) {
-    parser.current = scanToken();
-    if (parser.current.type != TOKEN_ERROR) break;
+    parser->current = scanToken(&parser->scanner);
+    if (parser->current.type != TOKEN_ERROR) break;
 
-    errorAtCurrent(parser.current.start);
+    errorAtCurrent(parser, parser->current.start);
   }
 }
 
-static void consume(TokenType type, const char* message) {
-  if (parser.current.type == type) {
-    advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+  if (parser->current.type == type) {
+    advance(parser);
     return;
   }
-  errorAtCurrent(message);
+  errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) {
-  return parser.current.type == type;
+static bool check(Parser* parser, TokenType type) {
+  return parser->current.type == type;
 }
 
-static bool match(TokenType type) {
-  if (!check(type)) return false;
-  advance();
+static bool match(Parser* parser, TokenType type) {
+  if (!check(parser, type)) return false;
+  advance(parser);
   return true;
 }
 
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+  writeChunk(currentChunk(parser), byte, parser->previous.line);
+}
+
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+  emitByte(parser, byte1);
+  emitByte(parser, byte2);
+}
+
+static void emitLong(Parser* parser, uint32_t bytes) {
+  emitByte(parser, (uint8_t)(bytes >> 16 & 0xff));
+  emitByte(parser, (uint8_t)(bytes >> 8  & 0xff));
+  emitByte(parser, (uint8_t)(bytes       & 0xff));
+}
+
+static void emitBytesLong(Parser* parser, uint8_t byte1, uint32_t bytes234) {
+  emitByte(parser, byte1);
+  emitLong(parser, bytes234);
+}
+
+// Emits an instruction with a one byte operand, or its _LONG form with
+// a 24-bit operand when the operand doesn't fit in a byte.
+static void emitOperand(Parser* parser, uint8_t instruction,
+                        uint8_t longInstruction, int operand) {
+  if (operand <= UINT8_MAX) {
+    emitBytes(parser, instruction, (uint8_t)operand);
+  } else {
+    emitBytesLong(parser, longInstruction, (uint32_t)operand);
+  }
+}
+
+// Gives the instruction just emitted an inline cache of its own.
+static void emitCache(Parser* parser) {
+  int cache = addInlineCache(currentChunk(parser));
+  if (cache > UINT16_MAX) {
+    error(parser, "Too many property accesses in function.");
+  }
+
+  emitByte(parser, (cache >> 8) & 0xff);
+  emitByte(parser, cache & 0xff);
+}
+
+static void addJump(Parser* parser) {
+  Compiler* current = parser->compiler;
+  if (current->jumpCapacity < current->jumpCount + 1) {
+    int oldCapacity = current->jumpCapacity;
+    current->jumpCapacity = GROW_CAPACITY(oldCapacity);
+    current->jumps = GROW_ARRAY(int, current->jumps,
+                                oldCapacity, current->jumpCapacity);
+  }
+
+  current->jumps[current->jumpCount++] = currentChunk(parser)->count;
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);
-  emitByte(byte2);
+static void writeJumpOffset(Parser* parser, int offset, uint32_t jump) {
+  uint8_t* code = &currentChunk(parser)->code[offset];
+  code[0] = (jump >> 24) & 0xff;
+  code[1] = (jump >> 16) & 0xff;
+  code[2] = (jump >> 8) & 0xff;
+  code[3] = jump & 0xff;
 }
 
-static void emitBytesLong(uint8_t byte1, uint32_t bytes234) {
-  emitByte(byte1);
-  emitByte((uint8_t)(bytes234 >> 16 & 0xff));
-  emitByte((uint8_t)(bytes234 >> 8  & 0xff));
-  emitByte((uint8_t)(bytes234       & 0xff));
+static uint32_t readJumpOffset(uint8_t* code) {
+  return ((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) |
+         ((uint32_t)code[2] << 8) | (uint32_t)code[3];
 }
 
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+static void emitLoop(Parser* parser, int loopStart) {
+  addJump(parser);
+  emitByte(parser, OP_LOOP_LONG);
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+  int offset = currentChunk(parser)->count - loopStart + 4;
+  emitBytes(parser, 0, 0);
+  emitBytes(parser, 0, 0);
+  writeJumpOffset(parser, currentChunk(parser)->count - 4, (uint32_t)offset);
+}
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+static int emitJump(Parser* parser, uint8_t instruction) {
+  // The _LONG form follows the instruction.
+  addJump(parser);
+  emitByte(parser, instruction + 1);
+  emitBytes(parser, 0xff, 0xff);
+  emitBytes(parser, 0xff, 0xff);
+  return currentChunk(parser)->count - 4;
 }
 
-static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
-  emitByte(0xff);
-  emitByte(0xff);
-  return currentChunk()->count - 2;
+static void emitReturn(Parser* parser) {
+  if (parser->compiler->type == TYPE_INITIALIZER) {
+    emitBytes(parser, OP_GET_LOCAL, 0);
+  } else {
+    emitByte(parser, OP_NIL);
+  }
+
+  emitByte(parser, OP_RETURN);
 }
 
-static void emitReturn() {
-  emitByte(OP_NIL);
-  emitByte(OP_RETURN);
+static int makeConstant(Parser* parser, Value value) {
+  int index = addConstant(currentChunk(parser), value);
+  if (index > LONG_OPERAND_MAX) {
+    error(parser, "Too many constants in one chunk.");
+    return 0;
+  }
+
+  return index;
 }
 
-static uint8_t makeConstant(Value value) {
-  int index = addConstant(currentChunk(), value);
-  return (uint8_t)index;
+static void emitConstant(Parser* parser, Value value) {
+  emitOperand(parser, OP_CONSTANT, OP_CONSTANT_LONG,
+              makeConstant(parser, value));
 }
 
-static uint32_t makeLongConstant(Value value) {
-  int index = addConstant(currentChunk(), value);
-  return (uint32_t)index;
+static void patchJump(Parser* parser, int offset) {
+  // -4 to adjust for the bytecode for the jump offset itself.
+  int jump = currentChunk(parser)->count - offset - 4;
+  writeJumpOffset(parser, offset, (uint32_t)jump);
 }
 
-static void emitConstant(Value value) {
-  if (currentChunk()->constants.count > 255) {
-    emitBytesLong(OP_CONSTANT_LONG, makeLongConstant(value));
-  } else
-    emitBytes(OP_CONSTANT, makeConstant(value));
+static int jumpWidth(int distance) {
+  if (distance <= UINT8_MAX) return 1;
+  if (distance <= UINT16_MAX) return 2;
+  return 4;
 }
 
-static void patchJump(int offset) {
-  // -2 to adjust for the bytecode for the jump offset itself.
-  int jump = currentChunk()->count - offset - 2;
+// Returns how many of the jumps start before the given offset.
+static int jumpsBefore(Parser* parser, int offset) {
+  int start = 0;
+  int end = parser->compiler->jumpCount;
+  while (start < end) {
+    int mid = (start + end) / 2;
+    if (parser->compiler->jumps[mid] < offset) {
+      start = mid + 1;
+    } else {
+      end = mid;
+    }
+  }
+
+  return start;
+}
+
+// Shrinks each jump to the _NEAR form with a one byte offset or the
+// plain form with a two byte one when its distance fits. All jumps start
+// out at one byte and the ones that don't fit are widened until none
+// change. Widening a jump only lengthens the others, so this settles.
+static void relaxJumps(Parser* parser) {
+  Chunk* chunk = currentChunk(parser);
+  int jumpCount = parser->compiler->jumpCount;
+  int* jumps = parser->compiler->jumps;
+  if (jumpCount == 0) return;
+
+  int* targets = ALLOCATE(int, jumpCount);
+  int* widths = ALLOCATE(int, jumpCount);
+  // How many bytes the jumps before each one shrink by.
+  int* removed = ALLOCATE(int, jumpCount + 1);
+
+  for (int i = 0; i < jumpCount; i++) {
+    uint8_t* code = &chunk->code[jumps[i]];
+    int offset = (int)readJumpOffset(code + 1);
+    targets[i] = code[0] == OP_LOOP_LONG ? jumps[i] + 5 - offset
+                                         : jumps[i] + 5 + offset;
+    widths[i] = 1;
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    removed[0] = 0;
+    for (int i = 0; i < jumpCount; i++) {
+      removed[i + 1] = removed[i] + 4 - widths[i];
+    }
+
+    for (int i = 0; i < jumpCount; i++) {
+      int end = jumps[i] + 5 - removed[i + 1];
+      int target = targets[i] - removed[jumpsBefore(parser, targets[i])];
+      int width = jumpWidth(target > end ? target - end : end - target);
+      if (width > widths[i]) {
+        widths[i] = width;
+        changed = true;
+      }
+    }
+  }
+
+  int count = chunk->count - removed[jumpCount];
+  uint8_t* code = ALLOCATE(uint8_t, count);
+  int from = 0;
+  int to = 0;
+  for (int i = 0; i < jumpCount; i++) {
+    memcpy(code + to, chunk->code + from, jumps[i] - from);
+    to += jumps[i] - from;
+
+    // The _NEAR and plain forms come before the _LONG one.
+    uint8_t instruction = chunk->code[jumps[i]];
+    code[to] = instruction - (widths[i] == 1 ? 2 : widths[i] == 2 ? 1 : 0);
+
+    int end = to + 1 + widths[i];
+    int target = targets[i] - removed[jumpsBefore(parser, targets[i])];
+    int distance = instruction == OP_LOOP_LONG ? end - target
+                                               : target - end;
+    for (int byte = 0; byte < widths[i]; byte++) {
+      code[end - 1 - byte] = (distance >> (8 * byte)) & 0xff;
+    }
+
+    to = end;
+    from = jumps[i] + 5;
+  }
+  memcpy(code + to, chunk->code + from, chunk->count - from);
 
-  if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+  for (int i = 0; i < chunk->lineCount; i++) {
+    int offset = chunk->lines[i].offset;
+    chunk->lines[i].offset = offset - removed[jumpsBefore(parser, offset)];
   }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  chunk->code = code;
+  chunk->count = count;
+  chunk->capacity = count;
+
+  FREE_ARRAY(int, targets, jumpCount);
+  FREE_ARRAY(int, widths, jumpCount);
+  FREE_ARRAY(int, removed, jumpCount + 1);
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
-  compiler->enclosing = current;
+static void initCompiler(Parser* parser, Compiler* compiler,
+                         FunctionType type) {
+  compiler->enclosing = parser->compiler;
   compiler->function = NULL;
   compiler->type = type;
   compiler->localCount = 0;
+  compiler->localCapacity = UINT8_COUNT;
+  compiler->locals = ALLOCATE(Local, compiler->localCapacity);
+  compiler->upvalueCapacity = 0;
+  compiler->upvalues = NULL;
+  compiler->jumpCount = 0;
+  compiler->jumpCapacity = 0;
+  compiler->jumps = NULL;
   compiler->scopeDepth = 0;
-  compiler->function = newFunction();
-  current = compiler;
+  initTable(&compiler->localSlots);
+  initTable(&compiler->upvalueSlots);
+  compiler->function = newFunction(parser->vm);
+  parser->compiler = compiler;
 
   // get function name
   if (type != TYPE_SCRIPT) {
-    current->function->name = copyString(parser.previous.start,
-                                         parser.previous.length);
+    compiler->function->name = copyString(parser->vm, parser->previous.start,
+                                          parser->previous.length);
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = &compiler->locals[compiler->localCount++];
   local->depth = 0;
   local->isCaptured = false;
-  local->name.start = "";
-  local->name.length = 0;
-}
-
-static ObjFunction* endCompiler() {
-  emitReturn();
-  ObjFunction* function = current->function;
+  if (type != TYPE_FUNCTION) {
+    local->name.start = "this";
+    local->name.length = 4;
+  } else {
+    local->name.start = "";
+    local->name.length = 0;
+  }
+  local->key = copyString(parser->vm, local->name.start, local->name.length);
+  local->shadowed = -1;
+  tableSet(&compiler->localSlots, local->key, NUMBER_VAL(0));
+  compiler->function->maxSlots = 1;
+}
+
+static ObjFunction* endCompiler(Parser* parser) {
+  emitReturn(parser);
+  ObjFunction* function = parser->compiler->function;
+  if (!parser->hadError) {
+    relaxJumps(parser);
+    // Only a bug in the compiler could fail this.
+    if (!verifyFunction(function)) error(parser, "Compiled invalid bytecode.");
+  }
 
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
+  if (!parser->hadError) {
     disassembleChunk(
-        currentChunk(), 
+        currentChunk(parser), 
         function->name != NULL ? function->name->chars : "<script>"
     );
   }
 #endif
 
-  current = current->enclosing;
+  parser->compiler = parser->compiler->enclosing;
   return function;
 }
 
-static void beginScope() {
-  current->scopeDepth++;
+static void freeCompiler(Compiler* compiler) {
+  FREE_ARRAY(Local, compiler->locals, compiler->localCapacity);
+  FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalueCapacity);
+  FREE_ARRAY(int, compiler->jumps, compiler->jumpCapacity);
+  freeTable(&compiler->localSlots);
+  freeTable(&compiler->upvalueSlots);
 }
 
-static void endScope() {
+static void beginScope(Parser* parser) {
+  parser->compiler->scopeDepth++;
+}
+
+static void endScope(Parser* parser) {
+  Compiler* current = parser->compiler;
   current->scopeDepth--;
 
-  int localsToPop = current->localCount;
+  int localsToPop = 0;
   bool capturedLocals = false;
-  while (current->localCount > 0 &&
-         current->locals[current->localCount - 1].depth > current->scopeDepth) {
-    current->localCount--;
-    capturedLocals = current->locals[current->localCount - 1].isCaptured;
+  while (localsToPop < current->localCount &&
+         current->locals[current->localCount - 1 - localsToPop].depth >
+             current->scopeDepth) {
+    if (current->locals[current->localCount - 1 - localsToPop].isCaptured) {
+      capturedLocals = true;
+    }
+    localsToPop++;
   }
-  localsToPop -= current->localCount;
 
   if (localsToPop > 1 && !capturedLocals) {
     // if no locals are captured and are more than one pop all at once
-    emitBytes(OP_POPN, (uint8_t)localsToPop);
+    for (int popped = 0; popped < localsToPop; popped += UINT8_MAX) {
+      int pops = localsToPop - popped;
+      emitBytes(parser, OP_POPN,
+                (uint8_t)(pops < UINT8_MAX ? pops : UINT8_MAX));
+    }
   } else if(localsToPop == 1 && !capturedLocals) {
     // if only one local not captured, pop it
-    emitByte(OP_POP);
+    emitByte(parser, OP_POP);
   } else {
     // we have interweaving captured and not captured locals
-    // iterate again and pop/close each one
-    while (current->localCount > 0 &&
-           current->locals[current->localCount - 1].depth > current->scopeDepth) {
-      if (current->locals[current->localCount - 1].isCaptured) {
-        emitByte(OP_CLOSE_UPVALUE);
+    // pop/close each one
+    for (int i = current->localCount - 1;
+         i >= current->localCount - localsToPop; i--) {
+      if (current->locals[i].isCaptured) {
+        emitByte(parser, OP_CLOSE_UPVALUE);
       } else {
-        emitByte(OP_POP);
+        emitByte(parser, OP_POP);
       }
     }
   }
+
+  // Names of the popped locals refer to the locals they shadowed again.
+  for (int i = 0; i < localsToPop; i++) {
+    Local* local = &current->locals[--current->localCount];
+    tableSet(&current->localSlots, local->key, NUMBER_VAL(local->shadowed));
+  }
 }
 
 // forward declarations
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
-static uint8_t identifierConstant(Token* name);
-static int resolveLocal(Compiler* compiler, Token* name);
-static int resolveUpvalue(Compiler* compiler, Token* name);
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal);
-static uint8_t argumentList();
+static void parsePrecedence(Parser* parser, Precedence precedence);
+static int identifierConstant(Parser* parser, Token* name);
+static int resolveLocal(Parser* parser, Compiler* compiler, ObjString* name);
+static int resolveUpvalue(Parser* parser, Compiler* compiler, ObjString* name);
+static int addUpvalue(Parser* parser, Compiler* compiler, ObjString* name,
+                      int index, bool isLocal);
+static uint8_t argumentList(Parser* parser);
+static Token syntheticToken(const char* text);
 
-static void and_(bool canAssign) {
-  int endJump = emitJump(OP_JUMP_IF_FALSE);
+static void and_(Parser* parser, bool canAssign) {
+  int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-  emitByte(OP_POP);
-  parsePrecedence(PREC_AND);
+  emitByte(parser, OP_POP);
+  parsePrecedence(parser, PREC_AND);
 
-  patchJump(endJump);
+  patchJump(parser, endJump);
 }
 
-static void ternary(bool canAssign) {
+static void ternary(Parser* parser, bool canAssign) {
   // // Compile the then branch.
   // parsePrecedence(PREC_CONDITIONAL);
 
@@ -306,111 +538,212 @@ static void ternary(bool canAssign) {
   // parsePrecedence(PREC_ASSIGNMENT);
 }
 
-static void binary(bool canAssign) {
+static void binary(Parser* parser, bool canAssign) {
   // Remember the operator.
-  TokenType operatorType = parser.previous.type;
+  TokenType operatorType = parser->previous.type;
 
   // Compile the right operand.
   ParseRule* rule = getRule(operatorType);
-  parsePrecedence((Precedence)(rule->precedence + 1));
+  parsePrecedence(parser, (Precedence)(rule->precedence + 1));
 
   // Emit the operator instruction.
   switch (operatorType) {
-    case TOKEN_BANG_EQUAL:    emitByte(OP_NEQUAL); break;
-    case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-    case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-    case TOKEN_LESS:          emitByte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-    case TOKEN_PLUS:          emitByte(OP_ADD); break;
-    case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-    case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-    case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+    case TOKEN_BANG_EQUAL:    emitByte(parser, OP_NEQUAL); break;
+    case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQUAL); break;
+    case TOKEN_GREATER:       emitByte(parser, OP_GREATER); break;
+    case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;
+    case TOKEN_LESS:          emitByte(parser, OP_LESS); break;
+    case TOKEN_LESS_EQUAL:    emitBytes(parser, OP_GREATER, OP_NOT); break;
+    case TOKEN_PLUS:          emitByte(parser, OP_ADD); break;
+    case TOKEN_MINUS:         emitByte(parser, OP_SUBTRACT); break;
+    case TOKEN_STAR:          emitByte(parser, OP_MULTIPLY); break;
+    case TOKEN_SLASH:         emitByte(parser, OP_DIVIDE); break;
     default:
       return; // Unreachable.
   }
 }
 
-static void call(bool canAssign) {
-  uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
+static void call(Parser* parser, bool canAssign) {
+  uint8_t argCount = argumentList(parser);
+  emitBytes(parser, OP_CALL, argCount);
+}
+
+static void dot(Parser* parser, bool canAssign) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  int name = identifierConstant(parser, &parser->previous);
+
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitOperand(parser, OP_SET_PROPERTY, OP_SET_PROPERTY_LONG, name);
+  } else if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(parser);
+    emitOperand(parser, OP_INVOKE, OP_INVOKE_LONG, name);
+    emitByte(parser, argCount);
+  } else {
+    emitOperand(parser, OP_GET_PROPERTY, OP_GET_PROPERTY_LONG, name);
+  }
+  emitCache(parser);
+}
+
+static void index_(Parser* parser, bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitByte(parser, OP_INDEX_SET);
+  } else {
+    emitByte(parser, OP_INDEX_GET);
+  }
 }
 
-static void literal(bool canAssign) {
-  switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL:   emitByte(OP_NIL); break;
-    case TOKEN_TRUE:  emitByte(OP_TRUE); break;
+static void array(Parser* parser, bool canAssign) {
+  uint8_t elementCount = 0;
+  if (!check(parser, TOKEN_RIGHT_BRACKET)) {
+    do {
+      expression(parser);
+
+      if (elementCount == 255) {
+        error(parser, "Can't have more than 255 elements in an array literal.");
+      }
+      elementCount++;
+    } while (match(parser, TOKEN_COMMA));
+  }
+
+  consume(parser, TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+  emitBytes(parser, OP_ARRAY, elementCount);
+}
+
+static void map(Parser* parser, bool canAssign) {
+  uint8_t entryCount = 0;
+  if (!check(parser, TOKEN_RIGHT_BRACE)) {
+    do {
+      expression(parser);
+      consume(parser, TOKEN_COLON, "Expect ':' after map key.");
+      expression(parser);
+
+      if (entryCount == 255) {
+        error(parser, "Can't have more than 255 entries in a map literal.");
+      }
+      entryCount++;
+    } while (match(parser, TOKEN_COMMA));
+  }
+
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+  emitBytes(parser, OP_MAP, entryCount);
+}
+
+static void literal(Parser* parser, bool canAssign) {
+  switch (parser->previous.type) {
+    case TOKEN_FALSE: emitByte(parser, OP_FALSE); break;
+    case TOKEN_NIL:   emitByte(parser, OP_NIL); break;
+    case TOKEN_TRUE:  emitByte(parser, OP_TRUE); break;
     default:
       return; // Unreachable.
   }
 }
 
-static void grouping(bool canAssign) {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void number(bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
-  if (value == 0) { emitByte(OP_ZERO); return; }
-  if (value == 1) { emitByte(OP_ONE); return; }
-  emitConstant(NUMBER_VAL(value));
+static void number(Parser* parser, bool canAssign) {
+  double value = strtod(parser->previous.start, NULL);
+  if (value == 0) { emitByte(parser, OP_ZERO); return; }
+  if (value == 1) { emitByte(parser, OP_ONE); return; }
+  emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void or_(bool canAssign) {
-  int elseJump = emitJump(OP_JUMP_IF_FALSE);
-  int endJump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool canAssign) {
+  int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  int endJump = emitJump(parser, OP_JUMP);
 
-  patchJump(elseJump);
-  emitByte(OP_POP);
+  patchJump(parser, elseJump);
+  emitByte(parser, OP_POP);
 
-  parsePrecedence(PREC_OR);
-  patchJump(endJump);
+  parsePrecedence(parser, PREC_OR);
+  patchJump(parser, endJump);
 }
 
-static void string(bool canAssign) {
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                  parser.previous.length - 2)));
+static void string(Parser* parser, bool canAssign) {
+  emitConstant(parser, OBJ_VAL(copyString(parser->vm,
+                                          parser->previous.start + 1,
+                                          parser->previous.length - 2)));
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
   uint8_t getOp, setOp;
-  int arg = resolveLocal(current, &name);
+  // The _LONG form of each instruction follows it.
+  ObjString* key = copyString(parser->vm, name.start, name.length);
+  int arg = resolveLocal(parser, parser->compiler, key);
   if (arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
-  } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+  } else if ((arg = resolveUpvalue(parser, parser->compiler, key)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = makeConstant(parser, OBJ_VAL(key));
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(setOp, (uint8_t)arg);
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitOperand(parser, setOp, setOp + 1, arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitOperand(parser, getOp, getOp + 1, arg);
   }
 }
 
-static void variable(bool canAssign) {
-  namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+  namedVariable(parser, parser->previous, canAssign);
+}
+
+static void super_(Parser* parser, bool canAssign) {
+  if (parser->currentClass == NULL) {
+    error(parser, "Can't use 'super' outside of a class.");
+  } else if (!parser->currentClass->hasSuperclass) {
+    error(parser, "Can't use 'super' in a class with no superclass.");
+  }
+
+  consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(parser, TOKEN_IDENTIFIER, "Expect superclass method name.");
+  int name = identifierConstant(parser, &parser->previous);
+
+  namedVariable(parser, syntheticToken("this"), false);
+  if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(parser);
+    namedVariable(parser, syntheticToken("super"), false);
+    emitOperand(parser, OP_SUPER_INVOKE, OP_SUPER_INVOKE_LONG, name);
+    emitByte(parser, argCount);
+    emitCache(parser);
+  } else {
+    namedVariable(parser, syntheticToken("super"), false);
+    emitOperand(parser, OP_GET_SUPER, OP_GET_SUPER_LONG, name);
+  }
 }
 
-static void unary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+static void this_(Parser* parser, bool canAssign) {
+  if (parser->currentClass == NULL) {
+    error(parser, "Can't use 'this' outside of a class.");
+    return;
+  }
+
+  variable(parser, false);
+}
+
+static void unary(Parser* parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
 
   // Compile the operand.
-  parsePrecedence(PREC_UNARY);
+  parsePrecedence(parser, PREC_UNARY);
 
   // Emit the operator instruction.
   switch (operatorType) {
-    case TOKEN_BANG: emitByte(OP_NOT); break;
-    case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+    case TOKEN_BANG: emitByte(parser, OP_NOT); break;
+    case TOKEN_MINUS: emitByte(parser, OP_NEGATE); break;
     default:
       return; // Unreachable.
   }
@@ -423,10 +756,12 @@ ParseRule rules[] = {
   [TOKEN_DEFAULT]       = {NULL,        NULL,   PREC_NONE},
   [TOKEN_LEFT_PAREN]    = {grouping,    call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,        NULL,   PREC_NONE},
-  [TOKEN_LEFT_BRACE]    = {NULL,        NULL,   PREC_NONE}, 
+  [TOKEN_LEFT_BRACE]    = {map,         NULL,   PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,        NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {array,       index_, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,        NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,        NULL,   PREC_NONE},
-  [TOKEN_DOT]           = {NULL,        NULL,   PREC_NONE},
+  [TOKEN_DOT]           = {NULL,        dot,    PREC_CALL},
   [TOKEN_MINUS]         = {unary,       binary, PREC_TERM},
   [TOKEN_PLUS]          = {NULL,        binary, PREC_TERM},
   [TOKEN_SEMICOLON]     = {NULL,        NULL,   PREC_NONE},
@@ -457,8 +792,8 @@ ParseRule rules[] = {
   [TOKEN_OR]            = {NULL,        or_,    PREC_OR},
   [TOKEN_PRINT]         = {NULL,        NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,        NULL,   PREC_NONE},
-  [TOKEN_SUPER]         = {NULL,        NULL,   PREC_NONE},
-  [TOKEN_THIS]          = {NULL,        NULL,   PREC_NONE},
+  [TOKEN_SUPER]         = {super_,      NULL,   PREC_NONE},
+  [TOKEN_THIS]          = {this_,       NULL,   PREC_NONE},
   [TOKEN_TRUE]          = {literal,     NULL,   PREC_NONE},
   [TOKEN_VAR]           = {NULL,        NULL,   PREC_NONE},
   [TOKEN_WHILE]         = {NULL,        NULL,   PREC_NONE},
@@ -466,31 +801,38 @@ ParseRule rules[] = {
   [TOKEN_EOF]           = {NULL,        NULL,   PREC_NONE},
 };
 
-static void parsePrecedence(Precedence precedence) {
-  advance();
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+  advance(parser);
+  ParseFn prefixRule = getRule(parser->previous.type)->prefix;
   if (prefixRule == NULL) {
-    error("Expect expression.");
+    error(parser, "Expect expression.");
     return;
   }
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixRule(canAssign);
+  prefixRule(parser, canAssign);
 
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule(canAssign);
+  while (precedence <= getRule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn infixRule = getRule(parser->previous.type)->infix;
+    infixRule(parser, canAssign);
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    error("Invalid assignment target.");
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    error(parser, "Invalid assignment target.");
   }
 }
 
-static uint8_t identifierConstant(Token* name) {
-  return makeConstant(OBJ_VAL(copyString(name->start,
-                                         name->length)));
+static int identifierConstant(Parser* parser, Token* name) {
+  return makeConstant(parser, OBJ_VAL(copyString(parser->vm, name->start,
+                                                  name->length)));
+}
+
+static Token syntheticToken(const char* text) {
+  Token token;
+  token.start = text;
+  token.length = (int)strlen(text);
+  return token;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -498,123 +840,150 @@ static bool identifiersEqual(Token* a, Token* b) {
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
-  for (int i = compiler->localCount - 1; i >= 0; i--) {
-    Local* local = &compiler->locals[i];
-    if (identifiersEqual(name, &local->name)) {
-      if (local->depth == -1) {
-        error("Can't read local variable in its own initializer.");
-      }
-      return i;
-    }
-  }
+// Returns the slot of the innermost local with the given name, or -1.
+static int localSlot(Compiler* compiler, ObjString* name) {
+  Value slot;
+  if (!tableGet(&compiler->localSlots, name, &slot)) return -1;
+  return (int)AS_NUMBER(slot);
+}
 
-  return -1;
+static int resolveLocal(Parser* parser, Compiler* compiler, ObjString* name) {
+  int slot = localSlot(compiler, name);
+  if (slot != -1 && compiler->locals[slot].depth == -1) {
+    error(parser, "Can't read local variable in its own initializer.");
+  }
+  return slot;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+// The enclosing functions are suspended while this one compiles, so a
+// name keeps referring to the same variable and the upvalue found for
+// it can be reused.
+static int resolveUpvalue(Parser* parser, Compiler* compiler, ObjString* name) {
   if (compiler->enclosing == NULL) return -1;
 
-  int local = resolveLocal(compiler->enclosing, name);
+  Value index;
+  if (tableGet(&compiler->upvalueSlots, name, &index)) {
+    return (int)AS_NUMBER(index);
+  }
+
+  int local = resolveLocal(parser, compiler->enclosing, name);
   if (local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    return addUpvalue(parser, compiler, name, local, true);
   }
 
-  int upvalue = resolveUpvalue(compiler->enclosing, name);
+  int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t)upvalue, false);
+    return addUpvalue(parser, compiler, name, upvalue, false);
   }
 
   return -1;
 }
 
-static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
-    error("Too many local variables in function.");
+static void addLocal(Parser* parser, Token name) {
+  Compiler* current = parser->compiler;
+  if (current->localCount == LOCALS_MAX) {
+    error(parser, "Too many local variables in function.");
     return;
   }
-  Local* local = &current->locals[current->localCount++];
+
+  if (current->localCapacity < current->localCount + 1) {
+    int oldCapacity = current->localCapacity;
+    current->localCapacity = GROW_CAPACITY(oldCapacity);
+    current->locals = GROW_ARRAY(Local, current->locals,
+                                 oldCapacity, current->localCapacity);
+  }
+
+  Local* local = &current->locals[current->localCount];
   local->name = name;
+  local->key = copyString(parser->vm, name.start, name.length);
+  local->shadowed = localSlot(current, local->key);
   local->depth = -1;
   local->isCaptured = false;
+  tableSet(&current->localSlots, local->key,
+           NUMBER_VAL(current->localCount++));
+  if (current->localCount > current->function->maxSlots) {
+    current->function->maxSlots = current->localCount;
+  }
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser* parser, Compiler* compiler, ObjString* name,
+                      int index, bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
-
-  for (int i = 0; i < upvalueCount; i++) {
-    Upvalue* upvalue = &compiler->upvalues[i];
-    if (upvalue->index == index && upvalue->isLocal == isLocal) {
-      return i;
-    }
+  if (upvalueCount == UPVALUES_MAX) {
+    error(parser, "Too many closure variables in function.");
+    return 0;
   }
 
-  if (upvalueCount == UINT8_COUNT) {
-    error("Too many closure variables in function.");
-    return 0;
+  if (compiler->upvalueCapacity < upvalueCount + 1) {
+    int oldCapacity = compiler->upvalueCapacity;
+    compiler->upvalueCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->upvalues = GROW_ARRAY(Upvalue, compiler->upvalues,
+                                    oldCapacity, compiler->upvalueCapacity);
   }
 
   compiler->upvalues[upvalueCount].isLocal = isLocal;
   compiler->upvalues[upvalueCount].index = index;
+  tableSet(&compiler->upvalueSlots, name, NUMBER_VAL(upvalueCount));
   return compiler->function->upvalueCount++;
 }
 
-static void declareVariable() {
+static void declareVariable(Parser* parser) {
+  Compiler* current = parser->compiler;
   if (current->scopeDepth == 0) return;
 
-  Token* name = &parser.previous;
-  for (int i = current->localCount - 1; i >= 0; i--) {
-    Local* local = &current->locals[i];
-    if (local->depth != -1 && local->depth < current->scopeDepth) {
-      break; 
-    }
-
-    if (identifiersEqual(name, &local->name)) {
-      error("Already variable with this name in this scope.");
+  // Only the innermost local with the name can be in this scope.
+  Token* name = &parser->previous;
+  ObjString* key = copyString(parser->vm, name->start, name->length);
+  int slot = localSlot(current, key);
+  if (slot != -1) {
+    Local* local = &current->locals[slot];
+    if (local->depth == -1 || local->depth == current->scopeDepth) {
+      error(parser, "Already variable with this name in this scope.");
     }
   }
 
-  addLocal(*name);
+  addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
+static int parseVariable(Parser* parser, const char* errorMessage) {
+  consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-  declareVariable();
-  if (current->scopeDepth > 0) return 0;
+  declareVariable(parser);
+  if (parser->compiler->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return identifierConstant(parser, &parser->previous);
 }
 
-static void markInitialized() {
+static void markInitialized(Parser* parser) {
+  Compiler* current = parser->compiler;
   if (current->scopeDepth == 0) return;
   current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-  if (current->scopeDepth > 0) {
-    markInitialized();
+static void defineVariable(Parser* parser, int global) {
+  if (parser->compiler->scopeDepth > 0) {
+    markInitialized(parser);
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitOperand(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser* parser) {
   uint8_t argCount = 0;
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      expression();
+      expression(parser);
 
       if (argCount == 255) {
-        error("Can't have more than 255 arguments.");
+        error(parser, "Can't have more than 255 arguments.");
       }
       argCount++;
-    } while (match(TOKEN_COMMA));
+    } while (match(parser, TOKEN_COMMA));
   }
 
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
   return argCount;
 }
 
@@ -622,324 +991,419 @@ static ParseRule* getRule(TokenType type) {
   return &rules[type];
 }
 
-static void expression() {
-  parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+  parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block() {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();
+static void block(Parser* parser) {
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    declaration(parser);
   }
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
+static void function(Parser* parser, FunctionType type) {
   Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope(); 
+  initCompiler(parser, &compiler, type);
+  beginScope(parser); 
 
   // Compile the parameter list.
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      current->function->arity++;
-      if (current->function->arity > 255) {
-        errorAtCurrent("Can't have more than 255 parameters.");
+      parser->compiler->function->arity++;
+      if (parser->compiler->function->arity > 255) {
+        errorAtCurrent(parser, "Can't have more than 255 parameters.");
       }
 
-      uint8_t paramConstant = parseVariable("Expect parameter name.");
-      defineVariable(paramConstant);
-    } while (match(TOKEN_COMMA));
+      int paramConstant = parseVariable(parser, "Expect parameter name.");
+      defineVariable(parser, paramConstant);
+    } while (match(parser, TOKEN_COMMA));
   }
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
 
   // The body.
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(parser);
 
   // Create the function object.
-  ObjFunction* function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  ObjFunction* function = endCompiler(parser);
+  int constant = makeConstant(parser, OBJ_VAL(function));
 
+  // OP_CLOSURE_LONG has 24-bit upvalue indexes too.
+  bool isLong = constant > UINT8_MAX;
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    if (compiler.upvalues[i].index > UINT8_MAX) isLong = true;
   }
+
+  emitByte(parser, isLong ? OP_CLOSURE_LONG : OP_CLOSURE);
+  if (isLong) {
+    emitLong(parser, (uint32_t)constant);
+  } else {
+    emitByte(parser, (uint8_t)constant);
+  }
+
+  for (int i = 0; i < function->upvalueCount; i++) {
+    emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+    if (isLong) {
+      emitLong(parser, (uint32_t)compiler.upvalues[i].index);
+    } else {
+      emitByte(parser, (uint8_t)compiler.upvalues[i].index);
+    }
+  }
+
+  freeCompiler(&compiler);
 }
 
-static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name.");
-  markInitialized();
-  function(TYPE_FUNCTION);
-  defineVariable(global);
+static void method(Parser* parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+  int constant = identifierConstant(parser, &parser->previous);
+
+  FunctionType type = TYPE_METHOD;
+  if (parser->previous.length == 4 &&
+      memcmp(parser->previous.start, "init", 4) == 0) {
+    type = TYPE_INITIALIZER;
+  }
+
+  function(parser, type);
+  emitOperand(parser, OP_METHOD, OP_METHOD_LONG, constant);
 }
 
-static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+static void classDeclaration(Parser* parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser->previous;
+  int nameConstant = identifierConstant(parser, &parser->previous);
+  declareVariable(parser);
+
+  emitOperand(parser, OP_CLASS, OP_CLASS_LONG, nameConstant);
+  defineVariable(parser, nameConstant);
+
+  ClassCompiler classCompiler;
+  classCompiler.hasSuperclass = false;
+  classCompiler.enclosing = parser->currentClass;
+  parser->currentClass = &classCompiler;
 
-  if (match(TOKEN_EQUAL)) {
-    expression();
+  if (match(parser, TOKEN_LESS)) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
+    variable(parser, false);
+
+    if (identifiersEqual(&className, &parser->previous)) {
+      error(parser, "A class can't inherit from itself.");
+    }
+
+    // The superclass lives in a local named "super" for the methods to
+    // capture.
+    beginScope(parser);
+    addLocal(parser, syntheticToken("super"));
+    defineVariable(parser, 0);
+
+    namedVariable(parser, className, false);
+    emitByte(parser, OP_INHERIT);
+    classCompiler.hasSuperclass = true;
+  }
+
+  namedVariable(parser, className, false);
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    method(parser);
+  }
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(parser, OP_POP);
+
+  if (classCompiler.hasSuperclass) {
+    endScope(parser);
+  }
+
+  parser->currentClass = parser->currentClass->enclosing;
+}
+
+static void funDeclaration(Parser* parser) {
+  int global = parseVariable(parser, "Expect function name.");
+  markInitialized(parser);
+  function(parser, TYPE_FUNCTION);
+  defineVariable(parser, global);
+}
+
+static void varDeclaration(Parser* parser) {
+  int global = parseVariable(parser, "Expect variable name.");
+
+  if (match(parser, TOKEN_EQUAL)) {
+    expression(parser);
   } else {
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
   }
-  consume(TOKEN_SEMICOLON,
+  consume(parser, TOKEN_SEMICOLON,
           "Expect ';' after variable declaration.");
 
-  defineVariable(global);
+  defineVariable(parser, global);
 }
 
-static void expressionStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  emitByte(parser, OP_POP);
 }
 
-static void breakStatement() {
-  if(innermostLoopStart == -1) {
-    error("A 'break' outside of a loop is not allowed.");
+static void breakStatement(Parser* parser) {
+  if(parser->innermostLoopStart == -1) {
+    error(parser, "A 'break' outside of a loop is not allowed.");
   }
-  consume(TOKEN_SEMICOLON, "Expect ';' after 'break'.");
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after 'break'.");
 
   // Discard any locals created inside the loop.
+  Compiler* current = parser->compiler;
   for (int i = current->localCount - 1;
-       i >= 0 && current->locals[i].depth > innermostLoopScopeDepth;
+       i >= 0 && current->locals[i].depth > parser->innermostLoopScopeDepth;
        i--) {
-    emitByte(OP_POP);
+    emitByte(parser, OP_POP);
   }
 
-  innermostBreakOffset = emitJump(OP_JUMP);
+  int jump = emitJump(parser, OP_JUMP);
+  writeJumpOffset(parser, jump, (uint32_t)parser->innermostBreakJump);
+  parser->innermostBreakJump = jump;
 }
 
-static void continueStatement() {
-  if(innermostLoopStart == -1) {
-    error("A 'continue' outside of a loop is not alllowed.");
+static void patchBreaks(Parser* parser) {
+  while (parser->innermostBreakJump != -1) {
+    int jump = parser->innermostBreakJump;
+    uint8_t* operand = &currentChunk(parser)->code[jump];
+    parser->innermostBreakJump = (int)readJumpOffset(operand);
+    patchJump(parser, jump);
   }
-  consume(TOKEN_SEMICOLON, "Expect ';' after 'continue'.");
+}
+
+static void continueStatement(Parser* parser) {
+  if(parser->innermostLoopStart == -1) {
+    error(parser, "A 'continue' outside of a loop is not alllowed.");
+  }
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after 'continue'.");
 
   // Discard any locals created inside the loop.
+  Compiler* current = parser->compiler;
   for (int i = current->localCount - 1;
-       i >= 0 && current->locals[i].depth > innermostLoopScopeDepth;
+       i >= 0 && current->locals[i].depth > parser->innermostLoopScopeDepth;
        i--) {
-    emitByte(OP_POP);
+    emitByte(parser, OP_POP);
   }
 
   // Jump to top of current innermost loop.
-  emitLoop(innermostLoopStart);
+  emitLoop(parser, parser->innermostLoopStart);
 }
 
-static void forStatement() {
-  beginScope();
+static void forStatement(Parser* parser) {
+  beginScope(parser);
 
   // Initializer clause
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-  if (match(TOKEN_SEMICOLON)) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(parser, TOKEN_SEMICOLON)) {
     // No initializer.
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
   } else {
-    expressionStatement();
+    expressionStatement(parser);
   }
 
-  int surroundingLoopStart = innermostLoopStart;
-  int surroundingLoopScopeDepth = innermostLoopScopeDepth;
-  int sorroundingLoopBreakOffset = innermostBreakOffset;
-  innermostLoopStart = currentChunk()->count;
-  innermostLoopScopeDepth = current->scopeDepth;
+  int surroundingLoopStart = parser->innermostLoopStart;
+  int surroundingLoopScopeDepth = parser->innermostLoopScopeDepth;
+  int surroundingBreakJump = parser->innermostBreakJump;
+  parser->innermostBreakJump = -1;
+  parser->innermostLoopStart = currentChunk(parser)->count;
+  parser->innermostLoopScopeDepth = parser->compiler->scopeDepth;
 
   // Condition clause
   int exitJump = -1;
-  if (!match(TOKEN_SEMICOLON)) {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+  if (!match(parser, TOKEN_SEMICOLON)) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
     // Jump out of the loop if the condition is false.
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // Condition.
+    exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP); // Condition.
   }
 
   // Increment clause
-  if (!match(TOKEN_RIGHT_PAREN)) {
-    int bodyJump = emitJump(OP_JUMP);
+  if (!match(parser, TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(parser, OP_JUMP);
 
-    int incrementStart = currentChunk()->count;
-    expression();
-    emitByte(OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+    int incrementStart = currentChunk(parser)->count;
+    expression(parser);
+    emitByte(parser, OP_POP);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-    emitLoop(innermostLoopStart);
-    innermostLoopStart = incrementStart;
-    patchJump(bodyJump);
+    emitLoop(parser, parser->innermostLoopStart);
+    parser->innermostLoopStart = incrementStart;
+    patchJump(parser, bodyJump);
   }
 
-  statement();
+  statement(parser);
 
-  emitLoop(innermostLoopStart);
+  emitLoop(parser, parser->innermostLoopStart);
 
   if (exitJump != -1) {
-    patchJump(exitJump);
-    emitByte(OP_POP); // Condition.
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP); // Condition.
   }
 
-  innermostLoopStart = surroundingLoopStart;
-  innermostLoopScopeDepth = surroundingLoopScopeDepth;
+  parser->innermostLoopStart = surroundingLoopStart;
+  parser->innermostLoopScopeDepth = surroundingLoopScopeDepth;
 
-  // Patch jump from inner break, if it exists
-  if (innermostBreakOffset > sorroundingLoopBreakOffset) {
-    patchJump(innermostBreakOffset);
-  }
-  innermostBreakOffset = sorroundingLoopBreakOffset;
+  patchBreaks(parser);
+  parser->innermostBreakJump = surroundingBreakJump;
 
-  endScope();
+  endScope(parser);
 }
 
-static void ifStatement() {
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
+static void ifStatement(Parser* parser) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition."); 
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
+  int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
 
-  int elseJump = emitJump(OP_JUMP);
+  int elseJump = emitJump(parser, OP_JUMP);
 
-  patchJump(thenJump);
-  emitByte(OP_POP);
+  patchJump(parser, thenJump);
+  emitByte(parser, OP_POP);
 
-  if (match(TOKEN_ELSE)) statement();
-  patchJump(elseJump);
+  if (match(parser, TOKEN_ELSE)) statement(parser);
+  patchJump(parser, elseJump);
 }
 
-static void printStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement() {
-  if (current->type == TYPE_SCRIPT) {
-    error("Can't return from top-level code.");
+static void returnStatement(Parser* parser) {
+  if (parser->compiler->type == TYPE_SCRIPT) {
+    error(parser, "Can't return from top-level code.");
   }
 
-  if (match(TOKEN_SEMICOLON)) {
-    emitReturn();
+  if (match(parser, TOKEN_SEMICOLON)) {
+    emitReturn(parser);
   } else {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-    emitByte(OP_RETURN);
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+      error(parser, "Can't return a value from an initializer.");
+    }
+
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    emitByte(parser, OP_RETURN);
   }
 }
 
-static void switchStatement() {
+static void switchStatement(Parser* parser) {
 #define MAX_CASES 256
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
 
   int state = 0; // 0: before all cases, 1: before default, 2: after default.
   int caseEnds[MAX_CASES];
   int caseCount = 0;
   int previousCaseSkip = -1;
 
-  while (!match(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    if (match(TOKEN_CASE) || match(TOKEN_DEFAULT)) {
-      TokenType caseType = parser.previous.type;
+  while (!match(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    if (match(parser, TOKEN_CASE) || match(parser, TOKEN_DEFAULT)) {
+      TokenType caseType = parser->previous.type;
 
       if (state == 2) {
-        error("Can't have another case or default after the default case.");
+        error(parser,
+              "Can't have another case or default after the default case.");
       }
 
       if (state == 1) {
         // At the end of the previous case, jump over the others.
-        caseEnds[caseCount++] = emitJump(OP_JUMP);
+        caseEnds[caseCount++] = emitJump(parser, OP_JUMP);
 
         // Patch its condition to jump to the next case (this one).
-        patchJump(previousCaseSkip);
-        emitByte(OP_POP);
+        patchJump(parser, previousCaseSkip);
+        emitByte(parser, OP_POP);
       }
 
       if (caseType == TOKEN_CASE) {
         state = 1;
 
         // See if the case is equal to the value.
-        emitByte(OP_DUP);
-        expression();
+        emitByte(parser, OP_DUP);
+        expression(parser);
 
-        consume(TOKEN_COLON, "Expect ':' after case value.");
+        consume(parser, TOKEN_COLON, "Expect ':' after case value.");
 
-        emitByte(OP_EQUAL);
-        previousCaseSkip = emitJump(OP_JUMP_IF_FALSE);
+        emitByte(parser, OP_EQUAL);
+        previousCaseSkip = emitJump(parser, OP_JUMP_IF_FALSE);
 
         // Pop the comparison result.
-        emitByte(OP_POP);
+        emitByte(parser, OP_POP);
       } else {
         state = 2;
-        consume(TOKEN_COLON, "Expect ':' after default.");
+        consume(parser, TOKEN_COLON, "Expect ':' after default.");
         previousCaseSkip = -1;
       }
     } else {
       // Otherwise, it's a statement inside the current case.
       if (state == 0) {
-        error("Can't have statements before any case.");
+        error(parser, "Can't have statements before any case.");
       }
-      statement();
+      statement(parser);
     }
   }
 
   // If we ended without a default case, patch its condition jump.
   if (state == 1) {
-    patchJump(previousCaseSkip);
-    emitByte(OP_POP);
+    patchJump(parser, previousCaseSkip);
+    emitByte(parser, OP_POP);
   }
 
   // Patch all the case jumps to the end.
   for (int i = 0; i < caseCount; i++) {
-    patchJump(caseEnds[i]);
+    patchJump(parser, caseEnds[i]);
   }
 
-  emitByte(OP_POP); // The switch value.
+  emitByte(parser, OP_POP); // The switch value.
 #undef MAX_CASES
 }
 
-static void whileStatement() {
-  int surroundingLoopStart = innermostLoopStart;
-  int surroundingLoopScopeDepth = innermostLoopScopeDepth;
-  int sorroundingLoopBreakOffset = innermostBreakOffset;
-  innermostLoopStart = currentChunk()->count;
-  innermostLoopScopeDepth = current->scopeDepth;
+static void whileStatement(Parser* parser) {
+  int surroundingLoopStart = parser->innermostLoopStart;
+  int surroundingLoopScopeDepth = parser->innermostLoopScopeDepth;
+  int surroundingBreakJump = parser->innermostBreakJump;
+  parser->innermostBreakJump = -1;
+  parser->innermostLoopStart = currentChunk(parser)->count;
+  parser->innermostLoopScopeDepth = parser->compiler->scopeDepth;
 
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
 
-  statement();
+  statement(parser);
 
-  emitLoop(innermostLoopStart);
-  patchJump(exitJump);
-  emitByte(OP_POP);
+  emitLoop(parser, parser->innermostLoopStart);
+  patchJump(parser, exitJump);
+  emitByte(parser, OP_POP);
 
-  innermostLoopStart = surroundingLoopStart;
-  innermostLoopScopeDepth = surroundingLoopScopeDepth;
+  parser->innermostLoopStart = surroundingLoopStart;
+  parser->innermostLoopScopeDepth = surroundingLoopScopeDepth;
 
-  // Patch jump from inner break, if it exists
-  if (innermostBreakOffset > sorroundingLoopBreakOffset) {
-    patchJump(innermostBreakOffset);
-  }
-  innermostBreakOffset = sorroundingLoopBreakOffset;
+  patchBreaks(parser);
+  parser->innermostBreakJump = surroundingBreakJump;
 }
 
-static void synchronize() {
-  parser.panicMode = false;
+static void synchronize(Parser* parser) {
+  parser->panicMode = false;
 
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON) return;
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON) return;
 
-    switch (parser.current.type) {
+    switch (parser->current.type) {
       case TOKEN_CLASS:
       case TOKEN_FUN:
       case TOKEN_VAR:
@@ -955,62 +1419,76 @@ static void synchronize() {
         ;
     }
 
-    advance();
+    advance(parser);
   }
 }
 
-static void declaration() {
-  if (match(TOKEN_FUN)) {
-    funDeclaration();
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+static void declaration(Parser* parser) {
+  if (match(parser, TOKEN_CLASS)) {
+    classDeclaration(parser);
+  } else if (match(parser, TOKEN_FUN)) {
+    funDeclaration(parser);
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
   } else {
-    statement();
-  }
-
-  if (parser.panicMode) synchronize();
-}
-
-static void statement() {
-  if (match(TOKEN_PRINT)) {
-    printStatement();
-  } else if (match(TOKEN_FOR)) {
-    forStatement();
-  } else if (match(TOKEN_IF)) {
-    ifStatement();
-  } else if (match(TOKEN_RETURN)) {
-    returnStatement();
-  } else if (match(TOKEN_WHILE)) {
-    whileStatement();
-  } else if (match(TOKEN_SWITCH)) {
-    switchStatement();
-  } else if (match(TOKEN_LEFT_BRACE)) {
-    beginScope();
-    block();
-    endScope();
-  } else if (match(TOKEN_BREAK)) {
-    breakStatement();
-  } else if (match(TOKEN_CONTINUE)) {
-    continueStatement();
+    statement(parser);
+  }
+
+  if (parser->panicMode) synchronize(parser);
+}
+
+static void statement(Parser* parser) {
+  if (match(parser, TOKEN_PRINT)) {
+    printStatement(parser);
+  } else if (match(parser, TOKEN_FOR)) {
+    forStatement(parser);
+  } else if (match(parser, TOKEN_IF)) {
+    ifStatement(parser);
+  } else if (match(parser, TOKEN_RETURN)) {
+    returnStatement(parser);
+  } else if (match(parser, TOKEN_WHILE)) {
+    whileStatement(parser);
+  } else if (match(parser, TOKEN_SWITCH)) {
+    switchStatement(parser);
+  } else if (match(parser, TOKEN_LEFT_BRACE)) {
+    beginScope(parser);
+    block(parser);
+    endScope(parser);
+  } else if (match(parser, TOKEN_BREAK)) {
+    breakStatement(parser);
+  } else if (match(parser, TOKEN_CONTINUE)) {
+    continueStatement(parser);
   } else {
-    expressionStatement();
+    expressionStatement(parser);
   }
 }
 
-ObjFunction* compile(const char* source) {
-  initScanner(source);
-  Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
+ObjFunction* compile(VM* vm, const char* source) {
+  return compileAt(vm, source, 1);
+}
 
+ObjFunction* compileAt(VM* vm, const char* source, int line) {
+  Parser parser;
+  parser.vm = vm;
+  initScannerAt(&parser.scanner, source, line);
   parser.hadError = false;
   parser.panicMode = false;
+  parser.compiler = NULL;
+  parser.currentClass = NULL;
+  parser.innermostLoopStart = -1;
+  parser.innermostLoopScopeDepth = 0;
+  parser.innermostBreakJump = -1;
+
+  Compiler compiler;
+  initCompiler(&parser, &compiler, TYPE_SCRIPT);
 
-  advance();
+  advance(&parser);
 
-  while (!match(TOKEN_EOF)) {
-    declaration();
+  while (!match(&parser, TOKEN_EOF)) {
+    declaration(&parser);
   }
 
-  ObjFunction* function = endCompiler();
+  ObjFunction* function = endCompiler(&parser);
+  freeCompiler(&compiler);
   return parser.hadError ? NULL : function;
 }
\ No newline at end of file
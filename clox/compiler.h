@@ -4,6 +4,7 @@
 #include "object.h"
 #include "vm.h"
 
-ObjFunction* compile(const char* source);
+ObjFunction* compile(VM* vm, const char* source);
+ObjFunction* compileAt(VM* vm, const char* source, int line);
 
 #endif
\ No newline at end of file
@@ -5,18 +5,27 @@
 #include "value.h"
 
 // forward declarations
+static uint32_t readLong(Chunk* chunk, int offset);
 static int simpleInstruction(const char* name, int offset);
 static int constantInstruction(const char* name, Chunk* chunk, int offset);
 static int longConstantInstruction(const char* name, Chunk* chunk, int offset);
 static int byteInstruction(const char* name, Chunk* chunk, int offset);
-static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset);
+static int longSlotInstruction(const char* name, Chunk* chunk, int offset);
+static int jumpInstruction(const char* name, int sign, int width,
+                           Chunk* chunk, int offset);
+static int propertyInstruction(const char* name, Chunk* chunk, int offset,
+                               bool isLong);
+static int invokeInstruction(const char* name, Chunk* chunk, int offset,
+                             bool isLong);
 
 void inspectTable(Table* table) {
   printf("count: %d, capacity: %d\n", table->count, table->capacity);
   for (int i = 0; i < table->capacity; ++i) {
     Entry* e = &table->entries[i];
-    if (e->key != NULL) {
-      printf("  [ %04d : %.*s ==> ", i, e->key->length, e->key->chars);
+    if (!IS_NIL(e->key)) {
+      printf("  [ %04d : ", i);
+      printValue(e->key);
+      printf(" ==> ");
       printValue(e->value);
       printf(" ]\n");
     }
@@ -80,12 +89,45 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_POP:           return simpleInstruction("OP_POP", offset);
     case OP_POPN:          return byteInstruction("OP_POPN", chunk, offset);
     case OP_GET_LOCAL:     return byteInstruction("OP_GET_LOCAL", chunk, offset);
+    case OP_GET_LOCAL_LONG:
+      return longSlotInstruction("OP_GET_LOCAL_LONG", chunk, offset);
     case OP_SET_LOCAL:     return byteInstruction("OP_SET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL_LONG:
+      return longSlotInstruction("OP_SET_LOCAL_LONG", chunk, offset);
     case OP_GET_GLOBAL:    return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+      return longConstantInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
     case OP_DEFINE_GLOBAL: return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+      return longConstantInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
     case OP_SET_GLOBAL:    return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL_LONG:
+      return longConstantInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
     case OP_GET_UPVALUE:   return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+    case OP_GET_UPVALUE_LONG:
+      return longSlotInstruction("OP_GET_UPVALUE_LONG", chunk, offset);
     case OP_SET_UPVALUE:   return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+    case OP_SET_UPVALUE_LONG:
+      return longSlotInstruction("OP_SET_UPVALUE_LONG", chunk, offset);
+    case OP_GET_PROPERTY:
+      return propertyInstruction("OP_GET_PROPERTY", chunk, offset, false);
+    case OP_GET_PROPERTY_LONG:
+      return propertyInstruction("OP_GET_PROPERTY_LONG", chunk, offset, true);
+    case OP_SET_PROPERTY:
+      return propertyInstruction("OP_SET_PROPERTY", chunk, offset, false);
+    case OP_SET_PROPERTY_LONG:
+      return propertyInstruction("OP_SET_PROPERTY_LONG", chunk, offset, true);
+    case OP_GET_SUPER:     return constantInstruction("OP_GET_SUPER", chunk, offset);
+    case OP_GET_SUPER_LONG:
+      return longConstantInstruction("OP_GET_SUPER_LONG", chunk, offset);
+    case OP_INVOKE:
+      return invokeInstruction("OP_INVOKE", chunk, offset, false);
+    case OP_INVOKE_LONG:
+      return invokeInstruction("OP_INVOKE_LONG", chunk, offset, true);
+    case OP_SUPER_INVOKE:
+      return invokeInstruction("OP_SUPER_INVOKE", chunk, offset, false);
+    case OP_SUPER_INVOKE_LONG:
+      return invokeInstruction("OP_SUPER_INVOKE_LONG", chunk, offset, true);
     case OP_EQUAL:         return simpleInstruction("OP_EQUAL", offset);
     case OP_NEQUAL:        return simpleInstruction("OP_NEQUAL", offset);
     case OP_GREATER:       return simpleInstruction("OP_GREATER", offset);
@@ -94,16 +136,48 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     case OP_SUBTRACT:      return simpleInstruction("OP_SUBTRACT", offset);
     case OP_MULTIPLY:      return simpleInstruction("OP_MULTIPLY", offset);
     case OP_DIVIDE:        return simpleInstruction("OP_DIVIDE", offset);
+    case OP_GREATER_NUMBER:
+      return simpleInstruction("OP_GREATER_NUMBER", offset);
+    case OP_LESS_NUMBER:   return simpleInstruction("OP_LESS_NUMBER", offset);
+    case OP_ADD_NUMBER:    return simpleInstruction("OP_ADD_NUMBER", offset);
+    case OP_SUBTRACT_NUMBER:
+      return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+    case OP_MULTIPLY_NUMBER:
+      return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+    case OP_DIVIDE_NUMBER:
+      return simpleInstruction("OP_DIVIDE_NUMBER", offset);
     case OP_NOT:           return simpleInstruction("OP_NOT", offset);
     case OP_NEGATE:        return simpleInstruction("OP_NEGATE", offset);
-    case OP_JUMP:          return jumpInstruction("OP_JUMP", 1, chunk, offset);
-    case OP_JUMP_IF_FALSE: return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
-    case OP_LOOP:          return jumpInstruction("OP_LOOP", -1, chunk, offset);
+    case OP_JUMP_NEAR:
+      return jumpInstruction("OP_JUMP_NEAR", 1, 1, chunk, offset);
+    case OP_JUMP:
+      return jumpInstruction("OP_JUMP", 1, 2, chunk, offset);
+    case OP_JUMP_LONG:
+      return jumpInstruction("OP_JUMP_LONG", 1, 4, chunk, offset);
+    case OP_JUMP_IF_FALSE_NEAR:
+      return jumpInstruction("OP_JUMP_IF_FALSE_NEAR", 1, 1, chunk, offset);
+    case OP_JUMP_IF_FALSE:
+      return jumpInstruction("OP_JUMP_IF_FALSE", 1, 2, chunk, offset);
+    case OP_JUMP_IF_FALSE_LONG:
+      return jumpInstruction("OP_JUMP_IF_FALSE_LONG", 1, 4, chunk, offset);
+    case OP_LOOP_NEAR:
+      return jumpInstruction("OP_LOOP_NEAR", -1, 1, chunk, offset);
+    case OP_LOOP:
+      return jumpInstruction("OP_LOOP", -1, 2, chunk, offset);
+    case OP_LOOP_LONG:
+      return jumpInstruction("OP_LOOP_LONG", -1, 4, chunk, offset);
     case OP_CALL:          return byteInstruction("OP_CALL", chunk, offset);
-    case OP_CLOSURE: {
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      // The long form has 24-bit upvalue indexes as well.
+      bool isLong = instruction == OP_CLOSURE_LONG;
+      int width = isLong ? 3 : 1;
       offset++;
-      uint8_t constant = chunk->code[offset++];
-      printf("%-16s %4d ", "OP_CLOSURE", constant);
+      uint32_t constant = isLong ? readLong(chunk, offset - 1)
+                                 : chunk->code[offset];
+      offset += width;
+      printf("%-16s %4d ", isLong ? "OP_CLOSURE_LONG" : "OP_CLOSURE",
+             constant);
       printValue(chunk->constants.values[constant]);
       printf("\n");
 
@@ -111,22 +185,42 @@ int disassembleInstruction(Chunk* chunk, int offset) {
           chunk->constants.values[constant]);
       for (int j = 0; j < function->upvalueCount; j++) {
         int isLocal = chunk->code[offset++];
-        int index = chunk->code[offset++];
+        int index = isLong ? (int)readLong(chunk, offset - 1)
+                           : chunk->code[offset];
+        offset += width;
         printf("%04d      |                     %s %d\n",
-               offset - 2, isLocal ? "local" : "upvalue", index);
+               offset - 1 - width, isLocal ? "local" : "upvalue", index);
       }
 
       return offset;
     }
     case OP_CLOSE_UPVALUE: return simpleInstruction("OP_CLOSE_UPVALUE", offset);
     case OP_RETURN:        return simpleInstruction("OP_RETURN", offset);
+    case OP_CLASS:         return constantInstruction("OP_CLASS", chunk, offset);
+    case OP_CLASS_LONG:
+      return longConstantInstruction("OP_CLASS_LONG", chunk, offset);
+    case OP_INHERIT:       return simpleInstruction("OP_INHERIT", offset);
+    case OP_METHOD:        return constantInstruction("OP_METHOD", chunk, offset);
+    case OP_METHOD_LONG:
+      return longConstantInstruction("OP_METHOD_LONG", chunk, offset);
     case OP_PRINT:         return simpleInstruction("OP_PRINT", offset);
+    case OP_ARRAY:         return byteInstruction("OP_ARRAY", chunk, offset);
+    case OP_MAP:           return byteInstruction("OP_MAP", chunk, offset);
+    case OP_INDEX_GET:     return simpleInstruction("OP_INDEX_GET", offset);
+    case OP_INDEX_SET:     return simpleInstruction("OP_INDEX_SET", offset);
     default:
       printf("Unknown opcode %d\n", instruction);
       return offset + 1;
   }
 }
 
+// Reads the 24-bit operand of the _LONG instruction at offset.
+static uint32_t readLong(Chunk* chunk, int offset) {
+  return (uint32_t)(chunk->code[offset + 1] << 16) |
+         (uint32_t)(chunk->code[offset + 2] << 8) |
+         (uint32_t)chunk->code[offset + 3];
+}
+
 static int simpleInstruction(const char* name, int offset) {
   printf("%s\n", name);
   return offset + 1;
@@ -138,12 +232,21 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2; 
 }
 
-static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
-  uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
-  jump |= chunk->code[offset + 2];
+static int longSlotInstruction(const char* name, Chunk* chunk, int offset) {
+  uint32_t slot = readLong(chunk, offset);
+  printf("%-16s %4d\n", name, slot);
+  return offset + 4;
+}
+
+static int jumpInstruction(const char* name, int sign, int width,
+                           Chunk* chunk, int offset) {
+  uint32_t jump = 0;
+  for (int i = 1; i <= width; i++) {
+    jump = (jump << 8) | chunk->code[offset + i];
+  }
   printf("%-16s %4d -> %d\n", name, offset,
-         offset + 3 + sign * jump);
-  return offset + 3;
+         offset + 1 + width + sign * (int)jump);
+  return offset + 1 + width;
 }
 
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
@@ -154,10 +257,35 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
   return offset + 2;
 }
 
+static int propertyInstruction(const char* name, Chunk* chunk, int offset,
+                               bool isLong) {
+  uint32_t constant = isLong ? readLong(chunk, offset)
+                             : chunk->code[offset + 1];
+  offset += isLong ? 3 : 1;
+  uint16_t cache = (uint16_t)(chunk->code[offset + 1] << 8);
+  cache |= chunk->code[offset + 2];
+  printf("%-16s %4d '", name, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 3;
+}
+
+static int invokeInstruction(const char* name, Chunk* chunk, int offset,
+                             bool isLong) {
+  uint32_t constant = isLong ? readLong(chunk, offset)
+                             : chunk->code[offset + 1];
+  offset += isLong ? 3 : 1;
+  uint8_t argCount = chunk->code[offset + 1];
+  uint16_t cache = (uint16_t)(chunk->code[offset + 2] << 8);
+  cache |= chunk->code[offset + 3];
+  printf("%-16s (%d args) %4d '", name, argCount, constant);
+  printValue(chunk->constants.values[constant]);
+  printf("' cache %d\n", cache);
+  return offset + 4;
+}
+
 static int longConstantInstruction(const char* name, Chunk* chunk, int offset) {
-  uint32_t index = (uint32_t) (((uint32_t)(chunk->code[offset + 1] << 16)
-                            |   (uint32_t)(chunk->code[offset + 2] << 8))
-                            |   (uint32_t)(chunk->code[offset + 3]));
+  uint32_t index = readLong(chunk, offset);
   printf("%-16s %4d ", name, index);
   printValue(chunk->constants.values[index]);
   printf("\n");
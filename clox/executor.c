@@ -0,0 +1,171 @@
+#include <sched.h>
+#include <stdint.h>
+
+#include "executor.h"
+#include "memory.h"
+
+// The queue is Dmitry Vyukov's bounded MPMC queue. Each slot carries a
+// sequence number that says whose turn it is: a producer may fill the
+// slot at position p when its sequence is p, a consumer may empty it
+// when its sequence is p + 1. Emptying sets it to p + capacity, the
+// position the slot will be filled at next time around.
+
+static void initJobQueue(JobQueue* queue, int capacity) {
+  size_t size = 1;
+  while (size < (size_t)capacity) size *= 2;
+
+  queue->slots = ALLOCATE(JobSlot, size);
+  queue->mask = size - 1;
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&queue->slots[i].sequence, i);
+  }
+  atomic_init(&queue->enqueuePosition, 0);
+  atomic_init(&queue->dequeuePosition, 0);
+}
+
+static void freeJobQueue(JobQueue* queue) {
+  FREE_ARRAY(JobSlot, queue->slots, queue->mask + 1);
+}
+
+static bool enqueueJob(JobQueue* queue, Job job) {
+  size_t position = atomic_load_explicit(&queue->enqueuePosition,
+                                         memory_order_relaxed);
+  for (;;) {
+    JobSlot* slot = &queue->slots[position & queue->mask];
+    size_t sequence = atomic_load_explicit(&slot->sequence,
+                                           memory_order_acquire);
+    intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+    if (difference == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+              &queue->enqueuePosition, &position, position + 1,
+              memory_order_relaxed, memory_order_relaxed)) {
+        slot->job = job;
+        atomic_store_explicit(&slot->sequence, position + 1,
+                              memory_order_release);
+        return true;
+      }
+    } else if (difference < 0) {
+      // The slot still holds the job from one lap ago.
+      return false;
+    } else {
+      position = atomic_load_explicit(&queue->enqueuePosition,
+                                      memory_order_relaxed);
+    }
+  }
+}
+
+static bool dequeueJob(JobQueue* queue, Job* job) {
+  size_t position = atomic_load_explicit(&queue->dequeuePosition,
+                                         memory_order_relaxed);
+  for (;;) {
+    JobSlot* slot = &queue->slots[position & queue->mask];
+    size_t sequence = atomic_load_explicit(&slot->sequence,
+                                           memory_order_acquire);
+    intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+    if (difference == 0) {
+      if (atomic_compare_exchange_weak_explicit(
+              &queue->dequeuePosition, &position, position + 1,
+              memory_order_relaxed, memory_order_relaxed)) {
+        *job = slot->job;
+        atomic_store_explicit(&slot->sequence, position + queue->mask + 1,
+                              memory_order_release);
+        return true;
+      }
+    } else if (difference < 0) {
+      // Not filled yet.
+      return false;
+    } else {
+      position = atomic_load_explicit(&queue->dequeuePosition,
+                                      memory_order_relaxed);
+    }
+  }
+}
+
+static void* runWorker(void* argument) {
+  Worker* worker = (Worker*)argument;
+  JobQueue* queue = &worker->executor->queue;
+
+  for (;;) {
+    sem_wait(&worker->executor->ready);
+
+    // The job this worker claimed is in the queue, but another producer
+    // may still be filling a slot ahead of it.
+    Job job;
+    while (!dequeueJob(queue, &job)) sched_yield();
+    if (job.source == NULL && job.module == NULL) return NULL;
+
+    InterpretResult result;
+    if (job.module != NULL) {
+      result = interpretModule(&worker->vm, job.module);
+      resetVM(&worker->vm);
+      releaseModule(job.module);
+    } else {
+      result = interpret(&worker->vm, job.source);
+      resetVM(&worker->vm);
+    }
+    if (job.done != NULL) job.done(job.context, result);
+  }
+}
+
+void initExecutor(Executor* executor, int workerCount, int capacity) {
+  initJobQueue(&executor->queue, capacity);
+  sem_init(&executor->ready, 0, 0);
+
+  executor->workers = ALLOCATE(Worker, workerCount);
+  executor->workerCount = workerCount;
+  for (int i = 0; i < workerCount; i++) {
+    Worker* worker = &executor->workers[i];
+    worker->executor = executor;
+    initVM(&worker->vm);
+    snapshotVM(&worker->vm);
+    pthread_create(&worker->thread, NULL, runWorker, worker);
+  }
+}
+
+static void enqueueWaiting(Executor* executor, Job job) {
+  while (!enqueueJob(&executor->queue, job)) sched_yield();
+  sem_post(&executor->ready);
+}
+
+void freeExecutor(Executor* executor) {
+  // Every worker stops at the first stop job it takes, after the jobs
+  // queued before it.
+  Job stop = {NULL, NULL, NULL, NULL};
+  for (int i = 0; i < executor->workerCount; i++) {
+    enqueueWaiting(executor, stop);
+  }
+
+  for (int i = 0; i < executor->workerCount; i++) {
+    Worker* worker = &executor->workers[i];
+    pthread_join(worker->thread, NULL);
+    freeVM(&worker->vm);
+  }
+
+  FREE_ARRAY(Worker, executor->workers, executor->workerCount);
+  sem_destroy(&executor->ready);
+  freeJobQueue(&executor->queue);
+}
+
+bool submitJob(Executor* executor, const char* source,
+               JobDoneFn done, void* context) {
+  Job job = {source, NULL, done, context};
+  if (!enqueueJob(&executor->queue, job)) return false;
+
+  sem_post(&executor->ready);
+  return true;
+}
+
+bool submitModule(Executor* executor, Module* module,
+                  JobDoneFn done, void* context) {
+  retainModule(module);
+  Job job = {NULL, module, done, context};
+  if (!enqueueJob(&executor->queue, job)) {
+    releaseModule(module);
+    return false;
+  }
+
+  sem_post(&executor->ready);
+  return true;
+}
@@ -0,0 +1,75 @@
+#ifndef clox_executor_h
+#define clox_executor_h
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "module.h"
+#include "vm.h"
+
+// Runs scripts on a pool of worker threads. Each worker keeps one VM for
+// its whole life and resets it after every script, so a script only pays
+// for compiling and running itself. Jobs are handed to the workers
+// through a bounded lock-free queue.
+
+typedef void (*JobDoneFn)(void* context, InterpretResult result);
+
+// A job runs either source or a compiled module. One with neither tells
+// the worker that takes it to stop.
+typedef struct {
+  const char* source;
+  Module* module;
+  JobDoneFn done;
+  void* context;
+} Job;
+
+typedef struct {
+  atomic_size_t sequence;
+  Job job;
+} JobSlot;
+
+// Keeps the producers' and the consumers' position on separate cache
+// lines.
+#define CACHE_LINE 64
+
+typedef struct {
+  JobSlot* slots;
+  size_t mask;
+  _Alignas(CACHE_LINE) atomic_size_t enqueuePosition;
+  _Alignas(CACHE_LINE) atomic_size_t dequeuePosition;
+} JobQueue;
+
+typedef struct Executor Executor;
+
+typedef struct {
+  Executor* executor;
+  pthread_t thread;
+  VM vm;
+} Worker;
+
+struct Executor {
+  JobQueue queue;
+  // Counts the jobs in the queue that no worker has claimed yet.
+  sem_t ready;
+  Worker* workers;
+  int workerCount;
+};
+
+// The queue holds capacity jobs, which is rounded up to a power of two.
+void initExecutor(Executor* executor, int workerCount, int capacity);
+// Runs the queued jobs, then stops and frees the workers.
+void freeExecutor(Executor* executor);
+// Queues source to be run by the next free worker, which calls done with
+// the result, if done isn't NULL. The source has to stay alive until
+// then. Returns false without queueing anything when the queue is full.
+bool submitJob(Executor* executor, const char* source,
+               JobDoneFn done, void* context);
+// Like submitJob, but runs an already compiled module. The job holds a
+// reference to it until it has run. A worker that runs the same module
+// as its last job skips setting its VM up for it again.
+bool submitModule(Executor* executor, Module* module,
+                  JobDoneFn done, void* context);
+
+#endif
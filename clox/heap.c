@@ -0,0 +1,755 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "heap.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "value.h"
+
+// A heap image is laid out in the host's native byte order:
+//
+//   HeapHeader                      the VM's roots
+//   objects                         in objects list order, 8-byte aligned
+//   arrays                          what the objects own, 8-byte aligned
+//   uint64_t[relocationCount]       offsets of the pointers in the image
+//   NativeRelocation[nativeCount]   offsets of the native functions
+//
+// Objects and arrays are stored exactly as the VM uses them, with every
+// pointer set to the address it has when the image is mapped at
+// HEAP_BASE. When the mapping lands there nothing but the natives is
+// patched, so a VM starts in the same time however much the heap holds.
+// Anywhere else each pointer in the relocations is moved by the
+// difference. Natives are patched either way, since the functions move
+// with the executable.
+//
+// An image is only read back by the build that wrote it. Its header and
+// relocations are checked, but the objects are trusted.
+
+#define HEAP_MAGIC   "LOXH"
+#define HEAP_VERSION 1
+#define HEAP_BASE    ((uint64_t)0x100000000000)
+
+#define HEAP_LAYOUT \
+    ((uint32_t)(sizeof(Value) | sizeof(Table) << 8 | \
+                sizeof(ObjFunction) << 16 | sizeof(ObjInstance) << 24))
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t layout;
+  uint32_t nativeCount;
+  uint64_t base;
+  uint64_t size;
+  uint64_t relocationsOffset;
+  uint64_t relocationCount;
+  uint64_t nativesOffset;
+  Table globals;
+  Table strings;
+  ObjString* initString;
+  ObjShape* rootShape;
+  Obj* objects;
+} HeapHeader;
+
+typedef struct {
+  uint64_t offset;
+  uint32_t index;
+  uint32_t padding;
+} NativeRelocation;
+
+typedef struct {
+  // The objects to save, in the order they are laid out.
+  int objectCount;
+  int objectCapacity;
+  Obj** objects;
+  // Object address -> its offset in the image.
+  Table offsets;
+  uint64_t objectsEnd;
+
+  size_t count;
+  size_t capacity;
+  uint8_t* bytes;
+
+  size_t relocationCount;
+  size_t relocationCapacity;
+  uint64_t* relocations;
+
+  size_t nativeCount;
+  size_t nativeCapacity;
+  NativeRelocation* natives;
+
+  bool failed;
+} HeapWriter;
+
+static uint64_t align8(uint64_t size) {
+  return (size + 7) & ~(uint64_t)7;
+}
+
+// Object addresses fit in the 53 bits a double holds exactly, which
+// lets the VM's own tables map them.
+static Value addressKey(const void* address) {
+  return NUMBER_VAL((double)(uintptr_t)address);
+}
+
+static size_t objectSize(Obj* object) {
+  switch (object->type) {
+    case OBJ_ARRAY:        return sizeof(ObjArray);
+    case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+    case OBJ_CLASS:        return sizeof(ObjClass);
+    case OBJ_CLOSURE:      return sizeof(ObjClosure);
+    case OBJ_FUNCTION:     return sizeof(ObjFunction);
+    case OBJ_INSTANCE:
+      return sizeof(ObjInstance) +
+             sizeof(Value) * ((ObjInstance*)object)->inlineCapacity;
+    case OBJ_MAP:          return sizeof(ObjMap);
+    case OBJ_NATIVE:       return sizeof(ObjNative);
+    case OBJ_SHAPE:        return sizeof(ObjShape);
+    case OBJ_STRING:
+      return sizeof(ObjString) + ((ObjString*)object)->length + 1;
+    case OBJ_UPVALUE:      return sizeof(ObjUpvalue);
+  }
+  return 0; // Unreachable.
+}
+
+// ----------------------------------
+//      Collecting
+// ----------------------------------
+
+static void markObject(HeapWriter* writer, Obj* object) {
+  if (object == NULL) return;
+
+  Value offset;
+  if (tableGetValue(&writer->offsets, addressKey(object), &offset)) return;
+
+  tableSetValue(&writer->offsets, addressKey(object),
+                NUMBER_VAL((double)writer->objectsEnd));
+  writer->objectsEnd += align8(objectSize(object));
+
+  if (writer->objectCapacity < writer->objectCount + 1) {
+    int oldCapacity = writer->objectCapacity;
+    writer->objectCapacity = GROW_CAPACITY(oldCapacity);
+    writer->objects = GROW_ARRAY(Obj*, writer->objects,
+                                 oldCapacity, writer->objectCapacity);
+  }
+  writer->objects[writer->objectCount++] = object;
+}
+
+static void markValue(HeapWriter* writer, Value value) {
+  if (IS_OBJ(value)) markObject(writer, AS_OBJ(value));
+}
+
+static void markTable(HeapWriter* writer, Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    markValue(writer, table->entries[i].key);
+    markValue(writer, table->entries[i].value);
+  }
+}
+
+static void markReferences(HeapWriter* writer, Obj* object) {
+  switch (object->type) {
+    case OBJ_ARRAY: {
+      ObjArray* array = (ObjArray*)object;
+      if (array->packed) break;
+      for (int i = 0; i < array->count; i++) {
+        markValue(writer, array->as.values[i]);
+      }
+      break;
+    }
+
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      markValue(writer, bound->receiver);
+      markObject(writer, (Obj*)bound->method);
+      break;
+    }
+
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      markObject(writer, (Obj*)klass->name);
+      markValue(writer, klass->initializer);
+      markTable(writer, &klass->methods);
+      break;
+    }
+
+    case OBJ_CLOSURE: {
+      ObjClosure* closure = (ObjClosure*)object;
+      markObject(writer, (Obj*)closure->function);
+      for (int i = 0; i < closure->upvalueCount; i++) {
+        markObject(writer, (Obj*)closure->upvalues[i]);
+      }
+      break;
+    }
+
+    case OBJ_FUNCTION: {
+      ObjFunction* function = (ObjFunction*)object;
+      markObject(writer, (Obj*)function->name);
+      for (int i = 0; i < function->chunk.constants.count; i++) {
+        markValue(writer, function->chunk.constants.values[i]);
+      }
+      break;
+    }
+
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      markObject(writer, (Obj*)instance->klass);
+      markObject(writer, (Obj*)instance->shape);
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(writer, instance->fields[i]);
+      }
+      break;
+    }
+
+    case OBJ_MAP:
+      markTable(writer, &((ObjMap*)object)->table);
+      break;
+
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      markObject(writer, (Obj*)shape->parent);
+      markObject(writer, (Obj*)shape->name);
+      markTable(writer, &shape->transitions);
+      markTable(writer, &shape->slots);
+      break;
+    }
+
+    case OBJ_UPVALUE:
+      markValue(writer, ((ObjUpvalue*)object)->closed);
+      break;
+
+    case OBJ_NATIVE:
+    case OBJ_STRING:
+      break;
+  }
+}
+
+// ----------------------------------
+//      Writing
+// ----------------------------------
+
+// Appends zeroed space and returns its offset.
+static uint64_t reserve(HeapWriter* writer, size_t size) {
+  size_t start = align8(writer->count);
+  size_t end = start + size;
+  if (writer->capacity < end) {
+    size_t oldCapacity = writer->capacity;
+    while (writer->capacity < end) {
+      writer->capacity = GROW_CAPACITY(writer->capacity);
+    }
+    writer->bytes = GROW_ARRAY(uint8_t, writer->bytes,
+                               oldCapacity, writer->capacity);
+  }
+  memset(writer->bytes + writer->count, 0, end - writer->count);
+  writer->count = end;
+  return start;
+}
+
+static uint64_t append(HeapWriter* writer, const void* bytes, size_t size) {
+  uint64_t offset = reserve(writer, size);
+  memcpy(writer->bytes + offset, bytes, size);
+  return offset;
+}
+
+// Stores the address of the image offset target at the image offset at.
+static void writePointer(HeapWriter* writer, uint64_t at, uint64_t target) {
+  uint64_t address = HEAP_BASE + target;
+  memcpy(writer->bytes + at, &address, sizeof(address));
+
+  if (writer->relocationCapacity < writer->relocationCount + 1) {
+    size_t oldCapacity = writer->relocationCapacity;
+    writer->relocationCapacity = GROW_CAPACITY(oldCapacity);
+    writer->relocations = GROW_ARRAY(uint64_t, writer->relocations,
+                                     oldCapacity, writer->relocationCapacity);
+  }
+  writer->relocations[writer->relocationCount++] = at;
+}
+
+static void writeNull(HeapWriter* writer, uint64_t at) {
+  memset(writer->bytes + at, 0, sizeof(void*));
+}
+
+static void writeObjectPointer(HeapWriter* writer, uint64_t at, void* object) {
+  if (object == NULL) {
+    writeNull(writer, at);
+    return;
+  }
+
+  Value offset;
+  tableGetValue(&writer->offsets, addressKey(object), &offset);
+  writePointer(writer, at, (uint64_t)AS_NUMBER(offset));
+}
+
+static void writeValue(HeapWriter* writer, uint64_t at, Value value) {
+  memcpy(writer->bytes + at, &value, sizeof(Value));
+  if (IS_OBJ(value)) {
+    writeObjectPointer(writer, at + offsetof(Value, as), AS_OBJ(value));
+  }
+}
+
+static void writeValues(HeapWriter* writer, uint64_t at,
+                        Value* values, int count) {
+  if (count == 0) {
+    writeNull(writer, at);
+    return;
+  }
+
+  uint64_t array = reserve(writer, sizeof(Value) * count);
+  for (int i = 0; i < count; i++) {
+    writeValue(writer, array + sizeof(Value) * i, values[i]);
+  }
+  writePointer(writer, at, array);
+}
+
+static void writeTable(HeapWriter* writer, uint64_t at, Table* table) {
+  memcpy(writer->bytes + at, table, sizeof(Table));
+  if (table->capacity == 0) {
+    writeNull(writer, at + offsetof(Table, entries));
+    return;
+  }
+
+  uint64_t entries = reserve(writer, sizeof(Entry) * table->capacity);
+  for (int i = 0; i < table->capacity; i++) {
+    uint64_t entry = entries + sizeof(Entry) * i;
+    writeValue(writer, entry + offsetof(Entry, key), table->entries[i].key);
+    writeValue(writer, entry + offsetof(Entry, value),
+               table->entries[i].value);
+  }
+  writePointer(writer, at + offsetof(Table, entries), entries);
+}
+
+static void writeFunction(HeapWriter* writer, uint64_t at,
+                          ObjFunction* function) {
+  ObjFunction copy = *function;
+  Chunk* chunk = &copy.chunk;
+  chunk->capacity = chunk->count;
+  chunk->lineCapacity = chunk->lineCount;
+  chunk->constants.capacity = chunk->constants.count;
+  chunk->cacheCapacity = chunk->cacheCount;
+  copy.frozen = false;
+  copy.cacheStart = 0;
+  copy.jit = NULL;
+  copy.hotness = 0;
+  copy.aot = NULL;
+  copy.traces = NULL;
+  memcpy(writer->bytes + at, &copy, sizeof(copy));
+
+  uint64_t chunkAt = at + offsetof(ObjFunction, chunk);
+  writeObjectPointer(writer, at + offsetof(ObjFunction, name),
+                     function->name);
+  if (chunk->count > 0) {
+    writePointer(writer, chunkAt + offsetof(Chunk, code),
+                 append(writer, function->chunk.code, chunk->count));
+  } else {
+    writeNull(writer, chunkAt + offsetof(Chunk, code));
+  }
+
+  if (chunk->lineCount > 0) {
+    writePointer(writer, chunkAt + offsetof(Chunk, lines),
+                 append(writer, function->chunk.lines,
+                        sizeof(LineStart) * chunk->lineCount));
+  } else {
+    writeNull(writer, chunkAt + offsetof(Chunk, lines));
+  }
+
+  writeValues(writer,
+              chunkAt + offsetof(Chunk, constants) +
+                  offsetof(ValueArray, values),
+              function->chunk.constants.values, chunk->constants.count);
+
+  // The caches are saved empty, since what they point to may not be.
+  if (chunk->cacheCount > 0) {
+    writePointer(writer, chunkAt + offsetof(Chunk, caches),
+                 reserve(writer, sizeof(InlineCache) * chunk->cacheCount));
+  } else {
+    writeNull(writer, chunkAt + offsetof(Chunk, caches));
+  }
+}
+
+static void writeClosure(HeapWriter* writer, uint64_t at,
+                         ObjClosure* closure) {
+  memcpy(writer->bytes + at, closure, sizeof(ObjClosure));
+  writeObjectPointer(writer, at + offsetof(ObjClosure, function),
+                     closure->function);
+
+  if (closure->upvalueCount > 0) {
+    uint64_t upvalues = reserve(writer,
+                                sizeof(ObjUpvalue*) * closure->upvalueCount);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      writeObjectPointer(writer, upvalues + sizeof(ObjUpvalue*) * i,
+                         closure->upvalues[i]);
+    }
+    writePointer(writer, at + offsetof(ObjClosure, upvalues), upvalues);
+  } else {
+    writeNull(writer, at + offsetof(ObjClosure, upvalues));
+  }
+
+  // Even a closure of a module's function uses the function's own
+  // caches once it is in the image. They were written with the function.
+  Value function;
+  tableGetValue(&writer->offsets, addressKey(closure->function), &function);
+  uint64_t caches;
+  memcpy(&caches, writer->bytes + (uint64_t)AS_NUMBER(function) +
+                      offsetof(ObjFunction, chunk) + offsetof(Chunk, caches),
+         sizeof(caches));
+  if (caches != 0) {
+    writePointer(writer, at + offsetof(ObjClosure, caches),
+                 caches - HEAP_BASE);
+  } else {
+    writeNull(writer, at + offsetof(ObjClosure, caches));
+  }
+}
+
+static void writeInstance(HeapWriter* writer, uint64_t at,
+                          ObjInstance* instance) {
+  memcpy(writer->bytes + at, instance, sizeof(ObjInstance));
+  writeObjectPointer(writer, at + offsetof(ObjInstance, klass),
+                     instance->klass);
+  writeObjectPointer(writer, at + offsetof(ObjInstance, shape),
+                     instance->shape);
+
+  int fieldCount = instance->shape->fieldCount;
+  bool inlined = instance->fields == instance->inlineFields;
+  for (int i = 0; i < instance->inlineCapacity; i++) {
+    Value value = inlined && i < fieldCount ? instance->fields[i] : NIL_VAL;
+    writeValue(writer, at + offsetof(ObjInstance, inlineFields) +
+                           sizeof(Value) * i, value);
+  }
+
+  if (inlined) {
+    writePointer(writer, at + offsetof(ObjInstance, fields),
+                 at + offsetof(ObjInstance, inlineFields));
+    return;
+  }
+
+  uint64_t fields = reserve(writer, sizeof(Value) * instance->capacity);
+  for (int i = 0; i < instance->capacity; i++) {
+    Value value = i < fieldCount ? instance->fields[i] : NIL_VAL;
+    writeValue(writer, fields + sizeof(Value) * i, value);
+  }
+  writePointer(writer, at + offsetof(ObjInstance, fields), fields);
+}
+
+static void writeArray(HeapWriter* writer, uint64_t at, ObjArray* array) {
+  ObjArray copy = *array;
+  copy.capacity = array->count;
+  memcpy(writer->bytes + at, &copy, sizeof(copy));
+
+  uint64_t elements = at + offsetof(ObjArray, as);
+  if (!array->packed) {
+    writeValues(writer, elements, array->as.values, array->count);
+  } else if (array->count > 0) {
+    writePointer(writer, elements,
+                 append(writer, array->as.numbers,
+                        sizeof(double) * array->count));
+  } else {
+    writeNull(writer, elements);
+  }
+}
+
+static void writeNative(HeapWriter* writer, uint64_t at, ObjNative* native) {
+  memcpy(writer->bytes + at, native, sizeof(ObjNative));
+  writeNull(writer, at + offsetof(ObjNative, function));
+
+  int index = nativeIndex(native->function);
+  if (index == -1) {
+    writer->failed = true;
+    return;
+  }
+
+  if (writer->nativeCapacity < writer->nativeCount + 1) {
+    size_t oldCapacity = writer->nativeCapacity;
+    writer->nativeCapacity = GROW_CAPACITY(oldCapacity);
+    writer->natives = GROW_ARRAY(NativeRelocation, writer->natives,
+                                 oldCapacity, writer->nativeCapacity);
+  }
+  NativeRelocation relocation = {at + offsetof(ObjNative, function),
+                                 (uint32_t)index, 0};
+  writer->natives[writer->nativeCount++] = relocation;
+}
+
+static void writeObject(HeapWriter* writer, uint64_t at, Obj* object) {
+  switch (object->type) {
+    case OBJ_ARRAY:
+      writeArray(writer, at, (ObjArray*)object);
+      break;
+
+    case OBJ_BOUND_METHOD: {
+      ObjBoundMethod* bound = (ObjBoundMethod*)object;
+      memcpy(writer->bytes + at, bound, sizeof(ObjBoundMethod));
+      writeValue(writer, at + offsetof(ObjBoundMethod, receiver),
+                 bound->receiver);
+      writeObjectPointer(writer, at + offsetof(ObjBoundMethod, method),
+                         bound->method);
+      break;
+    }
+
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      memcpy(writer->bytes + at, klass, sizeof(ObjClass));
+      writeObjectPointer(writer, at + offsetof(ObjClass, name), klass->name);
+      writeValue(writer, at + offsetof(ObjClass, initializer),
+                 klass->initializer);
+      writeTable(writer, at + offsetof(ObjClass, methods), &klass->methods);
+      break;
+    }
+
+    case OBJ_CLOSURE:
+      writeClosure(writer, at, (ObjClosure*)object);
+      break;
+
+    case OBJ_FUNCTION:
+      writeFunction(writer, at, (ObjFunction*)object);
+      break;
+
+    case OBJ_INSTANCE:
+      writeInstance(writer, at, (ObjInstance*)object);
+      break;
+
+    case OBJ_MAP: {
+      ObjMap* map = (ObjMap*)object;
+      memcpy(writer->bytes + at, map, sizeof(ObjMap));
+      writeTable(writer, at + offsetof(ObjMap, table), &map->table);
+      break;
+    }
+
+    case OBJ_NATIVE:
+      writeNative(writer, at, (ObjNative*)object);
+      break;
+
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      memcpy(writer->bytes + at, shape, sizeof(ObjShape));
+      writeObjectPointer(writer, at + offsetof(ObjShape, parent),
+                         shape->parent);
+      writeObjectPointer(writer, at + offsetof(ObjShape, name), shape->name);
+      writeTable(writer, at + offsetof(ObjShape, transitions),
+                 &shape->transitions);
+      writeTable(writer, at + offsetof(ObjShape, slots), &shape->slots);
+      break;
+    }
+
+    case OBJ_STRING:
+      memcpy(writer->bytes + at, object, objectSize(object));
+      break;
+
+    case OBJ_UPVALUE: {
+      // Only closed upvalues can be saved. An open one points into the
+      // stack.
+      ObjUpvalue* upvalue = (ObjUpvalue*)object;
+      if (upvalue->location != &upvalue->closed) {
+        writer->failed = true;
+        break;
+      }
+      memcpy(writer->bytes + at, upvalue, sizeof(ObjUpvalue));
+      writePointer(writer, at + offsetof(ObjUpvalue, location),
+                   at + offsetof(ObjUpvalue, closed));
+      writeValue(writer, at + offsetof(ObjUpvalue, closed), upvalue->closed);
+      writeNull(writer, at + offsetof(ObjUpvalue, next));
+      break;
+    }
+  }
+}
+
+static void writeImage(HeapWriter* writer, VM* vm) {
+  writer->objectsEnd = align8(sizeof(HeapHeader));
+  markTable(writer, &vm->globals);
+  markTable(writer, &vm->strings);
+  markObject(writer, (Obj*)vm->initString);
+  markObject(writer, (Obj*)vm->rootShape);
+  for (int i = 0; i < writer->objectCount; i++) {
+    markReferences(writer, writer->objects[i]);
+  }
+
+  reserve(writer, writer->objectsEnd);
+
+  HeapHeader* header = (HeapHeader*)writer->bytes;
+  memcpy(header->magic, HEAP_MAGIC, 4);
+  header->version = HEAP_VERSION;
+  header->layout = HEAP_LAYOUT;
+  header->base = HEAP_BASE;
+  writeTable(writer, offsetof(HeapHeader, globals), &vm->globals);
+  writeTable(writer, offsetof(HeapHeader, strings), &vm->strings);
+  writeObjectPointer(writer, offsetof(HeapHeader, initString),
+                     vm->initString);
+  writeObjectPointer(writer, offsetof(HeapHeader, rootShape),
+                     vm->rootShape);
+  writeObjectPointer(writer, offsetof(HeapHeader, objects),
+                     writer->objects[0]);
+
+  // Closures point into the caches written with their functions, so they
+  // come last.
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < writer->objectCount; i++) {
+      Obj* object = writer->objects[i];
+      if ((object->type == OBJ_CLOSURE) != (pass == 1)) continue;
+
+      Value offset;
+      tableGetValue(&writer->offsets, addressKey(object), &offset);
+      uint64_t at = (uint64_t)AS_NUMBER(offset);
+      writeObject(writer, at, object);
+      writeObjectPointer(writer, at + offsetof(Obj, next),
+                         i + 1 < writer->objectCount
+                             ? writer->objects[i + 1] : NULL);
+    }
+  }
+
+  // The tables are not relocated themselves, so they are appended last.
+  uint64_t relocationsOffset = append(writer, writer->relocations,
+      sizeof(uint64_t) * writer->relocationCount);
+  uint64_t nativesOffset = writer->nativeCount == 0
+      ? align8(writer->count)
+      : append(writer, writer->natives,
+               sizeof(NativeRelocation) * writer->nativeCount);
+
+  header = (HeapHeader*)writer->bytes;
+  header->relocationsOffset = relocationsOffset;
+  header->relocationCount = writer->relocationCount;
+  header->nativesOffset = nativesOffset;
+  header->nativeCount = (uint32_t)writer->nativeCount;
+  header->size = writer->count;
+}
+
+bool writeHeap(VM* vm, const char* path) {
+  HeapWriter writer;
+  memset(&writer, 0, sizeof(writer));
+  initTable(&writer.offsets);
+  writeImage(&writer, vm);
+
+  // Write to a private temporary file and rename it into place, like
+  // the script cache.
+  size_t tempLength = strlen(path) + 32;
+  char* tempPath = ALLOCATE(char, tempLength);
+  snprintf(tempPath, tempLength, "%s.%ld.tmp", path, (long)getpid());
+
+  bool written = false;
+  FILE* file = writer.failed ? NULL : fopen(tempPath, "wb");
+  if (file != NULL) {
+    written = fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+    written = fclose(file) == 0 && written;
+    written = written && rename(tempPath, path) == 0;
+    if (!written) remove(tempPath);
+  }
+
+  FREE_ARRAY(char, tempPath, tempLength);
+  FREE_ARRAY(uint8_t, writer.bytes, writer.capacity);
+  FREE_ARRAY(uint64_t, writer.relocations, writer.relocationCapacity);
+  FREE_ARRAY(NativeRelocation, writer.natives, writer.nativeCapacity);
+  FREE_ARRAY(Obj*, writer.objects, writer.objectCapacity);
+  freeTable(&writer.offsets);
+  return written;
+}
+
+// ----------------------------------
+//      Loading
+// ----------------------------------
+
+static bool inImage(uint64_t size, uint64_t offset, uint64_t length) {
+  return offset <= size && length <= size - offset;
+}
+
+static bool validHeader(const HeapHeader* header, uint64_t size) {
+  long pageSize = sysconf(_SC_PAGESIZE);
+  return memcmp(header->magic, HEAP_MAGIC, 4) == 0 &&
+         header->version == HEAP_VERSION &&
+         header->layout == HEAP_LAYOUT &&
+         header->size == size &&
+         header->base % (uint64_t)pageSize == 0 &&
+         header->relocationsOffset % 8 == 0 &&
+         header->nativesOffset % 8 == 0 &&
+         header->relocationsOffset >= sizeof(HeapHeader) &&
+         header->relocationCount <= size / sizeof(uint64_t) &&
+         inImage(size, header->relocationsOffset,
+                 sizeof(uint64_t) * header->relocationCount) &&
+         inImage(size, header->nativesOffset,
+                 sizeof(NativeRelocation) * (uint64_t)header->nativeCount);
+}
+
+// Pointers only live before the relocations, and only point there.
+static bool relocate(uint8_t* base, const HeapHeader* header) {
+  uint64_t end = header->relocationsOffset;
+  uint64_t delta = (uint64_t)(uintptr_t)base - header->base;
+
+  if (delta != 0) {
+    const uint64_t* relocations =
+        (const uint64_t*)(base + header->relocationsOffset);
+    for (uint64_t i = 0; i < header->relocationCount; i++) {
+      uint64_t at = relocations[i];
+      if (at % 8 != 0 || !inImage(end, at, sizeof(uint64_t))) return false;
+
+      uint64_t address;
+      memcpy(&address, base + at, sizeof(address));
+      if (address - header->base >= end) return false;
+      address += delta;
+      memcpy(base + at, &address, sizeof(address));
+    }
+  }
+
+  const NativeRelocation* natives =
+      (const NativeRelocation*)(base + header->nativesOffset);
+  for (uint32_t i = 0; i < header->nativeCount; i++) {
+    NativeFn function = nativeFunction((int)natives[i].index);
+    uint64_t at = natives[i].offset;
+    if (function == NULL || at % 8 != 0 ||
+        !inImage(end, at, sizeof(NativeFn))) {
+      return false;
+    }
+    memcpy(base + at, &function, sizeof(function));
+  }
+  return true;
+}
+
+bool mapHeap(VM* vm, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return false;
+
+  struct stat status;
+  HeapHeader header;
+  if (fstat(fd, &status) == -1 ||
+      (size_t)status.st_size < sizeof(HeapHeader) ||
+      pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      !validHeader(&header, (uint64_t)status.st_size)) {
+    close(fd);
+    return false;
+  }
+
+  // Mapping at the address the image was written for saves relocating
+  // it. Kernels without MAP_FIXED_NOREPLACE take the address as a hint.
+  size_t size = (size_t)status.st_size;
+  void* base = MAP_FAILED;
+#ifdef MAP_FIXED_NOREPLACE
+  base = mmap((void*)(uintptr_t)header.base, size, PROT_READ | PROT_WRITE,
+              MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+#endif
+  if (base == MAP_FAILED) {
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (base == MAP_FAILED) return false;
+
+  if (!relocate((uint8_t*)base, &header) || !addMappedMemory(base, size)) {
+    munmap(base, size);
+    return false;
+  }
+
+  HeapHeader* image = (HeapHeader*)base;
+  vm->globals = image->globals;
+  vm->strings = image->strings;
+  vm->initString = image->initString;
+  vm->rootShape = image->rootShape;
+  vm->objects = image->objects;
+  vm->heap = base;
+  vm->heapSize = size;
+  return true;
+}
+
+void unmapHeap(VM* vm) {
+  removeMappedMemory(vm->heap);
+  munmap(vm->heap, vm->heapSize);
+  vm->heap = NULL;
+  vm->heapSize = 0;
+}
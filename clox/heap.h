@@ -0,0 +1,24 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+#include "vm.h"
+
+// A heap image holds a VM's globals and interned strings and every
+// object they reach, saved after a script has set them up. A VM started
+// from the image maps the file instead of running that script again:
+//
+//   clox --write-heap prelude.heap prelude.lox
+//   clox --heap prelude.heap script.lox
+//
+// The mapping is private, so a page of the file is only copied once the
+// VM writes to it.
+
+// Call it between scripts, when no upvalue is open. Returns false when
+// the image can't be written.
+bool writeHeap(VM* vm, const char* path);
+// Used by initVMFromHeap() and freeVM().
+bool mapHeap(VM* vm, const char* path);
+void unmapHeap(VM* vm);
+
+#endif
@@ -0,0 +1,691 @@
+#include <string.h>
+
+#include "jit.h"
+#include "memory.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+struct JitCode {
+  uint8_t* code;
+  size_t size;
+  // Where the machine code for each instruction starts, by bytecode
+  // offset.
+  uint32_t* entries;
+  int entryCount;
+};
+
+// The compiled code is called with the VM, the frame, and the address
+// of the instruction to start at. The prologue jumps there after loading
+// the registers below.
+typedef InterpretResult (*JitFn)(VM* vm, CallFrame* frame, uint8_t* start);
+
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+// Callee-saved, so they live across calls to the helpers.
+#define VM_REG    RBX
+#define TOP_REG   R12
+#define SLOTS_REG R13
+#define FRAME_REG R14
+
+#define VALUE_SIZE ((int32_t)sizeof(Value))
+#define TYPE_OFFSET ((int32_t)offsetof(Value, type))
+#define AS_OFFSET ((int32_t)offsetof(Value, as))
+
+#define CC_E  0x4
+#define CC_NE 0x5
+
+typedef struct {
+  // Where the rel32 to patch is.
+  int at;
+  // The bytecode offset jumped to.
+  int target;
+} Fixup;
+
+typedef struct {
+  ObjFunction* function;
+  uint8_t* code;
+  int count;
+  int capacity;
+  Fixup* fixups;
+  int fixupCount;
+  int fixupCapacity;
+  uint32_t* entries;
+  int okExit;
+  int errorExit;
+} Compiler;
+
+static void emitByte(Compiler* compiler, uint8_t byte) {
+  if (compiler->capacity < compiler->count + 1) {
+    int oldCapacity = compiler->capacity;
+    compiler->capacity = GROW_CAPACITY(oldCapacity);
+    compiler->code = GROW_ARRAY(uint8_t, compiler->code,
+                                oldCapacity, compiler->capacity);
+  }
+  compiler->code[compiler->count++] = byte;
+}
+
+static void emitBytes(Compiler* compiler, const void* bytes, int count) {
+  for (int i = 0; i < count; i++) {
+    emitByte(compiler, ((const uint8_t*)bytes)[i]);
+  }
+}
+
+static void emitInt32(Compiler* compiler, int32_t value) {
+  emitBytes(compiler, &value, 4);
+}
+
+static void emitInt64(Compiler* compiler, int64_t value) {
+  emitBytes(compiler, &value, 8);
+}
+
+static void emitRex(Compiler* compiler, bool wide, int reg, int base) {
+  uint8_t rex = 0x40 | (wide << 3) | ((reg >> 3) << 2) | (base >> 3);
+  if (rex != 0x40) emitByte(compiler, rex);
+}
+
+// The ModRM byte for [base + disp32]. Every memory operand uses the
+// disp32 form, which also keeps R13 from meaning RIP-relative.
+static void emitMemory(Compiler* compiler, int reg, int base, int32_t disp) {
+  emitByte(compiler, 0x80 | ((reg & 7) << 3) | (base & 7));
+  if ((base & 7) == RSP) emitByte(compiler, 0x24);
+  emitInt32(compiler, disp);
+}
+
+static void emitOpMemory(Compiler* compiler, bool wide, uint8_t op,
+                         int reg, int base, int32_t disp) {
+  emitRex(compiler, wide, reg, base);
+  emitByte(compiler, op);
+  emitMemory(compiler, reg, base, disp);
+}
+
+static void emitLoad(Compiler* compiler, int reg, int base, int32_t disp) {
+  emitOpMemory(compiler, true, 0x8b, reg, base, disp);
+}
+
+static void emitStore(Compiler* compiler, int base, int32_t disp, int reg) {
+  emitOpMemory(compiler, true, 0x89, reg, base, disp);
+}
+
+static void emitMove(Compiler* compiler, int dst, int src) {
+  emitRex(compiler, true, src, dst);
+  emitByte(compiler, 0x89);
+  emitByte(compiler, 0xc0 | ((src & 7) << 3) | (dst & 7));
+}
+
+static void emitMoveImmediate(Compiler* compiler, int reg, int64_t value) {
+  emitRex(compiler, true, 0, reg);
+  emitByte(compiler, 0xb8 + (reg & 7));
+  emitInt64(compiler, value);
+}
+
+static void emitAddImmediate(Compiler* compiler, int reg, int32_t value) {
+  emitRex(compiler, true, 0, reg);
+  emitByte(compiler, 0x81);
+  emitByte(compiler, 0xc0 | (reg & 7));
+  emitInt32(compiler, value);
+}
+
+// SSE instructions put their prefix before the REX byte.
+static void emitSse(Compiler* compiler, uint8_t prefix, uint8_t op,
+                    int xmm, int base, int32_t disp) {
+  emitByte(compiler, prefix);
+  emitRex(compiler, false, xmm, base);
+  emitByte(compiler, 0x0f);
+  emitByte(compiler, op);
+  emitMemory(compiler, xmm, base, disp);
+}
+
+static int emitJump(Compiler* compiler) {
+  emitByte(compiler, 0xe9);
+  emitInt32(compiler, 0);
+  return compiler->count - 4;
+}
+
+static int emitJumpIf(Compiler* compiler, uint8_t condition) {
+  emitByte(compiler, 0x0f);
+  emitByte(compiler, 0x80 | condition);
+  emitInt32(compiler, 0);
+  return compiler->count - 4;
+}
+
+static void patchJump(Compiler* compiler, int at, int target) {
+  int32_t offset = target - (at + 4);
+  memcpy(&compiler->code[at], &offset, 4);
+}
+
+static void patchHere(Compiler* compiler, int at) {
+  patchJump(compiler, at, compiler->count);
+}
+
+static void addFixup(Compiler* compiler, int at, int target) {
+  if (compiler->fixupCapacity < compiler->fixupCount + 1) {
+    int oldCapacity = compiler->fixupCapacity;
+    compiler->fixupCapacity = GROW_CAPACITY(oldCapacity);
+    compiler->fixups = GROW_ARRAY(Fixup, compiler->fixups,
+                                  oldCapacity, compiler->fixupCapacity);
+  }
+  compiler->fixups[compiler->fixupCount++] = (Fixup){at, target};
+}
+
+// cmp dword [base + disp], type
+static void emitCompareType(Compiler* compiler, int base, int32_t disp,
+                            ValueType type) {
+  emitOpMemory(compiler, false, 0x83, 7, base, disp + TYPE_OFFSET);
+  emitByte(compiler, type);
+}
+
+// Values are stored and loaded a quadword at a time, the type with its
+// padding. A load that spans two stores, or only part of one, can't be
+// forwarded from the stores and waits for them to reach the cache.
+static void emitStoreType(Compiler* compiler, int base, int32_t disp,
+                          ValueType type) {
+  emitOpMemory(compiler, true, 0xc7, 0, base, disp + TYPE_OFFSET);
+  emitInt32(compiler, type);
+}
+
+// Uses rcx and rdx.
+static void emitCopyValue(Compiler* compiler, int dst, int32_t dstDisp,
+                          int src, int32_t srcDisp) {
+  emitLoad(compiler, RCX, src, srcDisp);
+  emitLoad(compiler, RDX, src, srcDisp + 8);
+  emitStore(compiler, dst, dstDisp, RCX);
+  emitStore(compiler, dst, dstDisp + 8, RDX);
+}
+
+static void emitPushValue(Compiler* compiler, int base, int32_t disp) {
+  emitCopyValue(compiler, TOP_REG, 0, base, disp);
+  emitAddImmediate(compiler, TOP_REG, VALUE_SIZE);
+}
+
+static void emitPushConstant(Compiler* compiler, Value value) {
+  int64_t bits = 0;
+  if (IS_BOOL(value)) {
+    bits = AS_BOOL(value);
+  } else if (!IS_NIL(value)) {
+    memcpy(&bits, &value.as, sizeof(bits));
+  }
+  emitStoreType(compiler, TOP_REG, 0, value.type);
+  emitMoveImmediate(compiler, RAX, bits);
+  emitStore(compiler, TOP_REG, AS_OFFSET, RAX);
+  emitAddImmediate(compiler, TOP_REG, VALUE_SIZE);
+}
+
+// Stores the bool in al over the value at disp from the stack top.
+static void emitStoreBool(Compiler* compiler, int32_t disp) {
+  emitBytes(compiler, (uint8_t[]){0x0f, 0xb6, 0xc0}, 3);
+  emitStoreType(compiler, TOP_REG, disp, VAL_BOOL);
+  emitStore(compiler, TOP_REG, disp + AS_OFFSET, RAX);
+}
+
+// Calls a helper with the VM as its first argument, after storing the
+// stack top and the ip of the next instruction where the helper, and
+// the runtime errors it reports, look for them. The other arguments are
+// already in place.
+static void emitHelper(Compiler* compiler, void* helper, uint8_t* next) {
+  emitStore(compiler, VM_REG, offsetof(VM, stackTop), TOP_REG);
+  emitMoveImmediate(compiler, RAX, (int64_t)next);
+  emitStore(compiler, FRAME_REG, offsetof(CallFrame, ip), RAX);
+  emitMove(compiler, RDI, VM_REG);
+  emitMoveImmediate(compiler, RAX, (int64_t)helper);
+  emitBytes(compiler, (uint8_t[]){0xff, 0xd0}, 2);
+  emitLoad(compiler, TOP_REG, VM_REG, offsetof(VM, stackTop));
+}
+
+// For a helper that returns false after a runtime error.
+static void emitCheckedHelper(Compiler* compiler, void* helper,
+                              uint8_t* next) {
+  emitHelper(compiler, helper, next);
+  emitBytes(compiler, (uint8_t[]){0x84, 0xc0}, 2);
+  patchJump(compiler, emitJumpIf(compiler, CC_E), compiler->errorExit);
+}
+
+static void emitError(Compiler* compiler, const char* message,
+                      uint8_t* next) {
+  emitMoveImmediate(compiler, RSI, (int64_t)message);
+  emitHelper(compiler, (void*)jitError, next);
+  patchJump(compiler, emitJump(compiler), compiler->errorExit);
+}
+
+// Jumps to the bytecode target if the value on top of the stack is
+// falsey.
+static void emitJumpIfFalsey(Compiler* compiler, int target) {
+  emitCompareType(compiler, TOP_REG, -VALUE_SIZE, VAL_NIL);
+  addFixup(compiler, emitJumpIf(compiler, CC_E), target);
+  emitCompareType(compiler, TOP_REG, -VALUE_SIZE, VAL_BOOL);
+  int truthy = emitJumpIf(compiler, CC_NE);
+  // cmp byte [r12 - 8], 0
+  emitOpMemory(compiler, false, 0x80, 7, TOP_REG, -VALUE_SIZE + AS_OFFSET);
+  emitByte(compiler, 0);
+  addFixup(compiler, emitJumpIf(compiler, CC_E), target);
+  patchHere(compiler, truthy);
+}
+
+// Fills slow with the two jumps taken unless both operands are
+// numbers.
+static void emitNumberGuard(Compiler* compiler, int slow[2]) {
+  emitCompareType(compiler, TOP_REG, -2 * VALUE_SIZE, VAL_NUMBER);
+  slow[0] = emitJumpIf(compiler, CC_NE);
+  emitCompareType(compiler, TOP_REG, -VALUE_SIZE, VAL_NUMBER);
+  slow[1] = emitJumpIf(compiler, CC_NE);
+}
+
+static void emitArithmetic(Compiler* compiler, uint8_t sseOp,
+                           uint8_t* next) {
+  int slow[2];
+  emitNumberGuard(compiler, slow);
+  emitSse(compiler, 0xf2, 0x10, 0, TOP_REG, -2 * VALUE_SIZE + AS_OFFSET);
+  emitSse(compiler, 0xf2, sseOp, 0, TOP_REG, -VALUE_SIZE + AS_OFFSET);
+  emitSse(compiler, 0xf2, 0x11, 0, TOP_REG, -2 * VALUE_SIZE + AS_OFFSET);
+  emitAddImmediate(compiler, TOP_REG, -VALUE_SIZE);
+  int done = emitJump(compiler);
+
+  patchHere(compiler, slow[0]);
+  patchHere(compiler, slow[1]);
+  if (sseOp == 0x58) {
+    emitCheckedHelper(compiler, (void*)jitAdd, next);
+  } else {
+    emitError(compiler, "Operands must be numbers.", next);
+  }
+  patchHere(compiler, done);
+}
+
+static void emitComparison(Compiler* compiler, bool greater, uint8_t* next) {
+  int slow[2];
+  emitNumberGuard(compiler, slow);
+  // a > b and b < a both come down to ucomisd and seta, which is false
+  // when either is NaN.
+  int32_t left = greater ? -2 * VALUE_SIZE : -VALUE_SIZE;
+  int32_t right = greater ? -VALUE_SIZE : -2 * VALUE_SIZE;
+  emitSse(compiler, 0xf2, 0x10, 0, TOP_REG, left + AS_OFFSET);
+  emitSse(compiler, 0x66, 0x2e, 0, TOP_REG, right + AS_OFFSET);
+  emitBytes(compiler, (uint8_t[]){0x0f, 0x97, 0xc0}, 3);
+  emitStoreBool(compiler, -2 * VALUE_SIZE);
+  emitAddImmediate(compiler, TOP_REG, -VALUE_SIZE);
+  int done = emitJump(compiler);
+
+  patchHere(compiler, slow[0]);
+  patchHere(compiler, slow[1]);
+  emitError(compiler, "Operands must be numbers.", next);
+  patchHere(compiler, done);
+}
+
+static void emitEquality(Compiler* compiler, bool negate) {
+  // A Value is passed in two registers.
+  emitLoad(compiler, RDI, TOP_REG, -2 * VALUE_SIZE);
+  emitLoad(compiler, RSI, TOP_REG, -2 * VALUE_SIZE + 8);
+  emitLoad(compiler, RDX, TOP_REG, -VALUE_SIZE);
+  emitLoad(compiler, RCX, TOP_REG, -VALUE_SIZE + 8);
+  emitMoveImmediate(compiler, RAX, (int64_t)valuesEqual);
+  emitBytes(compiler, (uint8_t[]){0xff, 0xd0}, 2);
+  if (negate) emitBytes(compiler, (uint8_t[]){0x34, 0x01}, 2);
+  emitStoreBool(compiler, -2 * VALUE_SIZE);
+  emitAddImmediate(compiler, TOP_REG, -VALUE_SIZE);
+}
+
+static void emitNot(Compiler* compiler) {
+  // xor eax, eax, then set it for a falsey value.
+  emitBytes(compiler, (uint8_t[]){0x31, 0xc0}, 2);
+  emitCompareType(compiler, TOP_REG, -VALUE_SIZE, VAL_NIL);
+  int nil = emitJumpIf(compiler, CC_E);
+  emitCompareType(compiler, TOP_REG, -VALUE_SIZE, VAL_BOOL);
+  int truthy = emitJumpIf(compiler, CC_NE);
+  emitOpMemory(compiler, false, 0x80, 7, TOP_REG, -VALUE_SIZE + AS_OFFSET);
+  emitByte(compiler, 0);
+  int falsey = emitJumpIf(compiler, CC_E);
+  int done = emitJump(compiler);
+  patchHere(compiler, nil);
+  patchHere(compiler, falsey);
+  // mov al, 1
+  emitBytes(compiler, (uint8_t[]){0xb0, 0x01}, 2);
+  patchHere(compiler, truthy);
+  patchHere(compiler, done);
+  emitStoreBool(compiler, -VALUE_SIZE);
+}
+
+static void emitNegate(Compiler* compiler, uint8_t* next) {
+  emitCompareType(compiler, TOP_REG, -VALUE_SIZE, VAL_NUMBER);
+  int slow = emitJumpIf(compiler, CC_NE);
+  emitMoveImmediate(compiler, RAX, INT64_MIN);
+  emitOpMemory(compiler, true, 0x31, RAX, TOP_REG, -VALUE_SIZE + AS_OFFSET);
+  int done = emitJump(compiler);
+  patchHere(compiler, slow);
+  emitError(compiler, "Operand must be a number.", next);
+  patchHere(compiler, done);
+}
+
+// Leaves the address of upvalue index's value in rax.
+static void emitUpvalueAddress(Compiler* compiler, uint32_t index) {
+  emitLoad(compiler, RAX, FRAME_REG, offsetof(CallFrame, closure));
+  emitLoad(compiler, RAX, RAX, offsetof(ObjClosure, upvalues));
+  emitLoad(compiler, RAX, RAX, index * sizeof(ObjUpvalue*));
+  emitLoad(compiler, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+static void emitPrologue(Compiler* compiler) {
+  // push rbp, rbx, r12, r13 and r14, which also aligns the stack for
+  // the helpers.
+  emitBytes(compiler, (uint8_t[]){0x55, 0x53, 0x41, 0x54, 0x41, 0x55,
+                                  0x41, 0x56}, 8);
+  emitMove(compiler, VM_REG, RDI);
+  emitMove(compiler, FRAME_REG, RSI);
+  emitLoad(compiler, TOP_REG, VM_REG, offsetof(VM, stackTop));
+  emitLoad(compiler, SLOTS_REG, FRAME_REG, offsetof(CallFrame, slots));
+  // jmp rdx
+  emitBytes(compiler, (uint8_t[]){0xff, 0xe2}, 2);
+
+  // mov eax, result, then pop the registers and return.
+  compiler->errorExit = compiler->count;
+  emitByte(compiler, 0xb8);
+  emitInt32(compiler, INTERPRET_RUNTIME_ERROR);
+  int epilogue = emitJump(compiler);
+  compiler->okExit = compiler->count;
+  emitByte(compiler, 0xb8);
+  emitInt32(compiler, INTERPRET_OK);
+  patchHere(compiler, epilogue);
+  emitBytes(compiler, (uint8_t[]){0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c,
+                                  0x5b, 0x5d, 0xc3}, 9);
+}
+
+static uint32_t readLong(uint8_t* code) {
+  return (code[0] << 16) | (code[1] << 8) | code[2];
+}
+
+static uint32_t readShort(uint8_t* code) {
+  return (code[0] << 8) | code[1];
+}
+
+static uint32_t readUint32(uint8_t* code) {
+  return ((uint32_t)code[0] << 24) | ((uint32_t)code[1] << 16) |
+         ((uint32_t)code[2] << 8) | (uint32_t)code[3];
+}
+
+// Emits the instruction at offset. Returns its length, or 0 when it has
+// no template.
+static int compileInstruction(Compiler* compiler, int offset) {
+  Chunk* chunk = &compiler->function->chunk;
+  uint8_t* ip = &chunk->code[offset];
+  ValueArray* constants = &chunk->constants;
+
+  // The long forms share the short form's template, with a wider
+  // operand.
+  bool isLong = false;
+  uint32_t operand = 0;
+  int length = 2;
+  switch (ip[0]) {
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+      isLong = true;
+      operand = readLong(ip + 1);
+      length = 4;
+      break;
+    default:
+      if (offset + 1 < chunk->count) operand = ip[1];
+      break;
+  }
+  // Where the ip is left for a helper, after the instruction.
+  uint8_t* next = ip + length;
+  uint8_t* after = ip + 1;
+
+  switch (ip[0] - isLong) {
+    case OP_CONSTANT:
+      emitPushConstant(compiler, constants->values[operand]);
+      return length;
+
+    case OP_NIL: emitPushConstant(compiler, NIL_VAL); return 1;
+    case OP_TRUE: emitPushConstant(compiler, BOOL_VAL(true)); return 1;
+    case OP_FALSE: emitPushConstant(compiler, BOOL_VAL(false)); return 1;
+    case OP_ZERO: emitPushConstant(compiler, NUMBER_VAL(0)); return 1;
+    case OP_ONE: emitPushConstant(compiler, NUMBER_VAL(1)); return 1;
+
+    case OP_POP:
+      emitAddImmediate(compiler, TOP_REG, -VALUE_SIZE);
+      return 1;
+
+    case OP_POPN:
+      emitAddImmediate(compiler, TOP_REG, -VALUE_SIZE * (int32_t)operand);
+      return 2;
+
+    case OP_DUP:
+      emitPushValue(compiler, TOP_REG, -VALUE_SIZE);
+      return 1;
+
+    case OP_GET_LOCAL:
+      emitPushValue(compiler, SLOTS_REG, operand * VALUE_SIZE);
+      return length;
+
+    case OP_SET_LOCAL:
+      emitCopyValue(compiler, SLOTS_REG, operand * VALUE_SIZE,
+                    TOP_REG, -VALUE_SIZE);
+      return length;
+
+    case OP_GET_GLOBAL:
+      emitMoveImmediate(compiler, RSI,
+                        (int64_t)AS_STRING(constants->values[operand]));
+      emitCheckedHelper(compiler, (void*)jitGetGlobal, next);
+      return length;
+
+    case OP_DEFINE_GLOBAL:
+      emitMoveImmediate(compiler, RSI,
+                        (int64_t)AS_STRING(constants->values[operand]));
+      emitHelper(compiler, (void*)jitDefineGlobal, next);
+      return length;
+
+    case OP_SET_GLOBAL:
+      emitMoveImmediate(compiler, RSI,
+                        (int64_t)AS_STRING(constants->values[operand]));
+      emitCheckedHelper(compiler, (void*)jitSetGlobal, next);
+      return length;
+
+    case OP_GET_UPVALUE:
+      emitUpvalueAddress(compiler, operand);
+      emitPushValue(compiler, RAX, 0);
+      return length;
+
+    case OP_SET_UPVALUE:
+      emitUpvalueAddress(compiler, operand);
+      emitCopyValue(compiler, RAX, 0, TOP_REG, -VALUE_SIZE);
+      return length;
+
+    case OP_EQUAL: emitEquality(compiler, false); return 1;
+    case OP_NEQUAL: emitEquality(compiler, true); return 1;
+
+    // The generic and the quickened forms share a template, which checks
+    // the operands either way.
+    case OP_GREATER:
+    case OP_GREATER_NUMBER:
+      emitComparison(compiler, true, after);
+      return 1;
+    case OP_LESS:
+    case OP_LESS_NUMBER:
+      emitComparison(compiler, false, after);
+      return 1;
+    case OP_ADD:
+    case OP_ADD_NUMBER:
+      emitArithmetic(compiler, 0x58, after);
+      return 1;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUMBER:
+      emitArithmetic(compiler, 0x5c, after);
+      return 1;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUMBER:
+      emitArithmetic(compiler, 0x59, after);
+      return 1;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUMBER:
+      emitArithmetic(compiler, 0x5e, after);
+      return 1;
+
+    case OP_NOT: emitNot(compiler); return 1;
+    case OP_NEGATE: emitNegate(compiler, after); return 1;
+
+    case OP_PRINT:
+      emitHelper(compiler, (void*)jitPrint, after);
+      return 1;
+
+    case OP_JUMP_NEAR:
+      addFixup(compiler, emitJump(compiler), offset + 2 + ip[1]);
+      return 2;
+    case OP_JUMP:
+      addFixup(compiler, emitJump(compiler), offset + 3 + readShort(ip + 1));
+      return 3;
+    case OP_JUMP_LONG:
+      addFixup(compiler, emitJump(compiler),
+               offset + 5 + readUint32(ip + 1));
+      return 5;
+
+    case OP_JUMP_IF_FALSE_NEAR:
+      emitJumpIfFalsey(compiler, offset + 2 + ip[1]);
+      return 2;
+    case OP_JUMP_IF_FALSE:
+      emitJumpIfFalsey(compiler, offset + 3 + readShort(ip + 1));
+      return 3;
+    case OP_JUMP_IF_FALSE_LONG:
+      emitJumpIfFalsey(compiler, offset + 5 + readUint32(ip + 1));
+      return 5;
+
+    case OP_LOOP_NEAR:
+      addFixup(compiler, emitJump(compiler), offset + 2 - ip[1]);
+      return 2;
+    case OP_LOOP:
+      addFixup(compiler, emitJump(compiler), offset + 3 - readShort(ip + 1));
+      return 3;
+    case OP_LOOP_LONG:
+      addFixup(compiler, emitJump(compiler),
+               offset + 5 - (int)readUint32(ip + 1));
+      return 5;
+
+    case OP_CALL:
+      // mov esi, argCount
+      emitByte(compiler, 0xbe);
+      emitInt32(compiler, operand);
+      emitCheckedHelper(compiler, (void*)jitCall, next);
+      return 2;
+
+    case OP_CLOSE_UPVALUE:
+      emitHelper(compiler, (void*)jitCloseUpvalue, after);
+      return 1;
+
+    case OP_RETURN:
+      emitMove(compiler, RSI, FRAME_REG);
+      emitHelper(compiler, (void*)jitReturn, after);
+      patchJump(compiler, emitJump(compiler), compiler->okExit);
+      return 1;
+
+    default:
+      return 0;
+  }
+}
+
+static bool compileFunction(Compiler* compiler) {
+  Chunk* chunk = &compiler->function->chunk;
+  emitPrologue(compiler);
+
+  int offset = 0;
+  while (offset < chunk->count) {
+    compiler->entries[offset] = compiler->count;
+    int length = compileInstruction(compiler, offset);
+    if (length == 0) return false;
+    offset += length;
+  }
+
+  for (int i = 0; i < compiler->fixupCount; i++) {
+    Fixup* fixup = &compiler->fixups[i];
+    if (fixup->target < 0 || fixup->target >= chunk->count ||
+        compiler->entries[fixup->target] == UINT32_MAX) {
+      return false;
+    }
+    patchJump(compiler, fixup->at, compiler->entries[fixup->target]);
+  }
+  return true;
+}
+
+bool compileJit(ObjFunction* function) {
+  Compiler compiler;
+  compiler.function = function;
+  compiler.code = NULL;
+  compiler.count = 0;
+  compiler.capacity = 0;
+  compiler.fixups = NULL;
+  compiler.fixupCount = 0;
+  compiler.fixupCapacity = 0;
+  compiler.entries = ALLOCATE(uint32_t, function->chunk.count);
+  for (int i = 0; i < function->chunk.count; i++) {
+    compiler.entries[i] = UINT32_MAX;
+  }
+
+  bool compiled = compileFunction(&compiler);
+  uint8_t* code = MAP_FAILED;
+  if (compiled) {
+    code = mmap(NULL, compiler.count, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (code != MAP_FAILED) {
+    memcpy(code, compiler.code, compiler.count);
+    if (mprotect(code, compiler.count, PROT_READ | PROT_EXEC) != 0) {
+      munmap(code, compiler.count);
+      code = MAP_FAILED;
+    }
+  }
+
+  FREE_ARRAY(uint8_t, compiler.code, compiler.capacity);
+  FREE_ARRAY(Fixup, compiler.fixups, compiler.fixupCapacity);
+  if (code == MAP_FAILED) {
+    FREE_ARRAY(uint32_t, compiler.entries, function->chunk.count);
+    function->hotness = -1;
+    return false;
+  }
+
+  JitCode* jit = ALLOCATE(JitCode, 1);
+  jit->code = code;
+  jit->size = compiler.count;
+  jit->entries = compiler.entries;
+  jit->entryCount = function->chunk.count;
+  function->jit = jit;
+  return true;
+}
+
+InterpretResult runJit(VM* vm, CallFrame* frame) {
+  ObjFunction* function = frame->closure->function;
+  JitCode* jit = function->jit;
+  uint32_t entry = jit->entries[frame->ip - function->chunk.code];
+  return ((JitFn)jit->code)(vm, frame, jit->code + entry);
+}
+
+void freeJit(ObjFunction* function) {
+  JitCode* jit = function->jit;
+  if (jit == NULL) return;
+
+  munmap(jit->code, jit->size);
+  FREE_ARRAY(uint32_t, jit->entries, jit->entryCount);
+  FREE(JitCode, jit);
+  function->jit = NULL;
+}
+
+#else
+
+bool compileJit(ObjFunction* function) {
+  function->hotness = -1;
+  return false;
+}
+
+InterpretResult runJit(VM* vm, CallFrame* frame) {
+  // Unreachable, since nothing is ever compiled.
+  return INTERPRET_RUNTIME_ERROR;
+}
+
+void freeJit(ObjFunction* function) {
+}
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "vm.h"
+
+// A baseline compiler from bytecode to x86-64 machine code. Each
+// instruction becomes a fixed template: the value stack stays where the
+// interpreter keeps it, with its top in a register, and anything beyond
+// numbers, locals, globals, jumps and calls is left to runtime helpers
+// in vm.c. A function is compiled after JIT_THRESHOLD calls and loop
+// iterations, and only if every instruction in it has a template, so
+// code with classes, properties, closures or collections keeps running
+// in the interpreter.
+//
+// Compiled code can start at any instruction, so a frame the interpreter
+// is already running moves over at its next loop or call.
+
+#define JIT_THRESHOLD 1000
+
+typedef struct JitCode JitCode;
+
+// Returns false when the function can't be compiled, on other machines
+// than x86-64 Linux too. It is never tried again.
+bool compileJit(ObjFunction* function);
+// Runs the frame from its ip until it returns.
+InterpretResult runJit(VM* vm, CallFrame* frame);
+void freeJit(ObjFunction* function);
+
+// The runtime helpers compiled code calls. The ones that return bool
+// return false after reporting a runtime error.
+bool jitGetGlobal(VM* vm, ObjString* name);
+bool jitSetGlobal(VM* vm, ObjString* name);
+void jitDefineGlobal(VM* vm, ObjString* name);
+bool jitAdd(VM* vm);
+void jitError(VM* vm, const char* message);
+void jitPrint(VM* vm);
+void jitCloseUpvalue(VM* vm);
+bool jitCall(VM* vm, int argCount);
+void jitReturn(VM* vm, CallFrame* frame);
+
+#endif
@@ -0,0 +1,176 @@
+#include <math.h>
+#include <string.h>
+
+#include "kernel.h"
+
+// The kernels work on a vector of doubles at a time when the compiler
+// targets AVX or SSE2, and fall back to plain loops otherwise or when
+// KERNEL_NO_SIMD is defined. Sums are accumulated in several lanes, so
+// they can round differently from adding the elements in order. The
+// minimum and maximum are NaN when any element is, like a sum, whichever
+// loop sees the NaN.
+#if defined(__AVX__) && !defined(KERNEL_NO_SIMD)
+#include <immintrin.h>
+#define LANES 4
+typedef __m256d Vector;
+#define LOAD(p)          _mm256_loadu_pd(p)
+#define STORE(p, v)      _mm256_storeu_pd(p, v)
+#define SPLAT(x)         _mm256_set1_pd(x)
+#define ADD(a, b)        _mm256_add_pd(a, b)
+#define MUL(a, b)        _mm256_mul_pd(a, b)
+#define MIN(a, b)        _mm256_min_pd(a, b)
+#define MAX(a, b)        _mm256_max_pd(a, b)
+#define OR(a, b)         _mm256_or_pd(a, b)
+#define IS_NAN(v)        _mm256_cmp_pd(v, v, _CMP_UNORD_Q)
+#define ANY(v)           (_mm256_movemask_pd(v) != 0)
+#elif defined(__SSE2__) && !defined(KERNEL_NO_SIMD)
+#include <emmintrin.h>
+#define LANES 2
+typedef __m128d Vector;
+#define LOAD(p)          _mm_loadu_pd(p)
+#define STORE(p, v)      _mm_storeu_pd(p, v)
+#define SPLAT(x)         _mm_set1_pd(x)
+#define ADD(a, b)        _mm_add_pd(a, b)
+#define MUL(a, b)        _mm_mul_pd(a, b)
+#define MIN(a, b)        _mm_min_pd(a, b)
+#define MAX(a, b)        _mm_max_pd(a, b)
+#define OR(a, b)         _mm_or_pd(a, b)
+#define IS_NAN(v)        _mm_cmpunord_pd(v, v)
+#define ANY(v)           (_mm_movemask_pd(v) != 0)
+#endif
+
+#ifdef LANES
+static double reduceSum(Vector v) {
+  double lanes[LANES];
+  STORE(lanes, v);
+  double result = 0;
+  for (int i = 0; i < LANES; i++) result += lanes[i];
+  return result;
+}
+#endif
+
+double sumNumbers(const double* a, int count) {
+  int i = 0;
+  double result = 0;
+#ifdef LANES
+  // Two accumulators keep the adds from waiting on each other.
+  Vector first = SPLAT(0);
+  Vector second = SPLAT(0);
+  for (; i + 2 * LANES <= count; i += 2 * LANES) {
+    first = ADD(first, LOAD(a + i));
+    second = ADD(second, LOAD(a + i + LANES));
+  }
+  result = reduceSum(ADD(first, second));
+#endif
+  for (; i < count; i++) result += a[i];
+  return result;
+}
+
+double dotNumbers(const double* a, const double* b, int count) {
+  int i = 0;
+  double result = 0;
+#ifdef LANES
+  Vector first = SPLAT(0);
+  Vector second = SPLAT(0);
+  for (; i + 2 * LANES <= count; i += 2 * LANES) {
+    first = ADD(first, MUL(LOAD(a + i), LOAD(b + i)));
+    second = ADD(second, MUL(LOAD(a + i + LANES), LOAD(b + i + LANES)));
+  }
+  result = reduceSum(ADD(first, second));
+#endif
+  for (; i < count; i++) result += a[i] * b[i];
+  return result;
+}
+
+// Callers make sure count is at least one.
+double minNumbers(const double* a, int count) {
+  int i = 0;
+  double result = a[0];
+#ifdef LANES
+  if (count >= LANES) {
+    // MIN() keeps whichever operand comes second when one is NaN, so
+    // the NaNs are looked for separately.
+    Vector smallest = LOAD(a);
+    Vector nans = IS_NAN(smallest);
+    for (i = LANES; i + LANES <= count; i += LANES) {
+      Vector next = LOAD(a + i);
+      smallest = MIN(smallest, next);
+      nans = OR(nans, IS_NAN(next));
+    }
+    if (ANY(nans)) return NAN;
+
+    double lanes[LANES];
+    STORE(lanes, smallest);
+    for (int lane = 0; lane < LANES; lane++) {
+      if (lanes[lane] < result) result = lanes[lane];
+    }
+  }
+#endif
+  // Once the result is NaN no comparison replaces it.
+  for (; i < count; i++) {
+    if (a[i] < result || isnan(a[i])) result = a[i];
+  }
+  return result;
+}
+
+double maxNumbers(const double* a, int count) {
+  int i = 0;
+  double result = a[0];
+#ifdef LANES
+  if (count >= LANES) {
+    Vector largest = LOAD(a);
+    Vector nans = IS_NAN(largest);
+    for (i = LANES; i + LANES <= count; i += LANES) {
+      Vector next = LOAD(a + i);
+      largest = MAX(largest, next);
+      nans = OR(nans, IS_NAN(next));
+    }
+    if (ANY(nans)) return NAN;
+
+    double lanes[LANES];
+    STORE(lanes, largest);
+    for (int lane = 0; lane < LANES; lane++) {
+      if (lanes[lane] > result) result = lanes[lane];
+    }
+  }
+#endif
+  for (; i < count; i++) {
+    if (a[i] > result || isnan(a[i])) result = a[i];
+  }
+  return result;
+}
+
+void scaleNumbers(double* a, int count, double factor) {
+  int i = 0;
+#ifdef LANES
+  Vector factors = SPLAT(factor);
+  for (; i + LANES <= count; i += LANES) {
+    STORE(a + i, MUL(LOAD(a + i), factors));
+  }
+#endif
+  for (; i < count; i++) a[i] *= factor;
+}
+
+void addNumbers(double* a, const double* b, int count) {
+  int i = 0;
+#ifdef LANES
+  for (; i + LANES <= count; i += LANES) {
+    STORE(a + i, ADD(LOAD(a + i), LOAD(b + i)));
+  }
+#endif
+  for (; i < count; i++) a[i] += b[i];
+}
+
+void fillNumbers(double* a, int count, double value) {
+  int i = 0;
+#ifdef LANES
+  Vector values = SPLAT(value);
+  for (; i + LANES <= count; i += LANES) STORE(a + i, values);
+#endif
+  for (; i < count; i++) a[i] = value;
+}
+
+void copyNumbers(double* a, const double* b, int count) {
+  // The C library's copy is already vectorized.
+  memmove(a, b, sizeof(double) * count);
+}
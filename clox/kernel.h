@@ -0,0 +1,19 @@
+#ifndef clox_kernel_h
+#define clox_kernel_h
+
+#include "common.h"
+
+// Loops over the elements of packed arrays, for the natives that let
+// scripts work on whole arrays without going through the interpreter
+// loop for every element.
+
+double sumNumbers(const double* a, int count);
+double dotNumbers(const double* a, const double* b, int count);
+double minNumbers(const double* a, int count);
+double maxNumbers(const double* a, int count);
+void scaleNumbers(double* a, int count, double factor);
+void addNumbers(double* a, const double* b, int count);
+void fillNumbers(double* a, int count, double value);
+void copyNumbers(double* a, const double* b, int count);
+
+#endif
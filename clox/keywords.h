@@ -0,0 +1,42 @@
+// Generated by keywords.py. Do not edit.
+#ifndef clox_keywords_h
+#define clox_keywords_h
+
+#include "scanner.h"
+
+typedef struct {
+  const char* name;
+  int length;
+  TokenType type;
+} Keyword;
+
+#define KEYWORD_TABLE_SIZE 64
+#define KEYWORD_HASH(length, first, last) \
+    (((length) + (unsigned char)(first) * 3u + \
+      (unsigned char)(last) * 37u) & (KEYWORD_TABLE_SIZE - 1))
+
+static const Keyword keywords[KEYWORD_TABLE_SIZE] = {
+  [2] = {"return", 6, TOKEN_RETURN},
+  [3] = {"while", 5, TOKEN_WHILE},
+  [6] = {"case", 4, TOKEN_CASE},
+  [9] = {"or", 2, TOKEN_OR},
+  [10] = {"continue", 8, TOKEN_CONTINUE},
+  [12] = {"else", 4, TOKEN_ELSE},
+  [13] = {"class", 5, TOKEN_CLASS},
+  [16] = {"false", 5, TOKEN_FALSE},
+  [24] = {"super", 5, TOKEN_SUPER},
+  [25] = {"print", 5, TOKEN_PRINT},
+  [26] = {"and", 3, TOKEN_AND},
+  [27] = {"fun", 3, TOKEN_FUN},
+  [31] = {"var", 3, TOKEN_VAR},
+  [34] = {"break", 5, TOKEN_BREAK},
+  [39] = {"switch", 6, TOKEN_SWITCH},
+  [41] = {"nil", 3, TOKEN_NIL},
+  [47] = {"for", 3, TOKEN_FOR},
+  [55] = {"default", 7, TOKEN_DEFAULT},
+  [57] = {"true", 4, TOKEN_TRUE},
+  [59] = {"if", 2, TOKEN_IF},
+  [63] = {"this", 4, TOKEN_THIS},
+};
+
+#endif
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""Generates keywords.h, the perfect hash table scanner.c uses to tell
+keywords from identifiers.
+
+A keyword is hashed from its length and its first and last characters
+only, so an identifier is classified with one table lookup and at most
+one memcmp no matter how many keywords there are. To add a keyword, add
+it to KEYWORDS and run `make keywords`.
+"""
+
+import sys
+
+KEYWORDS = [
+    ("and", "TOKEN_AND"),
+    ("break", "TOKEN_BREAK"),
+    ("case", "TOKEN_CASE"),
+    ("class", "TOKEN_CLASS"),
+    ("continue", "TOKEN_CONTINUE"),
+    ("default", "TOKEN_DEFAULT"),
+    ("else", "TOKEN_ELSE"),
+    ("false", "TOKEN_FALSE"),
+    ("for", "TOKEN_FOR"),
+    ("fun", "TOKEN_FUN"),
+    ("if", "TOKEN_IF"),
+    ("nil", "TOKEN_NIL"),
+    ("or", "TOKEN_OR"),
+    ("print", "TOKEN_PRINT"),
+    ("return", "TOKEN_RETURN"),
+    ("super", "TOKEN_SUPER"),
+    ("switch", "TOKEN_SWITCH"),
+    ("this", "TOKEN_THIS"),
+    ("true", "TOKEN_TRUE"),
+    ("var", "TOKEN_VAR"),
+    ("while", "TOKEN_WHILE"),
+]
+
+TABLE_SIZE = 64
+
+
+def keyword_hash(length, first, last, a, b):
+    return (length + ord(first) * a + ord(last) * b) & (TABLE_SIZE - 1)
+
+
+def find_multipliers():
+    for a in range(1, 256):
+        for b in range(1, 256):
+            slots = {keyword_hash(len(name), name[0], name[-1], a, b)
+                     for name, _ in KEYWORDS}
+            if len(slots) == len(KEYWORDS):
+                return a, b
+    sys.exit("keywords.py: no perfect hash for %d keywords in %d slots"
+             % (len(KEYWORDS), TABLE_SIZE))
+
+
+def main():
+    a, b = find_multipliers()
+    slots = sorted((keyword_hash(len(name), name[0], name[-1], a, b),
+                    name, token) for name, token in KEYWORDS)
+
+    print("// Generated by keywords.py. Do not edit.")
+    print("#ifndef clox_keywords_h")
+    print("#define clox_keywords_h")
+    print()
+    print('#include "scanner.h"')
+    print()
+    print("typedef struct {")
+    print("  const char* name;")
+    print("  int length;")
+    print("  TokenType type;")
+    print("} Keyword;")
+    print()
+    print("#define KEYWORD_TABLE_SIZE %d" % TABLE_SIZE)
+    print("#define KEYWORD_HASH(length, first, last) \\")
+    print("    (((length) + (unsigned char)(first) * %du + \\" % a)
+    print("      (unsigned char)(last) * %du) & (KEYWORD_TABLE_SIZE - 1))" % b)
+    print()
+    print("static const Keyword keywords[KEYWORD_TABLE_SIZE] = {")
+    for slot, name, token in slots:
+        print('  [%d] = {"%s", %d, %s},' % (slot, name, len(name), token))
+    print("};")
+    print()
+    print("#endif")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,28 +1,24 @@
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "allocations.h"
+#include "aot.h"
+#include "cache.h"
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "executor.h"
+#include "heap.h"
+#include "profiler.h"
+#include "stream.h"
 #include "vm.h"
 
 // #include "benchmark.h"
 
-static void repl() {
-  char line[1024];
-  for (;;) {
-    printf("> ");
-
-    if (!fgets(line, sizeof(line), stdin)) {
-      printf("\n");
-      break;
-    }
-
-    interpret(line);
-  }
-}
-
 static char* readFile(const char* path) {
   FILE* file = fopen(path, "rb");
   if (file == NULL) {
@@ -52,27 +48,185 @@ static char* readFile(const char* path) {
   return buffer;
 }
 
-static void runFile(const char* path) {
-  char* source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source); 
+static InterpretResult interpretCached(VM* vm, const char* path,
+                                       const char* source) {
+  ObjFunction* function = loadCache(vm, path, source);
+  if (function == NULL) {
+    function = compile(vm, source);
+    if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    writeCache(path, source, function);
+  }
+
+  return interpretFunction(vm, function);
+}
 
+static void exitOnError(InterpretResult result) {
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static void runFile(VM* vm, const char* path, bool useCache) {
+  char* source = readFile(path);
+  InterpretResult result = useCache ? interpretCached(vm, path, source)
+                                    : interpret(vm, source);
+  free(source); 
+
+  exitOnError(result);
+}
+
+// Without a path, or with "-", the script is read from stdin and run as
+// it arrives. A terminal gets a prompt instead.
+static void runStdin(VM* vm) {
+  exitOnError(interpretStream(vm, stdin, isatty(fileno(stdin))));
+}
+
+static void recordFailure(void* context, InterpretResult result) {
+  if (result != INTERPRET_OK) atomic_store((atomic_int*)context, result);
+}
+
+// Runs every script on a pool of workers, in no particular order.
+static void runFiles(int workerCount, const char* paths[], int count) {
+  Executor executor;
+  initExecutor(&executor, workerCount, count);
+
+  // A path given more than once is compiled once and its module shared
+  // by every run of it.
+  atomic_int failure = INTERPRET_OK;
+  Module** modules = (Module**)malloc(sizeof(Module*) * count);
+  for (int i = 0; i < count; i++) {
+    int first = 0;
+    while (strcmp(paths[first], paths[i]) != 0) first++;
+
+    if (first < i) {
+      modules[i] = modules[first];
+      if (modules[i] != NULL) retainModule(modules[i]);
+    } else {
+      char* source = readFile(paths[i]);
+      modules[i] = compileModule(source);
+      free(source);
+    }
+
+    if (modules[i] == NULL) {
+      recordFailure(&failure, INTERPRET_COMPILE_ERROR);
+      continue;
+    }
+    submitModule(&executor, modules[i], recordFailure, &failure);
+  }
+
+  freeExecutor(&executor);
+  for (int i = 0; i < count; i++) {
+    if (modules[i] != NULL) releaseModule(modules[i]);
+  }
+  free(modules);
+
+  exitOnError((InterpretResult)atomic_load(&failure));
+}
+
+static void emitC(VM* vm, const char* path, const char* outPath) {
+  char* source = readFile(path);
+  ObjFunction* function = compile(vm, source);
+  if (function == NULL) exit(65);
+
+  if (!writeAot(function, source, outPath)) {
+    fprintf(stderr, "Could not write C file \"%s\".\n", outPath);
+    exit(74);
+  }
+  free(source);
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: clox [--cache] [--jit] [--trace] [--heap <image>] "
+                  "[--write-heap <image>]\n"
+                  "            [--profile <out> [--profile-rate <hz>]] "
+                  "[--alloc-profile <out>] [path | -]\n"
+                  "       clox --emit-c <out.c> path\n"
+                  "       clox --workers <count> path...\n");
+  exit(64);
+}
+
 int main(int argc, const char* argv[]) {
-  initVM();
+  bool useCache = false;
+  bool useJit = false;
+  bool useTraces = false;
+  const char* path = NULL;
+  const char* heapPath = NULL;
+  const char* writeHeapPath = NULL;
+  const char* emitPath = NULL;
+  const char* profilePath = NULL;
+  int profileRate = PROFILE_DEFAULT_RATE;
+  const char* allocationPath = NULL;
+
+  if (argc >= 4 && strcmp(argv[1], "--workers") == 0) {
+    int workerCount = atoi(argv[2]);
+    if (workerCount < 1) usage();
+    runFiles(workerCount, &argv[3], argc - 3);
+    return 0;
+  }
 
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--cache") == 0) {
+      useCache = true;
+    } else if (strcmp(argv[i], "--jit") == 0) {
+      useJit = true;
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      useTraces = true;
+    } else if (strcmp(argv[i], "--heap") == 0 && i + 1 < argc) {
+      heapPath = argv[++i];
+    } else if (strcmp(argv[i], "--write-heap") == 0 && i + 1 < argc) {
+      writeHeapPath = argv[++i];
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profilePath = argv[++i];
+    } else if (strcmp(argv[i], "--profile-rate") == 0 && i + 1 < argc) {
+      profileRate = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--alloc-profile") == 0 && i + 1 < argc) {
+      allocationPath = argv[++i];
+    } else if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc) {
+      emitPath = argv[++i];
+    } else if (path == NULL) {
+      path = argv[i];
+    } else {
+      usage();
+    }
+  }
+
+  VM vm;
+  if (heapPath == NULL) {
+    initVM(&vm);
+  } else if (!initVMFromHeap(&vm, heapPath)) {
+    fprintf(stderr, "Could not load heap image \"%s\".\n", heapPath);
+    exit(74);
+  }
+  vm.jitEnabled = useJit;
+  vm.tracesEnabled = useTraces;
+
+  if (emitPath != NULL) {
+    if (path == NULL || strcmp(path, "-") == 0) usage();
+    emitC(&vm, path, emitPath);
+    return 0;
+  }
+
+  if (profilePath != NULL && !startProfiler(&vm, profilePath, profileRate)) {
+    fprintf(stderr, "Could not start the profiler.\n");
+    exit(74);
+  }
+
+  if (allocationPath != NULL && !startAllocationProfile(&vm, allocationPath)) {
+    fprintf(stderr, "Could not start the allocation profiler.\n");
+    exit(74);
+  }
+
+  if (path == NULL || strcmp(path, "-") == 0) {
+    runStdin(&vm);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    runFile(&vm, path, useCache);
+  }
+
+  if (writeHeapPath != NULL && !writeHeap(&vm, writeHeapPath)) {
+    fprintf(stderr, "Could not write heap image \"%s\".\n", writeHeapPath);
+    exit(74);
   }
 
-  freeVM();
+  if (profilePath != NULL) stopProfiler();
+  freeVM(&vm);
   return 0;
 }
@@ -1,9 +1,78 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "allocations.h"
+#include "jit.h"
+#include "trace.h"
 #include "memory.h"
 #include "vm.h"
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+// The address ranges of the mapped heap images. An empty slot has both
+// bounds zero. A range is published start first and retracted end first,
+// so a reader racing with either sees it whole or empty. Slots from
+// mappedSlots on have never been used.
+#define MAPPED_MAX 64
+
+static atomic_uintptr_t mappedStarts[MAPPED_MAX];
+static atomic_uintptr_t mappedEnds[MAPPED_MAX];
+static atomic_int mappedSlots;
+static pthread_mutex_t mappedLock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool isMapped(void* pointer) {
+  uintptr_t address = (uintptr_t)pointer;
+  int slots = atomic_load(&mappedSlots);
+  for (int i = 0; i < slots; i++) {
+    if (address >= atomic_load(&mappedStarts[i]) &&
+        address < atomic_load(&mappedEnds[i])) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool addMappedMemory(void* start, size_t size) {
+  pthread_mutex_lock(&mappedLock);
+  int slot = 0;
+  while (slot < MAPPED_MAX && atomic_load(&mappedEnds[slot]) != 0) slot++;
+  if (slot < MAPPED_MAX) {
+    atomic_store(&mappedStarts[slot], (uintptr_t)start);
+    atomic_store(&mappedEnds[slot], (uintptr_t)start + size);
+    if (slot == atomic_load(&mappedSlots)) atomic_store(&mappedSlots, slot + 1);
+  }
+  pthread_mutex_unlock(&mappedLock);
+  return slot < MAPPED_MAX;
+}
+
+void removeMappedMemory(void* start) {
+  pthread_mutex_lock(&mappedLock);
+  for (int i = 0; i < MAPPED_MAX; i++) {
+    if (atomic_load(&mappedStarts[i]) == (uintptr_t)start &&
+        atomic_load(&mappedEnds[i]) != 0) {
+      atomic_store(&mappedEnds[i], 0);
+      atomic_store(&mappedStarts[i], 0);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mappedLock);
+}
+
+static void* resize(void* pointer, size_t oldSize, size_t newSize) {
+  if (pointer != NULL &&
+      atomic_load_explicit(&mappedSlots, memory_order_relaxed) > 0 &&
+      isMapped(pointer)) {
+    // Mapped memory goes away with its image, so it is copied out
+    // instead of being resized, and never freed.
+    if (newSize == 0) return NULL;
+
+    void* result = malloc(newSize);
+    if (result == NULL) exit(1);
+    memcpy(result, pointer, oldSize < newSize ? oldSize : newSize);
+    return result;
+  }
+
   if (newSize == 0) {
     free(pointer);
     return NULL;
@@ -14,8 +83,42 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+  if (newSize > oldSize && allocatingVM != NULL) {
+    recordGrowth(newSize - oldSize);
+  }
+  return resize(pointer, oldSize, newSize);
+}
+
+void* allocateObjectMemory(size_t size) {
+  return resize(NULL, 0, size);
+}
+
 static void freeObject(Obj* object) {
+  if (allocatingVM != NULL) recordFree(allocatingVM, object);
+
   switch (object->type) {
+    case OBJ_ARRAY: {
+      ObjArray* array = (ObjArray*)object;
+      if (array->packed) {
+        FREE_ARRAY(double, array->as.numbers, array->capacity);
+      } else {
+        FREE_ARRAY(Value, array->as.values, array->capacity);
+      }
+      FREE(ObjArray, object);
+      break;
+    }
+
+    case OBJ_BOUND_METHOD:
+      FREE(ObjBoundMethod, object);
+      break;
+
+    case OBJ_CLASS: {
+      ObjClass* klass = (ObjClass*)object;
+      freeTable(&klass->methods);
+      FREE(ObjClass, object);
+      break;
+    }
 
     case OBJ_CLOSURE: {
       ObjClosure* closure = (ObjClosure*)object;
@@ -27,14 +130,41 @@ static void freeObject(Obj* object) {
     case OBJ_FUNCTION: {
       ObjFunction* function = (ObjFunction*)object;
       freeChunk(&function->chunk);
+      freeJit(function);
+      freeTraces(function);
       FREE(ObjFunction, object);
       break;
     }
 
+    case OBJ_INSTANCE: {
+      ObjInstance* instance = (ObjInstance*)object;
+      if (instance->fields != instance->inlineFields) {
+        FREE_ARRAY(Value, instance->fields, instance->capacity);
+      }
+      reallocate(object, sizeof(ObjInstance) +
+                         sizeof(Value) * instance->inlineCapacity, 0);
+      break;
+    }
+
+    case OBJ_MAP: {
+      ObjMap* map = (ObjMap*)object;
+      freeTable(&map->table);
+      FREE(ObjMap, object);
+      break;
+    }
+
     case OBJ_NATIVE:
       FREE(ObjNative, object);
       break;
 
+    case OBJ_SHAPE: {
+      ObjShape* shape = (ObjShape*)object;
+      freeTable(&shape->transitions);
+      freeTable(&shape->slots);
+      FREE(ObjShape, object);
+      break;
+    }
+
     case OBJ_STRING: {
       ObjString* string = (ObjString*)object;
       reallocate(object, sizeof(ObjString) + string->length + 1, 0);
@@ -47,9 +177,9 @@ static void freeObject(Obj* object) {
   }
 }
 
-void freeObjects() {
-  Obj* object = vm.objects;
-  while (object != NULL) {
+void freeObjects(Obj* objects, Obj* last) {
+  Obj* object = objects;
+  while (object != last) {
     Obj* next = object->next;
     freeObject(object);
     object = next;
@@ -20,6 +20,17 @@
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void freeObjects();
+// Like reallocate() from NULL, but left to the allocation profiler to
+// count by the object's type.
+void* allocateObjectMemory(size_t size);
+// Objects and arrays inside a mapped heap image are passed to
+// reallocate() like any others, which copies them out when they grow and
+// leaves them alone when they are freed. The range has to be added while
+// the image is mapped. Returns false when too many images are mapped.
+bool addMappedMemory(void* start, size_t size);
+void removeMappedMemory(void* start);
+// Frees the objects of a list that come before last, or all of them
+// when last is NULL.
+void freeObjects(Obj* objects, Obj* last);
 
 #endif
\ No newline at end of file
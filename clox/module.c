@@ -0,0 +1,51 @@
+#include "compiler.h"
+#include "memory.h"
+#include "module.h"
+
+Module* compileModule(const char* source) {
+  // The module takes over what compiling allocates in this VM, so the
+  // VM's own objects and strings become part of it too.
+  VM* vm = ALLOCATE(VM, 1);
+  initVM(vm);
+
+  ObjFunction* script = compile(vm, source);
+  if (script == NULL) {
+    freeVM(vm);
+    FREE(VM, vm);
+    return NULL;
+  }
+
+  Module* module = ALLOCATE(Module, 1);
+  atomic_init(&module->references, 1);
+  module->script = script;
+  module->strings = vm->strings;
+  module->objects = vm->objects;
+  module->cacheCount = 0;
+  initTable(&vm->strings);
+  vm->objects = NULL;
+  freeVM(vm);
+  FREE(VM, vm);
+
+  for (Obj* object = module->objects; object != NULL; object = object->next) {
+    if (object->type != OBJ_FUNCTION) continue;
+
+    ObjFunction* function = (ObjFunction*)object;
+    function->frozen = true;
+    function->cacheStart = module->cacheCount;
+    module->cacheCount += function->chunk.cacheCount;
+  }
+
+  return module;
+}
+
+void retainModule(Module* module) {
+  atomic_fetch_add(&module->references, 1);
+}
+
+void releaseModule(Module* module) {
+  if (atomic_fetch_sub(&module->references, 1) != 1) return;
+
+  freeObjects(module->objects, NULL);
+  freeTable(&module->strings);
+  FREE(Module, module);
+}
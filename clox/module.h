@@ -0,0 +1,34 @@
+#ifndef clox_module_h
+#define clox_module_h
+
+#include <stdatomic.h>
+
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+// A script compiled once and run by any number of VMs, on any threads,
+// at the same time. Its functions and strings are frozen: no VM writes
+// to them, so they are shared without copying or locking. Each VM that
+// runs the module keeps its own inline caches for the module's code and
+// interns its strings against the module's, so equal strings are still
+// the same object.
+struct Module {
+  atomic_int references;
+  ObjFunction* script;
+  Table strings;
+  // Every object the compiler allocated for the module.
+  Obj* objects;
+  // The inline caches of all its functions.
+  int cacheCount;
+};
+
+// Returns NULL after reporting compile errors. The caller holds the one
+// reference to the new module.
+Module* compileModule(const char* source);
+void retainModule(Module* module);
+// Frees the module when this was the last reference.
+void releaseModule(Module* module);
+
+#endif
@@ -1,7 +1,9 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "allocations.h"
 #include "memory.h"
+#include "module.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -9,15 +11,105 @@
 
 
 #define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+// Every object is linked into the list of the VM that allocated it, which
+// frees them all at once.
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+  Obj* object = (Obj*)allocateObjectMemory(size);
   object->type = type;
+  object->next = vm->objects;
+  vm->objects = object;
+  if (vm->allocations != NULL) recordAllocation(vm, object, size);
   return object;
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
+ObjArray* newArray(VM* vm) {
+  ObjArray* array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
+  array->packed = true;
+  array->count = 0;
+  array->capacity = 0;
+  array->as.numbers = NULL;
+  return array;
+}
+
+static void unpackArray(ObjArray* array) {
+  Value* values = ALLOCATE(Value, array->capacity);
+  for (int i = 0; i < array->count; i++) {
+    values[i] = NUMBER_VAL(array->as.numbers[i]);
+  }
+
+  FREE_ARRAY(double, array->as.numbers, array->capacity);
+  array->as.values = values;
+  array->packed = false;
+}
+
+// Packs an unpacked array again if it only holds numbers. Returns
+// whether the array is packed.
+bool packArray(ObjArray* array) {
+  if (array->packed) return true;
+
+  for (int i = 0; i < array->count; i++) {
+    if (!IS_NUMBER(array->as.values[i])) return false;
+  }
+
+  double* numbers = ALLOCATE(double, array->capacity);
+  for (int i = 0; i < array->count; i++) {
+    numbers[i] = AS_NUMBER(array->as.values[i]);
+  }
+
+  FREE_ARRAY(Value, array->as.values, array->capacity);
+  array->as.numbers = numbers;
+  array->packed = true;
+  return true;
+}
+
+void appendArray(ObjArray* array, Value value) {
+  if (array->capacity < array->count + 1) {
+    int oldCapacity = array->capacity;
+    array->capacity = GROW_CAPACITY(oldCapacity);
+    if (array->packed) {
+      array->as.numbers = GROW_ARRAY(double, array->as.numbers,
+                                     oldCapacity, array->capacity);
+    } else {
+      array->as.values = GROW_ARRAY(Value, array->as.values,
+                                    oldCapacity, array->capacity);
+    }
+  }
+
+  setArrayElement(array, array->count++, value);
+}
+
+void setArrayElement(ObjArray* array, int index, Value value) {
+  if (array->packed) {
+    if (IS_NUMBER(value)) {
+      array->as.numbers[index] = AS_NUMBER(value);
+      return;
+    }
+    unpackArray(array);
+  }
+
+  array->as.values[index] = value;
+}
+
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver,
+                               ObjClosure* method) {
+  ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+  bound->receiver = receiver;
+  bound->method = method;
+  return bound;
+}
+
+ObjClass* newClass(VM* vm, ObjString* name) {
+  ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+  klass->name = name;
+  klass->initializer = NIL_VAL;
+  initTable(&klass->methods);
+  klass->fieldCapacity = 0;
+  return klass;
+}
+
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
   ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*,
                                    function->upvalueCount);
   for (int i = 0; i < function->upvalueCount; i++) {
@@ -28,25 +120,146 @@ ObjClosure* newClosure(ObjFunction* function) {
   closure->function = function;
   closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
+  closure->caches = function->frozen
+      ? vm->moduleCaches + function->cacheStart
+      : function->chunk.caches;
   return closure;
 }
 
-ObjFunction* newFunction() {
+ObjFunction* newFunction(VM* vm) {
   ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
 
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
   function->name = NULL;
+  function->frozen = false;
+  function->cacheStart = 0;
+  function->jit = NULL;
+  function->hotness = 0;
+  function->aot = NULL;
+  function->traces = NULL;
   initChunk(&function->chunk);
   return function;
 }
 
-ObjNative* newNative(NativeFn function) {
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+  int capacity = klass->fieldCapacity;
+  ObjInstance* instance = (ObjInstance*)allocateObject(vm,
+      sizeof(ObjInstance) + sizeof(Value) * capacity, OBJ_INSTANCE);
+  instance->klass = klass;
+  instance->shape = vm->rootShape;
+  instance->fields = instance->inlineFields;
+  instance->capacity = capacity;
+  instance->inlineCapacity = capacity;
+  return instance;
+}
+
+ObjMap* newMap(VM* vm) {
+  ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+  map->count = 0;
+  initTable(&map->table);
+  return map;
+}
+
+void mapSet(ObjMap* map, Value key, Value value) {
+  if (tableSetValue(&map->table, key, value)) map->count++;
+}
+
+bool mapDelete(ObjMap* map, Value key) {
+  if (!tableDeleteValue(&map->table, key)) return false;
+
+  map->count--;
+  return true;
+}
+
+ObjNative* newNative(VM* vm, NativeFn function, int arity) {
   ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
   native->function = function;
+  native->arity = arity;
   return native;
 }
 
+ObjShape* newShape(VM* vm, ObjShape* parent, ObjString* name) {
+  ObjShape* shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->parent = parent;
+  shape->name = name;
+  shape->fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  initTable(&shape->transitions);
+  initTable(&shape->slots);
+  return shape;
+}
+
+// Shapes with at most this many fields are searched by walking up their
+// parents, larger ones through their slots table.
+#define SHAPE_WALK_MAX 8
+
+int shapeSlot(ObjShape* shape, ObjString* name) {
+  if (shape->fieldCount <= SHAPE_WALK_MAX) {
+    for (; shape->parent != NULL; shape = shape->parent) {
+      if (shape->name == name) return shape->fieldCount - 1;
+    }
+    return -1;
+  }
+
+  if (shape->slots.count == 0) {
+    for (ObjShape* field = shape; field->parent != NULL; field = field->parent) {
+      tableSet(&shape->slots, field->name, NUMBER_VAL(field->fieldCount - 1));
+    }
+  }
+
+  Value slot;
+  if (!tableGet(&shape->slots, name, &slot)) return -1;
+  return (int)AS_NUMBER(slot);
+}
+
+#undef SHAPE_WALK_MAX
+
+// Moves the instance to shape, a child of its current shape, storing
+// value in the new field.
+void addField(ObjInstance* instance, ObjShape* shape, Value value) {
+  int slot = instance->shape->fieldCount;
+  if (slot == instance->capacity) {
+    int capacity = GROW_CAPACITY(instance->capacity);
+    if (instance->fields == instance->inlineFields) {
+      instance->fields = ALLOCATE(Value, capacity);
+      memcpy(instance->fields, instance->inlineFields,
+             sizeof(Value) * instance->inlineCapacity);
+    } else {
+      instance->fields = GROW_ARRAY(Value, instance->fields,
+                                    instance->capacity, capacity);
+    }
+    instance->capacity = capacity;
+  }
+
+  instance->fields[slot] = value;
+  instance->shape = shape;
+
+  if (instance->klass->fieldCapacity < shape->fieldCount) {
+    instance->klass->fieldCapacity = shape->fieldCount;
+  }
+}
+
+// Returns the shape the instance had to move to, or NULL if it already
+// had the field.
+ObjShape* setField(VM* vm, ObjInstance* instance, ObjString* name,
+                   Value value) {
+  int slot = shapeSlot(instance->shape, name);
+  if (slot != -1) {
+    instance->fields[slot] = value;
+    return NULL;
+  }
+
+  Value next;
+  if (!tableGet(&instance->shape->transitions, name, &next)) {
+    next = OBJ_VAL(newShape(vm, instance->shape, name));
+    tableSet(&instance->shape->transitions, name, next);
+  }
+
+  addField(instance, AS_SHAPE(next), value);
+  return AS_SHAPE(next);
+}
+
 // implements hash algorithm FNV-1a
 uint32_t hashString(const char* key, int length) {
   uint32_t hash = 2166136261u;
@@ -59,30 +272,63 @@ uint32_t hashString(const char* key, int length) {
   return hash;
 }
 
-ObjString* makeString(int length) {
-  ObjString* string = 
-    (ObjString*)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
+ObjString* makeString(VM* vm, int length) {
+  ObjString* string = (ObjString*)allocateObject(
+      vm, sizeof(ObjString) + length + 1, OBJ_STRING);
   string->length = length;
   return string;
 }
 
-ObjString* copyString(const char* chars, int length) {
+// Returns the interned string equal to one just made by makeString(),
+// which is freed if there already is one, or interns it.
+ObjString* internString(VM* vm, ObjString* string) {
+  uint32_t hash = hashString(string->chars, string->length);
+
+  ObjString* interned = NULL;
+  if (vm->module != NULL) {
+    interned = tableFindString(&vm->module->strings, string->chars,
+                               string->length, hash);
+  }
+  if (interned == NULL) {
+    interned = tableFindString(&vm->strings, string->chars, string->length,
+                               hash);
+  }
+  if (interned != NULL) {
+    // Nothing was allocated since, so it is still first in the list.
+    vm->objects = string->obj.next;
+    if (vm->allocations != NULL) recordFree(vm, &string->obj);
+    reallocate(string, sizeof(ObjString) + string->length + 1, 0);
+    return interned;
+  }
+
+  string->hash = hash;
+  tableSet(&vm->strings, string, NIL_VAL);
+  return string;
+}
+
+ObjString* copyString(VM* vm, const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
 
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString* interned;
+  if (vm->module != NULL) {
+    interned = tableFindString(&vm->module->strings, chars, length, hash);
+    if (interned != NULL) return interned;
+  }
+
+  interned = tableFindString(&vm->strings, chars, length, hash);
   if (interned != NULL) return interned;
 
-  ObjString* string = makeString(length);
+  ObjString* string = makeString(vm, length);
   memcpy(string->chars, chars, length);
   string->chars[length] = '\0';
   string->hash = hash;
 
-  tableSet(&vm.strings, string, NIL_VAL);
+  tableSet(&vm->strings, string, NIL_VAL);
 
   return string;
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
   ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
   upvalue->location = slot;
@@ -98,17 +344,60 @@ static void printFunction(ObjFunction* function) {
   printf("<fn %s>", function->name->chars);
 }
 
+static void printArray(ObjArray* array) {
+  printf("[");
+  for (int i = 0; i < array->count; i++) {
+    if (i > 0) printf(", ");
+    printValue(arrayElement(array, i));
+  }
+  printf("]");
+}
+
+static void printMap(ObjMap* map) {
+  printf("{");
+  bool first = true;
+  for (int i = 0; i < map->table.capacity; i++) {
+    Entry* entry = &map->table.entries[i];
+    if (IS_NIL(entry->key)) continue;
+
+    if (!first) printf(", ");
+    first = false;
+    printValue(entry->key);
+    printf(": ");
+    printValue(entry->value);
+  }
+  printf("}");
+}
+
 void printObject(Value value) {
   switch (OBJ_TYPE(value)) {
+    case OBJ_ARRAY:
+      printArray(AS_ARRAY(value));
+      break;
+    case OBJ_BOUND_METHOD:
+      printFunction(AS_BOUND_METHOD(value)->method->function);
+      break;
+    case OBJ_CLASS:
+      printf("%s", AS_CLASS(value)->name->chars);
+      break;
     case OBJ_CLOSURE:
       printFunction(AS_CLOSURE(value)->function);
       break;
     case OBJ_FUNCTION:
       printFunction(AS_FUNCTION(value));
       break;
+    case OBJ_INSTANCE:
+      printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+      break;
+    case OBJ_MAP:
+      printMap(AS_MAP(value));
+      break;
     case OBJ_NATIVE:
       printf("<native fn>");
       break;
+    case OBJ_SHAPE:
+      printf("shape");
+      break;
     case OBJ_STRING:
       printf("%s", AS_CSTRING(value));
       break;
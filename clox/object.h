@@ -3,25 +3,43 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "table.h"
 #include "value.h"
 
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
 
+#define IS_ARRAY(value)        isObjType(value, OBJ_ARRAY)
+#define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+#define IS_CLASS(value)        isObjType(value, OBJ_CLASS)
 #define IS_CLOSURE(value)      isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
+#define IS_INSTANCE(value)     isObjType(value, OBJ_INSTANCE)
+#define IS_MAP(value)          isObjType(value, OBJ_MAP)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
 
+#define AS_ARRAY(value)        ((ObjArray*)AS_OBJ(value))
+#define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+#define AS_CLASS(value)        ((ObjClass*)AS_OBJ(value))
 #define AS_CLOSURE(value)      ((ObjClosure*)AS_OBJ(value))
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
-#define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
+#define AS_INSTANCE(value)     ((ObjInstance*)AS_OBJ(value))
+#define AS_MAP(value)          ((ObjMap*)AS_OBJ(value))
+#define AS_NATIVE(value)       ((ObjNative*)AS_OBJ(value))
+#define AS_SHAPE(value)        ((ObjShape*)AS_OBJ(value))
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
 
 typedef enum {
+  OBJ_ARRAY,
+  OBJ_BOUND_METHOD,
+  OBJ_CLASS,
   OBJ_CLOSURE,
   OBJ_FUNCTION,
+  OBJ_INSTANCE,
+  OBJ_MAP,
   OBJ_NATIVE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE
 } ObjType;
@@ -31,19 +49,42 @@ struct Obj {
   struct Obj* next;  
 };
 
+// Defined in vm.h, which depends on the objects here.
+typedef struct VM VM;
+
+// Runs a function compiled ahead of time to C in the top frame, until
+// it returns. Returns false after reporting a runtime error. See aot.h.
+typedef bool (*AotFn)(VM* vm);
+
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  int maxSlots;
   Chunk chunk;
   ObjString* name;
+  // A frozen function belongs to a module that VMs share. Its code is
+  // never rewritten, and each VM keeps the inline caches for it in its
+  // own array, from cacheStart on.
+  bool frozen;
+  int cacheStart;
+  // The function's machine code, once it is hot enough to compile. A
+  // hotness of -1 means it can't be compiled.
+  struct JitCode* jit;
+  int hotness;
+  AotFn aot;
+  // The traces of the function's loops. See trace.h.
+  struct Trace* traces;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+// Natives store their result in args[-1], the callee's slot, and return
+// false after reporting a runtime error.
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args);
 
 typedef struct {
   Obj obj;
   NativeFn function;
+  int arity;
 } ObjNative;
 
 struct ObjString {
@@ -65,14 +106,98 @@ typedef struct {
   ObjFunction* function;
   ObjUpvalue** upvalues;
   int upvalueCount;
+  InlineCache* caches;
 } ObjClosure;
 
-ObjClosure* newClosure(ObjFunction* function);
-ObjFunction* newFunction();
-ObjNative* newNative(NativeFn function);
-ObjString* makeString(int length);
-ObjString* copyString(const char* chars, int length);
-ObjUpvalue* newUpvalue(Value* slot);
+// A shape is the field layout shared by all instances that had the same
+// fields added in the same order. Each shape adds one field to its
+// parent, stored in the next slot. Adding a field to an instance moves it
+// to the child shape for that name, which is created the first time.
+struct ObjShape {
+  Obj obj;
+  ObjShape* parent;
+  ObjString* name;
+  int fieldCount;
+  Table transitions;
+  // Maps names to slots, for shapes too large to search by walking the
+  // parents. Built the first time it is needed.
+  Table slots;
+};
+
+struct ObjClass {
+  Obj obj;
+  ObjString* name;
+  Value initializer;
+  Table methods;
+  // The most fields an instance of the class has had, used to size the
+  // inline field storage of new instances.
+  int fieldCapacity;
+};
+
+typedef struct {
+  Obj obj;
+  ObjClass* klass;
+  ObjShape* shape;
+  // Points at inlineFields until the instance outgrows them.
+  Value* fields;
+  int capacity;
+  int inlineCapacity;
+  Value inlineFields[];
+} ObjInstance;
+
+typedef struct {
+  Obj obj;
+  Value receiver;
+  ObjClosure* method;
+} ObjBoundMethod;
+
+// Arrays start out packed, holding their elements as unboxed doubles,
+// and switch to boxed Values for good the first time anything other
+// than a number is stored in them.
+typedef struct {
+  Obj obj;
+  bool packed;
+  int count;
+  int capacity;
+  union {
+    double* numbers;
+    Value* values;
+  } as;
+} ObjArray;
+
+// The table counts tombstones too, so the map keeps its own count of
+// the keys it holds.
+typedef struct {
+  Obj obj;
+  int count;
+  Table table;
+} ObjMap;
+
+ObjArray* newArray(VM* vm);
+void appendArray(ObjArray* array, Value value);
+bool packArray(ObjArray* array);
+void setArrayElement(ObjArray* array, int index, Value value);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver,
+                               ObjClosure* method);
+ObjClass* newClass(VM* vm, ObjString* name);
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+ObjFunction* newFunction(VM* vm);
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
+ObjMap* newMap(VM* vm);
+void mapSet(ObjMap* map, Value key, Value value);
+bool mapDelete(ObjMap* map, Value key);
+ObjNative* newNative(VM* vm, NativeFn function, int arity);
+ObjShape* newShape(VM* vm, ObjShape* parent, ObjString* name);
+int shapeSlot(ObjShape* shape, ObjString* name);
+void addField(ObjInstance* instance, ObjShape* shape, Value value);
+ObjShape* setField(VM* vm, ObjInstance* instance, ObjString* name,
+                   Value value);
+// Allocates a string with room for length characters, which the caller
+// fills in and then passes to internString().
+ObjString* makeString(VM* vm, int length);
+ObjString* internString(VM* vm, ObjString* string);
+ObjString* copyString(VM* vm, const char* chars, int length);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
 void printObject(Value value);
 uint32_t hashString(const char* key, int length);
 
@@ -80,4 +205,9 @@ static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline Value arrayElement(ObjArray* array, int index) {
+  if (array->packed) return NUMBER_VAL(array->as.numbers[index]);
+  return array->as.values[index];
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,280 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "profiler.h"
+
+// Samples with the same frames are counted together as they are taken,
+// so the buffers only fill up with distinct stacks. The table of stacks
+// is left at most three quarters full, and samples of new stacks that
+// don't fit are counted and dropped.
+#define PROFILE_STACKS (1 << 16)
+#define PROFILE_FRAMES (1 << 20)
+
+typedef struct {
+  ObjFunction* function;
+  // How far the frame's ip is into the function's code.
+  int offset;
+} ProfileFrame;
+
+// A distinct stack, whose frames are in frames[start] on, outermost
+// first. A slot is empty while its count is zero. The signal handler
+// fills a slot in before it publishes a count of one, so writers on
+// other threads read the rest of a slot only once they see a count.
+typedef struct {
+  uint32_t hash;
+  int start;
+  int depth;
+  atomic_int count;
+} ProfileStack;
+
+static VM* profiledVM;
+static const char* profilePath;
+static ProfileStack* stacks;
+static ProfileFrame* frames;
+// Only the signal handler uses these two.
+static int stackCount;
+static int frameCount;
+static atomic_int dropped;
+// Writing the profile on exit and on SIGUSR1 at once.
+static pthread_mutex_t writeLock = PTHREAD_MUTEX_INITIALIZER;
+// Set under the lock by the last write. The functions the samples name
+// may be freed after it.
+static bool stopped;
+
+static uint32_t hashFrames(ProfileFrame* sample, int depth) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < depth; i++) {
+    uint64_t bits = (uint64_t)(uintptr_t)sample[i].function ^
+                    ((uint64_t)sample[i].offset << 48);
+    for (int byte = 0; byte < 8; byte++) {
+      hash ^= (uint8_t)(bits >> (byte * 8));
+      hash *= 16777619;
+    }
+  }
+  return hash;
+}
+
+static void takeSample(int signalNumber) {
+  VM* vm = profiledVM;
+  int vmFrames = vm->frameCount;
+  if (vmFrames <= 0 || vmFrames > FRAMES_MAX) return;
+
+  // The VM may be in the middle of pushing a frame, so the top one can
+  // be stale. Its offset is checked when the profile is written.
+  ProfileFrame sample[FRAMES_MAX];
+  int depth = 0;
+  for (int i = 0; i < vmFrames; i++) {
+    CallFrame* frame = &vm->frames[i];
+    ObjClosure* closure = frame->closure;
+    if (closure == NULL) break;
+    sample[depth].function = closure->function;
+    sample[depth].offset = (int)(frame->ip - closure->function->chunk.code);
+    depth++;
+  }
+  if (depth == 0) return;
+
+  uint32_t hash = hashFrames(sample, depth);
+  uint32_t index = hash & (PROFILE_STACKS - 1);
+  for (;;) {
+    ProfileStack* stack = &stacks[index];
+    if (atomic_load_explicit(&stack->count, memory_order_relaxed) == 0) break;
+    if (stack->hash == hash && stack->depth == depth &&
+        memcmp(&frames[stack->start], sample,
+               sizeof(ProfileFrame) * depth) == 0) {
+      atomic_fetch_add_explicit(&stack->count, 1, memory_order_relaxed);
+      return;
+    }
+    index = (index + 1) & (PROFILE_STACKS - 1);
+  }
+
+  if (stackCount + 1 > PROFILE_STACKS * 3 / 4 ||
+      frameCount + depth > PROFILE_FRAMES) {
+    atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  ProfileStack* stack = &stacks[index];
+  memcpy(&frames[frameCount], sample, sizeof(ProfileFrame) * depth);
+  stack->hash = hash;
+  stack->start = frameCount;
+  stack->depth = depth;
+  frameCount += depth;
+  stackCount++;
+  atomic_store_explicit(&stack->count, 1, memory_order_release);
+}
+
+typedef struct {
+  char* chars;
+  int length;
+  int capacity;
+} Buffer;
+
+static void appendString(Buffer* buffer, const char* string) {
+  int length = (int)strlen(string);
+  if (buffer->capacity < buffer->length + length + 1) {
+    while (buffer->capacity < buffer->length + length + 1) {
+      buffer->capacity = buffer->capacity < 64 ? 64 : buffer->capacity * 2;
+    }
+    buffer->chars = realloc(buffer->chars, buffer->capacity);
+  }
+  memcpy(buffer->chars + buffer->length, string, length + 1);
+  buffer->length += length;
+}
+
+static void appendFrame(Buffer* buffer, ProfileFrame* frame) {
+  ObjFunction* function = frame->function;
+  appendString(buffer, function->name == NULL ? "script"
+                                               : function->name->chars);
+
+  // The ip is past the instruction the frame is on.
+  int offset = frame->offset > 0 ? frame->offset - 1 : 0;
+  if (offset < function->chunk.count) {
+    char line[16];
+    snprintf(line, sizeof(line), ":%d", getLine(&function->chunk, offset));
+    appendString(buffer, line);
+  }
+}
+
+typedef struct {
+  char* text;
+  int count;
+} FoldedStack;
+
+static int compareStacks(const void* a, const void* b) {
+  return strcmp(((const FoldedStack*)a)->text, ((const FoldedStack*)b)->text);
+}
+
+// Writes the samples so far as folded stacks, unless the last write is
+// done. Stacks that differ only in where a frame is within a line fold
+// into one. The file is written next to the profile and renamed over
+// it, so readers never see half of one.
+static void writeProfile(bool last) {
+  pthread_mutex_lock(&writeLock);
+  if (stopped) {
+    pthread_mutex_unlock(&writeLock);
+    return;
+  }
+  stopped = last;
+
+  FoldedStack* folded = malloc(sizeof(FoldedStack) * PROFILE_STACKS);
+  int foldedCount = 0;
+  for (int i = 0; i < PROFILE_STACKS; i++) {
+    ProfileStack* stack = &stacks[i];
+    int count = atomic_load_explicit(&stack->count, memory_order_acquire);
+    if (count == 0) continue;
+
+    Buffer buffer = {NULL, 0, 0};
+    for (int frame = 0; frame < stack->depth; frame++) {
+      if (frame > 0) appendString(&buffer, ";");
+      appendFrame(&buffer, &frames[stack->start + frame]);
+    }
+    folded[foldedCount].text = buffer.chars;
+    folded[foldedCount].count = count;
+    foldedCount++;
+  }
+  qsort(folded, foldedCount, sizeof(FoldedStack), compareStacks);
+
+  size_t pathLength = strlen(profilePath);
+  char* tempPath = malloc(pathLength + 5);
+  memcpy(tempPath, profilePath, pathLength);
+  memcpy(tempPath + pathLength, ".tmp", 5);
+
+  FILE* file = fopen(tempPath, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write profile \"%s\".\n", profilePath);
+  } else {
+    for (int i = 0; i < foldedCount;) {
+      int count = 0;
+      int run = 0;
+      while (i + run < foldedCount &&
+             strcmp(folded[i].text, folded[i + run].text) == 0) {
+        count += folded[i + run].count;
+        run++;
+      }
+      fprintf(file, "%s %d\n", folded[i].text, count);
+      i += run;
+    }
+    fclose(file);
+    rename(tempPath, profilePath);
+  }
+
+  int droppedCount = atomic_load(&dropped);
+  if (droppedCount > 0) {
+    fprintf(stderr, "The profile is missing %d samples of stacks that "
+                    "didn't fit.\n", droppedCount);
+  }
+
+  for (int i = 0; i < foldedCount; i++) free(folded[i].text);
+  free(folded);
+  free(tempPath);
+  pthread_mutex_unlock(&writeLock);
+}
+
+void stopProfiler(void) {
+  if (stacks == NULL) return;
+
+  struct itimerval timer = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+
+  writeProfile(true);
+}
+
+// Runs on its own thread, the only one that doesn't block SIGUSR1, and
+// writes the profile each time the signal comes.
+static void* waitForSignals(void* unused) {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  for (;;) {
+    int signalNumber;
+    if (sigwait(&signals, &signalNumber) == 0) writeProfile(false);
+  }
+  return NULL;
+}
+
+bool startProfiler(VM* vm, const char* path, int rate) {
+  if (rate < 1 || rate > 1000000) return false;
+
+  stacks = calloc(PROFILE_STACKS, sizeof(ProfileStack));
+  frames = malloc(sizeof(ProfileFrame) * PROFILE_FRAMES);
+  if (stacks == NULL || frames == NULL) return false;
+  profiledVM = vm;
+  profilePath = path;
+  vm->profiling = true;
+  // Frames the VM hasn't used yet are skipped, until it sets them up.
+  for (int i = 0; i < FRAMES_MAX; i++) vm->frames[i].closure = NULL;
+
+  // The thread starts with both signals blocked, and only SIGPROF is
+  // unblocked again here, so samples are always of the VM's thread.
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGPROF);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  pthread_t thread;
+  bool started = pthread_create(&thread, NULL, waitForSignals, NULL) == 0;
+  if (started) pthread_detach(thread);
+  sigdelset(&signals, SIGUSR1);
+  pthread_sigmask(SIG_UNBLOCK, &signals, NULL);
+  if (!started) return false;
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = takeSample;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, NULL) != 0) return false;
+
+  atexit(stopProfiler);
+  struct itimerval timer;
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = 1000000 / rate;
+  timer.it_value = timer.it_interval;
+  return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
@@ -0,0 +1,35 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include "common.h"
+#include "vm.h"
+
+// A sampling profiler for Lox code. SIGPROF interrupts the VM the given
+// number of times a second of CPU time, and the handler counts the stack
+// of frames the VM is running in a preallocated table, without locks,
+// so a long run only needs room for its distinct stacks. The samples
+// are written out as folded stacks, one line per distinct stack with its
+// count, ready for flame graph tools:
+//
+//   clox --profile out.folded script.lox
+//   flamegraph.pl out.folded > out.svg
+//
+// Each frame is written as name:line. While profiling, run() stores its
+// ip in the frame before every instruction, so the line of the running
+// frame is exact too. In code compiled by --jit and in --trace traces it
+// is where the frame entered the compiled code.
+//
+// The profile is written when the process exits, and also whenever it
+// gets SIGUSR1, so a long-running script can be looked at while it runs.
+
+#define PROFILE_DEFAULT_RATE 1000
+
+// Starts profiling the VM, which has to run on the calling thread.
+// Returns false if the profiler couldn't be started.
+bool startProfiler(VM* vm, const char* path, int rate);
+// Stops sampling and writes the profile a last time. It runs on exit,
+// and has to run before the VM is freed, since the profile names the
+// VM's functions. Does nothing if the profiler isn't running.
+void stopProfiler(void);
+
+#endif
@@ -1,21 +1,60 @@
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "common.h"
+#include "keywords.h"
 #include "scanner.h"
 
-typedef struct {
-  const char* start;
-  const char* current;
-  int line;
-} Scanner;
-
-Scanner scanner;
+// The scanner skips runs of whitespace, comments, identifier characters
+// and string contents a whole vector at a time. Vectors are loaded from
+// aligned addresses, so a load never crosses into a page that holds no
+// byte of the source, and every run ends at the NUL terminator at the
+// latest. Define SCANNER_NO_SIMD to get the plain scalar loops.
+// AddressSanitizer can't tell that the aligned loads stay within the
+// source's pages, so sanitized builds use the scalar loops.
+#if !defined(SCANNER_NO_SIMD) && defined(__SANITIZE_ADDRESS__)
+#define SCANNER_NO_SIMD
+#elif !defined(SCANNER_NO_SIMD) && defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SCANNER_NO_SIMD
+#endif
+#endif
+
+#if defined(__AVX2__) && !defined(SCANNER_NO_SIMD)
+#include <immintrin.h>
+#define VECTOR_SIZE 32
+typedef __m256i Vector;
+#define LOAD(p)          _mm256_load_si256((const __m256i*)(p))
+#define SPLAT(c)         _mm256_set1_epi8(c)
+#define EQ(a, b)         _mm256_cmpeq_epi8(a, b)
+#define OR(a, b)         _mm256_or_si256(a, b)
+#define SUB(a, b)        _mm256_sub_epi8(a, b)
+#define SUBS_U(a, b)     _mm256_subs_epu8(a, b)
+#define MASK(v)          ((uint32_t)_mm256_movemask_epi8(v))
+#define FULL_MASK        0xffffffffu
+#elif defined(__SSE2__) && !defined(SCANNER_NO_SIMD)
+#include <emmintrin.h>
+#define VECTOR_SIZE 16
+typedef __m128i Vector;
+#define LOAD(p)          _mm_load_si128((const __m128i*)(p))
+#define SPLAT(c)         _mm_set1_epi8(c)
+#define EQ(a, b)         _mm_cmpeq_epi8(a, b)
+#define OR(a, b)         _mm_or_si128(a, b)
+#define SUB(a, b)        _mm_sub_epi8(a, b)
+#define SUBS_U(a, b)     _mm_subs_epu8(a, b)
+#define MASK(v)          ((uint32_t)_mm_movemask_epi8(v))
+#define FULL_MASK        0xffffu
+#endif
+
+void initScanner(Scanner* scanner, const char* source) {
+  initScannerAt(scanner, source, 1);
+}
 
-void initScanner(const char* source) {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+void initScannerAt(Scanner* scanner, const char* source, int line) {
+  scanner->start = source;
+  scanner->current = source;
+  scanner->line = line;
 }
 
 static bool isAlpha(char c) {
@@ -28,206 +67,297 @@ static bool isDigit(char c) {
   return c >= '0' && c <= '9';
 }
 
-static bool isAtEnd() {
-  return *scanner.current == '\0';
+static bool isAtEnd(Scanner* scanner) {
+  return *scanner->current == '\0';
 }
 
-static char advance() {
-  scanner.current++;
-  return scanner.current[-1];
+static char advance(Scanner* scanner) {
+  scanner->current++;
+  return scanner->current[-1];
 }
 
-static char peek() {
-  return *scanner.current;
+static char peek(Scanner* scanner) {
+  return *scanner->current;
 }
 
-static char peekNext() {
-  if (isAtEnd()) return '\0';
-  return scanner.current[1];
+static char peekNext(Scanner* scanner) {
+  if (isAtEnd(scanner)) return '\0';
+  return scanner->current[1];
 }
 
-static bool match(char expected) {
-  if (isAtEnd()) return false;
-  if (*scanner.current != expected) return false;
+static bool match(Scanner* scanner, char expected) {
+  if (isAtEnd(scanner)) return false;
+  if (*scanner->current != expected) return false;
 
-  scanner.current++;
+  scanner->current++;
   return true;
 }
 
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
   Token token;
   token.type = type;
-  token.start = scanner.start;
-  token.length = (int)(scanner.current - scanner.start);
-  token.line = scanner.line;
+  token.start = scanner->start;
+  token.length = (int)(scanner->current - scanner->start);
+  token.line = scanner->line;
 
   return token;
 }
 
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
   Token token;
   token.type = TOKEN_ERROR;
   token.start = message;
   token.length = (int)strlen(message);
-  token.line = scanner.line;
+  token.line = scanner->line;
 
   return token;
 }
 
-static void skipWhitespace() {
+// Most runs are only a few bytes long, so each of them is started with
+// a scalar loop and only handed to the vector loop if it goes on longer.
+#ifdef VECTOR_SIZE
+#define SCALAR_RUN 4
+#else
+#define SCALAR_RUN INT_MAX
+#endif
+
+static bool isBlank(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static const char* scanBlanks(const char* p, int* line, int limit) {
+  for (; limit > 0 && isBlank(*p); limit--, p++) {
+    if (*p == '\n') (*line)++;
+  }
+  return p;
+}
+
+static const char* scanToLineEnd(const char* p, int limit) {
+  for (; limit > 0 && *p != '\n' && *p != '\0'; limit--) p++;
+  return p;
+}
+
+static const char* scanIdentifier(const char* p, int limit) {
+  for (; limit > 0 && (isAlpha(*p) || isDigit(*p)); limit--) p++;
+  return p;
+}
+
+static const char* scanToQuote(const char* p, int* line, int limit) {
+  for (; limit > 0 && *p != '"' && *p != '\0'; limit--, p++) {
+    if (*p == '\n') (*line)++;
+  }
+  return p;
+}
+
+#ifdef VECTOR_SIZE
+
+// Bytes of v that lie in [low, high].
+static inline Vector inRange(Vector v, char low, char high) {
+  return EQ(SUBS_U(SUB(v, SPLAT(low)), SPLAT((char)(high - low))), SPLAT(0));
+}
+
+static inline const char* alignBlock(const char* p) {
+  return (const char*)((uintptr_t)p & ~(uintptr_t)(VECTOR_SIZE - 1));
+}
+
+static const char* vectorBlanks(const char* p, int* line) {
+  const char* block = alignBlock(p);
+  uint32_t live = (FULL_MASK << (p - block)) & FULL_MASK;
   for (;;) {
-    char c = peek();
-    switch (c) {
-      case ' ':
-      case '\r':
-      case '\t':
-        advance();
-        break;
-      
-      case '\n':
-        scanner.line++;
-        advance();
-        break;
-      
-      case '/':
-        if (peekNext() == '/') {
-          // A comment goes until the end of the line.
-          while (peek() != '\n' && !isAtEnd()) advance();
-        } else {
-          return;
-        }
-        break;
-
-      default:
-        return;
+    Vector v = LOAD(block);
+    uint32_t newlines = MASK(EQ(v, SPLAT('\n'))) & live;
+    uint32_t blanks = MASK(OR(OR(EQ(v, SPLAT(' ')), EQ(v, SPLAT('\t'))),
+                              OR(EQ(v, SPLAT('\r')), EQ(v, SPLAT('\n')))));
+    uint32_t stops = ~blanks & live;
+    if (stops != 0) {
+      uint32_t before = (1u << __builtin_ctz(stops)) - 1;
+      *line += __builtin_popcount(newlines & before);
+      return block + __builtin_ctz(stops);
     }
+    *line += __builtin_popcount(newlines);
+    block += VECTOR_SIZE;
+    live = FULL_MASK;
   }
 }
 
-static TokenType checkKeyword(int start, int length,
-    const char* rest, TokenType type) {
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
-    return type;
+static const char* vectorToLineEnd(const char* p) {
+  const char* block = alignBlock(p);
+  uint32_t live = (FULL_MASK << (p - block)) & FULL_MASK;
+  for (;;) {
+    Vector v = LOAD(block);
+    uint32_t stops = MASK(OR(EQ(v, SPLAT('\n')), EQ(v, SPLAT('\0')))) & live;
+    if (stops != 0) return block + __builtin_ctz(stops);
+    block += VECTOR_SIZE;
+    live = FULL_MASK;
   }
+}
 
-  return TOKEN_IDENTIFIER;
+static const char* vectorIdentifier(const char* p) {
+  const char* block = alignBlock(p);
+  uint32_t live = (FULL_MASK << (p - block)) & FULL_MASK;
+  for (;;) {
+    Vector v = LOAD(block);
+    // Setting bit 5 folds upper case letters onto lower case ones.
+    Vector letters = inRange(OR(v, SPLAT(0x20)), 'a', 'z');
+    Vector word = OR(OR(letters, inRange(v, '0', '9')), EQ(v, SPLAT('_')));
+    uint32_t stops = ~MASK(word) & live;
+    if (stops != 0) return block + __builtin_ctz(stops);
+    block += VECTOR_SIZE;
+    live = FULL_MASK;
+  }
 }
 
-static TokenType identifierType() {
-  switch (scanner.start[0]) {
-    case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-    case 'b': return checkKeyword(1, 4, "reak", TOKEN_BREAK);
-    case 'c':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'a': return checkKeyword(2, 2, "se", TOKEN_CASE);
-          case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
-          case 'o': return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
-        }
-      }
-      break;
-    case 'd': return checkKeyword(1, 6, "efault", TOKEN_DEFAULT);
-    case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-    case 'f':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-          case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-          case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-        }
-      }
-      break;
-    case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-    case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-    case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-    case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-    case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-    case 's':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'u': return checkKeyword(2, 3, "per", TOKEN_SUPER);
-          case 'w': return checkKeyword(2, 4, "itch", TOKEN_SWITCH);
-        }
-      }
-      break;
-    case 't':
-      if (scanner.current - scanner.start > 1) {
-        switch (scanner.start[1]) {
-          case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-          case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-        }
-      }
-      break;
-    case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-    case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+static const char* vectorToQuote(const char* p, int* line) {
+  const char* block = alignBlock(p);
+  uint32_t live = (FULL_MASK << (p - block)) & FULL_MASK;
+  for (;;) {
+    Vector v = LOAD(block);
+    uint32_t newlines = MASK(EQ(v, SPLAT('\n'))) & live;
+    uint32_t stops = MASK(OR(EQ(v, SPLAT('"')), EQ(v, SPLAT('\0')))) & live;
+    if (stops != 0) {
+      uint32_t before = (1u << __builtin_ctz(stops)) - 1;
+      *line += __builtin_popcount(newlines & before);
+      return block + __builtin_ctz(stops);
+    }
+    *line += __builtin_popcount(newlines);
+    block += VECTOR_SIZE;
+    live = FULL_MASK;
+  }
+}
+
+#endif
+
+// Skips spaces, tabs, carriage returns and newlines, counting newlines.
+static const char* skipBlanks(const char* p, int* line) {
+  p = scanBlanks(p, line, SCALAR_RUN);
+#ifdef VECTOR_SIZE
+  if (isBlank(*p)) p = vectorBlanks(p, line);
+#endif
+  return p;
+}
+
+// Finds the newline or NUL that ends a line comment.
+static const char* findLineEnd(const char* p) {
+  p = scanToLineEnd(p, SCALAR_RUN);
+#ifdef VECTOR_SIZE
+  if (*p != '\n' && *p != '\0') p = vectorToLineEnd(p);
+#endif
+  return p;
+}
+
+// Skips letters, digits and underscores.
+static const char* skipIdentifier(const char* p) {
+  p = scanIdentifier(p, SCALAR_RUN);
+#ifdef VECTOR_SIZE
+  if (isAlpha(*p) || isDigit(*p)) p = vectorIdentifier(p);
+#endif
+  return p;
+}
+
+// Finds the closing quote (or the NUL) of a string, counting newlines.
+static const char* findQuote(const char* p, int* line) {
+  p = scanToQuote(p, line, SCALAR_RUN);
+#ifdef VECTOR_SIZE
+  if (*p != '"' && *p != '\0') p = vectorToQuote(p, line);
+#endif
+  return p;
+}
+
+static void skipWhitespace(Scanner* scanner) {
+  for (;;) {
+    scanner->current = skipBlanks(scanner->current, &scanner->line);
+
+    if (peek(scanner) == '/' && peekNext(scanner) == '/') {
+      // A comment goes until the end of the line.
+      scanner->current = findLineEnd(scanner->current);
+    } else {
+      return;
+    }
+  }
+}
+
+static TokenType identifierType(Scanner* scanner) {
+  int length = (int)(scanner->current - scanner->start);
+  const Keyword* keyword = &keywords[
+      KEYWORD_HASH(length, scanner->start[0], scanner->current[-1])];
+
+  if (keyword->length == length &&
+      memcmp(scanner->start, keyword->name, length) == 0) {
+    return keyword->type;
   }
 
   return TOKEN_IDENTIFIER;
 }
 
-static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek())) advance();
+static Token identifier(Scanner* scanner) {
+  scanner->current = skipIdentifier(scanner->current);
 
-  return makeToken(identifierType());
+  return makeToken(scanner, identifierType(scanner));
 }
 
-static Token number() {
-  while (isDigit(peek())) advance();
+static Token number(Scanner* scanner) {
+  while (isDigit(peek(scanner))) advance(scanner);
 
   // Look for a fractional part.
-  if (peek() == '.' && isDigit(peekNext())) {
+  if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
     // Consume the ".".
-    advance();
+    advance(scanner);
 
-    while (isDigit(peek())) advance();
+    while (isDigit(peek(scanner))) advance(scanner);
   }
 
-  return makeToken(TOKEN_NUMBER);
+  return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token string() {
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n') scanner.line++;
-    advance();
-  }
+static Token string(Scanner* scanner) {
+  scanner->current = findQuote(scanner->current, &scanner->line);
 
-  if (isAtEnd()) return errorToken("Unterminated string.");
+  if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
   // The closing quote.
-  advance();
-  return makeToken(TOKEN_STRING);
+  advance(scanner);
+  return makeToken(scanner, TOKEN_STRING);
 }
 
-Token scanToken() {
-  skipWhitespace();
-  scanner.start = scanner.current;
+Token scanToken(Scanner* scanner) {
+  skipWhitespace(scanner);
+  scanner->start = scanner->current;
 
-  if (isAtEnd()) return makeToken(TOKEN_EOF);
+  if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-  char c = advance();
+  char c = advance(scanner);
 
-  if (isAlpha(c)) return identifier();
-  if (isDigit(c)) return number();
+  if (isAlpha(c)) return identifier(scanner);
+  if (isDigit(c)) return number(scanner);
   switch (c) {
-    case '(': return makeToken(TOKEN_LEFT_PAREN);
-    case ')': return makeToken(TOKEN_RIGHT_PAREN);
-    case '{': return makeToken(TOKEN_LEFT_BRACE);
-    case '}': return makeToken(TOKEN_RIGHT_BRACE);
-    case ';': return makeToken(TOKEN_SEMICOLON);
-    case ':': return makeToken(TOKEN_COLON);
-    case ',': return makeToken(TOKEN_COMMA);
-    case '.': return makeToken(TOKEN_DOT);
-    case '-': return makeToken(TOKEN_MINUS);
-    case '+': return makeToken(TOKEN_PLUS);
-    case '/': return makeToken(TOKEN_SLASH);
-    case '*': return makeToken(TOKEN_STAR);
-    case '!': return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
-    case '=': return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
-    case '<': return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
-    case '>': return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
-    case '"': return string();
+    case '(': return makeToken(scanner, TOKEN_LEFT_PAREN);
+    case ')': return makeToken(scanner, TOKEN_RIGHT_PAREN);
+    case '{': return makeToken(scanner, TOKEN_LEFT_BRACE);
+    case '}': return makeToken(scanner, TOKEN_RIGHT_BRACE);
+    case '[': return makeToken(scanner, TOKEN_LEFT_BRACKET);
+    case ']': return makeToken(scanner, TOKEN_RIGHT_BRACKET);
+    case ';': return makeToken(scanner, TOKEN_SEMICOLON);
+    case ':': return makeToken(scanner, TOKEN_COLON);
+    case ',': return makeToken(scanner, TOKEN_COMMA);
+    case '.': return makeToken(scanner, TOKEN_DOT);
+    case '-': return makeToken(scanner, TOKEN_MINUS);
+    case '+': return makeToken(scanner, TOKEN_PLUS);
+    case '/': return makeToken(scanner, TOKEN_SLASH);
+    case '*': return makeToken(scanner, TOKEN_STAR);
+    case '!':
+      return makeToken(scanner,
+          match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+    case '=':
+      return makeToken(scanner,
+          match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+    case '<':
+      return makeToken(scanner,
+          match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+    case '>':
+      return makeToken(scanner,
+          match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+    case '"': return string(scanner);
   }
 
-  return errorToken("Unexpected character.");
+  return errorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
@@ -5,6 +5,7 @@ typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
   TOKEN_INTERROGATION, TOKEN_COLON,
@@ -37,7 +38,14 @@ typedef struct {
   int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+typedef struct {
+  const char* start;
+  const char* current;
+  int line;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+void initScannerAt(Scanner* scanner, const char* source, int line);
+Token scanToken(Scanner* scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,265 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "compiler.h"
+#include "memory.h"
+#include "scanner.h"
+#include "stream.h"
+#include "vm.h"
+
+// Input is buffered until it holds at least one complete top-level
+// declaration. The buffer is scanned as it grows, so a declaration that
+// spans many lines is never rescanned from its start:
+//
+// * "scanned" is where scanning resumes when more input arrives.
+// * A ';' or '}' outside any brackets ends a declaration, unless the
+//   '}' closes a map literal rather than a block. If the
+//   declaration has an "if" outside any brackets, an "else" may still
+//   follow, so the end is remembered in "candidate" until the next
+//   token shows whether it does.
+// * "end" is the end of the complete declarations found so far. They
+//   are compiled and run together, then dropped from the buffer.
+// * "tokenEnd" is the end of the last token, so input that holds no
+//   tokens past "end" can be dropped along with them.
+typedef struct {
+  char* buffer;
+  int length;
+  int capacity;
+  int line;
+  int scanned;
+  int depth;
+  TokenType previous;
+  bool inMap;
+  bool sawIf;
+  int candidate;
+  int end;
+  int tokenEnd;
+} Stream;
+
+static void initStream(Stream* stream) {
+  stream->buffer = NULL;
+  stream->length = 0;
+  stream->capacity = 0;
+  stream->line = 1;
+  stream->scanned = 0;
+  stream->depth = 0;
+  stream->previous = TOKEN_SEMICOLON;
+  stream->inMap = false;
+  stream->sawIf = false;
+  stream->candidate = -1;
+  stream->end = 0;
+  stream->tokenEnd = 0;
+}
+
+static void endDeclaration(Stream* stream, int end) {
+  stream->end = end;
+  stream->depth = 0;
+  stream->sawIf = false;
+  stream->candidate = -1;
+}
+
+static void append(Stream* stream, const char* text, int length) {
+  if (stream->capacity < stream->length + length + 1) {
+    int oldCapacity = stream->capacity;
+    stream->capacity = GROW_CAPACITY(oldCapacity);
+    if (stream->capacity < stream->length + length + 1) {
+      stream->capacity = stream->length + length + 1;
+    }
+    stream->buffer = GROW_ARRAY(char, stream->buffer,
+                                oldCapacity, stream->capacity);
+  }
+
+  memcpy(stream->buffer + stream->length, text, length);
+  stream->length += length;
+  stream->buffer[stream->length] = '\0';
+}
+
+// Whether a '{' after the given token opens a block. Otherwise it can
+// only open a map literal.
+static bool opensBlock(TokenType previous) {
+  switch (previous) {
+    case TOKEN_RIGHT_PAREN:
+    case TOKEN_RIGHT_BRACE:
+    case TOKEN_SEMICOLON:
+    case TOKEN_IDENTIFIER:
+    case TOKEN_ELSE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool isUnterminatedString(Token token) {
+  return token.type == TOKEN_ERROR &&
+         strncmp(token.start, "Unterminated string.", token.length) == 0;
+}
+
+// Scans the input that arrived since the last call and moves "end" past
+// every declaration that is now known to be complete.
+static void scanStream(Stream* stream) {
+  Scanner scanner;
+  initScanner(&scanner, stream->buffer + stream->scanned);
+
+  for (;;) {
+    Token token = scanToken(&scanner);
+    if (token.type == TOKEN_EOF) {
+      stream->scanned = stream->length;
+      return;
+    }
+
+    // An unterminated string may still be closed by a later line, so
+    // the scan resumes from before it.
+    if (isUnterminatedString(token)) {
+      stream->tokenEnd = stream->length;
+      return;
+    }
+
+    if (stream->candidate != -1) {
+      if (token.type == TOKEN_ELSE) {
+        stream->candidate = -1;
+      } else {
+        endDeclaration(stream, stream->candidate);
+      }
+    }
+
+    // Error tokens point at their message rather than into the buffer.
+    if (token.type != TOKEN_ERROR) {
+      stream->tokenEnd = (int)(token.start - stream->buffer) + token.length;
+    }
+
+    switch (token.type) {
+      case TOKEN_LEFT_BRACE:
+        if (stream->depth == 0) stream->inMap = !opensBlock(stream->previous);
+        stream->depth++;
+        break;
+
+      case TOKEN_LEFT_PAREN:
+      case TOKEN_LEFT_BRACKET:
+        stream->depth++;
+        break;
+
+      case TOKEN_RIGHT_PAREN:
+      case TOKEN_RIGHT_BRACKET:
+        stream->depth--;
+        break;
+
+      case TOKEN_RIGHT_BRACE:
+      case TOKEN_SEMICOLON:
+        if (token.type == TOKEN_RIGHT_BRACE) stream->depth--;
+        if (stream->depth != 0) break;
+        if (token.type == TOKEN_RIGHT_BRACE && stream->inMap) break;
+
+        if (stream->sawIf) {
+          stream->candidate = stream->tokenEnd;
+        } else {
+          endDeclaration(stream, stream->tokenEnd);
+        }
+        break;
+
+      case TOKEN_IF:
+        if (stream->depth == 0) stream->sawIf = true;
+        break;
+
+      default:
+        break;
+    }
+
+    // Unbalanced brackets will not be fixed by more input, so the
+    // compiler gets to report them right away.
+    if (stream->depth < 0) endDeclaration(stream, stream->tokenEnd);
+
+    stream->previous = token.type;
+    stream->scanned = stream->tokenEnd;
+  }
+}
+
+// Called when no input follows the buffer for now: at the end of the
+// input everything left is complete, and a prompt cannot wait for the
+// next line to rule out an "else".
+static void endOfInput(Stream* stream, bool final, bool interactive) {
+  if (stream->candidate != -1 && (final || interactive)) {
+    endDeclaration(stream, stream->candidate);
+  }
+
+  if (final || stream->tokenEnd <= stream->end) {
+    endDeclaration(stream, stream->length);
+  }
+}
+
+static int countLines(const char* text, int length) {
+  int lines = 0;
+  for (int i = 0; i < length; i++) {
+    if (text[i] == '\n') lines++;
+  }
+  return lines;
+}
+
+// Compiles and runs the complete declarations at the start of the buffer
+// and drops them from it.
+static InterpretResult runComplete(VM* vm, Stream* stream) {
+  int end = stream->end;
+  if (end == 0) return INTERPRET_OK;
+
+  char next = stream->buffer[end];
+  stream->buffer[end] = '\0';
+  ObjFunction* function = compileAt(vm, stream->buffer, stream->line);
+  stream->buffer[end] = next;
+
+  InterpretResult result = function == NULL
+      ? INTERPRET_COMPILE_ERROR
+      : interpretFunction(vm, function);
+  fflush(stdout);
+
+  stream->line += countLines(stream->buffer, end);
+  stream->length -= end;
+  memmove(stream->buffer, stream->buffer + end, stream->length + 1);
+  stream->scanned -= end;
+  if (stream->candidate != -1) stream->candidate -= end;
+  stream->tokenEnd = stream->tokenEnd > end ? stream->tokenEnd - end : 0;
+  stream->end = 0;
+
+  return result;
+}
+
+InterpretResult interpretStream(VM* vm, FILE* input, bool interactive) {
+  Stream stream;
+  initStream(&stream);
+
+  InterpretResult result = INTERPRET_OK;
+  char* line = NULL;
+  size_t lineCapacity = 0;
+
+  for (;;) {
+    if (interactive) {
+      printf(stream.length == 0 ? "> " : "... ");
+      fflush(stdout);
+    }
+
+    ssize_t lineLength = getline(&line, &lineCapacity, input);
+    bool final = lineLength == -1;
+    if (!final) append(&stream, line, (int)lineLength);
+
+    if (stream.length > 0) {
+      scanStream(&stream);
+      endOfInput(&stream, final, interactive);
+    }
+
+    result = runComplete(vm, &stream);
+    if (result != INTERPRET_OK && !interactive) break;
+
+    if (final) break;
+  }
+
+  if (interactive) {
+    printf("\n");
+    result = INTERPRET_OK;
+  }
+
+  free(line);
+  FREE_ARRAY(char, stream.buffer, stream.capacity);
+  return result;
+}
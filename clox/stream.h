@@ -0,0 +1,15 @@
+#ifndef clox_stream_h
+#define clox_stream_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "vm.h"
+
+// Reads a script from input as it arrives and runs each top-level
+// declaration as soon as it is complete. When interactive, prompts for
+// every line and carries on after errors, which makes it the REPL.
+
+InterpretResult interpretStream(VM* vm, FILE* input, bool interactive);
+
+#endif
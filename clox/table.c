@@ -19,13 +19,53 @@ void freeTable(Table* table) {
   initTable(table);
 }
 
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-  uint32_t index = key->hash & (capacity - 1);
+// Mixes the bits of a double, whose low bits are all zero for small
+// integers, so they spread over the buckets.
+static uint32_t hashBits(uint64_t hash) {
+  hash = ~hash + (hash << 18);
+  hash = hash ^ (hash >> 31);
+  hash = hash * 21;
+  hash = hash ^ (hash >> 11);
+  hash = hash + (hash << 6);
+  hash = hash ^ (hash >> 22);
+  return (uint32_t)(hash & 0x3fffffff);
+}
+
+static uint32_t hashValue(Value key) {
+  switch (key.type) {
+    case VAL_BOOL: return AS_BOOL(key) ? 3 : 5;
+    case VAL_NUMBER: {
+      // Adding zero turns -0 into 0, which compares equal to it.
+      double number = AS_NUMBER(key) + 0.0;
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+      return hashBits(bits);
+    }
+    case VAL_OBJ: return AS_STRING(key)->hash;
+    default:
+      return 0; // Unreachable.
+  }
+}
+
+static bool keysEqual(Value a, Value b) {
+  if (a.type != b.type) return false;
+
+  switch (a.type) {
+    case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
+    case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+    case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+    default:
+      return false; // Unreachable.
+  }
+}
+
+static Entry* findEntry(Entry* entries, int capacity, Value key) {
+  uint32_t index = hashValue(key) & (capacity - 1);
   Entry* tombstone = NULL;
   for (;;) {
     Entry* entry = &entries[index];
 
-    if (entry->key == NULL) {
+    if (IS_NIL(entry->key)) {
       if (IS_NIL(entry->value)) {
         // Empty entry.
         return tombstone != NULL ? tombstone : entry;
@@ -33,7 +73,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
         // We found a tombstone.
         if (tombstone == NULL) tombstone = entry;
       }
-    } else if (entry->key == key) {
+    } else if (keysEqual(entry->key, key)) {
       // We found the key.
       return entry;
     }
@@ -42,11 +82,46 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
   }
 }
 
+// Same as findEntry, for the tables keyed only by interned strings,
+// where comparing the pointers is enough.
+static Entry* findStringEntry(Entry* entries, int capacity, ObjString* key) {
+  uint32_t index = key->hash & (capacity - 1);
+  Entry* tombstone = NULL;
+  for (;;) {
+    Entry* entry = &entries[index];
+
+    if (AS_OBJ(entry->key) == (Obj*)key && IS_OBJ(entry->key)) {
+      // We found the key.
+      return entry;
+    } else if (IS_NIL(entry->key)) {
+      if (IS_NIL(entry->value)) {
+        // Empty entry.
+        return tombstone != NULL ? tombstone : entry;
+      } else {
+        // We found a tombstone.
+        if (tombstone == NULL) tombstone = entry;
+      }
+    }
+
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
 bool tableGet(Table* table, ObjString* key, Value* value) {
   if (table->count == 0) return false;
 
+  Entry* entry = findStringEntry(table->entries, table->capacity, key);
+  if (IS_NIL(entry->key)) return false;
+
+  *value = entry->value;
+  return true;
+}
+
+bool tableGetValue(Table* table, Value key, Value* value) {
+  if (table->count == 0) return false;
+
   Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  if (IS_NIL(entry->key)) return false;
 
   *value = entry->value;
   return true;
@@ -55,14 +130,14 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
 static void adjustCapacity(Table* table, int capacity) {
   Entry* entries = ALLOCATE(Entry, capacity);
   for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
+    entries[i].key = NIL_VAL;
     entries[i].value = NIL_VAL;
   }
 
   table->count = 0;
   for (int i = 0; i < table->capacity; i++) {
     Entry* entry = &table->entries[i];
-    if (entry->key == NULL) continue;
+    if (IS_NIL(entry->key)) continue;
 
     Entry* dest = findEntry(entries, capacity, entry->key);
     dest->key = entry->key;
@@ -75,41 +150,61 @@ static void adjustCapacity(Table* table, int capacity) {
   table->capacity = capacity;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
+static bool setEntry(Table* table, Entry* entry, Value key, Value value) {
+  bool isNewKey = IS_NIL(entry->key);
+  if (isNewKey && IS_NIL(entry->value)) table->count++;
+
+  entry->key = key;
+  entry->value = value;
+  return isNewKey;
+}
+
+static void growIfFull(Table* table) {
   if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
     int capacity = GROW_CAPACITY(table->capacity);
     adjustCapacity(table, capacity);
   }
+}
+
+bool tableSet(Table* table, ObjString* key, Value value) {
+  growIfFull(table);
+  Entry* entry = findStringEntry(table->entries, table->capacity, key);
+  return setEntry(table, entry, OBJ_VAL(key), value);
+}
 
+bool tableSetValue(Table* table, Value key, Value value) {
+  growIfFull(table);
   Entry* entry = findEntry(table->entries, table->capacity, key);
+  return setEntry(table, entry, key, value);
+}
 
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) table->count++;
+static bool deleteEntry(Entry* entry) {
+  if (IS_NIL(entry->key)) return false;
 
-  entry->key = key;
-  entry->value = value;
-  return isNewKey;
+  // Place a tombstone in the entry.
+  entry->key = NIL_VAL;
+  entry->value = BOOL_VAL(true);
+
+  return true;
 }
 
 bool tableDelete(Table* table, ObjString* key) {
   if (table->count == 0) return false;
 
-  // Find the entry.
-  Entry* entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) return false;
+  return deleteEntry(findStringEntry(table->entries, table->capacity, key));
+}
 
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+bool tableDeleteValue(Table* table, Value key) {
+  if (table->count == 0) return false;
 
-  return true;
+  return deleteEntry(findEntry(table->entries, table->capacity, key));
 }
 
 void tableAddAll(Table* from, Table* to) {
   for (int i = 0; i < from->capacity; i++) {
     Entry* entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
+    if (!IS_NIL(entry->key)) {
+      tableSetValue(to, entry->key, entry->value);
     }
   }
 }
@@ -122,14 +217,16 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
   for (;;) {
     Entry* entry = &table->entries[index];
 
-    if (entry->key == NULL) {
+    if (IS_NIL(entry->key)) {
       // Stop if we find an empty non-tombstone entry.
       if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length
-              && entry->key->hash == hash
-              && memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it.
-      return entry->key;
+    } else {
+      ObjString* key = AS_STRING(entry->key);
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0) {
+        // We found it.
+        return key;
+      }
     }
 
     index = (index + 1) & (table->capacity - 1);
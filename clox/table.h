@@ -4,8 +4,10 @@
 #include "common.h"
 #include "value.h"
 
+// Keys are strings, numbers or booleans. A nil key marks a slot that is
+// empty (nil value) or a tombstone (true value).
 typedef struct {
-  ObjString* key;
+  Value key;
   Value value;
 } Entry;
 
@@ -20,7 +22,10 @@ void freeTable(Table* table);
 bool tableGet(Table* table, ObjString* key, Value* value);
 bool tableSet(Table* table, ObjString* key, Value value);
 bool tableDelete(Table* table, ObjString* key);
+bool tableGetValue(Table* table, Value key, Value* value);
+bool tableSetValue(Table* table, Value key, Value value);
+bool tableDeleteValue(Table* table, Value key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,925 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+#include "trace.h"
+#include "verify.h"
+
+// The most instructions a trace can have.
+#define TRACE_MAX 512
+// How many times recording a loop can fail before it's left alone.
+#define TRACE_ATTEMPTS 3
+// After this many runs, a trace that ran fewer than two iterations a
+// run on average is dropped: its guards fail too often for it to pay.
+#define TRACE_RUNS_CHECKED 64
+
+typedef enum {
+  TRACE_MOVE,
+  TRACE_ADD,
+  TRACE_SUBTRACT,
+  TRACE_MULTIPLY,
+  TRACE_DIVIDE,
+  TRACE_GREATER,
+  TRACE_LESS,
+  TRACE_EQUAL,
+  TRACE_NEQUAL,
+  TRACE_NOT,
+  TRACE_NEGATE,
+  TRACE_GUARD_NUMBER,
+  TRACE_GUARD_TRUTHY,
+  TRACE_GUARD_FALSEY,
+  // A comparison and the guard on its result in one, which exits unless
+  // the result is c.
+  TRACE_GUARD_GREATER,
+  TRACE_GUARD_LESS,
+  TRACE_GET_GLOBAL,
+  TRACE_SET_GLOBAL,
+  TRACE_GET_UPVALUE,
+  TRACE_SET_UPVALUE,
+  TRACE_INDEX_GET,
+  TRACE_INDEX_SET,
+  TRACE_PRINT,
+  TRACE_LOOP,
+} TraceOpcode;
+
+// Operands are stack slots. The trace's constants are copied above the
+// frame's slots, from its maxSlots on, whenever the trace is entered, so
+// operands need no check for which they are. The arithmetic instructions
+// trust their operands to be numbers, which guards made sure of.
+typedef struct {
+  uint8_t opcode;
+  // The exit taken when a guard, or an instruction that checks its
+  // operands, fails.
+  int exit;
+  int dst;
+  int a;
+  int b;
+  int c;
+} TraceOp;
+
+// Leaving the trace at offset, with depth values on the stack. The
+// writes store the values the trace kept out of the stack.
+typedef struct {
+  int offset;
+  int depth;
+  int writeStart;
+  int writeCount;
+} TraceExit;
+
+typedef struct {
+  int slot;
+  int operand;
+} TraceWrite;
+
+struct Trace {
+  Trace* next;
+  // The offset of the loop header.
+  int start;
+  // The jumps back to the header so far, or -1 once the loop is left to
+  // the interpreter.
+  int hotness;
+  int attempts;
+  // The guards on entry come first, then the loop from loopStart on.
+  // code is NULL until the trace is recorded.
+  TraceOp* code;
+  int count;
+  int capacity;
+  int loopStart;
+  ValueArray constants;
+  TraceExit* exits;
+  int exitCount;
+  int exitCapacity;
+  TraceWrite* writes;
+  int writeCount;
+  int writeCapacity;
+  // How often the trace ran, and how many iterations, up to
+  // TRACE_RUNS_CHECKED runs.
+  int runs;
+  uint32_t iterations;
+};
+
+static void freeCode(Trace* trace) {
+  FREE_ARRAY(TraceOp, trace->code, trace->capacity);
+  FREE_ARRAY(TraceExit, trace->exits, trace->exitCapacity);
+  FREE_ARRAY(TraceWrite, trace->writes, trace->writeCapacity);
+  freeValueArray(&trace->constants);
+  trace->code = NULL;
+  trace->count = trace->capacity = 0;
+  trace->exits = NULL;
+  trace->exitCount = trace->exitCapacity = 0;
+  trace->writes = NULL;
+  trace->writeCount = trace->writeCapacity = 0;
+  trace->runs = trace->iterations = 0;
+}
+
+void freeTraces(ObjFunction* function) {
+  Trace* trace = function->traces;
+  while (trace != NULL) {
+    Trace* next = trace->next;
+    freeCode(trace);
+    FREE(Trace, trace);
+    trace = next;
+  }
+  function->traces = NULL;
+}
+
+static Trace* findTrace(ObjFunction* function, int start) {
+  for (Trace* trace = function->traces; trace != NULL; trace = trace->next) {
+    if (trace->start == start) return trace;
+  }
+
+  Trace* trace = ALLOCATE(Trace, 1);
+  trace->next = function->traces;
+  trace->start = start;
+  trace->hotness = 0;
+  trace->attempts = 0;
+  trace->code = NULL;
+  trace->count = trace->capacity = 0;
+  trace->loopStart = 0;
+  initValueArray(&trace->constants);
+  trace->exits = NULL;
+  trace->exitCount = trace->exitCapacity = 0;
+  trace->writes = NULL;
+  trace->writeCount = trace->writeCapacity = 0;
+  trace->runs = trace->iterations = 0;
+  function->traces = trace;
+  return trace;
+}
+
+static inline bool isFalsey(Value value) {
+  return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Finds the element of an array the way OP_INDEX_GET and OP_INDEX_SET
+// do, failing wherever they report an error.
+static inline bool arrayAt(Value array, Value index, int* at) {
+  if (!IS_ARRAY(array) || !IS_NUMBER(index)) return false;
+  double number = AS_NUMBER(index);
+  if (!(number >= 0 && number < AS_ARRAY(array)->count)) return false;
+  *at = (int)number;
+  return *at == number;
+}
+
+// Runs one instruction. Returns false when its exit is taken, and for
+// TRACE_LOOP, which the caller handles.
+static inline bool runOp(VM* vm, Value* slots, ObjUpvalue** upvalues,
+                         TraceOp* op) {
+  switch (op->opcode) {
+    case TRACE_MOVE:
+      slots[op->dst] = slots[op->a];
+      return true;
+
+#define NUMBER_OP(valueType, operator)                            \
+      slots[op->dst] = valueType(AS_NUMBER(slots[op->a]) operator \
+                                 AS_NUMBER(slots[op->b]));      \
+      return true
+
+    case TRACE_ADD: NUMBER_OP(NUMBER_VAL, +);
+    case TRACE_SUBTRACT: NUMBER_OP(NUMBER_VAL, -);
+    case TRACE_MULTIPLY: NUMBER_OP(NUMBER_VAL, *);
+    case TRACE_DIVIDE: NUMBER_OP(NUMBER_VAL, /);
+    case TRACE_GREATER: NUMBER_OP(BOOL_VAL, >);
+    case TRACE_LESS: NUMBER_OP(BOOL_VAL, <);
+#undef NUMBER_OP
+
+    case TRACE_EQUAL:
+      slots[op->dst] = BOOL_VAL(valuesEqual(slots[op->a], slots[op->b]));
+      return true;
+    case TRACE_NEQUAL:
+      slots[op->dst] = BOOL_VAL(!valuesEqual(slots[op->a],
+                                             slots[op->b]));
+      return true;
+    case TRACE_NOT:
+      slots[op->dst] = BOOL_VAL(isFalsey(slots[op->a]));
+      return true;
+    case TRACE_NEGATE:
+      slots[op->dst] = NUMBER_VAL(-AS_NUMBER(slots[op->a]));
+      return true;
+
+    case TRACE_GUARD_NUMBER: return IS_NUMBER(slots[op->a]);
+    case TRACE_GUARD_TRUTHY: return !isFalsey(slots[op->a]);
+    case TRACE_GUARD_FALSEY: return isFalsey(slots[op->a]);
+    case TRACE_GUARD_GREATER: {
+      bool greater = AS_NUMBER(slots[op->a]) > AS_NUMBER(slots[op->b]);
+      slots[op->dst] = BOOL_VAL(greater);
+      return greater == op->c;
+    }
+    case TRACE_GUARD_LESS: {
+      bool less = AS_NUMBER(slots[op->a]) < AS_NUMBER(slots[op->b]);
+      slots[op->dst] = BOOL_VAL(less);
+      return less == op->c;
+    }
+
+    case TRACE_GET_GLOBAL:
+      return tableGet(&vm->globals, AS_STRING(slots[op->a]),
+                      &slots[op->dst]);
+    case TRACE_SET_GLOBAL: {
+      ObjString* name = AS_STRING(slots[op->a]);
+      if (tableSet(&vm->globals, name, slots[op->b])) {
+        // Left for the interpreter to report.
+        tableDelete(&vm->globals, name);
+        return false;
+      }
+      return true;
+    }
+
+    case TRACE_GET_UPVALUE:
+      slots[op->dst] = *upvalues[op->a]->location;
+      return true;
+    case TRACE_SET_UPVALUE:
+      *upvalues[op->a]->location = slots[op->b];
+      return true;
+
+    case TRACE_INDEX_GET: {
+      Value array = slots[op->a];
+      int at;
+      if (!arrayAt(array, slots[op->b], &at)) return false;
+      slots[op->dst] = arrayElement(AS_ARRAY(array), at);
+      return true;
+    }
+    case TRACE_INDEX_SET: {
+      Value array = slots[op->a];
+      int at;
+      if (!arrayAt(array, slots[op->b], &at)) return false;
+      Value value = slots[op->c];
+      setArrayElement(AS_ARRAY(array), at, value);
+      slots[op->dst] = value;
+      return true;
+    }
+
+    case TRACE_PRINT:
+      printValue(slots[op->a]);
+      printf("\n");
+      return true;
+
+    case TRACE_LOOP:
+      return false;
+  }
+  return true;
+}
+
+static uint8_t* runTrace(VM* vm, CallFrame* frame, Trace* trace) {
+  Value* slots = frame->slots;
+  ObjUpvalue** upvalues = frame->closure->upvalues;
+  memcpy(slots + frame->closure->function->maxSlots, trace->constants.values,
+         sizeof(Value) * trace->constants.count);
+
+  TraceOp* code = trace->code;
+  TraceOp* op;
+  uint32_t iterations = 0;
+  int pc = 0;
+  for (;;) {
+    op = &code[pc++];
+    if (!runOp(vm, slots, upvalues, op)) {
+      if (op->opcode != TRACE_LOOP) break;
+      iterations++;
+      pc = trace->loopStart;
+    }
+  }
+
+  if (trace->runs < TRACE_RUNS_CHECKED) {
+    trace->runs++;
+    trace->iterations += iterations;
+  }
+
+  TraceExit* exit = &trace->exits[op->exit];
+  for (int i = 0; i < exit->writeCount; i++) {
+    TraceWrite* write = &trace->writes[exit->writeStart + i];
+    slots[write->slot] = slots[write->operand];
+  }
+  vm->stackTop = slots + exit->depth;
+  return frame->closure->function->chunk.code + exit->offset;
+}
+
+// The recorder runs the loop's next iteration itself, one instruction at
+// a time, emitting the trace as it goes and running what it emits. It
+// keeps a model of the stack in which each slot holds an operand: the
+// slot itself once its value is stored there, or else the constant or
+// stored slot the value is a copy of. So pushing a local or a constant
+// emits nothing, and a value is only stored when an instruction produces
+// it or a local is assigned. An operand always refers to a stored slot
+// below the one that holds it, or to a constant.
+typedef struct {
+  VM* vm;
+  CallFrame* frame;
+  Trace* trace;
+  Value* slots;
+  int depth;
+  int entryDepth;
+  // Where the constants start.
+  int constantBase;
+  int* stack;
+  // Whether the value stored in each slot is known to be a number, and
+  // whether the trace has stored one there yet.
+  bool* numbers;
+  bool* written;
+  // The slots the guards on entry check are numbers.
+  int* guarded;
+  int guardedCount;
+  // Which instructions the iteration has run, by offset.
+  bool* visited;
+  // The slot the last instruction emitted stored to, or -1.
+  int lastStore;
+} Recorder;
+
+typedef enum {
+  RECORD_NEXT,
+  RECORD_DONE,
+  RECORD_ABORT
+} RecordResult;
+
+static int emit(Recorder* recorder, TraceOpcode opcode, int exit, int dst,
+                int a, int b, int c) {
+  Trace* trace = recorder->trace;
+  if (trace->capacity < trace->count + 1) {
+    int oldCapacity = trace->capacity;
+    trace->capacity = GROW_CAPACITY(oldCapacity);
+    trace->code = GROW_ARRAY(TraceOp, trace->code, oldCapacity,
+                             trace->capacity);
+  }
+
+  TraceOp* op = &trace->code[trace->count];
+  op->opcode = opcode;
+  op->exit = exit;
+  op->dst = dst;
+  op->a = a;
+  op->b = b;
+  op->c = c;
+  recorder->lastStore = -1;
+  return trace->count++;
+}
+
+// Runs the instruction just emitted. The recorder only emits what it has
+// checked will succeed.
+static void execute(Recorder* recorder, int index) {
+  Trace* trace = recorder->trace;
+  runOp(recorder->vm, recorder->slots, recorder->frame->closure->upvalues,
+        &trace->code[index]);
+}
+
+static bool sameConstant(Value a, Value b) {
+  // Telling 0 and -0 apart.
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return memcmp(&AS_NUMBER(a), &AS_NUMBER(b), sizeof(double)) == 0;
+  }
+  return a.type == b.type && valuesEqual(a, b);
+}
+
+static int addTraceConstant(Recorder* recorder, Value value) {
+  ValueArray* constants = &recorder->trace->constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (sameConstant(constants->values[i], value)) {
+      return recorder->constantBase + i;
+    }
+  }
+
+  writeValueArray(constants, value);
+  int slot = recorder->constantBase + constants->count - 1;
+  recorder->slots[slot] = value;
+  return slot;
+}
+
+static bool isConstant(Recorder* recorder, int operand) {
+  return operand >= recorder->constantBase;
+}
+
+static bool isNumber(Recorder* recorder, int operand) {
+  if (isConstant(recorder, operand)) {
+    return IS_NUMBER(recorder->slots[operand]);
+  }
+  return recorder->numbers[operand];
+}
+
+// An exit back to the instruction at offset, with the stack as the
+// recorder has it now.
+static int addExit(Recorder* recorder, int offset) {
+  Trace* trace = recorder->trace;
+  if (trace->exitCapacity < trace->exitCount + 1) {
+    int oldCapacity = trace->exitCapacity;
+    trace->exitCapacity = GROW_CAPACITY(oldCapacity);
+    trace->exits = GROW_ARRAY(TraceExit, trace->exits, oldCapacity,
+                              trace->exitCapacity);
+  }
+
+  TraceExit* exit = &trace->exits[trace->exitCount];
+  exit->offset = offset;
+  exit->depth = recorder->depth;
+  exit->writeStart = trace->writeCount;
+  exit->writeCount = 0;
+  for (int slot = 0; slot < recorder->depth; slot++) {
+    if (recorder->stack[slot] == slot) continue;
+    if (trace->writeCapacity < trace->writeCount + 1) {
+      int oldCapacity = trace->writeCapacity;
+      trace->writeCapacity = GROW_CAPACITY(oldCapacity);
+      trace->writes = GROW_ARRAY(TraceWrite, trace->writes, oldCapacity,
+                                 trace->writeCapacity);
+    }
+    TraceWrite* write = &trace->writes[trace->writeCount++];
+    write->slot = slot;
+    write->operand = recorder->stack[slot];
+    exit->writeCount++;
+  }
+  return trace->exitCount++;
+}
+
+// Stores the value of a slot that holds a copy.
+static void materialize(Recorder* recorder, int slot) {
+  int operand = recorder->stack[slot];
+  if (operand == slot) return;
+  execute(recorder, emit(recorder, TRACE_MOVE, 0, slot, operand, 0, 0));
+  recorder->numbers[slot] = isNumber(recorder, operand);
+  recorder->written[slot] = true;
+  recorder->stack[slot] = slot;
+}
+
+// Emits and runs an instruction that stores its result in dst, once the
+// slots holding copies of what dst holds now have stored them.
+static void store(Recorder* recorder, TraceOpcode opcode, int exit,
+                  int dst, int a, int b, int c, bool number) {
+  for (int slot = 0; slot < recorder->depth; slot++) {
+    if (slot != dst && recorder->stack[slot] == dst) {
+      materialize(recorder, slot);
+    }
+  }
+
+  execute(recorder, emit(recorder, opcode, exit, dst, a, b, c));
+  recorder->numbers[dst] = number;
+  recorder->written[dst] = true;
+  recorder->stack[dst] = dst;
+  recorder->lastStore = dst;
+}
+
+// Assigns a local the value on top of the stack. When the instruction
+// just emitted produced that value, it stores it in the local instead.
+static void setLocal(Recorder* recorder, int slot) {
+  int top = recorder->depth - 1;
+  int operand = recorder->stack[top];
+  if (operand == slot) return;
+
+  bool copied = false;
+  for (int i = 0; i < recorder->depth; i++) {
+    if (i != slot && recorder->stack[i] == slot) copied = true;
+  }
+  if (operand != top || recorder->lastStore != top || copied) {
+    store(recorder, TRACE_MOVE, 0, slot, operand, 0, 0,
+          isNumber(recorder, operand));
+    return;
+  }
+
+  recorder->trace->code[recorder->trace->count - 1].dst = slot;
+  recorder->slots[slot] = recorder->slots[top];
+  recorder->numbers[slot] = recorder->numbers[top];
+  recorder->written[slot] = true;
+  recorder->stack[slot] = slot;
+  recorder->stack[top] = slot;
+  recorder->lastStore = -1;
+}
+
+// Emits an instruction with no effect but its result, or if its
+// operands are constants, works the result out as a constant instead.
+static void storePure(Recorder* recorder, TraceOpcode opcode, int dst,
+                      int a, int b, bool number) {
+  if (!isConstant(recorder, a) || !isConstant(recorder, b)) {
+    store(recorder, opcode, 0, dst, a, b, 0, number);
+    return;
+  }
+
+  TraceOp op = {opcode, 0, dst, a, b, 0};
+  runOp(recorder->vm, recorder->slots, NULL, &op);
+  recorder->stack[dst] = addTraceConstant(recorder, recorder->slots[dst]);
+}
+
+static void pushOperand(Recorder* recorder, int operand) {
+  recorder->stack[recorder->depth++] = operand;
+}
+
+static bool isPure(TraceOpcode opcode) {
+  switch (opcode) {
+    case TRACE_ADD:
+    case TRACE_SUBTRACT:
+    case TRACE_MULTIPLY:
+    case TRACE_DIVIDE:
+    case TRACE_GREATER:
+    case TRACE_LESS:
+    case TRACE_EQUAL:
+    case TRACE_NEQUAL:
+    case TRACE_NOT:
+    case TRACE_NEGATE:
+    case TRACE_GET_UPVALUE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Pops the top of the stack, dropping the instruction just emitted if
+// it did nothing but store the value.
+static void popOperand(Recorder* recorder) {
+  Trace* trace = recorder->trace;
+  if (recorder->lastStore == recorder->depth - 1 &&
+      isPure(trace->code[trace->count - 1].opcode)) {
+    trace->count--;
+  }
+  recorder->lastStore = -1;
+  recorder->depth--;
+}
+
+// Makes sure the operand is a number, which it is now. A local the loop
+// hasn't assigned yet is checked when the trace is entered.
+static void requireNumber(Recorder* recorder, int operand, int offset) {
+  if (isNumber(recorder, operand)) return;
+
+  if (!recorder->written[operand]) {
+    recorder->guarded[recorder->guardedCount++] = operand;
+  } else {
+    emit(recorder, TRACE_GUARD_NUMBER, addExit(recorder, offset), 0,
+         operand, 0, 0);
+  }
+  recorder->numbers[operand] = true;
+}
+
+static RecordResult recordArithmetic(Recorder* recorder, int offset,
+                                     TraceOpcode opcode) {
+  int a = recorder->stack[recorder->depth - 2];
+  int b = recorder->stack[recorder->depth - 1];
+  if (!IS_NUMBER(recorder->slots[a]) ||
+      !IS_NUMBER(recorder->slots[b])) {
+    return RECORD_ABORT;
+  }
+
+  requireNumber(recorder, a, offset);
+  requireNumber(recorder, b, offset);
+  recorder->depth -= 2;
+  storePure(recorder, opcode, recorder->depth, a, b,
+            opcode != TRACE_GREATER && opcode != TRACE_LESS);
+  recorder->depth++;
+  return RECORD_NEXT;
+}
+
+// Turns the comparison just emitted into a guard that its result is
+// expected, when the result is the operand of the guard.
+static bool foldComparison(Recorder* recorder, int operand, bool expected,
+                           int offset) {
+  if (operand != recorder->lastStore) return false;
+  TraceOp* last = &recorder->trace->code[recorder->trace->count - 1];
+  if (last->opcode == TRACE_GREATER) {
+    last->opcode = TRACE_GUARD_GREATER;
+  } else if (last->opcode == TRACE_LESS) {
+    last->opcode = TRACE_GUARD_LESS;
+  } else {
+    return false;
+  }
+
+  last->exit = addExit(recorder, offset);
+  last->c = expected;
+  // The exit needs the result where it is.
+  recorder->lastStore = -1;
+  return true;
+}
+
+static uint32_t readOperand(uint8_t* code, int width) {
+  uint32_t operand = 0;
+  for (int i = 0; i < width; i++) {
+    operand = (operand << 8) | code[i];
+  }
+  return operand;
+}
+
+static RecordResult recordInstruction(Recorder* recorder, int offset,
+                                      Instruction* instruction, int* next) {
+  ObjFunction* function = recorder->frame->closure->function;
+  uint8_t* ip = &function->chunk.code[offset];
+  *next = offset + instruction->length;
+
+  int top = recorder->depth - 1;
+  switch (*ip) {
+    case OP_CONSTANT:
+      pushOperand(recorder, addTraceConstant(recorder,
+                                 function->chunk.constants.values[ip[1]]));
+      return RECORD_NEXT;
+    case OP_CONSTANT_LONG:
+      pushOperand(recorder, addTraceConstant(recorder,
+          function->chunk.constants.values[readOperand(ip + 1, 3)]));
+      return RECORD_NEXT;
+    case OP_NIL: pushOperand(recorder, addTraceConstant(recorder, NIL_VAL)); break;
+    case OP_TRUE: pushOperand(recorder, addTraceConstant(recorder, BOOL_VAL(true))); break;
+    case OP_FALSE:
+      pushOperand(recorder, addTraceConstant(recorder, BOOL_VAL(false)));
+      break;
+    case OP_ZERO: pushOperand(recorder, addTraceConstant(recorder, NUMBER_VAL(0))); break;
+    case OP_ONE: pushOperand(recorder, addTraceConstant(recorder, NUMBER_VAL(1))); break;
+
+    case OP_POP: popOperand(recorder); break;
+    case OP_POPN:
+      for (int i = 0; i < ip[1]; i++) popOperand(recorder);
+      break;
+    case OP_DUP: pushOperand(recorder, recorder->stack[top]); break;
+
+    case OP_GET_LOCAL:
+      pushOperand(recorder, recorder->stack[ip[1]]);
+      break;
+    case OP_GET_LOCAL_LONG:
+      pushOperand(recorder, recorder->stack[readOperand(ip + 1, 3)]);
+      break;
+
+    case OP_SET_LOCAL:
+      setLocal(recorder, ip[1]);
+      break;
+    case OP_SET_LOCAL_LONG:
+      setLocal(recorder, (int)readOperand(ip + 1, 3));
+      break;
+
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_LONG: {
+      int index = (int)readOperand(ip + 1, *ip == OP_GET_UPVALUE ? 1 : 3);
+      store(recorder, TRACE_GET_UPVALUE, 0, recorder->depth, index, 0, 0,
+            false);
+      recorder->depth++;
+      break;
+    }
+
+    case OP_SET_UPVALUE:
+    case OP_SET_UPVALUE_LONG: {
+      int index = (int)readOperand(ip + 1, *ip == OP_SET_UPVALUE ? 1 : 3);
+      execute(recorder, emit(recorder, TRACE_SET_UPVALUE, 0, 0, index,
+                             recorder->stack[top], 0));
+      break;
+    }
+
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG: {
+      Value name = function->chunk.constants.values[
+          readOperand(ip + 1, *ip == OP_GET_GLOBAL ? 1 : 3)];
+      Value value;
+      if (!tableGet(&recorder->vm->globals, AS_STRING(name), &value)) {
+        return RECORD_ABORT;
+      }
+      store(recorder, TRACE_GET_GLOBAL, addExit(recorder, offset),
+            recorder->depth, addTraceConstant(recorder, name), 0, 0, false);
+      recorder->depth++;
+      break;
+    }
+
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG: {
+      Value name = function->chunk.constants.values[
+          readOperand(ip + 1, *ip == OP_SET_GLOBAL ? 1 : 3)];
+      Value value;
+      if (!tableGet(&recorder->vm->globals, AS_STRING(name), &value)) {
+        return RECORD_ABORT;
+      }
+      execute(recorder, emit(recorder, TRACE_SET_GLOBAL,
+                             addExit(recorder, offset), 0,
+                             addTraceConstant(recorder, name),
+                             recorder->stack[top], 0));
+      break;
+    }
+
+    case OP_EQUAL:
+    case OP_NEQUAL: {
+      int a = recorder->stack[top - 1];
+      int b = recorder->stack[top];
+      recorder->depth -= 2;
+      storePure(recorder, *ip == OP_EQUAL ? TRACE_EQUAL : TRACE_NEQUAL,
+                recorder->depth, a, b, false);
+      recorder->depth++;
+      break;
+    }
+
+    case OP_GREATER:
+    case OP_GREATER_NUMBER:
+      return recordArithmetic(recorder, offset, TRACE_GREATER);
+    case OP_LESS:
+    case OP_LESS_NUMBER:
+      return recordArithmetic(recorder, offset, TRACE_LESS);
+    case OP_ADD:
+    case OP_ADD_NUMBER:
+      return recordArithmetic(recorder, offset, TRACE_ADD);
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUMBER:
+      return recordArithmetic(recorder, offset, TRACE_SUBTRACT);
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUMBER:
+      return recordArithmetic(recorder, offset, TRACE_MULTIPLY);
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUMBER:
+      return recordArithmetic(recorder, offset, TRACE_DIVIDE);
+
+    case OP_NOT: {
+      int operand = recorder->stack[top];
+      recorder->depth--;
+      storePure(recorder, TRACE_NOT, top, operand, operand, false);
+      recorder->depth++;
+      break;
+    }
+
+    case OP_NEGATE: {
+      int operand = recorder->stack[top];
+      if (!IS_NUMBER(recorder->slots[operand])) return RECORD_ABORT;
+      requireNumber(recorder, operand, offset);
+      recorder->depth--;
+      storePure(recorder, TRACE_NEGATE, top, operand, operand, true);
+      recorder->depth++;
+      break;
+    }
+
+    case OP_PRINT:
+      execute(recorder, emit(recorder, TRACE_PRINT, 0, 0,
+                             recorder->stack[top], 0, 0));
+      recorder->depth--;
+      break;
+
+    case OP_JUMP_NEAR:
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+      *next = instruction->target;
+      break;
+
+    case OP_JUMP_IF_FALSE_NEAR:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG: {
+      int operand = recorder->stack[top];
+      bool falsey = isFalsey(recorder->slots[operand]);
+      // A constant condition always goes the same way.
+      if (!foldComparison(recorder, operand, !falsey, offset) &&
+          !isConstant(recorder, operand)) {
+        emit(recorder, falsey ? TRACE_GUARD_FALSEY : TRACE_GUARD_TRUTHY,
+             addExit(recorder, offset), 0, operand, 0, 0);
+      }
+      if (falsey) *next = instruction->target;
+      break;
+    }
+
+    case OP_LOOP_NEAR:
+    case OP_LOOP:
+    case OP_LOOP_LONG:
+      if (instruction->target == recorder->trace->start) return RECORD_DONE;
+      // Another loop inside this one.
+      if (recorder->visited[instruction->target]) return RECORD_ABORT;
+      // The jump back from a for loop's body to its increment.
+      *next = instruction->target;
+      break;
+
+    case OP_INDEX_GET: {
+      int array = recorder->stack[top - 1];
+      int index = recorder->stack[top];
+      int at;
+      if (!arrayAt(recorder->slots[array],
+                   recorder->slots[index], &at)) {
+        return RECORD_ABORT;
+      }
+      int exit = addExit(recorder, offset);
+      recorder->depth -= 2;
+      store(recorder, TRACE_INDEX_GET, exit, recorder->depth, array, index,
+            0, false);
+      recorder->depth++;
+      break;
+    }
+
+    case OP_INDEX_SET: {
+      int array = recorder->stack[top - 2];
+      int index = recorder->stack[top - 1];
+      int value = recorder->stack[top];
+      int at;
+      if (!arrayAt(recorder->slots[array],
+                   recorder->slots[index], &at)) {
+        return RECORD_ABORT;
+      }
+      int exit = addExit(recorder, offset);
+      recorder->depth -= 3;
+      store(recorder, TRACE_INDEX_SET, exit, recorder->depth, array, index,
+            value, isNumber(recorder, value));
+      recorder->depth++;
+      break;
+    }
+
+    default:
+      return RECORD_ABORT;
+  }
+  return RECORD_NEXT;
+}
+
+// Ends a recorded iteration at the jump back to the header: stores every
+// copy, checks the locals the guards on entry are about still hold
+// numbers, and puts the guards on entry in front.
+static void finishTrace(Recorder* recorder) {
+  Trace* trace = recorder->trace;
+  for (int slot = 0; slot < recorder->depth; slot++) {
+    materialize(recorder, slot);
+  }
+
+  // Exit 0 goes back to the header with nothing to write.
+  for (int i = 0; i < recorder->guardedCount; i++) {
+    int slot = recorder->guarded[i];
+    if (!recorder->numbers[slot]) {
+      emit(recorder, TRACE_GUARD_NUMBER, 0, 0, slot, 0, 0);
+    }
+  }
+  emit(recorder, TRACE_LOOP, 0, 0, 0, 0, 0);
+
+  int bodyCount = trace->count;
+  for (int i = 0; i < recorder->guardedCount; i++) {
+    emit(recorder, TRACE_GUARD_NUMBER, 0, 0, recorder->guarded[i], 0, 0);
+  }
+  TraceOp* code = ALLOCATE(TraceOp, trace->count);
+  memcpy(code, trace->code + bodyCount,
+         sizeof(TraceOp) * recorder->guardedCount);
+  memcpy(code + recorder->guardedCount, trace->code,
+         sizeof(TraceOp) * bodyCount);
+  FREE_ARRAY(TraceOp, trace->code, trace->capacity);
+  trace->code = code;
+  trace->capacity = trace->count;
+  trace->loopStart = recorder->guardedCount;
+}
+
+static uint8_t* recordTrace(VM* vm, CallFrame* frame, Trace* trace) {
+  ObjFunction* function = frame->closure->function;
+  int slotCount = function->maxSlots + 1;
+
+  Recorder recorder;
+  recorder.vm = vm;
+  recorder.frame = frame;
+  recorder.trace = trace;
+  recorder.slots = frame->slots;
+  recorder.depth = (int)(vm->stackTop - frame->slots);
+  recorder.entryDepth = recorder.depth;
+  recorder.constantBase = function->maxSlots;
+  recorder.lastStore = -1;
+  recorder.stack = ALLOCATE(int, slotCount);
+  recorder.numbers = ALLOCATE(bool, slotCount);
+  recorder.written = ALLOCATE(bool, slotCount);
+  recorder.guarded = ALLOCATE(int, slotCount);
+  recorder.guardedCount = 0;
+  recorder.visited = ALLOCATE(bool, function->chunk.count);
+  for (int slot = 0; slot < slotCount; slot++) {
+    recorder.stack[slot] = slot;
+    recorder.numbers[slot] = false;
+    recorder.written[slot] = false;
+  }
+  for (int i = 0; i < function->chunk.count; i++) recorder.visited[i] = false;
+  addExit(&recorder, trace->start);
+
+  int offset = trace->start;
+  RecordResult result = RECORD_NEXT;
+  while (result == RECORD_NEXT) {
+    if (trace->count >= TRACE_MAX || trace->constants.count >= TRACE_MAX) {
+      result = RECORD_ABORT;
+      break;
+    }
+
+    Instruction instruction;
+    decodeInstruction(function, offset, &instruction);
+    recorder.visited[offset] = true;
+    int next;
+    result = recordInstruction(&recorder, offset, &instruction, &next);
+    if (result == RECORD_NEXT) offset = next;
+  }
+
+  if (result == RECORD_DONE) {
+    finishTrace(&recorder);
+    offset = trace->start;
+  } else {
+    // Leaves the instruction that couldn't be recorded to the
+    // interpreter.
+    for (int slot = 0; slot < recorder.depth; slot++) {
+      materialize(&recorder, slot);
+    }
+    freeCode(trace);
+    trace->hotness = ++trace->attempts < TRACE_ATTEMPTS ? 0 : -1;
+  }
+  vm->stackTop = frame->slots + recorder.depth;
+
+  FREE_ARRAY(int, recorder.stack, slotCount);
+  FREE_ARRAY(bool, recorder.numbers, slotCount);
+  FREE_ARRAY(bool, recorder.written, slotCount);
+  FREE_ARRAY(int, recorder.guarded, slotCount);
+  FREE_ARRAY(bool, recorder.visited, function->chunk.count);
+  return function->chunk.code + offset;
+}
+
+uint8_t* enterTrace(VM* vm, CallFrame* frame, uint8_t* ip) {
+  ObjFunction* function = frame->closure->function;
+  // Frozen functions are shared between threads, and compiled ones don't
+  // run loops in the interpreter.
+  if (function->frozen || function->jit != NULL) return ip;
+
+  // The constants go above the frame, where the stack has to have room
+  // for as many as a trace can have.
+  Value* constants = frame->slots + function->maxSlots;
+  if (constants + TRACE_MAX > vm->stack + STACK_MAX) return ip;
+
+  Trace* trace = findTrace(function, (int)(ip - function->chunk.code));
+  if (trace->code == NULL) {
+    if (trace->hotness < 0 || ++trace->hotness < TRACE_THRESHOLD) return ip;
+    ip = recordTrace(vm, frame, trace);
+    if (trace->code == NULL) return ip;
+  }
+
+  ip = runTrace(vm, frame, trace);
+  if (trace->runs == TRACE_RUNS_CHECKED &&
+      trace->iterations < 2u * TRACE_RUNS_CHECKED) {
+    freeCode(trace);
+    trace->hotness = -1;
+  }
+  return ip;
+}
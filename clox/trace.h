@@ -0,0 +1,33 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+
+#include "common.h"
+#include "vm.h"
+
+// Traces of hot loops. Once a loop has jumped back to the same
+// instruction TRACE_THRESHOLD times, the next iteration runs in a
+// recorder that notes what each instruction did and with which types of
+// values, and turns that one path through the loop into a trace: code
+// for a small register machine that works on the frame's stack slots,
+// with the stack temporaries folded away and the number checks of the
+// bytecode replaced by guards. Guards on the locals the loop starts with
+// are checked once when the trace is entered, and then again only where
+// the loop changes them.
+//
+// A trace runs whole iterations until a guard fails, or the loop ends,
+// and then hands the frame back to run() at the instruction the guard
+// was for, which runs it generically. Traces only cover what a loop does
+// with numbers, locals, upvalues, globals and arrays; a loop that calls
+// functions, or has a loop inside it, keeps running in the interpreter.
+
+#define TRACE_THRESHOLD 64
+
+typedef struct Trace Trace;
+
+// Called by run() at the loop header ip, after a jump back. Runs the
+// loop's trace, recording it first when the loop has just got hot, and
+// returns where the interpreter goes on.
+uint8_t* enterTrace(VM* vm, CallFrame* frame, uint8_t* ip);
+void freeTraces(ObjFunction* function);
+
+#endif
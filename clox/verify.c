@@ -0,0 +1,473 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "verify.h"
+
+static uint32_t readOperand(uint8_t* code, int width) {
+  uint32_t operand = 0;
+  for (int i = 0; i < width; i++) {
+    operand = (operand << 8) | code[i];
+  }
+  return operand;
+}
+
+// Reads a constant index of the given width at offset and checks that
+// it names a constant of the chunk.
+static bool constantOperand(Chunk* chunk, int offset, int width,
+                            Value* constant) {
+  uint32_t index = readOperand(&chunk->code[offset], width);
+  if (index >= (uint32_t)chunk->constants.count) return false;
+
+  *constant = chunk->constants.values[index];
+  return true;
+}
+
+static bool nameOperand(Chunk* chunk, int offset, int width) {
+  Value name;
+  return constantOperand(chunk, offset, width, &name) && IS_STRING(name);
+}
+
+static bool cacheOperand(Chunk* chunk, int offset) {
+  return readOperand(&chunk->code[offset], 2) < (uint32_t)chunk->cacheCount;
+}
+
+static bool closureInstruction(ObjFunction* function, int offset,
+                               int width, Instruction* instruction) {
+  Chunk* chunk = &function->chunk;
+  Value constant;
+  if (offset + 1 + width > chunk->count ||
+      !constantOperand(chunk, offset + 1, width, &constant) ||
+      !IS_FUNCTION(constant)) {
+    return false;
+  }
+
+  // Each upvalue is an isLocal byte and an index.
+  ObjFunction* closed = AS_FUNCTION(constant);
+  int length = 1 + width + closed->upvalueCount * (1 + width);
+  if (offset + length > chunk->count) return false;
+
+  instruction->length = length;
+  instruction->pushes = 1;
+  for (int i = 0; i < closed->upvalueCount; i++) {
+    uint8_t* upvalue = &chunk->code[offset + 1 + width + i * (1 + width)];
+    int index = (int)readOperand(upvalue + 1, width);
+    if (upvalue[0] == 1) {
+      // A local function captures itself in the slot the closure is
+      // about to be pushed to.
+      if (index > instruction->locals) instruction->locals = index;
+    } else if (upvalue[0] != 0 || index >= function->upvalueCount) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool decodeInstruction(ObjFunction* function, int offset,
+                       Instruction* instruction) {
+  Chunk* chunk = &function->chunk;
+  uint8_t opcode = chunk->code[offset];
+  instruction->length = 1;
+  instruction->pops = 0;
+  instruction->pushes = 0;
+  instruction->locals = 0;
+  instruction->target = -1;
+  instruction->next = true;
+
+  // Operands are one byte, or three for the _LONG forms.
+  int width = 1;
+  switch (opcode) {
+    case OP_CONSTANT_LONG:
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+    case OP_GET_SUPER_LONG:
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE_LONG:
+    case OP_CLOSURE_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+      width = 3;
+      break;
+    default:
+      break;
+  }
+
+  int operand = offset + 1;
+  switch (opcode) {
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_ZERO:
+    case OP_ONE:
+      instruction->pushes = 1;
+      return true;
+
+    case OP_POP:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+      instruction->pops = 1;
+      return true;
+
+    case OP_DUP:
+      instruction->pops = 1;
+      instruction->pushes = 2;
+      return true;
+
+    case OP_EQUAL:
+    case OP_NEQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER_NUMBER:
+    case OP_LESS_NUMBER:
+    case OP_ADD_NUMBER:
+    case OP_SUBTRACT_NUMBER:
+    case OP_MULTIPLY_NUMBER:
+    case OP_DIVIDE_NUMBER:
+    case OP_INDEX_GET:
+    case OP_INHERIT:
+      instruction->pops = 2;
+      instruction->pushes = 1;
+      return true;
+
+    case OP_NOT:
+    case OP_NEGATE:
+      instruction->pops = 1;
+      instruction->pushes = 1;
+      return true;
+
+    case OP_INDEX_SET:
+      instruction->pops = 3;
+      instruction->pushes = 1;
+      return true;
+
+    case OP_RETURN:
+      instruction->pops = 1;
+      instruction->next = false;
+      return true;
+
+    default:
+      break;
+  }
+
+  // Everything else has operands.
+  instruction->length = 1 + width;
+  if (offset + instruction->length > chunk->count) return false;
+
+  switch (opcode) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG: {
+      Value constant;
+      instruction->pushes = 1;
+      return constantOperand(chunk, operand, width, &constant);
+    }
+
+    case OP_GET_LOCAL:
+    case OP_GET_LOCAL_LONG:
+      instruction->pushes = 1;
+      instruction->locals =
+          (int)readOperand(&chunk->code[operand], width) + 1;
+      return true;
+
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_LONG:
+      instruction->pops = 1;
+      instruction->pushes = 1;
+      instruction->locals =
+          (int)readOperand(&chunk->code[operand], width) + 1;
+      return true;
+
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_CLASS:
+    case OP_CLASS_LONG:
+      instruction->pushes = 1;
+      return nameOperand(chunk, operand, width);
+
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+      instruction->pops = 1;
+      return nameOperand(chunk, operand, width);
+
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+      instruction->pops = 1;
+      instruction->pushes = 1;
+      return nameOperand(chunk, operand, width);
+
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_LONG:
+      instruction->pushes = 1;
+      return readOperand(&chunk->code[operand], width) <
+             (uint32_t)function->upvalueCount;
+
+    case OP_SET_UPVALUE:
+    case OP_SET_UPVALUE_LONG:
+      instruction->pops = 1;
+      instruction->pushes = 1;
+      return readOperand(&chunk->code[operand], width) <
+             (uint32_t)function->upvalueCount;
+
+    case OP_GET_PROPERTY:
+    case OP_GET_PROPERTY_LONG:
+      instruction->length += 2;
+      instruction->pops = 1;
+      instruction->pushes = 1;
+      return offset + instruction->length <= chunk->count &&
+             nameOperand(chunk, operand, width) &&
+             cacheOperand(chunk, operand + width);
+
+    case OP_SET_PROPERTY:
+    case OP_SET_PROPERTY_LONG:
+      instruction->length += 2;
+      instruction->pops = 2;
+      instruction->pushes = 1;
+      return offset + instruction->length <= chunk->count &&
+             nameOperand(chunk, operand, width) &&
+             cacheOperand(chunk, operand + width);
+
+    case OP_GET_SUPER:
+    case OP_GET_SUPER_LONG:
+      // Pops the superclass and the receiver, pushes the bound method.
+      instruction->pops = 2;
+      instruction->pushes = 1;
+      return nameOperand(chunk, operand, width);
+
+    case OP_INVOKE:
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE:
+    case OP_SUPER_INVOKE_LONG: {
+      // The name, the argument count and the cache.
+      instruction->length += 3;
+      if (offset + instruction->length > chunk->count) return false;
+
+      // The receiver and arguments, and the superclass for super calls.
+      bool isSuper = opcode == OP_SUPER_INVOKE ||
+                     opcode == OP_SUPER_INVOKE_LONG;
+      instruction->pops = chunk->code[operand + width] + 1 + isSuper;
+      instruction->pushes = 1;
+      return nameOperand(chunk, operand, width) &&
+             cacheOperand(chunk, operand + width + 1);
+    }
+
+    case OP_POPN:
+      instruction->pops = chunk->code[operand];
+      return true;
+
+    case OP_CALL:
+      instruction->pops = chunk->code[operand] + 1;
+      instruction->pushes = 1;
+      return true;
+
+    case OP_ARRAY:
+      instruction->pops = chunk->code[operand];
+      instruction->pushes = 1;
+      return true;
+
+    case OP_MAP:
+      instruction->pops = chunk->code[operand] * 2;
+      instruction->pushes = 1;
+      return true;
+
+    case OP_JUMP_NEAR:
+    case OP_JUMP:
+    case OP_JUMP_LONG:
+    case OP_JUMP_IF_FALSE_NEAR:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_LONG:
+    case OP_LOOP_NEAR:
+    case OP_LOOP:
+    case OP_LOOP_LONG: {
+      // The _NEAR, plain and _LONG forms of each jump are in that order.
+      int form = (opcode - OP_JUMP_NEAR) % 3;
+      int jumpWidth = form == 0 ? 1 : form == 1 ? 2 : 4;
+      instruction->length = 1 + jumpWidth;
+      if (offset + instruction->length > chunk->count) return false;
+
+      int64_t jump = readOperand(&chunk->code[operand], jumpWidth);
+      int64_t end = offset + instruction->length;
+      int64_t target = opcode >= OP_LOOP_NEAR ? end - jump : end + jump;
+      if (target < 0 || target >= chunk->count) return false;
+
+      instruction->target = (int)target;
+      if (opcode >= OP_JUMP_IF_FALSE_NEAR && opcode <= OP_JUMP_IF_FALSE_LONG) {
+        // Only peeks at the condition.
+        instruction->pops = 1;
+        instruction->pushes = 1;
+      } else {
+        instruction->next = false;
+      }
+      return true;
+    }
+
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG:
+      return closureInstruction(function, offset, width, instruction);
+
+    case OP_METHOD:
+    case OP_METHOD_LONG:
+      // Pops the closure and leaves the class.
+      instruction->pops = 2;
+      instruction->pushes = 1;
+      return nameOperand(chunk, operand, width);
+
+    default:
+      return false;
+  }
+}
+
+static bool isClosure(uint8_t opcode) {
+  return opcode == OP_CLOSURE || opcode == OP_CLOSURE_LONG;
+}
+
+static bool isMethod(uint8_t opcode) {
+  return opcode == OP_METHOD || opcode == OP_METHOD_LONG;
+}
+
+// Every instruction that starts in the chunk needs a line, and the line
+// lookup needs the first one to start at zero.
+static bool validLines(Chunk* chunk) {
+  if (chunk->lineCount == 0 || chunk->lines[0].offset != 0) return false;
+  for (int i = 1; i < chunk->lineCount; i++) {
+    if (chunk->lines[i].offset <= chunk->lines[i - 1].offset) return false;
+  }
+  return true;
+}
+
+#define UNKNOWN -1
+#define UNREACHABLE -2
+
+typedef struct {
+  ObjFunction* function;
+  // The stack depth before each instruction, counting the callee and its
+  // arguments. It is UNKNOWN for bytes that haven't been reached, and
+  // UNREACHABLE for instructions the scan found no way to.
+  int* depths;
+  // Everything before this offset has been decoded.
+  int scanned;
+  // Instructions found to be reachable after the scan went past them.
+  int* pending;
+  int pendingCount;
+  int maxDepth;
+} Verifier;
+
+static bool reach(Verifier* verifier, int offset, int depth) {
+  int* known = &verifier->depths[offset];
+  if (*known == UNREACHABLE) {
+    *known = depth;
+    verifier->pending[verifier->pendingCount++] = offset;
+    return true;
+  }
+
+  // A byte the scan went past without finding an instruction there.
+  if (*known == UNKNOWN && offset < verifier->scanned) return false;
+
+  if (*known == UNKNOWN) *known = depth;
+  return *known == depth;
+}
+
+// Checks the stack effects of a reachable instruction and passes the
+// stack depth after it on to the instructions that can run next.
+static bool flow(Verifier* verifier, int offset, Instruction* instruction) {
+  Chunk* chunk = &verifier->function->chunk;
+  int depth = verifier->depths[offset];
+
+  // Instructions can't pop the frame's first slot, or use locals that
+  // aren't on the stack yet.
+  if (instruction->pops >= depth || instruction->locals > depth) {
+    return false;
+  }
+
+  depth += instruction->pushes - instruction->pops;
+  if (depth > verifier->maxDepth) verifier->maxDepth = depth;
+
+  int next = offset + instruction->length;
+  if (instruction->next) {
+    // Running off the end of the chunk.
+    if (next == chunk->count || !reach(verifier, next, depth)) return false;
+  }
+
+  // A method is defined with the closure right before it, so it can't
+  // be jumped to.
+  int target = instruction->target;
+  return target == -1 ||
+         (!isMethod(chunk->code[target]) && reach(verifier, target, depth));
+}
+
+bool findStackDepths(ObjFunction* function, int* depths) {
+  Chunk* chunk = &function->chunk;
+  if (chunk->count == 0 || !validLines(chunk)) return false;
+
+  Verifier verifier;
+  verifier.function = function;
+  verifier.depths = depths;
+  verifier.pending = ALLOCATE(int, chunk->count);
+  verifier.pendingCount = 0;
+  verifier.scanned = 0;
+  for (int i = 0; i < chunk->count; i++) verifier.depths[i] = UNKNOWN;
+  verifier.depths[0] = function->arity + 1;
+  verifier.maxDepth = verifier.depths[0];
+
+  // Scan the chunk from start to end. Most code is reached by falling
+  // through or jumping forward, so the scan finds its stack depth first.
+  bool valid = true;
+  uint8_t previous = OP_RETURN;
+  for (int offset = 0; valid && offset < chunk->count;) {
+    Instruction instruction;
+    uint8_t opcode = chunk->code[offset];
+    if (!decodeInstruction(function, offset, &instruction) ||
+        (isMethod(opcode) && !isClosure(previous))) {
+      valid = false;
+      break;
+    }
+
+    // Jumps can't land inside an instruction.
+    int next = offset + instruction.length;
+    for (int i = offset + 1; i < next; i++) {
+      if (verifier.depths[i] != UNKNOWN) valid = false;
+    }
+
+    previous = opcode;
+    verifier.scanned = next;
+    if (verifier.depths[offset] == UNKNOWN) {
+      verifier.depths[offset] = UNREACHABLE;
+    } else {
+      valid = valid && flow(&verifier, offset, &instruction);
+    }
+    offset = next;
+  }
+
+  // Then follow the code only reached by jumping back to it, like the
+  // increment clause of a for loop.
+  while (valid && verifier.pendingCount > 0) {
+    int offset = verifier.pending[--verifier.pendingCount];
+    Instruction instruction;
+    decodeInstruction(function, offset, &instruction);
+    valid = flow(&verifier, offset, &instruction);
+  }
+
+  FREE_ARRAY(int, verifier.pending, chunk->count);
+
+  if (valid) function->maxSlots = verifier.maxDepth;
+  return valid;
+}
+
+bool verifyFunction(ObjFunction* function) {
+  int* depths = ALLOCATE(int, function->chunk.count);
+  bool valid = findStackDepths(function, depths);
+  FREE_ARRAY(int, depths, function->chunk.count);
+  return valid;
+}
+
+#undef UNKNOWN
+#undef UNREACHABLE
@@ -0,0 +1,35 @@
+#ifndef clox_verify_h
+#define clox_verify_h
+
+#include "object.h"
+
+// What an instruction needs from the stack and what it can do next. It
+// pops "pops" values from the stack and pushes "pushes" in their place.
+typedef struct {
+  int length;
+  int pops;
+  int pushes;
+  // How deep the stack has to be for the locals it uses to be on it.
+  int locals;
+  // Where it can jump to, or -1 if it can't.
+  int target;
+  // Whether execution can go on to the next instruction.
+  bool next;
+} Instruction;
+
+// Checks that a function's bytecode is safe to run without bounds
+// checks: every instruction decodes and its operands are in range, jumps
+// land on instructions, and the stack has the same depth whichever way
+// an instruction is reached and never drops below the frame. On success
+// the function's maxSlots is set to the most stack slots it ever uses.
+bool verifyFunction(ObjFunction* function);
+// Verifies the function like verifyFunction() and fills depths, which
+// has a slot for each byte of code, with the stack depth before every
+// reachable instruction. Other bytes get a negative depth.
+bool findStackDepths(ObjFunction* function, int* depths);
+// Decodes the instruction at offset, checking the operands that don't
+// depend on the stack.
+bool decodeInstruction(ObjFunction* function, int offset,
+                       Instruction* instruction);
+
+#endif
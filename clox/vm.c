@@ -6,24 +6,36 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "kernel.h"
 #include "object.h"
+#include "allocations.h"
+#include "aot.h"
+#include "heap.h"
+#include "jit.h"
 #include "memory.h"
+#include "module.h"
+#include "trace.h"
 #include "vm.h"
 
-VM vm;
 
-static Value clockNative(int argCount, Value* args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clockNative(VM* vm, int argCount, Value* args) {
+  args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
+}
+
+static void clearCaches(VM* vm) {
+  for (int i = 0; i < vm->module->cacheCount; i++) {
+    vm->moduleCaches[i].count = 0;
+  }
 }
 
-static void resetStack() {
-  vm.stackTop = vm.stack;
-  vm.frameCount = 0;
-  vm.openUpvalues = NULL;
-  vm.objects = NULL;
+static void resetStack(VM* vm) {
+  vm->stackTop = vm->stack;
+  vm->frameCount = 0;
+  vm->openUpvalues = NULL;
 }
 
-static void runtimeError(const char* format, ...) {
+static void runtimeError(VM* vm, const char* format, ...) {
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
@@ -31,8 +43,8 @@ static void runtimeError(const char* format, ...) {
   fputs("\n", stderr);
 
   // print stack trace
-  for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame* frame = &vm.frames[i];
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    CallFrame* frame = &vm->frames[i];
     ObjFunction* function = frame->closure->function;
     // -1 because the IP is sitting on the next instruction to be executed.
     size_t instruction = frame->ip - function->chunk.code - 1;
@@ -45,75 +57,413 @@ static void runtimeError(const char* format, ...) {
     }
   }
 
-  resetStack();
+  resetStack(vm);
+}
+
+static bool lenNative(VM* vm, int argCount, Value* args) {
+  if (IS_ARRAY(args[0])) {
+    args[-1] = NUMBER_VAL(AS_ARRAY(args[0])->count);
+  } else if (IS_MAP(args[0])) {
+    args[-1] = NUMBER_VAL(AS_MAP(args[0])->count);
+  } else if (IS_STRING(args[0])) {
+    args[-1] = NUMBER_VAL(AS_STRING(args[0])->length);
+  } else {
+    runtimeError(vm, "Can only take the length of arrays, maps and strings.");
+    return false;
+  }
+  return true;
+}
+
+static bool appendNative(VM* vm, int argCount, Value* args) {
+  if (!IS_ARRAY(args[0])) {
+    runtimeError(vm, "Can only append to arrays.");
+    return false;
+  }
+
+  appendArray(AS_ARRAY(args[0]), args[1]);
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+static bool isMapKey(Value key) {
+  return IS_STRING(key) || IS_NUMBER(key) || IS_BOOL(key);
+}
+
+static bool mapKey(VM* vm, Value key) {
+  if (!isMapKey(key)) {
+    runtimeError(vm, "Map keys must be strings, numbers or booleans.");
+    return false;
+  }
+  return true;
+}
+
+static bool hasNative(VM* vm, int argCount, Value* args) {
+  if (!IS_MAP(args[0])) {
+    runtimeError(vm, "Expected a map.");
+    return false;
+  }
+
+  Value value;
+  args[-1] = BOOL_VAL(isMapKey(args[1]) &&
+                      tableGetValue(&AS_MAP(args[0])->table, args[1], &value));
+  return true;
+}
+
+static bool removeNative(VM* vm, int argCount, Value* args) {
+  if (!IS_MAP(args[0])) {
+    runtimeError(vm, "Expected a map.");
+    return false;
+  }
+
+  args[-1] = BOOL_VAL(isMapKey(args[1]) && mapDelete(AS_MAP(args[0]), args[1]));
+  return true;
+}
+
+static bool keysNative(VM* vm, int argCount, Value* args) {
+  if (!IS_MAP(args[0])) {
+    runtimeError(vm, "Expected a map.");
+    return false;
+  }
+
+  ObjMap* map = AS_MAP(args[0]);
+  ObjArray* keys = newArray(vm);
+  for (int i = 0; i < map->table.capacity; i++) {
+    Entry* entry = &map->table.entries[i];
+    if (!IS_NIL(entry->key)) appendArray(keys, entry->key);
+  }
+
+  args[-1] = OBJ_VAL(keys);
+  return true;
+}
+
+// Checks that value is an array holding only numbers, and packs it.
+static bool numberArray(VM* vm, Value value, ObjArray** array) {
+  if (!IS_ARRAY(value) || !packArray(AS_ARRAY(value))) {
+    runtimeError(vm, "Expected an array of numbers.");
+    return false;
+  }
+
+  *array = AS_ARRAY(value);
+  return true;
+}
+
+static bool numberArrays(VM* vm, Value* args, ObjArray** a, ObjArray** b) {
+  if (!numberArray(vm, args[0], a) || !numberArray(vm, args[1], b)) {
+    return false;
+  }
+
+  if ((*a)->count != (*b)->count) {
+    runtimeError(vm, "Arrays must have the same length.");
+    return false;
+  }
+  return true;
+}
+
+static bool sumNative(VM* vm, int argCount, Value* args) {
+  ObjArray* array;
+  if (!numberArray(vm, args[0], &array)) return false;
+
+  args[-1] = NUMBER_VAL(sumNumbers(array->as.numbers, array->count));
+  return true;
+}
+
+static bool dotNative(VM* vm, int argCount, Value* args) {
+  ObjArray* a;
+  ObjArray* b;
+  if (!numberArrays(vm, args, &a, &b)) return false;
+
+  args[-1] = NUMBER_VAL(dotNumbers(a->as.numbers, b->as.numbers, a->count));
+  return true;
+}
+
+static bool minNative(VM* vm, int argCount, Value* args) {
+  ObjArray* array;
+  if (!numberArray(vm, args[0], &array)) return false;
+
+  if (array->count == 0) {
+    runtimeError(vm, "Can't take the minimum of an empty array.");
+    return false;
+  }
+
+  args[-1] = NUMBER_VAL(minNumbers(array->as.numbers, array->count));
+  return true;
+}
+
+static bool maxNative(VM* vm, int argCount, Value* args) {
+  ObjArray* array;
+  if (!numberArray(vm, args[0], &array)) return false;
+
+  if (array->count == 0) {
+    runtimeError(vm, "Can't take the maximum of an empty array.");
+    return false;
+  }
+
+  args[-1] = NUMBER_VAL(maxNumbers(array->as.numbers, array->count));
+  return true;
+}
+
+static bool scaleNative(VM* vm, int argCount, Value* args) {
+  ObjArray* array;
+  if (!numberArray(vm, args[0], &array)) return false;
+
+  if (!IS_NUMBER(args[1])) {
+    runtimeError(vm, "Scale factor must be a number.");
+    return false;
+  }
+
+  scaleNumbers(array->as.numbers, array->count, AS_NUMBER(args[1]));
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+static bool addNative(VM* vm, int argCount, Value* args) {
+  ObjArray* a;
+  ObjArray* b;
+  if (!numberArrays(vm, args, &a, &b)) return false;
+
+  addNumbers(a->as.numbers, b->as.numbers, a->count);
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+static bool fillNative(VM* vm, int argCount, Value* args) {
+  ObjArray* array;
+  if (!numberArray(vm, args[0], &array)) return false;
+
+  if (!IS_NUMBER(args[1])) {
+    runtimeError(vm, "Fill value must be a number.");
+    return false;
+  }
+
+  fillNumbers(array->as.numbers, array->count, AS_NUMBER(args[1]));
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+static bool copyNative(VM* vm, int argCount, Value* args) {
+  ObjArray* a;
+  ObjArray* b;
+  if (!numberArrays(vm, args, &a, &b)) return false;
+
+  copyNumbers(a->as.numbers, b->as.numbers, a->count);
+  args[-1] = NIL_VAL;
+  return true;
+}
+
+typedef struct {
+  const char* name;
+  NativeFn function;
+  int arity;
+} NativeDef;
+
+static const NativeDef natives[] = {
+  {"add",    addNative,    2},
+  {"append", appendNative, 2},
+  {"clock",  clockNative,  0},
+  {"copy",   copyNative,   2},
+  {"dot",    dotNative,    2},
+  {"fill",   fillNative,   2},
+  {"has",    hasNative,    2},
+  {"keys",   keysNative,   1},
+  {"len",    lenNative,    1},
+  {"max",    maxNative,    1},
+  {"min",    minNative,    1},
+  {"remove", removeNative, 2},
+  {"scale",  scaleNative,  2},
+  {"sum",    sumNative,    1},
+};
+
+#define NATIVE_COUNT (int)(sizeof(natives) / sizeof(natives[0]))
+
+int nativeIndex(NativeFn function) {
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    if (natives[i].function == function) return i;
+  }
+  return -1;
+}
+
+NativeFn nativeFunction(int index) {
+  if (index < 0 || index >= NATIVE_COUNT) return NULL;
+  return natives[index].function;
+}
+
+static void defineNative(VM* vm, const char* name, NativeFn function,
+                         int arity) {
+  push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+  push(vm, OBJ_VAL(newNative(vm, function, arity)));
+  tableSet(&vm->globals, AS_STRING(vm->stack[0]), vm->stack[1]);
+  pop(vm);
+  pop(vm);
+}
+
+// Interned strings that equal one of the module's are the module's, so
+// the module is set before anything is interned.
+static void initVMForModule(VM* vm, Module* module) {
+  resetStack(vm);
+  vm->objects = NULL;
+  vm->heap = NULL;
+  vm->heapSize = 0;
+  vm->jitEnabled = false;
+  vm->tracesEnabled = false;
+  vm->profiling = false;
+  vm->allocations = NULL;
+  vm->module = module;
+  vm->moduleCaches = NULL;
+  if (module != NULL) {
+    retainModule(module);
+    vm->moduleCaches = ALLOCATE(InlineCache, module->cacheCount);
+    clearCaches(vm);
+  }
+  initTable(&vm->globals);
+  initTable(&vm->strings);
+  initTable(&vm->baseGlobals);
+  initTable(&vm->baseStrings);
+  vm->baseObjects = NULL;
+
+  vm->initString = copyString(vm, "init", 4);
+  vm->rootShape = newShape(vm, NULL, NULL);
+
+  for (int i = 0; i < NATIVE_COUNT; i++) {
+    defineNative(vm, natives[i].name, natives[i].function, natives[i].arity);
+  }
 }
 
-static void defineNative(const char* name, NativeFn function) {
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  pop();
-  pop();
+void initVM(VM* vm) {
+  initVMForModule(vm, NULL);
 }
 
-void initVM() {
-  resetStack();
-  initTable(&vm.globals);
-  initTable(&vm.strings);
+bool initVMFromHeap(VM* vm, const char* path) {
+  resetStack(vm);
+  vm->module = NULL;
+  vm->moduleCaches = NULL;
+  initTable(&vm->baseGlobals);
+  initTable(&vm->baseStrings);
+  vm->baseObjects = NULL;
+  vm->heap = NULL;
+  vm->jitEnabled = false;
+  vm->tracesEnabled = false;
+  vm->profiling = false;
+  vm->allocations = NULL;
+  return mapHeap(vm, path);
+}
 
-  defineNative("clock", clockNative);
+void freeVM(VM* vm) {
+  // The profile ends here, and reallocate() mustn't look at the VM.
+  if (allocatingVM == vm) allocatingVM = NULL;
+  vm->allocations = NULL;
+  freeTable(&vm->globals);
+  freeTable(&vm->strings);
+  freeTable(&vm->baseGlobals);
+  freeTable(&vm->baseStrings);
+  vm->initString = NULL;
+  freeObjects(vm->objects, NULL);
+  vm->objects = NULL;
+  if (vm->heap != NULL) unmapHeap(vm);
+
+  if (vm->module != NULL) {
+    FREE_ARRAY(InlineCache, vm->moduleCaches, vm->module->cacheCount);
+    releaseModule(vm->module);
+    vm->module = NULL;
+  }
 }
 
-void freeVM() {
-  freeTable(&vm.globals);
-  freeTable(&vm.strings);
-  freeObjects();
+void snapshotVM(VM* vm) {
+  freeTable(&vm->baseGlobals);
+  freeTable(&vm->baseStrings);
+  tableAddAll(&vm->globals, &vm->baseGlobals);
+  tableAddAll(&vm->strings, &vm->baseStrings);
+  vm->baseObjects = vm->objects;
 }
 
-void push(Value value) {
-  *vm.stackTop = value;
-  vm.stackTop++;
+void resetVM(VM* vm) {
+  resetStack(vm);
+  freeObjects(vm->objects, vm->baseObjects);
+  vm->objects = vm->baseObjects;
+  // The caches may refer to the freed shapes and classes.
+  if (vm->module != NULL) clearCaches(vm);
+
+  freeTable(&vm->globals);
+  freeTable(&vm->strings);
+  tableAddAll(&vm->baseGlobals, &vm->globals);
+  tableAddAll(&vm->baseStrings, &vm->strings);
+
+  // The only object from before the snapshot that scripts change. The
+  // shapes it leads to were just freed.
+  freeTable(&vm->rootShape->transitions);
+  initTable(&vm->rootShape->transitions);
 }
 
-Value pop() {
-  vm.stackTop--;
-  return *vm.stackTop;
+void push(VM* vm, Value value) {
+  *vm->stackTop = value;
+  vm->stackTop++;
 }
 
-static Value peek(int distance) {
-  return vm.stackTop[-1 - distance];
+Value pop(VM* vm) {
+  vm->stackTop--;
+  return *vm->stackTop;
 }
 
-static bool call(ObjClosure* closure, int argCount) {
+static Value peek(VM* vm, int distance) {
+  return vm->stackTop[-1 - distance];
+}
+
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {
-    runtimeError("Expected %d arguments but got %d.",
+    runtimeError(vm, "Expected %d arguments but got %d.",
         closure->function->arity, argCount);
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
-    runtimeError("Stack overflow.");
+  // The verifier found how many slots the function uses at most, so the
+  // instructions themselves don't check for overflow.
+  Value* slots = vm->stackTop - argCount - 1;
+  if (vm->frameCount == FRAMES_MAX ||
+      slots + closure->function->maxSlots > vm->stack + STACK_MAX) {
+    runtimeError(vm, "Stack overflow.");
     return false;
   }
 
-  CallFrame* frame = &vm.frames[vm.frameCount++];
+  CallFrame* frame = &vm->frames[vm->frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  frame->slots = slots;
   return true;
 }
 
 
-static bool callValue(Value callee, int argCount) {
+static bool callValue(VM* vm, Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
+      case OBJ_BOUND_METHOD: {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        return call(vm, bound->method, argCount);
+      }
+      case OBJ_CLASS: {
+        ObjClass* klass = AS_CLASS(callee);
+        vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
+        if (!IS_NIL(klass->initializer)) {
+          return call(vm, AS_CLOSURE(klass->initializer), argCount);
+        } else if (argCount != 0) {
+          runtimeError(vm, "Expected 0 arguments but got %d.", argCount);
+          return false;
+        }
+        return true;
+      }
       case OBJ_CLOSURE: 
-        return call(AS_CLOSURE(callee), argCount);
+        return call(vm, AS_CLOSURE(callee), argCount);
       case OBJ_NATIVE: {
-        NativeFn native = AS_NATIVE(callee);
-        Value result = native(argCount, vm.stackTop - argCount);
-        vm.stackTop -= argCount + 1;
-        push(result);
+        ObjNative* native = AS_NATIVE(callee);
+        if (argCount != native->arity) {
+          runtimeError(vm, "Expected %d arguments but got %d.",
+              native->arity, argCount);
+          return false;
+        }
+
+        if (!native->function(vm, argCount, vm->stackTop - argCount)) {
+          return false;
+        }
+        vm->stackTop -= argCount;
         return true;
       }
       default:
@@ -122,13 +472,131 @@ static bool callValue(Value callee, int argCount) {
     }
   }
 
-  runtimeError("Can only call functions and classes.");
+  runtimeError(vm, "Can only call functions and classes.");
   return false;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
+// Checks that an array index is an integer within bounds.
+static bool arrayIndex(VM* vm, ObjArray* array, Value value, int* index) {
+  if (!IS_NUMBER(value)) {
+    runtimeError(vm, "Array index must be a number.");
+    return false;
+  }
+
+  double number = AS_NUMBER(value);
+  // Written so that NaN is out of bounds too, before it reaches the cast.
+  if (!(number >= 0 && number < array->count)) {
+    runtimeError(vm, "Array index out of bounds.");
+    return false;
+  }
+
+  *index = (int)number;
+  if (*index != number) {
+    runtimeError(vm, "Array index must be an integer.");
+    return false;
+  }
+  return true;
+}
+
+static CacheEntry* findCacheEntry(InlineCache* cache, ObjInstance* instance) {
+  for (int i = 0; i < cache->count; i++) {
+    CacheEntry* entry = &cache->entries[i];
+    if (entry->shape == instance->shape &&
+        (entry->klass == NULL || entry->klass == instance->klass)) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+// Returns where entry was stored, or entry itself once the cache is full.
+static CacheEntry* addCacheEntry(InlineCache* cache, CacheEntry* entry) {
+  if (cache->count == INLINE_CACHE_SIZE) return entry;
+
+  cache->entries[cache->count] = *entry;
+  return &cache->entries[cache->count++];
+}
+
+// Finds what name refers to on instance, a field or else a method.
+static bool resolveProperty(VM* vm, ObjInstance* instance, ObjString* name,
+                            CacheEntry* entry) {
+  entry->shape = instance->shape;
+  entry->klass = NULL;
+  entry->next = NULL;
+  entry->slot = shapeSlot(instance->shape, name);
+  entry->method = NIL_VAL;
+  if (entry->slot != -1) return true;
+
+  if (!tableGet(&instance->klass->methods, name, &entry->method)) {
+    runtimeError(vm, "Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  entry->klass = instance->klass;
+  return true;
+}
+
+static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name,
+                            int argCount, InlineCache* cache) {
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].klass == klass) {
+      return call(vm, AS_CLOSURE(cache->entries[i].method), argCount);
+    }
+  }
+
+  CacheEntry entry = {NULL, klass, NULL, -1, NIL_VAL};
+  if (!tableGet(&klass->methods, name, &entry.method)) {
+    runtimeError(vm, "Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  addCacheEntry(cache, &entry);
+  return call(vm, AS_CLOSURE(entry.method), argCount);
+}
+
+// Calls a method, or a function stored in a field, without creating a
+// bound method for it first.
+static bool invoke(VM* vm, ObjString* name, int argCount, InlineCache* cache) {
+  Value receiver = peek(vm, argCount);
+  if (!IS_INSTANCE(receiver)) {
+    runtimeError(vm, "Only instances have methods.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(receiver);
+  CacheEntry* entry = findCacheEntry(cache, instance);
+  CacheEntry resolved;
+  if (entry == NULL) {
+    if (!resolveProperty(vm, instance, name, &resolved)) return false;
+    entry = addCacheEntry(cache, &resolved);
+  }
+
+  if (entry->slot != -1) {
+    Value value = instance->fields[entry->slot];
+    vm->stackTop[-argCount - 1] = value;
+    return callValue(vm, value, argCount);
+  }
+
+  return call(vm, AS_CLOSURE(entry->method), argCount);
+}
+
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
+  Value method;
+  if (!tableGet(&klass->methods, name, &method)) {
+    runtimeError(vm, "Undefined property '%s'.", name->chars);
+    return false;
+  }
+
+  ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
+  pop(vm);
+  push(vm, OBJ_VAL(bound));
+  return true;
+}
+
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
   ObjUpvalue* prevUpvalue = NULL;
-  ObjUpvalue* upvalue = vm.openUpvalues;
+  ObjUpvalue* upvalue = vm->openUpvalues;
 
   while (upvalue != NULL && upvalue->location > local) {
     prevUpvalue = upvalue;
@@ -139,11 +607,11 @@ static ObjUpvalue* captureUpvalue(Value* local) {
     return upvalue;
   }
 
-  ObjUpvalue* createdUpvalue = newUpvalue(local);
+  ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
   createdUpvalue->next = upvalue;
 
   if (prevUpvalue == NULL) {
-    vm.openUpvalues = createdUpvalue;
+    vm->openUpvalues = createdUpvalue;
   } else {
     prevUpvalue->next = createdUpvalue;
   }
@@ -151,310 +619,740 @@ static ObjUpvalue* captureUpvalue(Value* local) {
   return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
-  while (vm.openUpvalues != NULL &&
-         vm.openUpvalues->location >= last) {
-    ObjUpvalue* upvalue = vm.openUpvalues;
+static void closeUpvalues(VM* vm, Value* last) {
+  while (vm->openUpvalues != NULL &&
+         vm->openUpvalues->location >= last) {
+    ObjUpvalue* upvalue = vm->openUpvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
+    vm->openUpvalues = upvalue->next;
   }
 }
 
+static bool defineMethod(VM* vm, ObjString* name) {
+  // The verifier can't tell what a variable holds, so bytecode that
+  // didn't come from the compiler could name something else.
+  if (!IS_CLASS(peek(vm, 1))) {
+    runtimeError(vm, "Only classes have methods.");
+    return false;
+  }
+
+  Value method = peek(vm, 0);
+  ObjClass* klass = AS_CLASS(peek(vm, 1));
+  tableSet(&klass->methods, name, method);
+  if (name == vm->initString) klass->initializer = method;
+  pop(vm);
+  return true;
+}
+
 static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-  ObjString* b = AS_STRING(pop());
-  ObjString* a = AS_STRING(pop());
+static void concatenate(VM* vm) {
+  ObjString* b = AS_STRING(pop(vm));
+  ObjString* a = AS_STRING(pop(vm));
 
   int length = a->length + b->length;
-  ObjString* result = makeString(length);
+  ObjString* result = makeString(vm, length);
   memcpy(result->chars, a->chars, a->length);
   memcpy(result->chars + a->length, b->chars, b->length);
   result->chars[length] = '\0';
 
-  uint32_t hash = hashString(result->chars, length);
-  ObjString* interned = tableFindString(&vm.strings, result->chars, length, hash);
-  if (interned == NULL) {
-    tableSet(&vm.strings, result, NIL_VAL);
-  }
-
-  push(OBJ_VAL(result));
+  push(vm, OBJ_VAL(internString(vm, result)));
 }
 
-static void convertNumStr(double number) {
+static void convertNumStr(VM* vm, double number) {
 #define MAX_DIGITS_DOUBLE 24
   char string[24];
   snprintf(string, MAX_DIGITS_DOUBLE, "%g", number);
 
-  int length = strlen(string);
-  ObjString* result = makeString(length);
-  memcpy(result->chars, string, length);
-  result->chars[length] = '\0';
+  push(vm, OBJ_VAL(copyString(vm, string, (int)strlen(string))));
+#undef MAX_DIGITS_DOUBLE
+}
 
-  uint32_t hash = hashString(string, length);
-  ObjString* interned = tableFindString(&vm.strings, string, length, hash);
-  if (interned == NULL) {
-    tableSet(&vm.strings, result, NIL_VAL);
+// OP_ADD on anything but two numbers.
+static bool addObjects(VM* vm) {
+  if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+    concatenate(vm);
+  } else if (IS_STRING(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+    Value str = pop(vm);
+    double num = AS_NUMBER(pop(vm));
+    push(vm, str);
+    convertNumStr(vm, num);
+    concatenate(vm);
+  } else if (IS_NUMBER(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+    double num = AS_NUMBER(pop(vm));
+    convertNumStr(vm, num);
+    concatenate(vm);
+  } else {
+    runtimeError(vm, "Operands must be two numbers or two strings.");
+    return false;
   }
+  return true;
+}
 
-  push(OBJ_VAL(result));
-#undef MAX_DIGITS_DOUBLE
+// The instructions below take their operands from the stack like
+// run() does, and are shared with compiled code. The ones that return
+// bool return false after reporting a runtime error, so the frame's ip
+// has to be stored first.
+
+static bool getProperty(VM* vm, ObjString* name, InlineCache* cache) {
+  if (!IS_INSTANCE(peek(vm, 0))) {
+    runtimeError(vm, "Only instances have properties.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
+  CacheEntry* entry = findCacheEntry(cache, instance);
+  CacheEntry resolved;
+  if (entry == NULL) {
+    if (!resolveProperty(vm, instance, name, &resolved)) return false;
+    entry = addCacheEntry(cache, &resolved);
+  }
+
+  if (entry->slot != -1) {
+    vm->stackTop[-1] = instance->fields[entry->slot];
+  } else {
+    vm->stackTop[-1] = OBJ_VAL(newBoundMethod(
+        vm, vm->stackTop[-1], AS_CLOSURE(entry->method)));
+  }
+  return true;
 }
 
-static InterpretResult run() {
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+static bool setProperty(VM* vm, ObjString* name, InlineCache* cache) {
+  if (!IS_INSTANCE(peek(vm, 1))) {
+    runtimeError(vm, "Only instances have fields.");
+    return false;
+  }
+
+  ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+  CacheEntry* entry = findCacheEntry(cache, instance);
+  if (entry == NULL) {
+    CacheEntry added = {instance->shape, NULL, NULL, -1, NIL_VAL};
+    added.next = setField(vm, instance, name, peek(vm, 0));
+    added.slot = instance->shape->fieldCount - 1;
+    if (added.next == NULL) added.slot = shapeSlot(added.shape, name);
+    addCacheEntry(cache, &added);
+  } else if (entry->next != NULL) {
+    addField(instance, entry->next, peek(vm, 0));
+  } else {
+    instance->fields[entry->slot] = peek(vm, 0);
+  }
+
+  Value value = pop(vm);
+  pop(vm);
+  push(vm, value);
+  return true;
+}
+
+static bool getSuper(VM* vm, ObjString* name) {
+  if (!IS_CLASS(peek(vm, 0))) {
+    runtimeError(vm, "Superclass must be a class.");
+    return false;
+  }
+
+  ObjClass* superclass = AS_CLASS(pop(vm));
+  return bindMethod(vm, superclass, name);
+}
+
+static bool superInvoke(VM* vm, ObjString* name, int argCount,
+                        InlineCache* cache) {
+  if (!IS_CLASS(peek(vm, 0))) {
+    runtimeError(vm, "Superclass must be a class.");
+    return false;
+  }
+
+  ObjClass* superclass = AS_CLASS(pop(vm));
+  return invokeFromClass(vm, superclass, name, argCount, cache);
+}
+
+static void makeArray(VM* vm, int elementCount) {
+  ObjArray* array = newArray(vm);
+  for (int i = elementCount; i > 0; i--) {
+    appendArray(array, peek(vm, i - 1));
+  }
+  vm->stackTop -= elementCount;
+  push(vm, OBJ_VAL(array));
+}
+
+static bool makeMap(VM* vm, int entryCount) {
+  ObjMap* map = newMap(vm);
+  for (int i = entryCount * 2; i > 0; i -= 2) {
+    if (!mapKey(vm, peek(vm, i - 1))) return false;
+    mapSet(map, peek(vm, i - 1), peek(vm, i - 2));
+  }
+  vm->stackTop -= entryCount * 2;
+  push(vm, OBJ_VAL(map));
+  return true;
+}
+
+static bool indexGet(VM* vm) {
+  if (IS_MAP(peek(vm, 1))) {
+    Value value;
+    if (!mapKey(vm, peek(vm, 0))) return false;
+    ObjMap* map = AS_MAP(peek(vm, 1));
+    if (!tableGetValue(&map->table, peek(vm, 0), &value)) {
+      runtimeError(vm, "Undefined key.");
+      return false;
+    }
+
+    vm->stackTop -= 2;
+    push(vm, value);
+    return true;
+  }
+
+  if (!IS_ARRAY(peek(vm, 1))) {
+    runtimeError(vm, "Only arrays and maps can be indexed.");
+    return false;
+  }
+
+  ObjArray* array = AS_ARRAY(peek(vm, 1));
+  int index;
+  if (!arrayIndex(vm, array, peek(vm, 0), &index)) return false;
+
+  vm->stackTop -= 2;
+  push(vm, arrayElement(array, index));
+  return true;
+}
+
+static bool indexSet(VM* vm) {
+  if (IS_MAP(peek(vm, 2))) {
+    if (!mapKey(vm, peek(vm, 1))) return false;
+    mapSet(AS_MAP(peek(vm, 2)), peek(vm, 1), peek(vm, 0));
+  } else if (IS_ARRAY(peek(vm, 2))) {
+    ObjArray* array = AS_ARRAY(peek(vm, 2));
+    int index;
+    if (!arrayIndex(vm, array, peek(vm, 1), &index)) return false;
+    setArrayElement(array, index, peek(vm, 0));
+  } else {
+    runtimeError(vm, "Only arrays and maps can be indexed.");
+    return false;
+  }
+
+  Value value = pop(vm);
+  vm->stackTop -= 2;
+  push(vm, value);
+  return true;
+}
+
+// Creates the closure for the OP_CLOSURE or OP_CLOSURE_LONG at ip in the
+// frame's code, and returns the ip after its operands.
+static uint8_t* makeClosure(VM* vm, CallFrame* frame, uint8_t* ip) {
+  bool isLong = *ip++ == OP_CLOSURE_LONG;
+  uint32_t operand = ip[0];
+  if (isLong) operand = (operand << 16) | (ip[1] << 8) | ip[2];
+  ip += isLong ? 3 : 1;
+
+  Chunk* chunk = &frame->closure->function->chunk;
+  ObjFunction* function = AS_FUNCTION(chunk->constants.values[operand]);
+  ObjClosure* closure = newClosure(vm, function);
+  push(vm, OBJ_VAL(closure));
+  for (int i = 0; i < closure->upvalueCount; i++) {
+    uint8_t isLocal = *ip++;
+    uint32_t index = ip[0];
+    if (isLong) index = (index << 16) | (ip[1] << 8) | ip[2];
+    ip += isLong ? 3 : 1;
+
+    if (isLocal) {
+      closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+    } else {
+      closure->upvalues[i] = frame->closure->upvalues[index];
+    }
+  }
+  return ip;
+}
+
+static bool inherit(VM* vm) {
+  Value superclass = peek(vm, 1);
+  if (!IS_CLASS(superclass)) {
+    runtimeError(vm, "Superclass must be a class.");
+    return false;
+  }
+
+  if (!IS_CLASS(peek(vm, 0))) {
+    runtimeError(vm, "Only classes can inherit.");
+    return false;
+  }
+
+  ObjClass* subclass = AS_CLASS(peek(vm, 0));
+  tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+  subclass->initializer = AS_CLASS(superclass)->initializer;
+  pop(vm); // Subclass.
+  return true;
+}
+
+// Counts how hot the function is and compiles it once it is hot enough.
+// Returns whether it has machine code.
+static bool jitReady(ObjFunction* function) {
+  if (function->jit != NULL) return true;
+  if (function->frozen || function->hotness < 0) return false;
+  if (++function->hotness < JIT_THRESHOLD) return false;
+  return compileJit(function);
+}
+
+// Whether the function runs as code compiled ahead of time or by the
+// JIT instead of in run().
+static bool hasCompiledCode(VM* vm, ObjFunction* function) {
+  if (function->aot != NULL) return true;
+  return vm->jitEnabled && jitReady(function);
+}
+
+// Runs the top frame in its compiled code until it returns. A function
+// compiled ahead of time runs all its frames there, so they only start
+// from the beginning.
+static InterpretResult runCompiled(VM* vm, CallFrame* frame) {
+  ObjFunction* function = frame->closure->function;
+  if (function->aot != NULL) {
+    return function->aot(vm) ? INTERPRET_OK : INTERPRET_RUNTIME_ERROR;
+  }
+  return runJit(vm, frame);
+}
+
+// Runs frames until the one at exitDepth returns, so compiled code can
+// run the interpreter for a call and get back control. There are two
+// copies, one that keeps frame->ip current for the profiler and one that
+// doesn't, each in a function of its own so the plain loop is compiled
+// as if the profiler weren't there.
+static inline __attribute__((always_inline)) InterpretResult runFrames(
+    VM* vm, int exitDepth, bool profiling) {
+  CallFrame* frame = &vm->frames[vm->frameCount - 1];
   register uint8_t* ip = frame->ip;
 
 #define READ_BYTE()     (*ip++)
 #define READ_SHORT()    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+#define READ_LONG() \
+    (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_UINT32() \
+    (ip += 4, ((uint32_t)ip[-4] << 24) | ((uint32_t)ip[-3] << 16) | \
+              ((uint32_t)ip[-2] << 8) | (uint32_t)ip[-1])
+#define CONSTANT(index) (frame->closure->function->chunk.constants.values[index])
+#define READ_CONSTANT() CONSTANT(READ_BYTE())
 #define READ_STRING()   AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op)                        \
+#define READ_CACHE()    (&frame->closure->caches[READ_SHORT()])
+// Hands the top frame to its compiled code, if it has any, whenever the
+// interpreter starts running a frame or jumps back in a loop. The
+// compiled code runs the frame until it returns.
+#define ENTER_COMPILED()                                             \
+    do {                                                             \
+      while (hasCompiledCode(vm, frame->closure->function)) {        \
+        frame->ip = ip;                                              \
+        InterpretResult result = runCompiled(vm, frame);             \
+        if (result != INTERPRET_OK) return result;                   \
+        if (vm->frameCount == exitDepth) return INTERPRET_OK;        \
+        frame = &vm->frames[vm->frameCount - 1];                     \
+        ip = frame->ip;                                              \
+      }                                                              \
+    } while (false)
+// Hands a loop to its trace, if traces are on, when the interpreter
+// jumps back to the loop header.
+#define ENTER_TRACE()                                                \
+    do {                                                             \
+      if (vm->tracesEnabled) ip = enterTrace(vm, frame, ip);         \
+    } while (false)
+// Frozen code is shared between threads, so it is never rewritten.
+#define QUICKEN(instruction)                            \
     do {                                                \
-      if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+      if (!frame->closure->function->frozen) {          \
+        ip[-1] = instruction;                           \
+      }                                                 \
+    } while (false)
+#define BINARY_OP(valueType, op, numberOp)              \
+    do {                                                \
+      if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
         frame->ip = ip;                                 \
-        runtimeError("Operands must be numbers.");      \
+        runtimeError(vm, "Operands must be numbers.");      \
         return INTERPRET_RUNTIME_ERROR;                 \
       }                                                 \
-      double b = AS_NUMBER(pop());                      \
-      double a = AS_NUMBER(pop());                      \
-      push(valueType(a op b));                          \
+      QUICKEN(numberOp);                                \
+      double b = AS_NUMBER(pop(vm));                      \
+      double a = AS_NUMBER(pop(vm));                      \
+      push(vm, valueType(a op b));                          \
     } while (false)
+// The quickened form of an arithmetic instruction. When the operands
+// aren't both numbers it turns back into the generic instruction and
+// runs that instead.
+#define NUMBER_OP(valueType, op, genericOp)             \
+    do {                                                \
+      Value* b = vm->stackTop - 1;                       \
+      Value* a = vm->stackTop - 2;                       \
+      if (!IS_NUMBER(*a) || !IS_NUMBER(*b)) {           \
+        *--ip = genericOp;                              \
+        break;                                          \
+      }                                                 \
+      *a = valueType(AS_NUMBER(*a) op AS_NUMBER(*b));   \
+      vm->stackTop--;                                    \
+    } while (false)
+
+  ENTER_COMPILED();
 
   for (;;) {
 #ifdef DEBUG_VM_TABLES
-    // inspectVm(&vm);
-    // printf("Table globals: "); inspectTable(&vm.globals);
+    // inspectVm(vm);
+    // printf("Table globals: "); inspectTable(&vm->globals);
 #endif
 #ifdef DEBUG_TRACE_EXECUTION
-    inspectStack(&vm);
+    inspectStack(vm);
     // inspectChunk(&frame->closure->function->chunk);
     disassembleInstruction(
         &frame->closure->function->chunk,
         (int)(frame->ip - frame->closure->function->chunk.code));
 #endif
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
+    // One past the opcode, so the line the profiler looks up is the one
+    // of the instruction that runs, as it is for a frame that made a call.
+    if (profiling) frame->ip = ip + 1;
+    // The _LONG instructions read their operand here and jump to the
+    // body they share with the one byte form.
+    uint32_t operand;
+    switch (READ_BYTE()) {
       case OP_CONSTANT: {
         Value constant = READ_CONSTANT();
-        push(constant);
+        push(vm, constant);
         break;
       }
 
       case OP_CONSTANT_LONG: {
-        uint8_t index_byte1 = READ_BYTE();
-        uint8_t index_byte2 = READ_BYTE();
-        uint8_t index_byte3 = READ_BYTE();
-        uint32_t full_index = index_byte1 << 16 | index_byte2 << 8 | index_byte3;
-        Value constant = frame->closure->function->chunk.constants.values[full_index];
-        push(constant);
+        Value constant = CONSTANT(READ_LONG());
+        push(vm, constant);
         break;
       }
 
-      case OP_NIL: push(NIL_VAL); break;
-      case OP_TRUE: push(BOOL_VAL(true)); break;
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_ZERO: push(NUMBER_VAL(0)); break;
-      case OP_ONE: push(NUMBER_VAL(1)); break;
-      case OP_POP: pop(); break;
+      case OP_NIL: push(vm, NIL_VAL); break;
+      case OP_TRUE: push(vm, BOOL_VAL(true)); break;
+      case OP_FALSE: push(vm, BOOL_VAL(false)); break;
+      case OP_ZERO: push(vm, NUMBER_VAL(0)); break;
+      case OP_ONE: push(vm, NUMBER_VAL(1)); break;
+      case OP_POP: pop(vm); break;
 
       case OP_POPN: {
         uint8_t pops = READ_BYTE();
-        while(pops-- > 0) pop();
+        while(pops-- > 0) pop(vm);
         break;
       }
 
-      case OP_DUP: push(peek(0)); break;
+      case OP_DUP: push(vm, peek(vm, 0)); break;
 
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
+      case OP_GET_LOCAL_LONG: operand = READ_LONG(); goto getLocal;
+      case OP_GET_LOCAL: operand = READ_BYTE();
+      getLocal:
+        push(vm, frame->slots[operand]);
         break;
-      }
 
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
+      case OP_SET_LOCAL_LONG: operand = READ_LONG(); goto setLocal;
+      case OP_SET_LOCAL: operand = READ_BYTE();
+      setLocal:
+        frame->slots[operand] = peek(vm, 0);
         break;
-      }
 
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
+      case OP_GET_GLOBAL_LONG: operand = READ_LONG(); goto getGlobal;
+      case OP_GET_GLOBAL: operand = READ_BYTE();
+      getGlobal: {
+        ObjString* name = AS_STRING(CONSTANT(operand));
         Value value;
-        if (!tableGet(&vm.globals, name, &value)) {
+        if (!tableGet(&vm->globals, name, &value)) {
           frame->ip = ip;
-          runtimeError("Undefined variable '%s'.", name->chars);
+          runtimeError(vm, "Undefined variable '%s'.", name->chars);
           return INTERPRET_RUNTIME_ERROR;
         }
-        push(value);
+        push(vm, value);
         break;
       }
 
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
+      case OP_DEFINE_GLOBAL_LONG: operand = READ_LONG(); goto defineGlobal;
+      case OP_DEFINE_GLOBAL: operand = READ_BYTE();
+      defineGlobal: {
+        ObjString* name = AS_STRING(CONSTANT(operand));
+        tableSet(&vm->globals, name, peek(vm, 0));
+        pop(vm);
         break;
       }
 
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        if (tableSet(&vm.globals, name, peek(0))) {
-          tableDelete(&vm.globals, name);
+      case OP_SET_GLOBAL_LONG: operand = READ_LONG(); goto setGlobal;
+      case OP_SET_GLOBAL: operand = READ_BYTE();
+      setGlobal: {
+        ObjString* name = AS_STRING(CONSTANT(operand));
+        if (tableSet(&vm->globals, name, peek(vm, 0))) {
+          tableDelete(&vm->globals, name);
           frame->ip = ip;
-          runtimeError("Undefined variable '%s'.", name->chars);
+          runtimeError(vm, "Undefined variable '%s'.", name->chars);
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        break;
+      }
+
+      case OP_GET_UPVALUE_LONG: operand = READ_LONG(); goto getUpvalue;
+      case OP_GET_UPVALUE: operand = READ_BYTE();
+      getUpvalue:
+        push(vm, *frame->closure->upvalues[operand]->location);
+        break;
+
+      case OP_SET_UPVALUE_LONG: operand = READ_LONG(); goto setUpvalue;
+      case OP_SET_UPVALUE: operand = READ_BYTE();
+      setUpvalue:
+        *frame->closure->upvalues[operand]->location = peek(vm, 0);
+        break;
+
+      case OP_GET_PROPERTY_LONG: operand = READ_LONG(); goto getProperty;
+      case OP_GET_PROPERTY: operand = READ_BYTE();
+      getProperty: {
+        ObjString* name = AS_STRING(CONSTANT(operand));
+        InlineCache* cache = READ_CACHE();
+        frame->ip = ip;
+        if (!getProperty(vm, name, cache)) return INTERPRET_RUNTIME_ERROR;
+        break;
+      }
+
+      case OP_SET_PROPERTY_LONG: operand = READ_LONG(); goto setProperty;
+      case OP_SET_PROPERTY: operand = READ_BYTE();
+      setProperty: {
+        ObjString* name = AS_STRING(CONSTANT(operand));
+        InlineCache* cache = READ_CACHE();
+        frame->ip = ip;
+        if (!setProperty(vm, name, cache)) return INTERPRET_RUNTIME_ERROR;
+        break;
+      }
+
+      case OP_GET_SUPER_LONG: operand = READ_LONG(); goto getSuper;
+      case OP_GET_SUPER: operand = READ_BYTE();
+      getSuper: {
+        ObjString* name = AS_STRING(CONSTANT(operand));
+        frame->ip = ip;
+        if (!getSuper(vm, name)) return INTERPRET_RUNTIME_ERROR;
+        break;
+      }
+
+      case OP_INVOKE_LONG: operand = READ_LONG(); goto invoke;
+      case OP_INVOKE: operand = READ_BYTE();
+      invoke: {
+        ObjString* method = AS_STRING(CONSTANT(operand));
+        int argCount = READ_BYTE();
+        InlineCache* cache = READ_CACHE();
+        frame->ip = ip;
+        if (!invoke(vm, method, argCount, cache)) {
           return INTERPRET_RUNTIME_ERROR;
         }
+        frame = &vm->frames[vm->frameCount - 1];
+        ip = frame->ip;
+        ENTER_COMPILED();
         break;
       }
 
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
+      case OP_SUPER_INVOKE_LONG: operand = READ_LONG(); goto superInvoke;
+      case OP_SUPER_INVOKE: operand = READ_BYTE();
+      superInvoke: {
+        ObjString* method = AS_STRING(CONSTANT(operand));
+        int argCount = READ_BYTE();
+        InlineCache* cache = READ_CACHE();
+        frame->ip = ip;
+        if (!superInvoke(vm, method, argCount, cache)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        frame = &vm->frames[vm->frameCount - 1];
+        ip = frame->ip;
+        ENTER_COMPILED();
         break;
       }
 
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
+      case OP_ARRAY: makeArray(vm, READ_BYTE()); break;
+
+      case OP_MAP: {
+        int entryCount = READ_BYTE();
+        frame->ip = ip;
+        if (!makeMap(vm, entryCount)) return INTERPRET_RUNTIME_ERROR;
         break;
       }
 
+      case OP_INDEX_GET:
+        frame->ip = ip;
+        if (!indexGet(vm)) return INTERPRET_RUNTIME_ERROR;
+        break;
+
+      case OP_INDEX_SET:
+        frame->ip = ip;
+        if (!indexSet(vm)) return INTERPRET_RUNTIME_ERROR;
+        break;
+
       case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(valuesEqual(a, b)));
+        Value b = pop(vm);
+        Value a = pop(vm);
+        push(vm, BOOL_VAL(valuesEqual(a, b)));
         break;
       }
 
       case OP_NEQUAL: {
-        Value b = pop();
-        Value a = pop();
-        push(BOOL_VAL(!valuesEqual(a, b)));
+        Value b = pop(vm);
+        Value a = pop(vm);
+        push(vm, BOOL_VAL(!valuesEqual(a, b)));
         break;
       }
 
-      case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-      case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
+      case OP_GREATER:  BINARY_OP(BOOL_VAL, >, OP_GREATER_NUMBER); break;
+      case OP_LESS:     BINARY_OP(BOOL_VAL, <, OP_LESS_NUMBER); break;
 
       case OP_ADD: {
-        if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-          push(NUMBER_VAL(a + b));
-        } else if (IS_STRING(peek(0)) && IS_NUMBER(peek(1))) {
-          Value str = pop();
-          double num = AS_NUMBER(pop());
-          push(str);
-          convertNumStr(num);
-          concatenate();
-        } else if (IS_NUMBER(peek(0)) && IS_STRING(peek(1))) {
-          double num = AS_NUMBER(pop());
-          convertNumStr(num);
-          concatenate();
+        if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+          QUICKEN(OP_ADD_NUMBER);
+          double b = AS_NUMBER(pop(vm));
+          double a = AS_NUMBER(pop(vm));
+          push(vm, NUMBER_VAL(a + b));
         } else {
           frame->ip = ip;
-          runtimeError("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
+          if (!addObjects(vm)) return INTERPRET_RUNTIME_ERROR;
         }
         break;
       }
 
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
+      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUMBER); break;
+      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUMBER); break;
+      case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUMBER); break;
+
+      case OP_GREATER_NUMBER:  NUMBER_OP(BOOL_VAL, >, OP_GREATER); break;
+      case OP_LESS_NUMBER:     NUMBER_OP(BOOL_VAL, <, OP_LESS); break;
+      case OP_ADD_NUMBER:      NUMBER_OP(NUMBER_VAL, +, OP_ADD); break;
+      case OP_SUBTRACT_NUMBER: NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); break;
+      case OP_MULTIPLY_NUMBER: NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); break;
+      case OP_DIVIDE_NUMBER:   NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE); break;
 
       case OP_NOT:
-        push(BOOL_VAL(isFalsey(pop())));
+        push(vm, BOOL_VAL(isFalsey(pop(vm))));
         break;
 
       case OP_NEGATE:
-        if (!IS_NUMBER(peek(0))) {
+        if (!IS_NUMBER(peek(vm, 0))) {
           frame->ip = ip;
-          runtimeError("Operand must be a number.");
+          runtimeError(vm, "Operand must be a number.");
           return INTERPRET_RUNTIME_ERROR;
         }
-        // push(NUMBER_VAL(-AS_NUMBER(pop())));
-        *(vm.stackTop-1) = NUMBER_VAL(-AS_NUMBER(*(vm.stackTop-1)));
+        // push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+        *(vm->stackTop-1) = NUMBER_VAL(-AS_NUMBER(*(vm->stackTop-1)));
         break;
 
       case OP_PRINT: {
-        printValue(pop());
+        printValue(pop(vm));
         printf("\n");
         break;
       }
 
+      case OP_JUMP_NEAR: {
+        uint8_t offset = READ_BYTE();
+        ip += offset;
+        break;
+      }
+
       case OP_JUMP: {
         uint16_t offset = READ_SHORT();
         ip += offset;
         break;
       }
 
+      case OP_JUMP_LONG: {
+        uint32_t offset = READ_UINT32();
+        ip += offset;
+        break;
+      }
+
+      case OP_JUMP_IF_FALSE_NEAR: {
+        uint8_t offset = READ_BYTE();
+        if (isFalsey(peek(vm, 0))) ip += offset;
+        break;
+      }
+
       case OP_JUMP_IF_FALSE: {
         uint16_t offset = READ_SHORT();
-        if (isFalsey(peek(0))) ip += offset;
+        if (isFalsey(peek(vm, 0))) ip += offset;
+        break;
+      }
+
+      case OP_JUMP_IF_FALSE_LONG: {
+        uint32_t offset = READ_UINT32();
+        if (isFalsey(peek(vm, 0))) ip += offset;
+        break;
+      }
+
+      case OP_LOOP_NEAR: {
+        uint8_t offset = READ_BYTE();
+        ip -= offset;
+        ENTER_TRACE();
+        ENTER_COMPILED();
         break;
       }
 
       case OP_LOOP: {
         uint16_t offset = READ_SHORT();
         ip -= offset;
+        ENTER_TRACE();
+        ENTER_COMPILED();
+        break;
+      }
+
+      case OP_LOOP_LONG: {
+        uint32_t offset = READ_UINT32();
+        ip -= offset;
+        ENTER_TRACE();
+        ENTER_COMPILED();
         break;
       }
 
       case OP_CALL: {
         int argCount = READ_BYTE();
         frame->ip = ip;
-        if (!callValue(peek(argCount), argCount)) {
+        if (!callValue(vm, peek(vm, argCount), argCount)) {
           return INTERPRET_RUNTIME_ERROR;
         }
-        frame = &vm.frames[vm.frameCount - 1];
+        frame = &vm->frames[vm->frameCount - 1];
         ip = frame->ip;
+        ENTER_COMPILED();
         break;
       }
 
-      case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        for (int i = 0; i < closure->upvalueCount; i++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if (isLocal) {
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
-        }
+      case OP_CLOSURE_LONG:
+      case OP_CLOSURE:
+        ip = makeClosure(vm, frame, ip - 1);
         break;
-      }
 
       case OP_CLOSE_UPVALUE:
-        closeUpvalues(vm.stackTop - 1);
-        pop();
+        closeUpvalues(vm, vm->stackTop - 1);
+        pop(vm);
+        break;
+
+      case OP_CLASS_LONG: operand = READ_LONG(); goto klass;
+      case OP_CLASS: operand = READ_BYTE();
+      klass:
+        push(vm, OBJ_VAL(newClass(vm, AS_STRING(CONSTANT(operand)))));
+        break;
+
+      case OP_INHERIT:
+        frame->ip = ip;
+        if (!inherit(vm)) return INTERPRET_RUNTIME_ERROR;
+        break;
+
+      case OP_METHOD_LONG: operand = READ_LONG(); goto method;
+      case OP_METHOD: operand = READ_BYTE();
+      method:
+        frame->ip = ip;
+        if (!defineMethod(vm, AS_STRING(CONSTANT(operand)))) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
         break;
 
       case OP_RETURN: {
-        Value result = pop();
+        Value result = pop(vm);
 
-        closeUpvalues(frame->slots);
+        closeUpvalues(vm, frame->slots);
 
-        vm.frameCount--;
-        if (vm.frameCount == 0) {
-          pop();
+        vm->frameCount--;
+        if (vm->frameCount == 0) {
+          pop(vm);
           return INTERPRET_OK;
         }
 
-        vm.stackTop = frame->slots;
-        push(result);
+        vm->stackTop = frame->slots;
+        push(vm, result);
+        if (vm->frameCount == exitDepth) return INTERPRET_OK;
 
-        frame = &vm.frames[vm.frameCount - 1];
+        frame = &vm->frames[vm->frameCount - 1];
         ip = frame->ip;
+        ENTER_COMPILED();
         break;
       }
     }
@@ -463,19 +1361,188 @@ static InterpretResult run() {
 #undef READ_BYTE
 #undef READ_CONSTANT
 #undef READ_SHORT
+#undef READ_LONG
+#undef READ_UINT32
+#undef CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
+#undef QUICKEN
+#undef ENTER_COMPILED
+#undef ENTER_TRACE
 #undef BINARY_OP
+#undef NUMBER_OP
 }
 
-InterpretResult interpret(const char* source) {
-  ObjFunction* function = compile(source);
-  if (function == NULL) return INTERPRET_COMPILE_ERROR;
+static __attribute__((noinline)) InterpretResult runPlain(
+    VM* vm, int exitDepth) {
+  return runFrames(vm, exitDepth, false);
+}
+
+static __attribute__((noinline)) InterpretResult runProfiled(
+    VM* vm, int exitDepth) {
+  return runFrames(vm, exitDepth, true);
+}
+
+static InterpretResult run(VM* vm, int exitDepth) {
+  return vm->profiling ? runProfiled(vm, exitDepth)
+                       : runPlain(vm, exitDepth);
+}
+
+// ----------------------------------
+//      Runtime for compiled code
+// ----------------------------------
+
+bool jitGetGlobal(VM* vm, ObjString* name) {
+  Value value;
+  if (!tableGet(&vm->globals, name, &value)) {
+    runtimeError(vm, "Undefined variable '%s'.", name->chars);
+    return false;
+  }
+  push(vm, value);
+  return true;
+}
+
+bool jitSetGlobal(VM* vm, ObjString* name) {
+  if (tableSet(&vm->globals, name, peek(vm, 0))) {
+    tableDelete(&vm->globals, name);
+    runtimeError(vm, "Undefined variable '%s'.", name->chars);
+    return false;
+  }
+  return true;
+}
+
+void jitDefineGlobal(VM* vm, ObjString* name) {
+  tableSet(&vm->globals, name, peek(vm, 0));
+  pop(vm);
+}
+
+bool jitAdd(VM* vm) {
+  return addObjects(vm);
+}
+
+void jitError(VM* vm, const char* message) {
+  runtimeError(vm, "%s", message);
+}
+
+void jitPrint(VM* vm) {
+  printValue(pop(vm));
+  printf("\n");
+}
+
+void jitCloseUpvalue(VM* vm) {
+  closeUpvalues(vm, vm->stackTop - 1);
+  pop(vm);
+}
+
+// Runs the frame a call pushed, if it pushed one, until it returns.
+static bool finishCall(VM* vm, int depth) {
+  if (vm->frameCount == depth) return true;
+  return run(vm, depth) == INTERPRET_OK;
+}
+
+bool jitCall(VM* vm, int argCount) {
+  int depth = vm->frameCount;
+  if (!callValue(vm, peek(vm, argCount), argCount)) return false;
+  return finishCall(vm, depth);
+}
+
+void jitReturn(VM* vm, CallFrame* frame) {
+  Value result = pop(vm);
+  closeUpvalues(vm, frame->slots);
+
+  vm->frameCount--;
+  if (vm->frameCount == 0) {
+    pop(vm);
+    return;
+  }
+
+  vm->stackTop = frame->slots;
+  push(vm, result);
+}
+
+static InlineCache* frameCache(VM* vm, int index) {
+  return &vm->frames[vm->frameCount - 1].closure->caches[index];
+}
+
+bool aotGetProperty(VM* vm, ObjString* name, int cache) {
+  return getProperty(vm, name, frameCache(vm, cache));
+}
+
+bool aotSetProperty(VM* vm, ObjString* name, int cache) {
+  return setProperty(vm, name, frameCache(vm, cache));
+}
+
+bool aotGetSuper(VM* vm, ObjString* name) {
+  return getSuper(vm, name);
+}
+
+bool aotInvoke(VM* vm, ObjString* name, int argCount, int cache) {
+  int depth = vm->frameCount;
+  if (!invoke(vm, name, argCount, frameCache(vm, cache))) return false;
+  return finishCall(vm, depth);
+}
 
-  push(OBJ_VAL(function));
-  ObjClosure* closure = newClosure(function);
-  pop();
-  push(OBJ_VAL(closure));
-  callValue(OBJ_VAL(closure), 0);
+bool aotSuperInvoke(VM* vm, ObjString* name, int argCount, int cache) {
+  int depth = vm->frameCount;
+  if (!superInvoke(vm, name, argCount, frameCache(vm, cache))) return false;
+  return finishCall(vm, depth);
+}
+
+void aotClosure(VM* vm, uint8_t* ip) {
+  makeClosure(vm, &vm->frames[vm->frameCount - 1], ip);
+}
+
+void aotClass(VM* vm, ObjString* name) {
+  push(vm, OBJ_VAL(newClass(vm, name)));
+}
+
+bool aotInherit(VM* vm) {
+  return inherit(vm);
+}
+
+bool aotMethod(VM* vm, ObjString* name) {
+  return defineMethod(vm, name);
+}
+
+void aotArray(VM* vm, int elementCount) {
+  makeArray(vm, elementCount);
+}
+
+bool aotMap(VM* vm, int entryCount) {
+  return makeMap(vm, entryCount);
+}
+
+bool aotIndexGet(VM* vm) {
+  return indexGet(vm);
+}
+
+bool aotIndexSet(VM* vm) {
+  return indexSet(vm);
+}
+
+InterpretResult interpretFunction(VM* vm, ObjFunction* function) {
+  push(vm, OBJ_VAL(function));
+  ObjClosure* closure = newClosure(vm, function);
+  pop(vm);
+  push(vm, OBJ_VAL(closure));
+  callValue(vm, OBJ_VAL(closure), 0);
+
+  return run(vm, 0);
+}
+
+InterpretResult interpretModule(VM* vm, Module* module) {
+  if (vm->module != module) {
+    freeVM(vm);
+    initVMForModule(vm, module);
+    snapshotVM(vm);
+  }
+
+  return interpretFunction(vm, module->script);
+}
+
+InterpretResult interpret(VM* vm, const char* source) {
+  ObjFunction* function = compile(vm, source);
+  if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
-  return run();
+  return interpretFunction(vm, function);
 }
\ No newline at end of file
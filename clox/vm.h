@@ -7,7 +7,9 @@
 #include "value.h"
 
 #define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// Room for every frame to have a byte's worth of slots, plus one
+// function that uses the most locals a function can have.
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT + UINT16_COUNT)
 
 typedef struct {
   ObjClosure* closure;
@@ -15,16 +17,45 @@ typedef struct {
   Value* slots;
 } CallFrame;
 
-typedef struct {
+// Defined in module.h.
+typedef struct Module Module;
+
+// All the state of one interpreter. VMs share nothing but the frozen
+// modules they run, so each thread can run scripts in its own VM.
+struct VM {
   CallFrame frames[FRAMES_MAX];
   int frameCount;
   Value stack[STACK_MAX];
   Value* stackTop;
   Table globals;
   Table strings;
+  ObjString* initString;
+  ObjShape* rootShape;
   ObjUpvalue* openUpvalues;
   Obj* objects;
-} VM;
+  // What resetVM() goes back to.
+  Table baseGlobals;
+  Table baseStrings;
+  Obj* baseObjects;
+  // The module the VM runs, if any. Its strings are interned before the
+  // VM's own, and moduleCaches are the inline caches for its functions.
+  Module* module;
+  InlineCache* moduleCaches;
+  // The heap image the VM was started from, if any. Its objects are
+  // part of the objects list.
+  void* heap;
+  size_t heapSize;
+  // Whether hot functions are compiled to machine code. See jit.h.
+  bool jitEnabled;
+  // Whether hot loops are recorded and run as traces. See trace.h.
+  bool tracesEnabled;
+  // Whether run() stores its ip in the frame before every instruction,
+  // so the profilers see the line the frame is on. See profiler.h and
+  // allocations.h.
+  bool profiling;
+  // Where allocations are counted, if they are. See allocations.h.
+  struct AllocationProfile* allocations;
+};
 
 typedef enum {
   INTERPRET_OK,
@@ -32,12 +63,33 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
-
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
+void initVM(VM* vm);
+// Starts the VM from a heap image written by writeHeap() instead of
+// from scratch. Returns false, with nothing to free, when the image
+// can't be used.
+bool initVMFromHeap(VM* vm, const char* path);
+void freeVM(VM* vm);
+// Makes the current globals, interned strings and objects the state that
+// resetVM() returns to. Scripts run after the snapshot must not change
+// the objects from before it, so it is meant to be taken right after
+// initVM(). A VM started from a heap image is freed and started again
+// instead, which costs about as little.
+void snapshotVM(VM* vm);
+// Frees everything created since the snapshot and restores the globals
+// and interned strings, which readies the VM for another script far
+// cheaper than freeVM() and initVM().
+void resetVM(VM* vm);
+InterpretResult interpret(VM* vm, const char* source);
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
+// Runs the module's script. A VM that ran another module, or none, is
+// first freed and set up again for this one, and a new snapshot taken.
+InterpretResult interpretModule(VM* vm, Module* module);
+// The natives every VM defines, numbered so that heap images can refer
+// to them. nativeIndex() returns -1 and nativeFunction() NULL for
+// anything else.
+int nativeIndex(NativeFn function);
+NativeFn nativeFunction(int index);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
 
 #endif
\ No newline at end of file
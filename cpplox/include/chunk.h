@@ -8,6 +8,9 @@
 
 enum OpCode : uint8_t {
     OP_CONSTANT,
+    // Takes a 24-bit constant index, big-endian, once there are more
+    // constants than OP_CONSTANT's byte can index.
+    OP_CONSTANT_LONG,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -28,6 +31,7 @@ public:
     int disassembleInstruction(int offset) const;
     int simpleInstruction(const char* name, int offset) const;
     int constantInstruction(const char* name, int offset) const;
+    int longConstantInstruction(const char* name, int offset) const;
 
     static constexpr int initialVectorSize = 8;
     std::vector<uint8_t> code;
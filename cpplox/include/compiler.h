@@ -4,9 +4,6 @@
 #include "chunk.h"
 #include "scanner.h"
 
-#include <memory>
-#include <unordered_map>
-
 #define COLOR_BLACK   "\u001b[30m"
 #define COLOR_RED     "\u001b[31m"
 #define COLOR_GREEN   "\u001b[32m"
@@ -19,17 +16,33 @@
 
 class Compiler {
 private:
-    Token* current = nullptr;
-    Token* previous = nullptr;
+    // The tokens are kept by value in a ring, so a token stays put while
+    // the parser looks at it. The ring holds the previous and the current
+    // token and up to tokenRingSize - 2 tokens of lookahead.
+    static constexpr unsigned int tokenRingSize = 4;
+    Token tokens[tokenRingSize];
+    // Where the current token is in the source's tokens, and how many of
+    // them have been scanned. A token's slot is its index modulo the ring
+    // size, and index 0 is an empty token before the first one.
+    unsigned int currentIndex = 0;
+    unsigned int scannedCount = 1;
     bool hadError = false;
     bool panicMode = false;
-    std::shared_ptr<Scanner> scanner;
-    Chunk* compilingChunk;
+    Scanner scanner{""};
+    Chunk* compilingChunk = nullptr;
 
 public:
-    bool compile(const char* source, std::shared_ptr<Chunk> chunk);
+    // Compiles the source into the given chunk.
+    bool compile(const char* source, Chunk& chunk);
 
 private:
+    // The most constants a chunk can index, with OP_CONSTANT_LONG's 24
+    // bits.
+    static constexpr int maxConstants = (1 << 24) - 1;
+
+    Token& current();
+    Token& previous();
+    Token& lookahead(unsigned int distance);
     void advance();
     void consume(TokenType type, const char* message);
     void endCompiler();
@@ -42,7 +55,7 @@ private:
     void emitBytes(uint8_t byte1, uint8_t byte2);
     void emitReturn();
     void emitConstant(Value value);
-    uint8_t makeConstant(Value value);
+    int makeConstant(Value value);
 
     // ----------------------------------
     //      Parsing methods
@@ -69,51 +82,11 @@ private:
         Precedence precedence;
     };
 
-    std::unordered_map<TokenType, ParseRule> rules = {
-        {TOKEN_LEFT_PAREN     , {&Compiler::grouping,   NULL,               PREC_NONE}   } ,
-        {TOKEN_RIGHT_PAREN    , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_LEFT_BRACE     , {NULL,                  NULL,               PREC_NONE}   } , 
-        {TOKEN_RIGHT_BRACE    , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_COMMA          , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_DOT            , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_MINUS          , {&Compiler::unary,      &Compiler::binary,  PREC_TERM}   } ,
-        {TOKEN_PLUS           , {NULL,                  &Compiler::binary,  PREC_TERM}   } ,
-        {TOKEN_SEMICOLON      , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_SLASH          , {NULL,                  &Compiler::binary,  PREC_FACTOR} } ,
-        {TOKEN_STAR           , {NULL,                  &Compiler::binary,  PREC_FACTOR} } ,
-        {TOKEN_BANG           , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_BANG_EQUAL     , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_EQUAL          , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_EQUAL_EQUAL    , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_GREATER        , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_GREATER_EQUAL  , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_LESS           , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_LESS_EQUAL     , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_IDENTIFIER     , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_STRING         , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_NUMBER         , {&Compiler::number,     NULL,               PREC_NONE}   } ,
-        {TOKEN_AND            , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_CLASS          , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_ELSE           , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_FALSE          , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_FOR            , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_FUN            , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_IF             , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_NIL            , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_OR             , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_PRINT          , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_RETURN         , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_SUPER          , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_THIS           , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_TRUE           , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_VAR            , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_WHILE          , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_ERROR          , {NULL,                  NULL,               PREC_NONE}   } ,
-        {TOKEN_EOF            , {NULL,                  NULL,               PREC_NONE}   }
-    };
+    // Indexed by TokenType, see compiler.cpp.
+    static const ParseRule rules[TOKEN_EOF + 1];
 
     void parsePrecedence(Precedence precedence);
-    ParseRule* getRule(TokenType type);
+    const ParseRule* getRule(TokenType type);
     void expression();
     void number();
     void grouping();
@@ -125,7 +98,7 @@ private:
     // ----------------------------------
     void errorAtCurrent(const char* message);
     void error(const char* message);
-    void errorAt(Token *token, const char* message);
+    void errorAt(const Token& token, const char* message);
 };
 
 
@@ -22,7 +22,6 @@ public:
     bool isAlpha(char c);
     Token identifier();
     TokenType identifierType();
-    TokenType checkKeyword(int start, int length, const char* rest, TokenType type);
 
     const char* start;
     const char* current;
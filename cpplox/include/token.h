@@ -32,6 +32,7 @@ enum TokenType : uint8_t {
 class Token {
 public:
 
+    Token();
     Token(TokenType type, const char* start, int length, int line);
 
     TokenType type;
@@ -38,6 +38,8 @@ int Chunk::disassembleInstruction(int offset) const {
     uint8_t instruction = code[offset];
     switch (instruction) {
         case OP_CONSTANT:   return constantInstruction("OP_CONSTANT", offset);
+        case OP_CONSTANT_LONG:
+            return longConstantInstruction("OP_CONSTANT_LONG", offset);
         case OP_ADD:        return simpleInstruction("OP_ADD", offset);
         case OP_SUBTRACT:   return simpleInstruction("OP_SUBTRACT", offset);
         case OP_MULTIPLY:   return simpleInstruction("OP_MULTIPLY", offset);
@@ -61,4 +63,13 @@ int Chunk::constantInstruction(const char* name, int offset) const {
     printValue(constants[constant]);
     printf("'\n");
     return offset + 2;
+}
+
+int Chunk::longConstantInstruction(const char* name, int offset) const {
+    int constant = (code[offset + 1] << 16) | (code[offset + 2] << 8) |
+                   code[offset + 3];
+    printf("%-16s %4d '", name, constant);
+    printValue(constants[constant]);
+    printf("'\n");
+    return offset + 4;
 }
\ No newline at end of file
@@ -2,10 +2,58 @@
 #include "scanner.h"
 
 #include <cstdio>
-#include <new>
-
-bool Compiler::compile(const char* source, std::shared_ptr<Chunk> chunk) {
-    scanner = std::make_shared<Scanner>(source);
+#include <cstdlib>
+
+// The rules for each TokenType, in the order of the enum.
+const Compiler::ParseRule Compiler::rules[TOKEN_EOF + 1] = {
+    /* TOKEN_LEFT_PAREN    */ {&Compiler::grouping,   NULL,               PREC_NONE},
+    /* TOKEN_RIGHT_PAREN   */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_LEFT_BRACE    */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_RIGHT_BRACE   */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_COMMA         */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_DOT           */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_MINUS         */ {&Compiler::unary,      &Compiler::binary,  PREC_TERM},
+    /* TOKEN_PLUS          */ {NULL,                  &Compiler::binary,  PREC_TERM},
+    /* TOKEN_SEMICOLON     */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_SLASH         */ {NULL,                  &Compiler::binary,  PREC_FACTOR},
+    /* TOKEN_STAR          */ {NULL,                  &Compiler::binary,  PREC_FACTOR},
+    /* TOKEN_BANG          */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_BANG_EQUAL    */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_EQUAL         */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_EQUAL_EQUAL   */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_GREATER       */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_GREATER_EQUAL */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_LESS          */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_LESS_EQUAL    */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_IDENTIFIER    */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_STRING        */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_NUMBER        */ {&Compiler::number,     NULL,               PREC_NONE},
+    /* TOKEN_AND           */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_CLASS         */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_ELSE          */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_FALSE         */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_FOR           */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_FUN           */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_IF            */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_NIL           */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_OR            */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_PRINT         */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_RETURN        */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_SUPER         */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_THIS          */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_TRUE          */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_VAR           */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_WHILE         */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_ERROR         */ {NULL,                  NULL,               PREC_NONE},
+    /* TOKEN_EOF           */ {NULL,                  NULL,               PREC_NONE},
+};
+
+bool Compiler::compile(const char* source, Chunk& chunk) {
+    scanner = Scanner(source);
+    compilingChunk = &chunk;
+    tokens[0] = Token();
+    currentIndex = 0;
+    scannedCount = 1;
 
     hadError = false;
     panicMode = false;
@@ -16,37 +64,39 @@ bool Compiler::compile(const char* source, std::shared_ptr<Chunk> chunk) {
     endCompiler();
 
     return !hadError;
-    
-    // int line = -1;
-    // for (;;) {
-    //     Token token = scanToken();
-    //     if (token.line != line) {
-    //         printf("%4d ", token.line);
-    //         line = token.line;
-    //     } else {
-    //         printf("   | ");
-    //     }
-    //     printf("%2d '%.*s'\n", token.type, token.length, token.start); 
-
-    //     if (token.type == TOKEN_EOF) break;
-    // }
 }
 
-void Compiler::advance() {
-    // if (current != nullptr)
-        previous = current;
+Token& Compiler::current() {
+    return tokens[currentIndex % tokenRingSize];
+}
+
+Token& Compiler::previous() {
+    return tokens[(currentIndex - 1) % tokenRingSize];
+}
 
+// Scans ahead as far as needed. The distance can be at most
+// tokenRingSize - 2, or the previous token would be overwritten.
+Token& Compiler::lookahead(unsigned int distance) {
+    unsigned int index = currentIndex + distance;
+    while (scannedCount <= index) {
+        tokens[scannedCount % tokenRingSize] = scanner.scanToken();
+        scannedCount++;
+    }
+    return tokens[index % tokenRingSize];
+}
+
+void Compiler::advance() {
     for(;;) {
-        current = &(scanner->scanToken());
-        if (current->type != TOKEN_ERROR)
+        currentIndex++;
+        if (lookahead(0).type != TOKEN_ERROR)
             break;
 
-        errorAtCurrent(current->start);
+        errorAtCurrent(current().start);
     }
 }
 
 void Compiler::consume(TokenType type, const char* message) {
-    if (current->type == type) {
+    if (current().type == type) {
         advance();
         return;
     }
@@ -63,7 +113,7 @@ void Compiler::endCompiler() {
 // ----------------------------------
 
 void Compiler::emitByte(uint8_t byte) {
-    currentChunk()->writeChunk(byte, previous->line);
+    currentChunk()->writeChunk(byte, previous().line);
 }
 
 void Compiler::emitBytes(uint8_t byte1, uint8_t byte2) {
@@ -76,17 +126,24 @@ void Compiler::emitReturn() {
 }
 
 void Compiler::emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    int constant = makeConstant(value);
+    if (constant <= UINT8_MAX) {
+        emitBytes(OP_CONSTANT, (uint8_t) constant);
+    } else {
+        emitByte(OP_CONSTANT_LONG);
+        emitBytes((uint8_t) (constant >> 16), (uint8_t) (constant >> 8));
+        emitByte((uint8_t) constant);
+    }
 }
 
-uint8_t Compiler::makeConstant(Value value) {
+int Compiler::makeConstant(Value value) {
     int constant = currentChunk()->addConstant(value);
-    if (constant > UINT8_MAX) {
+    if (constant > maxConstants) {
         error("Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t) constant;
+    return constant;
 }
 
 Chunk* Compiler::currentChunk() {
@@ -98,10 +155,23 @@ Chunk* Compiler::currentChunk() {
 // ----------------------------------
 
 void Compiler::parsePrecedence(Precedence precedence) {
+    advance();
+    ParseRule::ParseFn prefixRule = getRule(previous().type)->prefix;
+    if (prefixRule == NULL) {
+        error("Expect expression.");
+        return;
+    }
+
+    (this->*prefixRule)();
 
+    while (precedence <= getRule(current().type)->precedence) {
+        advance();
+        ParseRule::ParseFn infixRule = getRule(previous().type)->infix;
+        (this->*infixRule)();
+    }
 }
 
-Compiler::ParseRule* Compiler::getRule(TokenType type) {
+const Compiler::ParseRule* Compiler::getRule(TokenType type) {
     return &rules[type];
 }
 
@@ -110,7 +180,7 @@ void Compiler::expression() {
 }
 
 void Compiler::number() {
-    double value = strtod(previous->start, NULL);
+    double value = strtod(previous().start, NULL);
     emitConstant(value);
 }
 
@@ -120,7 +190,7 @@ void Compiler::grouping() {
 }
 
 void Compiler::unary() {
-    TokenType operatorType = previous->type;
+    TokenType operatorType = previous().type;
 
     // Compile the operand
     parsePrecedence(PREC_UNARY);
@@ -136,8 +206,8 @@ void Compiler::unary() {
 }
 
 void Compiler::binary() {
-    TokenType operatorType = previous->type;
-    ParseRule* rule = getRule(operatorType);
+    TokenType operatorType = previous().type;
+    const ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
     switch (operatorType) {
@@ -154,26 +224,26 @@ void Compiler::binary() {
 // ----------------------------------
 
 void Compiler::errorAtCurrent(const char* message) {
-    errorAt(current, message);
+    errorAt(current(), message);
 }
 
 void Compiler::error(const char* message) {
-    errorAt(previous, message);
+    errorAt(previous(), message);
 }
 
-void Compiler::errorAt(Token* token, const char* message) {
+void Compiler::errorAt(const Token& token, const char* message) {
     if(panicMode)
         return;
 
     panicMode = true;
-    fprintf(stderr, COLOR_RED "[line %d] Error", token->line);
+    fprintf(stderr, COLOR_RED "[line %d] Error", token.line);
 
-    if (token->type == TOKEN_EOF) {
+    if (token.type == TOKEN_EOF) {
         fprintf(stderr, " at end");
-    } else if (token->type == TOKEN_ERROR) {
+    } else if (token.type == TOKEN_ERROR) {
 
     } else {
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(stderr, " at '%.*s'", token.length, token.start);
     }
 
     fprintf(stderr, ": %s" COLOR_RESET "\n", message);
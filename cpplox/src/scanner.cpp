@@ -1,6 +1,262 @@
 #include "scanner.h"
 
+#include <array>
 #include <cstring>
+#include <limits>
+#include <string_view>
+
+// Runs of whitespace, comments, identifier characters and string contents
+// are skipped a whole vector at a time. Vectors are loaded from aligned
+// addresses, so a load never crosses into a page that holds no byte of
+// the source, and every run ends at the NUL terminator at the latest.
+// Define SCANNER_NO_SIMD to get the plain scalar loops.
+// AddressSanitizer can't tell that the aligned loads stay within the
+// source's pages, so sanitized builds use the scalar loops.
+#if !defined(SCANNER_NO_SIMD) && defined(__SANITIZE_ADDRESS__)
+#define SCANNER_NO_SIMD
+#elif !defined(SCANNER_NO_SIMD) && defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SCANNER_NO_SIMD
+#endif
+#endif
+
+#if defined(__AVX2__) && !defined(SCANNER_NO_SIMD)
+#include <immintrin.h>
+#define CPPLOX_SCANNER_SIMD
+namespace {
+    using Vector = __m256i;
+    constexpr int vectorSize = 32;
+    constexpr uint32_t fullMask = 0xffffffffu;
+    inline Vector load(const char* p)       { return _mm256_load_si256(reinterpret_cast<const __m256i*>(p)); }
+    inline Vector splat(char c)             { return _mm256_set1_epi8(c); }
+    inline Vector eq(Vector a, Vector b)    { return _mm256_cmpeq_epi8(a, b); }
+    inline Vector vor(Vector a, Vector b)   { return _mm256_or_si256(a, b); }
+    inline Vector sub(Vector a, Vector b)   { return _mm256_sub_epi8(a, b); }
+    inline Vector subsU(Vector a, Vector b) { return _mm256_subs_epu8(a, b); }
+    inline uint32_t mask(Vector v)          { return static_cast<uint32_t>(_mm256_movemask_epi8(v)); }
+}
+#elif defined(__SSE2__) && !defined(SCANNER_NO_SIMD)
+#include <emmintrin.h>
+#define CPPLOX_SCANNER_SIMD
+namespace {
+    using Vector = __m128i;
+    constexpr int vectorSize = 16;
+    constexpr uint32_t fullMask = 0xffffu;
+    inline Vector load(const char* p)       { return _mm_load_si128(reinterpret_cast<const __m128i*>(p)); }
+    inline Vector splat(char c)             { return _mm_set1_epi8(c); }
+    inline Vector eq(Vector a, Vector b)    { return _mm_cmpeq_epi8(a, b); }
+    inline Vector vor(Vector a, Vector b)   { return _mm_or_si128(a, b); }
+    inline Vector sub(Vector a, Vector b)   { return _mm_sub_epi8(a, b); }
+    inline Vector subsU(Vector a, Vector b) { return _mm_subs_epu8(a, b); }
+    inline uint32_t mask(Vector v)          { return static_cast<uint32_t>(_mm_movemask_epi8(v)); }
+}
+#endif
+
+namespace {
+
+#ifdef CPPLOX_SCANNER_SIMD
+
+// Bytes of v that lie in [low, high].
+inline Vector inRange(Vector v, char low, char high) {
+    return eq(subsU(sub(v, splat(low)), splat(static_cast<char>(high - low))), splat(0));
+}
+
+inline const char* alignBlock(const char* p) {
+    return reinterpret_cast<const char*>(
+        reinterpret_cast<uintptr_t>(p) & ~static_cast<uintptr_t>(vectorSize - 1));
+}
+
+// Walks the aligned blocks starting at p until stopMask reports a byte
+// that ends the run, adding the newlines skipped to *line if given.
+template <typename StopMask>
+const char* scanBlocks(const char* p, int* line, StopMask stopMask) {
+    const char* block = alignBlock(p);
+    uint32_t live = (fullMask << (p - block)) & fullMask;
+    for (;;) {
+        Vector v = load(block);
+        uint32_t stops = stopMask(v) & live;
+        uint32_t newlines = line != nullptr ? mask(eq(v, splat('\n'))) & live : 0;
+        if (stops != 0) {
+            int index = __builtin_ctz(stops);
+            if (line != nullptr) *line += __builtin_popcount(newlines & ((1u << index) - 1));
+            return block + index;
+        }
+        if (line != nullptr) *line += __builtin_popcount(newlines);
+        block += vectorSize;
+        live = fullMask;
+    }
+}
+
+const char* vectorBlanks(const char* p, int* line) {
+    return scanBlocks(p, line, [](Vector v) {
+        Vector blanks = vor(vor(eq(v, splat(' ')), eq(v, splat('\t'))),
+                            vor(eq(v, splat('\r')), eq(v, splat('\n'))));
+        return ~mask(blanks);
+    });
+}
+
+const char* vectorToLineEnd(const char* p) {
+    return scanBlocks(p, nullptr, [](Vector v) {
+        return mask(vor(eq(v, splat('\n')), eq(v, splat('\0'))));
+    });
+}
+
+const char* vectorIdentifier(const char* p) {
+    return scanBlocks(p, nullptr, [](Vector v) {
+        // Setting bit 5 folds upper case letters onto lower case ones.
+        Vector letters = inRange(vor(v, splat(0x20)), 'a', 'z');
+        Vector word = vor(vor(letters, inRange(v, '0', '9')), eq(v, splat('_')));
+        return ~mask(word);
+    });
+}
+
+const char* vectorToQuote(const char* p, int* line) {
+    return scanBlocks(p, line, [](Vector v) {
+        return mask(vor(eq(v, splat('"')), eq(v, splat('\0'))));
+    });
+}
+
+#endif
+
+// Most runs are only a few bytes long, so each of them is started with
+// a scalar loop and only handed to the vector loop if it goes on longer.
+#ifdef CPPLOX_SCANNER_SIMD
+constexpr int scalarRun = 4;
+#else
+constexpr int scalarRun = std::numeric_limits<int>::max();
+#endif
+
+bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool isWord(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+const char* scanBlanks(const char* p, int* line, int limit) {
+    for (; limit > 0 && isBlank(*p); p++, limit--) {
+        if (*p == '\n') (*line)++;
+    }
+    return p;
+}
+
+const char* scanToLineEnd(const char* p, int limit) {
+    for (; limit > 0 && *p != '\n' && *p != '\0'; p++, limit--) {}
+    return p;
+}
+
+const char* scanIdentifier(const char* p, int limit) {
+    for (; limit > 0 && isWord(*p); p++, limit--) {}
+    return p;
+}
+
+const char* scanToQuote(const char* p, int* line, int limit) {
+    for (; limit > 0 && *p != '"' && *p != '\0'; p++, limit--) {
+        if (*p == '\n') (*line)++;
+    }
+    return p;
+}
+
+const char* skipBlanks(const char* p, int* line) {
+    p = scanBlanks(p, line, scalarRun);
+#ifdef CPPLOX_SCANNER_SIMD
+    if (isBlank(*p)) p = vectorBlanks(p, line);
+#endif
+    return p;
+}
+
+const char* findLineEnd(const char* p) {
+    p = scanToLineEnd(p, scalarRun);
+#ifdef CPPLOX_SCANNER_SIMD
+    if (*p != '\n' && *p != '\0') p = vectorToLineEnd(p);
+#endif
+    return p;
+}
+
+const char* skipIdentifier(const char* p) {
+    p = scanIdentifier(p, scalarRun);
+#ifdef CPPLOX_SCANNER_SIMD
+    if (isWord(*p)) p = vectorIdentifier(p);
+#endif
+    return p;
+}
+
+const char* findQuote(const char* p, int* line) {
+    p = scanToQuote(p, line, scalarRun);
+#ifdef CPPLOX_SCANNER_SIMD
+    if (*p != '"' && *p != '\0') p = vectorToQuote(p, line);
+#endif
+    return p;
+}
+
+// Keywords are told apart from identifiers by a perfect hash of their
+// length and first and last characters. The multipliers are searched for
+// at compile time, so adding a keyword to keywordList is all it takes.
+struct Keyword {
+    std::string_view name;
+    TokenType type = TOKEN_IDENTIFIER;
+};
+
+constexpr Keyword keywordList[] = {
+    {"and", TOKEN_AND},
+    {"class", TOKEN_CLASS},
+    {"else", TOKEN_ELSE},
+    {"false", TOKEN_FALSE},
+    {"for", TOKEN_FOR},
+    {"fun", TOKEN_FUN},
+    {"if", TOKEN_IF},
+    {"nil", TOKEN_NIL},
+    {"or", TOKEN_OR},
+    {"print", TOKEN_PRINT},
+    {"return", TOKEN_RETURN},
+    {"super", TOKEN_SUPER},
+    {"this", TOKEN_THIS},
+    {"true", TOKEN_TRUE},
+    {"var", TOKEN_VAR},
+    {"while", TOKEN_WHILE},
+};
+
+constexpr size_t keywordTableSize = 64;
+
+// The low byte of seed multiplies the first character, the high byte
+// the last one.
+constexpr size_t keywordHash(size_t length, char first, char last, uint32_t seed) {
+    return (length +
+            static_cast<unsigned char>(first) * (seed & 0xff) +
+            static_cast<unsigned char>(last) * (seed >> 8)) & (keywordTableSize - 1);
+}
+
+constexpr bool isPerfect(uint32_t seed) {
+    bool used[keywordTableSize] = {};
+    for (const Keyword& keyword : keywordList) {
+        size_t slot = keywordHash(keyword.name.size(), keyword.name.front(), keyword.name.back(), seed);
+        if (used[slot]) return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+constexpr uint32_t findKeywordSeed() {
+    for (uint32_t seed = 0x0101; seed <= 0xffff; seed++) {
+        if ((seed & 0xff) != 0 && isPerfect(seed)) return seed;
+    }
+    return 0;
+}
+
+constexpr uint32_t keywordSeed = findKeywordSeed();
+static_assert(keywordSeed != 0, "no perfect hash for the keywords, grow keywordTableSize");
+
+constexpr std::array<Keyword, keywordTableSize> keywordTable = [] {
+    std::array<Keyword, keywordTableSize> table{};
+    for (const Keyword& keyword : keywordList) {
+        table[keywordHash(keyword.name.size(), keyword.name.front(), keyword.name.back(), keywordSeed)] = keyword;
+    }
+    return table;
+}();
+
+} // namespace
 
 Scanner::Scanner(const char* source) {
     this->start = source;
@@ -9,6 +265,7 @@ Scanner::Scanner(const char* source) {
 }
 
 Token Scanner::scanToken() {
+    skipWhitespace();
     start = current;
 
     if (isAtEnd()) return makeToken(TokenType::TOKEN_EOF);
@@ -74,26 +331,13 @@ bool Scanner::match(char expected) {
 
 void Scanner::skipWhitespace() {
     for (;;) {
-        char c = peek();
-        switch (c) {
-            case ' ':
-            case '\r':
-            case '\t':
-                advance();
-                break;
-            case '\n':
-                line++;
-                advance();
-                break;
-            case '/':
-                if (peekNext() == '/') {
-                    while (peek() != '\n' && isAtEnd()) advance();
-                } else {
-                    return;
-                }
-                break;
-            default:
-                return;
+        current = skipBlanks(current, &line);
+
+        if (peek() == '/' && peekNext() == '/') {
+            // a comment goes until the end of the line
+            current = findLineEnd(current);
+        } else {
+            return;
         }
     }
 }
@@ -108,10 +352,7 @@ char Scanner::peekNext() {
 }
 
 Token Scanner::string() {
-    while (peek() != '"' && isAtEnd()) {
-        if (peek() == '\n') line++;
-        advance();
-    }
+    current = findQuote(current, &line);
 
     if (isAtEnd()) return errorToken("Unterminated string.");
 
@@ -135,7 +376,7 @@ Token Scanner::number() {
 }
 
 Token Scanner::identifier() {
-    while (isAlpha(peek()) || isDigit(peek())) advance();
+    current = skipIdentifier(current);
 
     return makeToken(identifierType());
 }
@@ -151,46 +392,14 @@ bool Scanner::isAlpha(char c) {
 }
 
 TokenType Scanner::identifierType() {
-    switch (start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        case 'f':
-            if (current - start > 1) {
-                switch (start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            }
-            break;
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if (current - start > 1) {
-                switch (start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            }
-            break;
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-    }
+    auto length = static_cast<size_t>(current - start);
+    const Keyword& keyword = keywordTable[keywordHash(length, start[0], current[-1], keywordSeed)];
 
-    return TokenType::TOKEN_IDENTIFIER;
-}
-
-TokenType Scanner::checkKeyword(int start, int length, const char* rest, TokenType type) {
-    if (this->current - this->start == start + length &&
-        memcmp(this->start + start, rest, length) == 0)
+    if (keyword.name.size() == length &&
+        memcmp(start, keyword.name.data(), length) == 0)
     {
-        return type;
+        return keyword.type;
     }
 
     return TokenType::TOKEN_IDENTIFIER;
-}
\ No newline at end of file
+}
@@ -1,5 +1,8 @@
 #include "token.h"
 
+Token::Token()
+: type{TOKEN_EOF}, start{""}, length{0}, line{0} {}
+
 Token::Token(TokenType type, const char* start, int length, int line)
 : type{type}, start{start}, length{length}, line{line} {}
 
@@ -8,7 +8,7 @@ InterpretResult VM::interpret(const char* source) {
     chunk = std::make_shared<Chunk>();
     Compiler compiler;
 
-    auto err = compiler.compile(source, chunk);
+    auto err = compiler.compile(source, *chunk);
     if(!err) {
         return InterpretResult::INTERPRET_COMPILE_ERROR;
     }
@@ -21,6 +21,8 @@ InterpretResult VM::interpret(const char* source) {
 InterpretResult VM::run() {
 #define READ_BYTE() (*ip++)
 #define READ_CONSTANT() (chunk->constants[READ_BYTE()])
+#define READ_LONG_CONSTANT() \
+    (ip += 3, chunk->constants[(ip[-3] << 16) | (ip[-2] << 8) | ip[-1]])
 #define BINARY_OP(op)           \
     do {                        \
       double b = stack.pop();   \
@@ -41,6 +43,11 @@ InterpretResult VM::run() {
                 stack.push(constant);
                 break;
             }
+            case OP_CONSTANT_LONG: {
+                Value constant = READ_LONG_CONSTANT();
+                stack.push(constant);
+                break;
+            }
             case OP_ADD:      BINARY_OP(+); break;
             case OP_SUBTRACT: BINARY_OP(-); break;
             case OP_MULTIPLY: BINARY_OP(*); break;
@@ -58,5 +65,6 @@ InterpretResult VM::run() {
 
 #undef READ_BYTE
 #undef READ_CONSTANT
+#undef READ_LONG_CONSTANT
 #undef BINARY_OP
 }
\ No newline at end of file
@@ -6,6 +6,14 @@ import sys
 import os
 import pytest
 
+# Where the scripts and the interpreter are, wherever pytest runs from.
+TESTS_DIR = os.path.dirname(os.path.abspath(__file__))
+CLOX = os.path.join(TESTS_DIR, "..", "clox", "clox")
+
+def run_lox(lox_exec, *arguments):
+  return subprocess.run([lox_exec] + [str(argument) for argument in arguments],
+                        capture_output=True, text=True, cwd=TESTS_DIR)
+
 def run_lox_script(lox_exec, script):
   return subprocess.run([lox_exec, script], capture_output=True, text=True)
 
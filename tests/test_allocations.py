@@ -0,0 +1,54 @@
+from lox_tests import CLOX, run_lox
+
+def read_sites(path):
+  lines = path.read_text().splitlines()
+  assert lines[1] == ""
+  assert lines[2].split() == ["bytes", "count", "live", "bytes", "live",
+                              "kind", "site"]
+  return [line.split() for line in lines[3:]]
+
+def read_objects(path):
+  return [site for site in read_sites(path) if site[4] != "storage"]
+
+def find_site(sites, kind, site):
+  return next(row for row in sites if row[4:] == [kind, site])
+
+def test_allocations_by_site(tmp_path):
+  report = tmp_path / "allocations.txt"
+  result = run_lox(CLOX, "--alloc-profile", report,
+                   "lox_scripts/allocations/sites.lox")
+  assert result.stdout == "2\n1000\n"
+  assert result.stderr == ""
+  sites = read_sites(report)
+  # The instances made in the loop come first, and are all kept.
+  assert sites[0][1:] == ["1000", sites[0][0], "1000", "OBJ_INSTANCE",
+                          "script:11"]
+  # Every string label() builds but the first is freed for the interned one.
+  label = find_site(sites, "OBJ_STRING", "label:6")
+  assert [label[1], label[3]] == ["1000", "1"]
+  assert find_site(sites, "OBJ_UPVALUE", "counter:17")[1] == "1"
+  # The array of points grows to hold all of them, a few times over.
+  storage = find_site(sites, "storage", "script:11")
+  assert int(storage[0]) >= 1000 * 8
+  assert 1 < int(storage[1]) < 20
+  assert storage[2:4] == ["-", "-"]
+  # So do the fields of the instances, and the upvalues of the closure.
+  find_site(sites, "storage", "init:2")
+  find_site(sites, "storage", "counter:17")
+
+def test_allocations_match_with_jit(tmp_path):
+  interpreted = tmp_path / "interpreted.txt"
+  compiled = tmp_path / "compiled.txt"
+  run_lox(CLOX, "--alloc-profile", interpreted,
+          "lox_scripts/allocations/sites.lox")
+  run_lox(CLOX, "--jit", "--alloc-profile", compiled,
+          "lox_scripts/allocations/sites.lox")
+  # The compiled code adds storage of its own, but the objects are the same.
+  assert read_objects(interpreted) == read_objects(compiled)
+
+def test_allocations_written_after_runtime_error(tmp_path):
+  report = tmp_path / "allocations.txt"
+  result = run_lox(CLOX, "--alloc-profile", report,
+                   "lox_scripts/trace/error.lox")
+  assert result.returncode == 70
+  assert read_sites(report)
@@ -0,0 +1,65 @@
+import glob
+import os
+import subprocess
+
+import pytest
+
+from lox_tests import CLOX, TESTS_DIR, run_lox
+
+# Every script but the one that runs until it's killed.
+SCRIPTS = sorted(
+    os.path.relpath(path, TESTS_DIR)
+    for path in glob.glob(os.path.join(TESTS_DIR, "lox_scripts", "**", "*.lox"),
+                          recursive=True)
+    if os.path.basename(path) != "forever.lox")
+
+def compile_script(script, tmp_path):
+  source = tmp_path / "script.c"
+  program = tmp_path / "script"
+  emitted = run_lox(CLOX, "--emit-c", source, script)
+  assert emitted.returncode == 0, emitted.stderr
+  built = subprocess.run(["cc", "-O1", "-I../clox", "-o", program, source,
+                          "../clox/libclox.a", "-lm", "-pthread"],
+                         capture_output=True, text=True, cwd=TESTS_DIR)
+  assert built.returncode == 0, built.stderr
+  return subprocess.run([program], capture_output=True, text=True)
+
+def test_compiled_script(tmp_path):
+  result = compile_script("lox_scripts/jit/hot.lox", tmp_path)
+  assert result.stdout == "6765\n2.49948e+07\n2000\n01234567891011\ntrue\ntrue\n1501\n"
+  assert result.stderr == ""
+  assert result.returncode == 0
+
+def test_compiled_closures(tmp_path):
+  result = compile_script("lox_scripts/closure/nested_closure.lox", tmp_path)
+  assert result.stdout == "a\nb\nc\n"
+  assert result.stderr == ""
+  assert result.returncode == 0
+
+@pytest.mark.parametrize("script", SCRIPTS)
+def test_compiled_matches_interpreter(script, tmp_path):
+  interpreted = run_lox(CLOX, script)
+  if interpreted.returncode == 65:
+    # Scripts that don't compile emit no C either, with the same errors.
+    emitted = run_lox(CLOX, "--emit-c", tmp_path / "script.c", script)
+    assert emitted.returncode == 65
+    assert emitted.stderr == interpreted.stderr
+    return
+
+  compiled = compile_script(script, tmp_path)
+  assert compiled.stdout == interpreted.stdout
+  assert compiled.stderr == interpreted.stderr
+  assert compiled.returncode == interpreted.returncode
+
+def test_runtime_error_in_compiled_script(tmp_path):
+  result = compile_script("lox_scripts/jit/error.lox", tmp_path)
+  assert result.stdout == ""
+  assert result.stderr == "Operands must be numbers.\n[line 2] in divide()\n[line 6] in script\n"
+  assert result.returncode == 70
+
+def test_compile_error_emits_nothing(tmp_path):
+  source = tmp_path / "script.c"
+  result = run_lox(CLOX, "--emit-c", source, "lox_scripts/unexpected_character.lox")
+  assert result.stderr == "[line 3] Error: Unexpected character.\n"
+  assert result.returncode == 65
+  assert not source.exists()
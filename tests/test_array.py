@@ -0,0 +1,88 @@
+from lox_tests import run_lox_script
+
+def array(test):
+  return run_lox_script("../clox/clox", "lox_scripts/array/" + test + ".lox")
+
+def test_literal():
+  result = array("literal")
+  assert result.stdout == "[]\n[1, 2, 3]\n[a, nil, true, 1.5]\n[[1, 2], [3]]\n"
+  assert result.stderr == ""
+
+def test_index():
+  result = array("index")
+  assert result.stdout == "10\n30\n25\n[10, 25, 30]\n[ten, 25, 30]\n35\n7\n"
+  assert result.stderr == ""
+
+def test_append():
+  result = array("append")
+  assert result.stdout == "100\n198\n[1, two, 3]\n3\n4\n"
+  assert result.stderr == ""
+
+def test_append_non_array():
+  result = array("append_non_array")
+  assert result.stdout == ""
+  assert result.stderr == "Can only append to arrays.\n[line 1] in script\n"
+
+def test_index_non_array():
+  result = array("index_non_array")
+  assert result.stdout == ""
+  assert result.stderr == "Only arrays and maps can be indexed.\n[line 2] in script\n"
+
+def test_index_not_integer():
+  result = array("index_not_integer")
+  assert result.stdout == ""
+  assert result.stderr == "Array index must be an integer.\n[line 2] in script\n"
+
+def test_index_not_number():
+  result = array("index_not_number")
+  assert result.stdout == ""
+  assert result.stderr == "Array index must be a number.\n[line 2] in script\n"
+
+def test_index_out_of_bounds():
+  result = array("index_out_of_bounds")
+  assert result.stdout == ""
+  assert result.stderr == "Array index out of bounds.\n[line 2] in script\n"
+
+def test_nan_index():
+  result = array("nan_index")
+  assert result.stdout == ""
+  assert result.stderr == "Array index out of bounds.\n[line 2] in script\n"
+
+def test_missing_bracket():
+  result = array("missing_bracket")
+  assert result.stdout == ""
+  assert result.stderr == "[line 1] Error at ';': Expect ']' after array elements.\n"
+
+def test_native_arity():
+  result = array("native_arity")
+  assert result.stdout == ""
+  assert result.stderr == "Expected 1 arguments but got 0.\n[line 1] in script\n"
+
+def test_kernels():
+  result = array("kernels")
+  assert result.stdout == ("66\n286\n1\n11\n-2\n9\n"
+                           "[2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22]\n"
+                           "[13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23]\n"
+                           "[11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1]\n"
+                           "5.5\n6\n0\n")
+  assert result.stderr == ""
+
+def test_kernel_empty_min():
+  result = array("kernel_empty_min")
+  assert result.stdout == ""
+  assert result.stderr == "Can't take the minimum of an empty array.\n[line 1] in script\n"
+
+def test_kernel_length_mismatch():
+  result = array("kernel_length_mismatch")
+  assert result.stdout == ""
+  assert result.stderr == "Arrays must have the same length.\n[line 1] in script\n"
+
+def test_kernel_non_numbers():
+  result = array("kernel_non_numbers")
+  assert result.stdout == ""
+  assert result.stderr == "Expected an array of numbers.\n[line 1] in script\n"
+
+def test_kernel_nan():
+  result = array("kernel_nan")
+  assert result.stdout == "true\n" * 6 + "1\n9\n"
+  assert result.stderr == ""
@@ -0,0 +1,64 @@
+import shutil
+import struct
+import subprocess
+
+def run_cached(script):
+  return subprocess.run(["../clox/clox", "--cache", str(script)],
+                        capture_output=True, text=True)
+
+def copy_script(tmp_path, test):
+  script = tmp_path / "script.lox"
+  shutil.copy("lox_scripts/" + test + ".lox", script)
+  return script
+
+def test_cache_next_to_source(tmp_path):
+  script = copy_script(tmp_path, "closure/nested_closure")
+  first = run_cached(script)
+  assert (tmp_path / "script.loxc").exists()
+
+  second = run_cached(script)
+  assert first.stdout == "a\nb\nc\n"
+  assert second.stdout == first.stdout
+  assert second.stderr == ""
+
+def test_stale_cache_is_ignored(tmp_path):
+  script = copy_script(tmp_path, "closure/nested_closure")
+  run_cached(script)
+
+  script.write_text('print "changed";\n')
+  result = run_cached(script)
+  assert result.stdout == "changed\n"
+  assert result.stderr == ""
+
+def test_corrupt_cache_is_ignored(tmp_path):
+  script = copy_script(tmp_path, "closure/nested_closure")
+  run_cached(script)
+
+  cache = tmp_path / "script.loxc"
+  cache.write_bytes(cache.read_bytes()[:40])
+  result = run_cached(script)
+  assert result.stdout == "a\nb\nc\n"
+  assert result.stderr == ""
+
+def test_unverifiable_cache_is_ignored(tmp_path):
+  script = copy_script(tmp_path, "closure/nested_closure")
+  run_cached(script)
+
+  # Replace the script's first instruction with an unknown opcode.
+  cache = tmp_path / "script.loxc"
+  image = bytearray(cache.read_bytes())
+  functions = struct.unpack_from("<Q", image, 32)[0]
+  code = struct.unpack_from("<Q", image, functions + 16)[0]
+  image[code] = 0xff
+  cache.write_bytes(bytes(image))
+
+  result = run_cached(script)
+  assert result.stdout == "a\nb\nc\n"
+  assert result.stderr == ""
+  assert cache.read_bytes() != bytes(image)
+
+def test_compile_error_writes_no_cache(tmp_path):
+  script = copy_script(tmp_path, "unexpected_character")
+  result = run_cached(script)
+  assert result.stderr == "[line 3] Error: Unexpected character.\n"
+  assert not (tmp_path / "script.loxc").exists()
@@ -18,11 +18,10 @@ def test_num():
   assert result.stdout == ""
   assert result.stderr == "Can only call functions and classes.\n[line 1] in script\n"
 
-# unimplemented
-# def test_object():
-#   result = call("object")
-#   assert result.stdout == ""
-#   assert result.stderr == "Can only call functions and classes.\n[line 1] in script\n"
+def test_object():
+  result = call("object")
+  assert result.stdout == ""
+  assert result.stderr == "Can only call functions and classes.\n[line 4] in script\n"
 
 def test_string():
   result = call("string")
@@ -0,0 +1,34 @@
+from lox_tests import run_lox_script
+
+def class_(test):
+  return run_lox_script("../clox/clox", "lox_scripts/class/" + test + ".lox")
+
+def test_empty():
+  result = class_("empty")
+  assert result.stdout == "Foo\n"
+  assert result.stderr == ""
+
+def test_inherit_self():
+  result = class_("inherit_self")
+  assert result.stdout == ""
+  assert result.stderr == "[line 1] Error at 'Foo': A class can't inherit from itself.\n"
+
+def test_inherited_method():
+  result = class_("inherited_method")
+  assert result.stdout == "in foo\nin bar\nin baz\n"
+  assert result.stderr == ""
+
+def test_local_inherit_other():
+  result = class_("local_inherit_other")
+  assert result.stdout == "B\n"
+  assert result.stderr == ""
+
+def test_local_reference_self():
+  result = class_("local_reference_self")
+  assert result.stdout == "Foo\n"
+  assert result.stderr == ""
+
+def test_reference_self():
+  result = class_("reference_self")
+  assert result.stdout == "Foo\n"
+  assert result.stderr == ""
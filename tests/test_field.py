@@ -0,0 +1,45 @@
+from lox_tests import run_lox_script
+
+def field(test):
+  return run_lox_script("../clox/clox", "lox_scripts/field/" + test + ".lox")
+
+def test_call_function_field():
+  result = field("call_function_field")
+  assert result.stdout == "bar\n1\n2\n"
+  assert result.stderr == ""
+
+def test_get_and_set_method():
+  result = field("get_and_set_method")
+  assert result.stdout == "other\n1\nmethod\n2\n"
+  assert result.stderr == ""
+
+def test_get_on_nil():
+  result = field("get_on_nil")
+  assert result.stdout == ""
+  assert result.stderr == "Only instances have properties.\n[line 1] in script\n"
+
+def test_many():
+  result = field("many")
+  assert result.stdout.startswith("apple\napricot\navocado\n")
+  assert result.stdout.endswith("watermelon\nyuzu\n")
+  assert result.stderr == ""
+
+def test_method_binds_this():
+  result = field("method_binds_this")
+  assert result.stdout == "foo1\n1\n"
+  assert result.stderr == ""
+
+def test_on_instance():
+  result = field("on_instance")
+  assert result.stdout == "bar value\nbaz value\nbar value\nbaz value\n"
+  assert result.stderr == ""
+
+def test_set_on_num():
+  result = field("set_on_num")
+  assert result.stdout == ""
+  assert result.stderr == "Only instances have fields.\n[line 1] in script\n"
+
+def test_undefined():
+  result = field("undefined")
+  assert result.stdout == ""
+  assert result.stderr == "Undefined property 'bar'.\n[line 4] in script\n"
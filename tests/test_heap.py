@@ -0,0 +1,34 @@
+from lox_tests import CLOX, run_lox
+
+USE_OUTPUT = "hello\n2\n3\n3\n11\n1\ntwo\n[1, 2, 3, 4]\n3\n9\n10\ntrue\n101\n"
+
+def test_script_runs_on_saved_heap(tmp_path):
+  image = tmp_path / "prelude.heap"
+  written = run_lox(CLOX, "--write-heap", image, "lox_scripts/heap/prelude.lox")
+  assert written.returncode == 0
+  assert image.exists()
+
+  result = run_lox(CLOX, "--heap", image, "lox_scripts/heap/use.lox")
+  assert result.stdout == USE_OUTPUT
+  assert result.stderr == ""
+
+def test_saved_heap_is_not_changed_by_scripts(tmp_path):
+  image = tmp_path / "prelude.heap"
+  run_lox(CLOX, "--write-heap", image, "lox_scripts/heap/prelude.lox")
+  before = image.read_bytes()
+
+  first = run_lox(CLOX, "--heap", image, "lox_scripts/heap/use.lox")
+  second = run_lox(CLOX, "--heap", image, "lox_scripts/heap/use.lox")
+  assert first.stdout == USE_OUTPUT
+  assert second.stdout == USE_OUTPUT
+  assert image.read_bytes() == before
+
+def test_corrupt_heap_is_rejected(tmp_path):
+  image = tmp_path / "prelude.heap"
+  run_lox(CLOX, "--write-heap", image, "lox_scripts/heap/prelude.lox")
+  image.write_bytes(image.read_bytes()[:100])
+
+  result = run_lox(CLOX, "--heap", image, "lox_scripts/heap/use.lox")
+  assert result.stdout == ""
+  assert result.stderr == 'Could not load heap image "%s".\n' % image
+  assert result.returncode == 74
@@ -0,0 +1,19 @@
+from lox_tests import CLOX, run_lox
+
+HOT_OUTPUT = "6765\n2.49948e+07\n2000\n01234567891011\ntrue\ntrue\n1501\n"
+
+def test_hot_functions():
+  result = run_lox(CLOX, "--jit", "lox_scripts/jit/hot.lox")
+  assert result.stdout == HOT_OUTPUT
+  assert result.stderr == ""
+
+def test_hot_functions_without_jit():
+  result = run_lox(CLOX, "lox_scripts/jit/hot.lox")
+  assert result.stdout == HOT_OUTPUT
+  assert result.stderr == ""
+
+def test_runtime_error_in_compiled_function():
+  result = run_lox(CLOX, "--jit", "lox_scripts/jit/error.lox")
+  assert result.stdout == ""
+  assert result.stderr == "Operands must be numbers.\n[line 2] in divide()\n[line 6] in script\n"
+  assert result.returncode == 70
@@ -0,0 +1,39 @@
+from lox_tests import run_lox_script
+
+def limit(test):
+  return run_lox_script("../clox/clox", "lox_scripts/limit/" + test + ".lox")
+
+def test_many_locals():
+  result = limit("too_many_locals")
+  assert result.stdout == "oops\n"
+  assert result.stderr == ""
+
+def test_many_upvalues():
+  result = limit("too_many_upvalues")
+  assert result.stdout == "oops\n"
+  assert result.stderr == ""
+
+def test_many_constants():
+  result = limit("too_many_constants")
+  assert result.stdout == "oops\n513\n"
+  assert result.stderr == ""
+
+def test_no_reuse_constants():
+  result = limit("no_reuse_constants")
+  assert result.stdout == "513\n"
+  assert result.stderr == ""
+
+def test_loop_too_large():
+  result = limit("loop_too_large")
+  assert result.stdout == "0\n"
+  assert result.stderr == ""
+
+def test_long_operands():
+  result = limit("long_operands")
+  assert result.stdout == "300\nfield!\nsub method\nmethod\n300\n301\n"
+  assert result.stderr == ""
+
+def test_stack_overflow():
+  result = limit("stack_overflow")
+  assert result.stdout == ""
+  assert result.stderr.startswith("Stack overflow.\n")
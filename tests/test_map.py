@@ -0,0 +1,49 @@
+from lox_tests import run_lox_script
+
+def map_(test):
+  return run_lox_script("../clox/clox", "lox_scripts/map/" + test + ".lox")
+
+def test_literal():
+  result = map_("literal")
+  assert result.stdout == "{}\n{a: 1}\n1\ntwo\nnil\n3\n"
+  assert result.stderr == ""
+
+def test_index():
+  result = map_("index")
+  assert result.stdout == "2\nnumber\nbool\n3\n3\nzero\nnumber\n5\n[1, 3]\n"
+  assert result.stderr == ""
+
+def test_natives():
+  result = map_("natives")
+  assert result.stdout == "true\nfalse\nfalse\ntrue\nfalse\nfalse\n1\n[b]\n50\n9801\n50\n"
+  assert result.stderr == ""
+
+def test_block_after_map():
+  result = map_("block_after_map")
+  assert result.stdout == "2\n1\n"
+  assert result.stderr == ""
+
+def test_undefined_key():
+  result = map_("undefined_key")
+  assert result.stdout == ""
+  assert result.stderr == "Undefined key.\n[line 2] in script\n"
+
+def test_invalid_key():
+  result = map_("invalid_key")
+  assert result.stdout == ""
+  assert result.stderr == "Map keys must be strings, numbers or booleans.\n[line 2] in script\n"
+
+def test_invalid_literal_key():
+  result = map_("invalid_literal_key")
+  assert result.stdout == ""
+  assert result.stderr == "Map keys must be strings, numbers or booleans.\n[line 1] in script\n"
+
+def test_missing_colon():
+  result = map_("missing_colon")
+  assert result.stdout == ""
+  assert result.stderr == "[line 1] Error at '1': Expect ':' after map key.\n"
+
+def test_computed_keys():
+  result = map_("computed_keys")
+  assert result.stdout == "1\ntrue\nfalse\n2\n2\n3\n4\ntrue\nfalse\n2\ntrue\n"
+  assert result.stderr == ""
@@ -0,0 +1,24 @@
+from lox_tests import run_lox_script
+
+def method(test):
+  return run_lox_script("../clox/clox", "lox_scripts/method/" + test + ".lox")
+
+def test_arity():
+  result = method("arity")
+  assert result.stdout == "no args\n1\n3\n6\n10\n15\n21\n28\n36\n"
+  assert result.stderr == ""
+
+def test_not_found():
+  result = method("not_found")
+  assert result.stdout == ""
+  assert result.stderr == "Undefined property 'unknown'.\n[line 3] in script\n"
+
+def test_print_bound_method():
+  result = method("print_bound_method")
+  assert result.stdout == "<fn method>\n"
+  assert result.stderr == ""
+
+def test_polymorphic_call_site():
+  result = method("polymorphic_call_site")
+  assert result.stdout == "A B C D E field \nfield E D C B A \n"
+  assert result.stderr == ""
@@ -0,0 +1,9 @@
+from lox_tests import run_lox_script
+
+def operator(test):
+  return run_lox_script("../clox/clox", "lox_scripts/operator/" + test + ".lox")
+
+def test_quicken():
+  result = operator("quicken")
+  assert result.stdout == "3\nab\n4\ntrue\nfalse\n3\n"
+  assert result.stderr == "Operands must be numbers.\n[line 5] in subtract()\n[line 15] in script\n"
@@ -0,0 +1,59 @@
+import re
+import signal
+import subprocess
+import time
+
+from lox_tests import CLOX, TESTS_DIR, run_lox
+
+def read_profile(path):
+  lines = path.read_text().splitlines()
+  for line in lines:
+    assert re.fullmatch(r"[\w:;]+ \d+", line), line
+  return lines
+
+def test_profile_written_on_exit(tmp_path):
+  profile = tmp_path / "out.folded"
+  result = run_lox(CLOX, "--profile", profile, "--profile-rate", 1000,
+                   "lox_scripts/profile/hot.lox")
+  assert result.stdout == "196418\n4.5e+12\n"
+  assert result.stderr == ""
+  lines = read_profile(profile)
+  assert all(line.startswith("script:") for line in lines)
+  assert any(";spin:" in line for line in lines)
+  # Every stack is written once, with all of its samples.
+  stacks = [line.rsplit(" ", 1)[0] for line in lines]
+  assert len(stacks) == len(set(stacks))
+
+def test_profile_finds_hot_line(tmp_path):
+  profile = tmp_path / "out.folded"
+  run_lox(CLOX, "--profile", profile, "--profile-rate", 10000,
+          "lox_scripts/profile/hot.lox")
+  # The body of the loop in spin(), which makes no calls.
+  assert any(line.startswith("script:15;spin:9 ")
+             for line in read_profile(profile))
+
+def test_profile_written_on_signal(tmp_path):
+  profile = tmp_path / "out.folded"
+  clox = subprocess.Popen([CLOX, "--profile", str(profile),
+                           "lox_scripts/profile/forever.lox"], cwd=TESTS_DIR)
+  try:
+    # Before the profiler starts, SIGUSR1 would still kill the process.
+    time.sleep(0.3)
+    lines = []
+    for _ in range(50):
+      time.sleep(0.1)
+      clox.send_signal(signal.SIGUSR1)
+      if profile.exists():
+        lines = read_profile(profile)
+        if lines:
+          break
+    assert lines and all(line.startswith("script:") for line in lines)
+  finally:
+    clox.kill()
+    clox.wait()
+
+def test_bad_profile_rate():
+  result = run_lox(CLOX, "--profile", "unused.folded", "--profile-rate", 0,
+                   "lox_scripts/profile/hot.lox")
+  assert result.stderr == "Could not start the profiler.\n"
+  assert result.returncode == 74
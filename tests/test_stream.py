@@ -0,0 +1,43 @@
+import subprocess
+
+def run_piped(source):
+  return subprocess.run(["../clox/clox", "-"], input=source,
+                        capture_output=True, text=True)
+
+def test_piped_script():
+  with open("lox_scripts/closure/nested_closure.lox") as script:
+    result = run_piped(script.read())
+  assert result.stdout == "a\nb\nc\n"
+  assert result.stderr == ""
+
+def test_else_on_next_line():
+  result = run_piped('if (false) print "then";\nelse print "else";\n')
+  assert result.stdout == "else\n"
+  assert result.stderr == ""
+
+def test_declaration_across_lines():
+  result = run_piped('fun f(a,\n  b) {\n  return a + b;\n}\nprint f(1,\n2);\n')
+  assert result.stdout == "3\n"
+
+def test_error_lines_count_from_start_of_input():
+  result = run_piped('print 1;\n\nprint 2;\nprint -"x";\n')
+  assert result.stdout == "1\n2\n"
+  assert result.stderr.startswith("Operand must be a number.\n[line 4]")
+  assert result.returncode == 70
+
+def test_runs_before_input_ends():
+  clox = subprocess.Popen(["../clox/clox", "-"], stdin=subprocess.PIPE,
+                          stdout=subprocess.PIPE, text=True)
+  clox.stdin.write('var a = "first";\nprint a;\n')
+  clox.stdin.flush()
+  assert clox.stdout.readline() == "first\n"
+
+  clox.stdin.write('print a + " again";\n')
+  clox.stdin.close()
+  assert clox.stdout.read() == "first again\n"
+  assert clox.wait() == 0
+
+def test_map_literal_across_lines():
+  result = run_piped('var m = {\n  "a": 1\n}\n;\nprint m["a"];\n')
+  assert result.stdout == "1\n"
+  assert result.stderr == ""
@@ -0,0 +1,19 @@
+from lox_tests import CLOX, run_lox
+
+LOOPS_OUTPUT = "999000\n124735\n100\n10000\n19900\n700\n"
+
+def test_traced_loops():
+  result = run_lox(CLOX, "--trace", "lox_scripts/trace/loops.lox")
+  assert result.stdout == LOOPS_OUTPUT
+  assert result.stderr == ""
+
+def test_loops_without_traces():
+  result = run_lox(CLOX, "lox_scripts/trace/loops.lox")
+  assert result.stdout == LOOPS_OUTPUT
+  assert result.stderr == ""
+
+def test_runtime_error_leaves_trace():
+  result = run_lox(CLOX, "--trace", "lox_scripts/trace/error.lox")
+  assert result.stdout == ""
+  assert result.stderr == "Operands must be numbers.\n[line 7] in script\n"
+  assert result.returncode == 70
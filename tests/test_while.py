@@ -0,0 +1,9 @@
+from lox_tests import run_lox_script
+
+def while_(test):
+  return run_lox_script("../clox/clox", "lox_scripts/while/" + test + ".lox")
+
+def test_break():
+  result = while_("break")
+  assert result.stdout == "2\n0\ndone\n"
+  assert result.stderr == ""
@@ -0,0 +1,35 @@
+import subprocess
+
+def run_workers(count, *tests):
+  paths = ["lox_scripts/workers/" + test + ".lox" for test in tests]
+  return subprocess.run(["../clox/clox", "--workers", str(count)] + paths,
+                        capture_output=True, text=True)
+
+def test_scripts_run_on_every_worker():
+  result = run_workers(4, *["fib"] * 8)
+  assert result.stdout == "fib 6765\n" * 8
+  assert result.stderr == ""
+  assert result.returncode == 0
+
+def test_globals_reset_between_scripts():
+  result = run_workers(1, "define", "use", "define")
+  assert result.stdout == "1\n1\n"
+  assert result.stderr == "Undefined variable 'counter'.\n[line 1] in script\n"
+  assert result.returncode == 70
+
+def test_module_reused_by_the_same_worker():
+  result = run_workers(1, "shapes", "shapes", "fib", "shapes")
+  assert result.stdout == "3675\ntrue\n" * 2 + "fib 6765\n" + "3675\ntrue\n"
+  assert result.stderr == ""
+  assert result.returncode == 0
+
+def test_module_shared_between_workers():
+  result = run_workers(4, *["shapes"] * 8)
+  assert result.stdout == "3675\ntrue\n" * 8
+  assert result.returncode == 0
+
+def test_compile_error_skips_only_that_script():
+  result = run_workers(2, "broken", "define")
+  assert result.stdout == "1\n"
+  assert result.stderr == "[line 1] Error at ';': Expect expression.\n"
+  assert result.returncode == 65